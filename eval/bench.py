@@ -0,0 +1,238 @@
+#!/usr/bin/python
+
+# Benchmark LLPE end to end: for each program in benchmarks.json, build its bitcode, specialise
+# it with the recorded options (measuring LLPE's wall time, peak RSS and context counts), then
+# time the original and specialised binaries using timeprogram.c. Results are written as JSON
+# and CSV, and optionally compared against a previous run's JSON.
+
+from __future__ import print_function
+
+import argparse
+import csv
+import json
+import os
+import os.path
+import subprocess
+import sys
+import time
+
+evaldir = os.path.dirname(os.path.abspath(__file__))
+repodir = os.path.dirname(evaldir)
+
+parser = argparse.ArgumentParser(description="LLPE benchmark suite")
+parser.add_argument("--benchmarks", default=os.path.join(evaldir, "benchmarks.json"))
+parser.add_argument("--only", action="append", help="Run only the named benchmark (may repeat)")
+parser.add_argument("--workdir", default=os.path.join(evaldir, "bench-work"))
+parser.add_argument("--eval-dir", default=os.environ.get("LLPE_EVAL_DIR", evaldir), help="Where prepared bitcode and spec files live")
+parser.add_argument("--llpe-lib-dir", default=os.environ.get("LLPE_LIB_DIR", os.path.join(repodir, "llpe", "build")))
+parser.add_argument("--opt", default=os.environ.get("OPT", "opt"))
+parser.add_argument("--clang", default=os.environ.get("CLANG", "clang"))
+parser.add_argument("--ld", default=os.environ.get("LLPE_LD", "ld.gold"), help="Linker for uClibc bitcode programs; must accept bitcode via --llvmgold")
+parser.add_argument("--llvmgold", default=os.environ.get("LLVMGOLD", "LLVMgold.so"), help="LLVM gold plugin used to link bitcode")
+parser.add_argument("--uclibc-lib-dir", default=os.environ.get("LLPE_UCLIBC_LIB_DIR"), help="uClibc install providing crt*.o and libc.a; required by uClibc programs")
+parser.add_argument("--runs", type=int, default=5, help="Timed runs of each binary")
+parser.add_argument("--output", default="bench-results", help="Results basename; .json and .csv are written")
+parser.add_argument("--baseline", help="Previous results JSON to compare against")
+args = parser.parse_args()
+
+def log(*msg):
+	print(*msg, file=sys.stderr)
+
+def findlib(name):
+
+	for root, dirs, files in os.walk(args.llpe_lib_dir):
+		if name in files:
+			return os.path.join(root, name)
+	raise Exception("Can't find %s under %s; set --llpe-lib-dir" % (name, args.llpe_lib_dir))
+
+def build_source(bench, work):
+
+	src = os.path.join(repodir, bench["source"])
+	raw = os.path.join(work, "raw.bc")
+	out = os.path.join(work, "orig.bc")
+	subprocess.check_call([args.clang, "-std=c99", "-O0", "-Xclang", "-disable-O0-optnone", "-emit-llvm", "-c", src, "-o", raw])
+	subprocess.check_call([args.opt, "-mem2reg", "-loop-simplify", "-lcssa", raw, "-o", out])
+	return out
+
+def read_stats(path):
+
+	stats = {}
+	if not os.path.exists(path):
+		return stats
+	with open(path, "r") as f:
+		for line in f:
+			key, sep, val = line.rpartition(":")
+			if sep:
+				try:
+					stats[key.strip()] = int(val)
+				except ValueError:
+					pass
+	return stats
+
+# Run LLPE, returning wall time (s), peak RSS (KB) and the stats it reports.
+def run_llpe(bench, inbc, outbc, work):
+
+	statsfile = os.path.join(work, "stats.txt")
+	cmd = [args.opt, "-load", findlib("LLVMLLPEMain.so"), "-load", findlib("LLVMLLPEDriver.so"),
+	       "-llpe", "-integrator-accept-all", "-llpe-stats-file", statsfile] + bench["llpe"] + [inbc, "-o", outbc]
+
+	with open(os.path.join(work, "llpe.log"), "w") as logf:
+		start = time.time()
+		proc = subprocess.Popen(cmd, stdout=logf, stderr=subprocess.STDOUT, cwd=args.eval_dir)
+		pid, status, rusage = os.wait4(proc.pid, 0)
+		wall = time.time() - start
+
+	if status != 0:
+		raise Exception("LLPE failed (see %s)" % os.path.join(work, "llpe.log"))
+
+	return wall, rusage.ru_maxrss, read_stats(statsfile)
+
+# 'link_spec', if given, links the specialised program instead of 'link' (e.g. uClibc programs
+# whose specialised entry point no longer takes main, so need a different crt1).
+def link(bench, inbc, out, timeprogram, spec):
+
+	linkcmd = bench.get("link_spec") if spec else None
+	if linkcmd is None:
+		linkcmd = bench.get("link")
+	if linkcmd is not None:
+		subst = {"in": inbc, "out": out, "timeprogram": timeprogram, "ld": args.ld, "llvmgold": args.llvmgold, "uclibc": args.uclibc_lib_dir}
+		cmd = [x.format(**subst) for x in linkcmd]
+	else:
+		cmd = [args.clang, "-O2", inbc, timeprogram, "-o", out]
+	subprocess.check_call(cmd)
+
+# Time --runs runs of binary; returns (mean ns, min ns, (stdout, exit code) of the last run).
+def time_binary(binary, runargs, work):
+
+	times = []
+	output = None
+	timesfile = os.path.join(work, "times.txt")
+
+	for i in range(args.runs):
+
+		with open(timesfile, "w") as timesf:
+			proc = subprocess.Popen([binary] + runargs, stdin=open(os.devnull, "r"), stdout=subprocess.PIPE, stderr=timesf, cwd=args.eval_dir)
+			output = (proc.communicate()[0], proc.returncode)
+
+		# timeprogram.c writes start and finish seconds and nanoseconds, in hex, as the last four lines.
+		with open(timesfile, "r") as timesf:
+			lines = timesf.readlines()[-4:]
+		if len(lines) != 4:
+			raise Exception("%s did not report its run time; was it linked with timeprogram.c?" % binary)
+		ss, sn, fs, fn = [int(l, 16) for l in lines]
+		times.append(((fs * 1000000000) + fn) - ((ss * 1000000000) + sn))
+
+	return sum(times) / len(times), min(times), output
+
+def run_benchmark(bench, timeprogram):
+
+	work = os.path.join(args.workdir, bench["name"])
+	if not os.path.exists(work):
+		os.makedirs(work)
+
+	result = {"name": bench["name"]}
+
+	if "source" in bench:
+		inbc = build_source(bench, work)
+	else:
+		inbc = os.path.join(args.eval_dir, bench["bitcode"])
+		if not os.path.exists(inbc):
+			log("Skipping", bench["name"], ": no", inbc)
+			return None
+
+	# Check before spending time specialising a program we couldn't link.
+	if args.uclibc_lib_dir is None and any("{uclibc}" in x for x in bench.get("link", []) + bench.get("link_spec", [])):
+		raise Exception("links against uClibc; set --uclibc-lib-dir or LLPE_UCLIBC_LIB_DIR to its install's lib directory")
+
+	runargs = []
+	if "argv_file" in bench:
+		with open(os.path.join(args.eval_dir, bench["argv_file"]), "r") as f:
+			runargs = [l.rstrip("\n") for l in f if l.strip() != ""][1:]
+	runargs += bench.get("run", [])
+
+	specbc = os.path.join(work, "spec.bc")
+	wall, rss, stats = run_llpe(bench, inbc, specbc, work)
+	result["llpe_seconds"] = wall
+	result["llpe_peak_rss_kb"] = rss
+	result["contexts"] = stats.get("Dynamic contexts")
+	result["residual_instructions"] = stats.get("Residual instructons")
+	result["stats"] = stats
+
+	origbin = os.path.join(work, "orig")
+	specbin = os.path.join(work, "spec")
+	link(bench, inbc, origbin, timeprogram, False)
+	link(bench, specbc, specbin, timeprogram, True)
+
+	origmean, origmin, origout = time_binary(origbin, runargs, work)
+	specmean, specmin, specout = time_binary(specbin, runargs, work)
+	result["orig_ns"] = origmean
+	result["spec_ns"] = specmean
+	result["orig_min_ns"] = origmin
+	result["spec_min_ns"] = specmin
+	result["speedup"] = float(origmean) / specmean if specmean else None
+	result["outputs_match"] = origout == specout
+
+	return result
+
+csvfields = ["name", "llpe_seconds", "llpe_peak_rss_kb", "contexts", "residual_instructions",
+	     "orig_ns", "spec_ns", "orig_min_ns", "spec_min_ns", "speedup", "outputs_match"]
+
+def compare(results, baselinepath):
+
+	with open(baselinepath, "r") as f:
+		baseline = dict((r["name"], r) for r in json.load(f)["results"])
+
+	print("%-20s %12s %12s %12s" % ("benchmark", "llpe time", "llpe rss", "speedup"))
+	for r in results:
+		b = baseline.get(r["name"])
+		if b is None:
+			print("%-20s %12s" % (r["name"], "(new)"))
+			continue
+		def ratio(key):
+			if not b.get(key) or r.get(key) is None:
+				return "-"
+			return "%.2fx" % (float(r[key]) / b[key])
+		print("%-20s %12s %12s %12s" % (r["name"], ratio("llpe_seconds"), ratio("llpe_peak_rss_kb"), ratio("speedup")))
+
+with open(args.benchmarks, "r") as f:
+	benchmarks = json.load(f)["benchmarks"]
+
+if args.only:
+	benchmarks = [b for b in benchmarks if b["name"] in args.only]
+
+if not os.path.exists(args.workdir):
+	os.makedirs(args.workdir)
+
+timeprogram = os.path.join(args.workdir, "timeprogram.o")
+subprocess.check_call([args.clang, "-O2", "-DTIMEPROGRAM_CONSTRUCTOR", "-c", os.path.join(evaldir, "timeprogram.c"), "-o", timeprogram])
+
+results = []
+failed = 0
+
+for bench in benchmarks:
+
+	log("Benchmark", bench["name"])
+	try:
+		r = run_benchmark(bench, timeprogram)
+	except Exception as e:
+		log("Benchmark", bench["name"], "failed:", e)
+		failed += 1
+		continue
+	if r is not None:
+		results.append(r)
+		if not r["outputs_match"]:
+			log("Warning:", bench["name"], "original and specialised outputs differ")
+
+with open(args.output + ".json", "w") as f:
+	json.dump({"results": results}, f, indent=1, sort_keys=True)
+
+with open(args.output + ".csv", "w") as f:
+	w = csv.DictWriter(f, fieldnames=csvfields, extrasaction="ignore")
+	w.writeheader()
+	for r in results:
+		w.writerow(r)
+
+if args.baseline:
+	compare(results, args.baseline)
+
+sys.exit(1 if failed else 0)
@@ -1,18 +1,23 @@
 #!/usr/bin/python
 
+import os
 import subprocess
 import sys
+import tempfile
 import numpy
 
 nul = open("/dev/null", "w")
 
 runtimes = []
 
+# timeprogram.c writes the start and finish times to stderr; collect them here.
+timesfile = tempfile.NamedTemporaryFile(prefix="py-runtime", delete=False).name
+
 for i in range(int(sys.argv[1])):
 
-	with open("/var/run/user/chris/py-runtime", "w") as timesf:
+	with open(timesfile, "w") as timesf:
 		subprocess.check_call(sys.argv[2:], stdout=nul, stderr=timesf)
-	with open("/var/run/user/chris/py-runtime", "r") as timesf:
+	with open(timesfile, "r") as timesf:
 		lines = timesf.readlines()
 		ss = int(lines[0], 16)
 		sn = int(lines[1], 16)
@@ -21,5 +26,7 @@ for i in range(int(sys.argv[1])):
 		runtime_ns = (((fs * 1000000000) + fn) - ((ss * 1000000000) + sn))
 		runtimes.append(runtime_ns)
 
+os.unlink(timesfile)
+
 print "Got", len(runtimes), "results, mean", numpy.mean(runtimes), "sd", numpy.std(runtimes)
 
@@ -43,6 +43,8 @@ void write_times() {
 
 }
 
+#ifndef TIMEPROGRAM_CONSTRUCTOR
+
 void __uClibc_main_timed (int (*main)(int, char **, char **), int argc,
 			   char **argv, void (*app_init)(void), void (*app_fini)(void),
 			   void (*rtld_fini)(void),
@@ -56,4 +58,17 @@ void __uClibc_main_timed (int (*main)(int, char **, char **), int argc,
 
 }
 
+#else
+
+// For programs that don't start through uClibc (e.g. ordinary glibc builds), compile with
+// -DTIMEPROGRAM_CONSTRUCTOR and link in: timing then runs from before main until exit.
+
+__attribute__((constructor)) static void timeprogram_start(void) {
+
+  backup_stderr = dup(2);
+  atexit(write_times);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+}
 
+#endif
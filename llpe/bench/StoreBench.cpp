@@ -0,0 +1,509 @@
+//===-- StoreBench.cpp ----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Microbenchmarks for the symbolic store primitives: the shared heap tree, extent-list
+// reads and writes and block-entry merging, plus IAWalker block visiting. Heaps are
+// synthesised directly rather than derived from a program, so no module or
+// specialisation context is needed and the data structures can be measured in isolation:
+//
+//   llpe-store-bench -objects 4096 -object-size 64 -sparsity 50 -preds 4
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <random>
+
+using namespace llvm;
+
+static cl::opt<unsigned> NObjects("objects", cl::init(4096), cl::desc("Heap objects per synthetic heap"));
+static cl::opt<unsigned> ObjectSize("object-size", cl::init(64), cl::desc("Size of each heap object in bytes"));
+static cl::opt<unsigned> FieldSize("field-size", cl::init(8), cl::desc("Size of each stored field in bytes (1, 2, 4 or 8)"));
+static cl::opt<unsigned> Sparsity("sparsity", cl::init(50), cl::desc("Percentage of heap objects each heap defines"));
+static cl::opt<unsigned> NPreds("preds", cl::init(4), cl::desc("Predecessor heaps per merge"));
+static cl::opt<unsigned> Divergence("divergence", cl::init(25), cl::desc("Percentage of defined objects each predecessor overwrites"));
+static cl::opt<unsigned> Iterations("iterations", cl::init(10), cl::desc("Repetitions of each benchmark"));
+static cl::opt<unsigned> Seed("seed", cl::init(1), cl::desc("Random seed for heap layout"));
+static cl::opt<unsigned> NBlocks("blocks", cl::init(4096), cl::desc("Blocks in the synthetic CFG walked by the walker benchmarks"));
+static cl::opt<unsigned> BlockSuccs("block-succs", cl::init(2), cl::desc("Successors of each synthetic block"));
+static cl::list<std::string> OnlyBenchmarks("only", cl::desc("Run only the named benchmark (may repeat)"));
+
+static IntegerType* FieldTy;
+static uint32_t FieldsPerObject;
+static std::mt19937 RNG;
+
+// Heap objects defined by the base heap, in index order.
+static std::vector<uint32_t> DefinedObjects;
+
+typedef std::chrono::steady_clock BenchClock;
+
+// Accumulates time over the timed parts of a benchmark only.
+struct BenchTimer {
+
+  BenchClock::duration total;
+  BenchClock::time_point started;
+  uint64_t ops;
+
+BenchTimer() : total(BenchClock::duration::zero()), ops(0) {}
+
+  void start() { started = BenchClock::now(); }
+  void stop(uint64_t n) { total += (BenchClock::now() - started); ops += n; }
+
+};
+
+static ImprovedValSetSingle getFieldVal(uint32_t version, uint32_t obj, uint32_t field) {
+
+  uint64_t Val = (((uint64_t)version) << 32) | ((obj * FieldsPerObject) + field);
+  return ImprovedValSetSingle(ImprovedVal(ShadowValue(ConstantInt::get(FieldTy, Val))), ValSetTypeScalar);
+
+}
+
+// As ShadowBB::getWritableStoreFor, for a partial overwrite of heap object idx.
+static ImprovedValSetMulti* getWritableMulti(OrdinaryLocalStore* Map, uint32_t idx) {
+
+  ShadowValue V = ShadowValue::getPtrIdx(-1, idx);
+  bool isNewStore;
+  LocStore* Store = Map->getOrCreateStoreFor(V, &isNewStore);
+
+  if(isNewStore) {
+    Store->store = new ImprovedValSetMulti(ObjectSize);
+  }
+  else if(!Store->store->isWritableMulti()) {
+    ImprovedValSetMulti* M = new ImprovedValSetMulti(ObjectSize);
+    M->Underlying = Store->store;
+    Store->store = M;
+  }
+
+  return cast<ImprovedValSetMulti>(Store->store);
+
+}
+
+static void writeField(ImprovedValSetMulti* M, uint32_t version, uint32_t obj, uint32_t field) {
+
+  uint64_t Offset = field * FieldSize;
+  SmallVector<IVSRange, 4> Vals;
+  Vals.push_back(std::make_pair(std::make_pair(Offset, Offset + FieldSize), getFieldVal(version, obj, field)));
+  replaceRangeWithPBs(M, Vals, Offset, FieldSize);
+
+}
+
+static OrdinaryLocalStore* buildBaseHeap() {
+
+  OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    ImprovedValSetMulti* M = getWritableMulti(Map, *it);
+    for(uint32_t i = 0; i != FieldsPerObject; ++i)
+      writeField(M, 0, *it, i);
+
+  }
+
+  return Map;
+
+}
+
+// Share Base, then overwrite one field of Divergence% of its objects, so each predecessor
+// has a mix of identical subtrees and objects whose extent lists sit on top of Base's.
+static OrdinaryLocalStore* buildPredHeap(OrdinaryLocalStore* Base, uint32_t version) {
+
+  OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+  Map->copyFramesFrom(*Base);
+
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    if((RNG() % 100) >= Divergence)
+      continue;
+
+    ImprovedValSetMulti* M = getWritableMulti(Map, *it);
+    writeField(M, version, *it, RNG() % FieldsPerObject);
+
+  }
+
+  return Map;
+
+}
+
+static LocStore* getHeapStore(OrdinaryLocalStore* Map, uint32_t idx) {
+
+  return Map->getReadableStoreFor(ShadowValue::getPtrIdx(-1, idx));
+
+}
+
+// SharedTreeRoot::getOrCreateStoreFor into an empty heap.
+static void benchTreeCreate(BenchTimer& T) {
+
+  OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+
+  T.start();
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    ShadowValue V = ShadowValue::getPtrIdx(-1, *it);
+    bool isNewStore;
+    LocStore* Store = Map->getOrCreateStoreFor(V, &isNewStore);
+    Store->store = new ImprovedValSetSingle(ValSetTypeUnknown, true);
+
+  }
+  T.stop(DefinedObjects.size());
+
+  Map->dropReference();
+
+}
+
+// SharedTreeRoot::getOrCreateStoreFor against a heap shared with its parent, forcing a
+// copy-on-write break of the path to each object touched.
+static void benchTreeCoW(BenchTimer& T, OrdinaryLocalStore* Base) {
+
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+    Map->copyFramesFrom(*Base);
+
+    ShadowValue V = ShadowValue::getPtrIdx(-1, *it);
+    bool isNewStore;
+    T.start();
+    Map->getOrCreateStoreFor(V, &isNewStore);
+    T.stop(1);
+
+    Map->dropReference();
+
+  }
+
+}
+
+// replaceRangeWithPBs, writing every field of every defined object.
+static void benchWrite(BenchTimer& T) {
+
+  OrdinaryLocalStore* Map = new OrdinaryLocalStore(0);
+
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    ImprovedValSetMulti* M = getWritableMulti(Map, *it);
+    T.start();
+    for(uint32_t i = 0; i != FieldsPerObject; ++i)
+      writeField(M, 1, *it, i);
+    T.stop(FieldsPerObject);
+
+  }
+
+  Map->dropReference();
+
+}
+
+// clearRange of an unaligned range in each defined object, which must truncate the
+// fields at either end.
+static void benchClear(BenchTimer& T) {
+
+  OrdinaryLocalStore* Map = buildBaseHeap();
+
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    ImprovedValSetMulti* M = cast<ImprovedValSetMulti>(getHeapStore(Map, *it)->store);
+    uint64_t Offset = RNG() % ObjectSize;
+    uint64_t Size = 1 + (RNG() % (ObjectSize - Offset));
+    T.start();
+    clearRange(M, Offset, Size);
+    T.stop(1);
+
+  }
+
+  Map->dropReference();
+
+}
+
+// readValRangeMultiFrom of each whole object, reading through to the base heap where the
+// predecessor did not overwrite.
+static void benchRead(BenchTimer& T, OrdinaryLocalStore* Pred) {
+
+  T.start();
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    SmallVector<IVSRange, 4> Results;
+    readValRangeMultiFrom(0, ObjectSize, getHeapStore(Pred, *it)->store, Results, 0, ObjectSize);
+
+  }
+  T.stop(DefinedObjects.size());
+
+}
+
+// LocStore::mergeStores of each defined object of every predecessor into the first's.
+static void benchMergeStores(BenchTimer& T, std::vector<OrdinaryLocalStore*>& Preds) {
+
+  OrdinaryMerger Visitor(0);
+
+  for(std::vector<uint32_t>::iterator it = DefinedObjects.begin(), itend = DefinedObjects.end(); it != itend; ++it) {
+
+    LocStore To(getHeapStore(Preds[0], *it)->store->getReadableCopy());
+
+    T.start();
+    for(uint32_t i = 1, ilim = Preds.size(); i != ilim; ++i) {
+      LocStore* From = getHeapStore(Preds[i], *it);
+      LocStore::mergeStores(From, &To, ObjectSize, &Visitor);
+    }
+    T.stop(Preds.size() - 1);
+
+    To.dropReference();
+
+  }
+
+}
+
+// MergeBlockVisitor::mergeHeaps, and so SharedTreeNode::mergeHeaps, over all predecessors.
+static void benchMergeHeaps(BenchTimer& T, std::vector<OrdinaryLocalStore*>& Preds) {
+
+  OrdinaryLocalStore* To = new OrdinaryLocalStore(0);
+  To->copyFramesFrom(*Preds[0]);
+
+  SmallVector<OrdinaryLocalStore*, 4> From(Preds.begin() + 1, Preds.end());
+  OrdinaryMerger Visitor(0);
+
+  T.start();
+  Visitor.mergeHeaps(To, From.begin(), From.end());
+  T.stop(1);
+
+  To->dropReference();
+
+}
+
+// A random CFG of NBlocks blocks, each with BlockSuccs successors one of which is the next
+// block, so every block is reachable from the first. Only the parts of ShadowBB and
+// ShadowBBInvar that IAWalker::queueWalkFrom and the walk below touch are filled in.
+static std::vector<ShadowBBInvar> WalkBBInvars;
+static std::vector<ShadowBB*> WalkBBs;
+
+static void buildWalkCFG() {
+
+  WalkBBInvars.resize(NBlocks);
+  for(uint32_t i = 0; i != NBlocks; ++i) {
+
+    ShadowBBInvar& BBI = WalkBBInvars[i];
+    BBI.idx = i;
+
+    uint32_t* succs = new uint32_t[BlockSuccs];
+    succs[0] = (i + 1) % NBlocks;
+    for(uint32_t j = 1; j != BlockSuccs; ++j)
+      succs[j] = RNG() % NBlocks;
+    BBI.succIdxs = ImmutableArray<uint32_t>(succs, BlockSuccs);
+
+    ShadowBB* BB = new ShadowBB();
+    BB->invar = &BBI;
+    BB->succsAlive = new bool[BlockSuccs];
+    BB->insts = ImmutableArray<ShadowInstruction>(new ShadowInstruction[4], 4);
+    BB->walkEpochStart = 0;
+    BB->walkEpochEnd = 0;
+    WalkBBs.push_back(BB);
+
+  }
+
+}
+
+static void freeWalkCFG() {
+
+  for(uint32_t i = 0; i != NBlocks; ++i) {
+    delete WalkBBs[i];
+    delete[] &(WalkBBInvars[i].succIdxs[0]);
+  }
+
+}
+
+// Visits every block reachable from the first using the same two-list worklist and
+// queueWalkFrom as ForwardIAWalker::walkInternal, without walking any instructions.
+class BenchWalker : public ForwardIAWalker {
+
+  virtual WalkInstructionResult walkInstruction(ShadowInstruction*, void*) { return WIRContinue; }
+  virtual bool shouldEnterCall(ShadowInstruction*, void*) { return false; }
+  virtual bool blockedByUnexpandedCall(ShadowInstruction*, void*) { return false; }
+
+  virtual void walkInternal() {
+
+    while(PList->size() || CList->size()) {
+
+      for(unsigned i = 0; i < CList->size(); ++i) {
+
+	ShadowBB* BB = (*CList)[i].first.second;
+	++visitedBlocks;
+	for(uint32_t j = 0, jlim = BB->invar->succIdxs.size(); j != jlim; ++j)
+	  queueWalkFrom(0, WalkBBs[BB->invar->succIdxs[j]], 0, false);
+
+      }
+
+      CList->clear();
+      std::swap(PList, CList);
+
+    }
+
+  }
+
+public:
+
+  uint64_t visitedBlocks;
+
+BenchWalker() : ForwardIAWalker(0, WalkBBs[0], false), visitedBlocks(0) { }
+
+};
+
+// A whole walk over the synthetic CFG. Hash-mode walks run with another walker live, which
+// forces them onto IAWalker's DenseSet as a nested walk would be.
+static void benchWalk(BenchTimer& T, bool hashMode) {
+
+  BenchWalker* Outer = hashMode ? new BenchWalker() : 0;
+
+  T.start();
+  BenchWalker W;
+  W.walk();
+  T.stop(W.visitedBlocks);
+
+  release_assert(W.visitedBlocks == NBlocks && "Walk missed blocks");
+  delete Outer;
+
+}
+
+static bool shouldRun(StringRef Name) {
+
+  if(OnlyBenchmarks.empty())
+    return true;
+
+  for(unsigned i = 0, ilim = OnlyBenchmarks.size(); i != ilim; ++i) {
+    if(OnlyBenchmarks[i] == Name)
+      return true;
+  }
+
+  return false;
+
+}
+
+static void report(StringRef Name, BenchTimer& T) {
+
+  double ms = std::chrono::duration<double, std::milli>(T.total).count();
+  double nsPerOp = T.ops ? (ms * 1000000.0) / T.ops : 0;
+  outs() << format("%-16s %12llu %12.3f %12.1f\n", Name.str().c_str(), (unsigned long long)T.ops, ms, nsPerOp);
+
+}
+
+int main(int argc, char** argv) {
+
+  cl::ParseCommandLineOptions(argc, argv, "LLPE symbolic store microbenchmarks\n");
+
+  if(FieldSize != 1 && FieldSize != 2 && FieldSize != 4 && FieldSize != 8) {
+    errs() << "-field-size must be 1, 2, 4 or 8\n";
+    exit(1);
+  }
+
+  if(ObjectSize < FieldSize || ObjectSize % FieldSize) {
+    errs() << "-object-size must be a multiple of -field-size\n";
+    exit(1);
+  }
+
+  if(NPreds < 2) {
+    errs() << "-preds must be at least 2\n";
+    exit(1);
+  }
+
+  if(NBlocks < 1 || BlockSuccs < 1) {
+    errs() << "-blocks and -block-succs must be at least 1\n";
+    exit(1);
+  }
+
+  LLVMContext Context;
+  Module M("llpe-store-bench", Context);
+  GlobalTD = &M.getDataLayout();
+  GlobalIHP = new LLPEAnalysisPass();
+
+  FieldTy = Type::getIntNTy(Context, FieldSize * 8);
+  FieldsPerObject = ObjectSize / FieldSize;
+  RNG.seed(Seed);
+
+  // Synthetic heap allocations: all the store needs of these is their size.
+  GlobalIHP->heap.resize(NObjects);
+  for(uint32_t i = 0; i != NObjects; ++i) {
+
+    AllocData& AD = GlobalIHP->heap[i];
+    AD.storeSize = ObjectSize;
+    AD.allocIdx = i;
+    AD.allocVague = false;
+    AD.allocTested = AllocUnchecked;
+    AD.isCommitted = false;
+    AD.allocValue = ShadowValue::getPtrIdx(-1, i);
+    AD.allocType = FieldTy;
+    AD.committedVal = 0;
+
+    if((RNG() % 100) < Sparsity)
+      DefinedObjects.push_back(i);
+
+  }
+
+  buildWalkCFG();
+
+  OrdinaryLocalStore* Base = buildBaseHeap();
+  std::vector<OrdinaryLocalStore*> Preds;
+  for(uint32_t i = 0; i != NPreds; ++i)
+    Preds.push_back(buildPredHeap(Base, i + 1));
+
+  outs() << DefinedObjects.size() << " of " << NObjects << " objects defined, " << ObjectSize << " bytes each, "
+	 << NPreds << " predecessors, " << Iterations << " iterations\n";
+  outs() << "benchmark                 ops     total ms        ns/op\n";
+
+  BenchTimer TreeCreate, TreeCoW, Write, Clear, Read, MergeStores, MergeHeaps, WalkEpoch, WalkHash;
+
+  for(uint32_t i = 0; i != Iterations; ++i) {
+
+    if(shouldRun("tree-create"))
+      benchTreeCreate(TreeCreate);
+    if(shouldRun("tree-cow"))
+      benchTreeCoW(TreeCoW, Base);
+    if(shouldRun("write"))
+      benchWrite(Write);
+    if(shouldRun("clear"))
+      benchClear(Clear);
+    if(shouldRun("read"))
+      benchRead(Read, Preds[1]);
+    if(shouldRun("merge-stores"))
+      benchMergeStores(MergeStores, Preds);
+    if(shouldRun("merge-heaps"))
+      benchMergeHeaps(MergeHeaps, Preds);
+    if(shouldRun("walk-epoch"))
+      benchWalk(WalkEpoch, false);
+    if(shouldRun("walk-hash"))
+      benchWalk(WalkHash, true);
+
+  }
+
+  if(shouldRun("tree-create"))
+    report("tree-create", TreeCreate);
+  if(shouldRun("tree-cow"))
+    report("tree-cow", TreeCoW);
+  if(shouldRun("write"))
+    report("write", Write);
+  if(shouldRun("clear"))
+    report("clear", Clear);
+  if(shouldRun("read"))
+    report("read", Read);
+  if(shouldRun("merge-stores"))
+    report("merge-stores", MergeStores);
+  if(shouldRun("merge-heaps"))
+    report("merge-heaps", MergeHeaps);
+  if(shouldRun("walk-epoch"))
+    report("walk-epoch", WalkEpoch);
+  if(shouldRun("walk-hash"))
+    report("walk-hash", WalkHash);
+
+  for(uint32_t i = 0; i != NPreds; ++i)
+    Preds[i]->dropReference();
+  Base->dropReference();
+  freeWalkCFG();
+
+  return 0;
+
+}
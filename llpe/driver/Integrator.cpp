@@ -7,8 +7,12 @@
 
 #include "llvm/Pass.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/LegacyPassManager.h"
 #include "llvm/Analysis/LLPE.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
 #include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/StringSaver.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
 
@@ -18,8 +22,17 @@
 #include <wx/dataview.h>
 #include <wx/bitmap.h>
 
+#include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <thread>
+
 #include <errno.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
 
 using namespace llvm;
 
@@ -27,8 +40,15 @@ using namespace llvm;
 // of passing a parameter to WxApp's constructor.
 static LLPEAnalysisPass* IHP;
 static bool IntegratorCancelled = false;
+static bool IntegratorCommitted = false;
 
 static cl::opt<bool> AcceptAllInt("integrator-accept-all", cl::init(false));
+static cl::opt<std::string> BatchJobsFile("llpe-batch-jobs", cl::init(""));
+static cl::opt<unsigned> BatchParallel("llpe-batch-parallel", cl::init(1));
+static cl::opt<std::string> MultiConfigsFile("llpe-multi-configs", cl::init(""));
+static cl::opt<unsigned> RenderThreads("integrator-render-threads", cl::init(2));
+static cl::opt<unsigned> ImageCacheSize("integrator-image-cache", cl::init(64));
+static cl::opt<unsigned> PrefetchContexts("integrator-prefetch", cl::init(4));
 
 namespace {
 
@@ -51,6 +71,52 @@ static RegisterPass<LLPEPass> X("llpe", "LLPE Partial Evaluation",
 				      false /* Only looks at CFG */,
 				      false /* Analysis Pass */);
 
+namespace {
+
+  // Run many specialisation jobs over one loaded module. Each line of the job file gives
+  // an output bitcode path followed by the LLPE options for that job (-llpe-root,
+  // -spec-argv, path conditions and so on). Each job specialises the module in place and is
+  // then undone, so the per-function analyses are only built once.
+  class LLPEBatchPass : public ModulePass {
+  public:
+
+    static char ID;
+    LLPEBatchPass() : ModulePass(ID) {}
+
+    bool runOnModule(Module& M);
+
+  };
+
+}
+
+char LLPEBatchPass::ID = 0;
+static RegisterPass<LLPEBatchPass> BatchX("llpe-batch", "LLPE Partial Evaluation (batch of jobs)",
+					  false /* Only looks at CFG */,
+					  false /* Analysis Pass */);
+
+namespace {
+
+  // Specialise the root for several configurations in one run and emit a dispatcher that
+  // calls whichever variant matches the actual arguments, or the unmodified root. Each line of
+  // the configuration file gives a name followed by that configuration's LLPE options, as for
+  // -llpe-batch; -llpe-dispatch is implied.
+  class LLPEMultiPass : public ModulePass {
+  public:
+
+    static char ID;
+    LLPEMultiPass() : ModulePass(ID) {}
+
+    bool runOnModule(Module& M);
+
+  };
+
+}
+
+char LLPEMultiPass::ID = 0;
+static RegisterPass<LLPEMultiPass> MultiX("llpe-multi", "LLPE Partial Evaluation (several configurations)",
+					  false /* Only looks at CFG */,
+					  false /* Analysis Pass */);
+
 // Implement a GUI for leafing through integration results
 
 class IntegratorApp : public wxApp {
@@ -61,25 +127,82 @@ class IntegratorApp : public wxApp {
 
 static char workdir[] = "/tmp/integrator_XXXXXX";
 
+class IntegratorFrame;
+
+// Runs dot for the image panel on background threads. Jobs for the selected context go
+// to the front of the queue; prefetches of its neighbours go to the back, and are dropped
+// if the selection moves on before they start.
+class RenderPool {
+
+  struct Job {
+
+    unsigned id;
+    std::string dotpath;
+    std::string pngpath;
+    bool urgent;
+
+  };
+
+  IntegratorFrame* Frame;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Job> jobs;
+  bool finished;
+  std::vector<std::thread> workers;
+
+  void run();
+
+public:
+
+  RenderPool(IntegratorFrame* F, unsigned nThreads);
+  void queue(unsigned id, const std::string& dotpath, const std::string& pngpath, bool urgent);
+  void promote(unsigned id);
+  void dropPrefetches(const DenseSet<unsigned>& keep, std::vector<unsigned>& dropped);
+  void finish();
+
+};
+
 class IntegratorFrame: public wxFrame
 {
   
   IntegrationAttempt* currentIA;
+  IntegratorTag* currentTag;
   wxBitmap* currentBitmap;
   wxStaticBitmap* image;
   wxBoxSizer* imagePanelSizer;
   wxScrolledWindow* imagePanel;
   wxDataViewCtrl* menuPanelData;
 
-  IntegratorTag* searchLastIA;
+  // Short headers in tree order, built on the first search.
+  std::vector<std::pair<std::string, IntegratorTag*> > searchIndex;
+  bool searchIndexBuilt;
+  size_t searchNext;
   wxString searchLastString;
 
-  std::string dotpath;
-  std::string pngpath;
-  std::string dotcommand;
+  // Rendered (or in-flight) images by (context, brief), most recently used first.
+  typedef PointerIntPair<IntegrationAttempt*, 1, bool> RenderKey;
+  struct RenderedImage {
+
+    unsigned id;
+    bool done;
+    bool ok;
+    std::list<RenderKey>::iterator lruPos;
+
+  };
+  DenseMap<RenderKey, RenderedImage> renderCache;
+  DenseMap<unsigned, RenderKey> rendersInFlight;
+  std::list<RenderKey> renderLRU;
+  unsigned nextRenderId;
+  RenderPool* renderer;
   
   bool brief;
 
+  void getRenderPaths(unsigned id, std::string& dotpath, std::string& pngpath);
+  RenderedImage& requestRender(IntegrationAttempt* IA, bool urgent);
+  void getPrefetchTargets(IntegratorTag* tag, SmallVectorImpl<IntegrationAttempt*>& targets);
+  void dropStalePrefetches(SmallVectorImpl<IntegrationAttempt*>& targets);
+  void showImage(RenderedImage&);
+
 public:
 
   IntegratorFrame(const wxString& title, const wxPoint& pos, const wxSize& size);
@@ -92,6 +215,8 @@ public:
   void OnSearchFunctionsNext(wxCommandEvent&);
 
   void redrawImage();
+  void invalidateImages();
+  void onRenderDone(unsigned id, bool ok);
 
   DECLARE_EVENT_TABLE()
 
@@ -261,6 +386,7 @@ public:
 
   }
 
+  // Only tags the view has created can be showing stats.
   void notifyStatsChanged(IntegratorTag* Tag) {
     
     ValueChanged(wxDataViewItem((void*)Tag), 2);
@@ -314,6 +440,7 @@ public:
     // All other contexts will have recalculated their stats too.
     notifyStatsChanged(RootTag);
 
+    Parent->invalidateImages();
     Parent->redrawImage();
 
     return true;
@@ -377,15 +504,18 @@ public:
 
     }
     else {
+
+      // Rows are only created when the view expands their parent.
+      std::vector<IntegratorTag*>& tagChildren = getTagChildren(tag);
     
-      for(std::vector<IntegratorTag*>::iterator it = tag->children.begin(),
-	    itend = tag->children.end(); it != itend; ++it) {
+      for(std::vector<IntegratorTag*>::iterator it = tagChildren.begin(),
+	    itend = tagChildren.end(); it != itend; ++it) {
 
 	children.Add(wxDataViewItem((void*)*it));
 
       }
 
-      return tag->children.size();
+      return tagChildren.size();
 
     }
 
@@ -394,28 +524,16 @@ public:
 };
 
 IntegratorFrame::IntegratorFrame(const wxString& title, const wxPoint& pos, const wxSize& size)
-  : wxFrame(NULL, -1, title, pos, size), currentIA(0), brief(true) {
+  : wxFrame(NULL, -1, title, pos, size), currentIA(0), currentTag(0), searchIndexBuilt(false), searchNext(0), nextRenderId(0), brief(true) {
 
   if(!mkdtemp(workdir)) {
     errs() << "Failed to create a temporary directory: " << strerror(errno) << "\n";
     exit(1);
   }
 
-  {
-    raw_string_ostream ROS(dotpath);
-    ROS << workdir << "/out.dot";
-  }
-  {
-    raw_string_ostream ROS(pngpath);
-    ROS << workdir << "/out.png";
-  }
-  {
-    raw_string_ostream ROS(dotcommand);
-    ROS << "dot " << dotpath << " -o " << pngpath << " -Tpng";
-  }
-
   searchLastString = "";
-  searchLastIA = 0;
+
+  renderer = new RenderPool(this, std::max(1U, (unsigned)RenderThreads));
 
   wxMenu *menuFile = new wxMenu;
   menuFile->Append( ID_Quit, _("E&xit") );
@@ -492,6 +610,10 @@ void IntegratorFrame::OnBriefToggle(wxCommandEvent& WXUNUSED(event)) {
 
 void IntegratorFrame::OnClose(wxCloseEvent& WXUNUSED(event)) {
 
+  renderer->finish();
+  delete renderer;
+  renderer = 0;
+
   std::string command;
   raw_string_ostream ROS(command);
   ROS << "rm -rf " << workdir;
@@ -507,47 +629,241 @@ void IntegratorFrame::OnClose(wxCloseEvent& WXUNUSED(event)) {
 
 }
 
-void IntegratorFrame::redrawImage() {
+RenderPool::RenderPool(IntegratorFrame* F, unsigned nThreads) : Frame(F), finished(false) {
 
-  if(!currentIA)
+  for(unsigned i = 0; i != nThreads; ++i)
+    workers.push_back(std::thread(&RenderPool::run, this));
+
+}
+
+void RenderPool::run() {
+
+  while(true) {
+
+    Job J;
+
+    {
+      std::unique_lock<std::mutex> G(lock);
+      cv.wait(G, [this] { return finished || !jobs.empty(); });
+      if(finished)
+	return;
+      J = jobs.front();
+      jobs.pop_front();
+    }
+
+    std::string command;
+    {
+      raw_string_ostream RSO(command);
+      RSO << "dot " << J.dotpath << " -o " << J.pngpath << " -Tpng";
+    }
+
+    int ret = system(command.c_str());
+    if(ret != 0)
+      errs() << "Failed to run '" << command << "' (returned " << ret << ")\n";
+
+    // wxWidgets objects may only be touched from the GUI thread.
+    Frame->CallAfter(&IntegratorFrame::onRenderDone, J.id, ret == 0);
+
+  }
+
+}
+
+void RenderPool::queue(unsigned id, const std::string& dotpath, const std::string& pngpath, bool urgent) {
+
+  Job J;
+  J.id = id;
+  J.dotpath = dotpath;
+  J.pngpath = pngpath;
+  J.urgent = urgent;
+
+  {
+    std::lock_guard<std::mutex> G(lock);
+    if(urgent)
+      jobs.push_front(J);
+    else
+      jobs.push_back(J);
+  }
+  cv.notify_one();
+
+}
+
+// The user selected a context whose render is still queued (e.g. as a prefetch):
+// move it to the front. Does nothing if a worker has already taken it.
+void RenderPool::promote(unsigned id) {
+
+  std::lock_guard<std::mutex> G(lock);
+
+  for(std::deque<Job>::iterator it = jobs.begin(), itend = jobs.end(); it != itend; ++it) {
+
+    if(it->id != id)
+      continue;
+
+    Job J = *it;
+    J.urgent = true;
+    jobs.erase(it);
+    jobs.push_front(J);
     return;
 
-  delete currentBitmap;
-  currentBitmap = 0;
+  }
+
+}
+
+// Remove queued prefetches whose ids are not in keep, reporting their ids in dropped.
+void RenderPool::dropPrefetches(const DenseSet<unsigned>& keep, std::vector<unsigned>& dropped) {
+
+  std::lock_guard<std::mutex> G(lock);
+
+  for(std::deque<Job>::iterator it = jobs.begin(); it != jobs.end();) {
+
+    if(it->urgent || keep.count(it->id)) {
+      ++it;
+      continue;
+    }
+
+    dropped.push_back(it->id);
+    it = jobs.erase(it);
+
+  }
+
+}
+
+// Drop outstanding jobs and wait for those already running.
+void RenderPool::finish() {
+
+  {
+    std::lock_guard<std::mutex> G(lock);
+    finished = true;
+    jobs.clear();
+  }
+  cv.notify_all();
+
+  for(std::vector<std::thread>::iterator it = workers.begin(), itend = workers.end(); it != itend; ++it)
+    it->join();
+
+}
+
+void IntegratorFrame::getRenderPaths(unsigned id, std::string& dotpath, std::string& pngpath) {
+
+  {
+    raw_string_ostream ROS(dotpath);
+    ROS << workdir << "/" << id << ".dot";
+  }
+  {
+    raw_string_ostream ROS(pngpath);
+    ROS << workdir << "/" << id << ".png";
+  }
+
+}
+
+// Find IA's image in the current brief mode, or write its DOT and queue it for rendering.
+// The DOT text itself is produced here since it reads the contexts, which only the GUI
+// thread may do.
+IntegratorFrame::RenderedImage& IntegratorFrame::requestRender(IntegrationAttempt* IA, bool urgent) {
+
+  RenderKey key(IA, brief);
+  DenseMap<RenderKey, RenderedImage>::iterator findit = renderCache.find(key);
+
+  if(findit != renderCache.end()) {
+    renderLRU.splice(renderLRU.begin(), renderLRU, findit->second.lruPos);
+    if(urgent && !findit->second.done)
+      renderer->promote(findit->second.id);
+    return findit->second;
+  }
+
+  unsigned id = nextRenderId++;
+  std::string dotpath, pngpath;
+  getRenderPaths(id, dotpath, pngpath);
 
   std::error_code error;
-  std::string otherpath;
-  raw_fd_ostream RFO(dotpath.c_str(), error, sys::fs::F_None);
-  currentIA->describeAsDOT(RFO, otherpath, brief);
-  RFO.close();
+  {
+    raw_fd_ostream RFO(dotpath.c_str(), error, sys::fs::F_None);
+    if(!error)
+      IA->describeAsDOT(RFO, brief);
+  }
+
+  renderLRU.push_front(key);
+  RenderedImage& entry = renderCache[key];
+  entry.id = id;
+  entry.lruPos = renderLRU.begin();
 
   if(error) {
 
     errs() << "Failed to open " << dotpath << ": " << error.message() << "\n";
+    entry.done = true;
+    entry.ok = false;
 
   }
   else {
 
-    std::string thiscmd;
-    if(otherpath.size()) {
-      raw_string_ostream RSO(thiscmd);
-      RSO << "dot " << otherpath << " -o " << pngpath << " -Tpng";
-    }
-    else {
-      thiscmd = dotcommand;
-    }
+    entry.done = false;
+    entry.ok = false;
+    rendersInFlight[id] = key;
+    renderer->queue(id, dotpath, pngpath, urgent);
 
-    if(int ret = system(thiscmd.c_str()) != 0) {
+  }
 
-      errs() << "Failed to run '" << thiscmd << "' (returned " << ret << ")\n";
-	
-    }
-    else {
+  // Evict the least recently used finished images. In-flight renders are kept so
+  // their results have somewhere to go.
+  std::list<RenderKey>::iterator it = renderLRU.end();
+  while(renderCache.size() > std::max(1U, (unsigned)ImageCacheSize) && it != renderLRU.begin()) {
 
-      currentBitmap = new wxBitmap(_(pngpath), wxBITMAP_TYPE_PNG);
+    --it;
+    RenderedImage& victim = renderCache[*it];
+    if(!victim.done || *it == key)
+      continue;
 
-    }
+    std::string victimDot, victimPng;
+    getRenderPaths(victim.id, victimDot, victimPng);
+    unlink(victimDot.c_str());
+    unlink(victimPng.c_str());
+
+    renderCache.erase(*it);
+    it = renderLRU.erase(it);
+
+  }
+
+  return renderCache[key];
+
+}
+
+void IntegratorFrame::onRenderDone(unsigned id, bool ok) {
+
+  DenseMap<unsigned, RenderKey>::iterator findit = rendersInFlight.find(id);
+  if(findit == rendersInFlight.end())
+    return;
+
+  RenderKey key = findit->second;
+  rendersInFlight.erase(findit);
+
+  DenseMap<RenderKey, RenderedImage>::iterator cacheit = renderCache.find(key);
+  if(cacheit == renderCache.end() || cacheit->second.id != id) {
+
+    // Invalidated while rendering.
+    std::string dotpath, pngpath;
+    getRenderPaths(id, dotpath, pngpath);
+    unlink(dotpath.c_str());
+    unlink(pngpath.c_str());
+    return;
+
+  }
+
+  cacheit->second.done = true;
+  cacheit->second.ok = ok;
+
+  if(key == RenderKey(currentIA, brief))
+    showImage(cacheit->second);
+
+}
+
+void IntegratorFrame::showImage(RenderedImage& entry) {
+
+  delete currentBitmap;
+  currentBitmap = 0;
 
+  if(entry.done && entry.ok) {
+    std::string dotpath, pngpath;
+    getRenderPaths(entry.id, dotpath, pngpath);
+    currentBitmap = new wxBitmap(_(pngpath), wxBITMAP_TYPE_PNG);
   }
 
   if(!currentBitmap)
@@ -558,6 +874,119 @@ void IntegratorFrame::redrawImage() {
 
 }
 
+// Find the contexts the user is likely to look at next: the selected context's children
+// (or a loop's first iterations), then its parent and next sibling.
+void IntegratorFrame::getPrefetchTargets(IntegratorTag* tag, SmallVectorImpl<IntegrationAttempt*>& targets) {
+
+  std::vector<IntegratorTag*>& children = getTagChildren(tag);
+  for(std::vector<IntegratorTag*>::iterator it = children.begin(), itend = children.end(); it != itend && targets.size() < PrefetchContexts; ++it) {
+
+    if((*it)->type == IntegratorTypeIA)
+      targets.push_back((IntegrationAttempt*)(*it)->ptr);
+    else {
+      std::vector<IntegratorTag*>& iters = getTagChildren(*it);
+      if(!iters.empty())
+	targets.push_back((IntegrationAttempt*)iters[0]->ptr);
+    }
+
+  }
+
+  IntegratorTag* parent = tag->parent;
+  if(parent && parent->type == IntegratorTypePA)
+    parent = parent->parent;
+
+  if(parent && targets.size() < PrefetchContexts) {
+
+    targets.push_back((IntegrationAttempt*)parent->ptr);
+
+    std::vector<IntegratorTag*>& siblings = getTagChildren(tag->parent);
+    std::vector<IntegratorTag*>::iterator it = std::find(siblings.begin(), siblings.end(), tag);
+    if(it != siblings.end() && ++it != siblings.end() && (*it)->type == IntegratorTypeIA && targets.size() < PrefetchContexts)
+      targets.push_back((IntegrationAttempt*)(*it)->ptr);
+
+  }
+
+}
+
+// Forget queued prefetches for contexts that are no longer near the selection, so they
+// don't hold up rendering the ones that are.
+void IntegratorFrame::dropStalePrefetches(SmallVectorImpl<IntegrationAttempt*>& targets) {
+
+  DenseSet<unsigned> keep;
+  for(SmallVectorImpl<IntegrationAttempt*>::iterator it = targets.begin(), itend = targets.end(); it != itend; ++it) {
+
+    DenseMap<RenderKey, RenderedImage>::iterator findit = renderCache.find(RenderKey(*it, brief));
+    if(findit != renderCache.end())
+      keep.insert(findit->second.id);
+
+  }
+
+  std::vector<unsigned> dropped;
+  renderer->dropPrefetches(keep, dropped);
+
+  for(std::vector<unsigned>::iterator it = dropped.begin(), itend = dropped.end(); it != itend; ++it) {
+
+    DenseMap<unsigned, RenderKey>::iterator flightit = rendersInFlight.find(*it);
+    if(flightit == rendersInFlight.end())
+      continue;
+
+    RenderKey key = flightit->second;
+    rendersInFlight.erase(flightit);
+
+    DenseMap<RenderKey, RenderedImage>::iterator cacheit = renderCache.find(key);
+    if(cacheit != renderCache.end() && cacheit->second.id == *it) {
+      renderLRU.erase(cacheit->second.lruPos);
+      renderCache.erase(cacheit);
+    }
+
+    std::string dotpath, pngpath;
+    getRenderPaths(*it, dotpath, pngpath);
+    unlink(dotpath.c_str());
+
+  }
+
+}
+
+// Enabling or disabling contexts changes how they are drawn.
+void IntegratorFrame::invalidateImages() {
+
+  for(DenseMap<RenderKey, RenderedImage>::iterator it = renderCache.begin(), itend = renderCache.end(); it != itend; ++it) {
+
+    if(!it->second.done)
+      continue;
+
+    std::string dotpath, pngpath;
+    getRenderPaths(it->second.id, dotpath, pngpath);
+    unlink(dotpath.c_str());
+    unlink(pngpath.c_str());
+
+  }
+
+  // Renders still in flight find their entry gone and clean up after themselves.
+  renderCache.clear();
+  renderLRU.clear();
+
+}
+
+void IntegratorFrame::redrawImage() {
+
+  if(!currentIA)
+    return;
+
+  RenderedImage& entry = requestRender(currentIA, true);
+  showImage(entry);
+
+  SmallVector<IntegrationAttempt*, 8> targets;
+  if(currentTag)
+    getPrefetchTargets(currentTag, targets);
+
+  dropStalePrefetches(targets);
+
+  for(SmallVector<IntegrationAttempt*, 8>::iterator it = targets.begin(), itend = targets.end(); it != itend; ++it)
+    requestRender(*it, false);
+
+}
+
 void IntegratorFrame::OnSelectionChanged(wxDataViewEvent& event) {
 
   wxDataViewItem item = event.GetItem();
@@ -566,6 +995,7 @@ void IntegratorFrame::OnSelectionChanged(wxDataViewEvent& event) {
   if(tag && tag->type == IntegratorTypeIA) {
 
     currentIA = (IntegrationAttempt*)(tag->ptr);
+    currentTag = tag;
     redrawImage();
 
   }
@@ -576,28 +1006,36 @@ void IntegratorFrame::OnSearchFunctionsNext(wxCommandEvent& event) {
 
   if(searchLastString == "")
     return;
-  if(searchLastIA == 0)
-    searchLastIA = IHP->getRootTag();
+
+  if(!searchIndexBuilt) {
+    buildTagSearchIndex(IHP->getRootTag(), searchIndex);
+    searchIndexBuilt = true;
+  }
 
   std::string stdSearchString(searchLastString.mb_str());
-  IntegratorTag* IA = searchFunctions(IHP->getRootTag(), stdSearchString, searchLastIA);
 
-  if(IA) {
-    wxDataViewItem key((void*)IA);
-    menuPanelData->Select(key);
-  }
-  else {
-    wxMessageBox("No more matches", "Search");
+  for(; searchNext < searchIndex.size(); ++searchNext) {
+
+    if(searchIndex[searchNext].first.find(stdSearchString) != std::string::npos) {
+
+      wxDataViewItem key((void*)searchIndex[searchNext].second);
+      menuPanelData->Select(key);
+      ++searchNext;
+      return;
+
+    }
+
   }
 
-  searchLastIA = IA;
+  wxMessageBox("No more matches", "Search");
+  searchNext = 0;
 
 }
 
 void IntegratorFrame::OnSearchFunctions(wxCommandEvent& event) {
 
   searchLastString = wxGetTextFromUser("Enter function name", "Search");
-  searchLastIA = 0;
+  searchNext = 0;
   OnSearchFunctionsNext(event);
 
 }
@@ -622,7 +1060,12 @@ bool LLPEPass::runOnModule(Module& M) {
 
   }
 
+  // The analysis gives up without a root context if, for example, -llpe-root names no function.
+  if(!IHP->getRoot())
+    return false;
+
   IHP->commit();
+  IntegratorCommitted = true;
 
   return false;
 
@@ -636,3 +1079,476 @@ void LLPEPass::getAnalysisUsage(AnalysisUsage& AU) const {
 }
 
 
+
+// A batch job: where to write the result, and the LLPE command line to use. For -llpe-multi,
+// output is instead the configuration's name.
+struct LLPEBatchJob {
+
+  std::string output;
+  std::vector<std::string> args;
+
+};
+
+static void readBatchJobs(std::string& path, std::vector<LLPEBatchJob>& jobs) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load from " << path << ": " << ec.message() << "\n";
+    exit(1);
+
+  }
+
+  SmallVector<StringRef, 16> lines;
+  (*MB)->getBuffer().split(lines, '\n', -1, false);
+
+  for(SmallVector<StringRef, 16>::iterator it = lines.begin(), itend = lines.end(); it != itend; ++it) {
+
+    StringRef line = it->trim();
+    if(line.empty() || line[0] == '#')
+      continue;
+
+    BumpPtrAllocator A;
+    StringSaver Saver(A);
+    SmallVector<const char*, 16> tokens;
+    cl::TokenizeGNUCommandLine(line, Saver, tokens);
+    
+    jobs.push_back(LLPEBatchJob());
+    jobs.back().output = tokens[0];
+    for(uint32_t i = 1; i < tokens.size(); ++i)
+      jobs.back().args.push_back(tokens[i]);
+
+  }
+
+}
+
+// Set the global LLPE options to those of Job. Options are global, so the previous
+// job's settings are cleared first.
+static bool parseBatchJobOptions(LLPEBatchJob& Job) {
+
+  std::vector<const char*> argv;
+  argv.push_back("llpe-batch");
+  for(std::vector<std::string>::iterator it = Job.args.begin(), itend = Job.args.end(); it != itend; ++it)
+    argv.push_back(it->c_str());
+
+  cl::ResetAllOptionOccurrences();
+  if(!cl::ParseCommandLineOptions(argv.size(), &argv[0], "LLPE batch job", &errs()))
+    return false;
+
+  // Batch jobs never show the GUI.
+  AcceptAllInt = true;
+  return true;
+
+}
+
+// What M looked like before a batch job, so that everything the job added can be removed
+// again and the next job can run on M itself.
+struct LLPEModuleSnapshot {
+
+  struct FunctionState {
+
+    Function* F;
+    std::string name;
+    AttributeList attrs;
+
+  };
+
+  std::vector<FunctionState> functions;
+  DenseSet<GlobalValue*> originals;
+  DenseMap<NamedMDNode*, unsigned> namedMDSizes;
+
+};
+
+static void snapshotModule(Module& M, LLPEModuleSnapshot& S) {
+
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+
+    LLPEModuleSnapshot::FunctionState FS;
+    FS.F = &*it;
+    FS.name = it->getName().str();
+    FS.attrs = it->getAttributes();
+    S.functions.push_back(FS);
+    S.originals.insert(&*it);
+
+  }
+
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it)
+    S.originals.insert(&*it);
+
+  for(Module::named_metadata_iterator it = M.named_metadata_begin(), itend = M.named_metadata_end(); it != itend; ++it)
+    S.namedMDSizes[&*it] = it->getNumOperands();
+
+}
+
+// Give the original functions back their names, users and attributes. The committed root
+// (or a dispatcher) takes over the root's name and users; it is left nameless.
+static bool restoreFunctionNames(Module& M, LLPEModuleSnapshot& S) {
+
+  // The committed root (or a dispatcher) took the root's name and its users.
+  for(std::vector<LLPEModuleSnapshot::FunctionState>::iterator it = S.functions.begin(),
+	itend = S.functions.end(); it != itend; ++it) {
+
+    if(it->F->getName() == it->name)
+      continue;
+
+    if(Function* Taker = M.getFunction(it->name)) {
+
+      if(S.originals.count(Taker) || Taker->getType() != it->F->getType())
+	return false;
+      Taker->replaceAllUsesWith(it->F);
+      Taker->setName("");
+
+    }
+
+    it->F->setName(it->name);
+
+  }
+
+  for(std::vector<LLPEModuleSnapshot::FunctionState>::iterator it = S.functions.begin(),
+	itend = S.functions.end(); it != itend; ++it)
+    it->F->setAttributes(it->attrs);
+
+  return true;
+
+}
+
+// Undo a batch job: give the original functions back their names, users and attributes,
+// and delete the functions, globals and metadata the job created. The job's instructions
+// in unspecialised functions must already be gone (see revertInPlaceChanges).
+// Returns false if M could not be restored.
+static bool restoreModule(Module& M, LLPEModuleSnapshot& S) {
+
+  std::vector<Function*> newFunctions;
+  for(Module::iterator it = M.begin(), itend = M.end(); it != itend; ++it) {
+    if(!S.originals.count(&*it))
+      newFunctions.push_back(&*it);
+  }
+
+  std::vector<GlobalVariable*> newGlobals;
+  for(Module::global_iterator it = M.global_begin(), itend = M.global_end(); it != itend; ++it) {
+    if(!S.originals.count(&*it))
+      newGlobals.push_back(&*it);
+  }
+
+  if(!restoreFunctionNames(M, S))
+    return false;
+
+  for(std::vector<Function*>::iterator it = newFunctions.begin(), itend = newFunctions.end(); it != itend; ++it)
+    (*it)->dropAllReferences();
+  for(std::vector<GlobalVariable*>::iterator it = newGlobals.begin(), itend = newGlobals.end(); it != itend; ++it)
+    (*it)->dropAllReferences();
+
+  bool restored = true;
+
+  for(std::vector<Function*>::iterator it = newFunctions.begin(), itend = newFunctions.end(); it != itend; ++it) {
+
+    (*it)->removeDeadConstantUsers();
+    if((*it)->use_empty())
+      (*it)->eraseFromParent();
+    else
+      restored = false;
+
+  }
+
+  for(std::vector<GlobalVariable*>::iterator it = newGlobals.begin(), itend = newGlobals.end(); it != itend; ++it) {
+
+    (*it)->removeDeadConstantUsers();
+    if((*it)->use_empty())
+      (*it)->eraseFromParent();
+    else
+      restored = false;
+
+  }
+
+  // Fake debug info adds a compile unit per job.
+  std::vector<NamedMDNode*> newMD;
+  for(Module::named_metadata_iterator it = M.named_metadata_begin(), itend = M.named_metadata_end(); it != itend; ++it) {
+
+    DenseMap<NamedMDNode*, unsigned>::iterator findit = S.namedMDSizes.find(&*it);
+    if(findit == S.namedMDSizes.end()) {
+      newMD.push_back(&*it);
+      continue;
+    }
+
+    if(it->getNumOperands() == findit->second)
+      continue;
+
+    SmallVector<MDNode*, 4> keep;
+    for(unsigned i = 0; i < findit->second; ++i)
+      keep.push_back(it->getOperand(i));
+    it->clearOperands();
+    for(SmallVector<MDNode*, 4>::iterator keepit = keep.begin(), keepend = keep.end(); keepit != keepend; ++keepit)
+      it->addOperand(*keepit);
+
+  }
+
+  for(std::vector<NamedMDNode*>::iterator it = newMD.begin(), itend = newMD.end(); it != itend; ++it)
+    (*it)->eraseFromParent();
+
+  return restored;
+
+}
+
+// Specialise M in place according to the options last parsed and write the result to Job.output.
+// Analyses shares the per-function analyses of M between jobs; the caller is responsible for
+// putting M back with restoreModule afterwards. If Variant is given, nothing is written: the
+// committed root keeps the root's name, and *Variant gets it and the arguments to dispatch on.
+// Returns false on failure.
+static bool runBatchJob(Module& M, LLPEBatchJob& Job, LLPEFunctionAnalyses& Analyses, DispatchVariant* Variant = 0) {
+
+  IntegratorCommitted = false;
+  bool done = false;
+
+  {
+
+    legacy::PassManager PM;
+    LLPEAnalysisPass* AP = new LLPEAnalysisPass(&Analyses);
+    AP->deferDispatcher = (Variant != 0);
+    PM.add(AP);
+    PM.add(new LLPEPass());
+    PM.run(M);
+
+    if(IntegratorCommitted && Variant) {
+
+      *Variant = AP->dispatchVariant;
+      done = true;
+
+    }
+    else if(IntegratorCommitted) {
+
+      std::error_code error;
+      raw_fd_ostream Out(Job.output, error, sys::fs::F_None);
+      if(error)
+	errs() << "Failed to open " << Job.output << ": " << error.message() << "\n";
+      else {
+	WriteBitcodeToFile(M, Out);
+	done = true;
+      }
+
+    }
+
+    AP->revertInPlaceChanges();
+
+  }
+
+  return done;
+
+}
+
+bool LLPEBatchPass::runOnModule(Module& M) {
+
+  if(BatchJobsFile.empty()) {
+    errs() << "-llpe-batch requires -llpe-batch-jobs\n";
+    exit(1);
+  }
+
+  std::string jobsPath = BatchJobsFile;
+  unsigned maxWorkers = BatchParallel;
+  std::vector<LLPEBatchJob> jobs;
+  readBatchJobs(jobsPath, jobs);
+
+  uint32_t failed = 0;
+
+  LLPEFunctionAnalyses Analyses;
+
+  if(maxWorkers > 1) {
+
+    // Build the dominator trees and function descriptions once, here, then fork a worker per
+    // job, up to maxWorkers at once. Each worker inherits M and the analyses copy-on-write,
+    // specialises M in place and exits once its output is written, so nothing a job does
+    // needs undoing and only the descriptions its options change are rebuilt.
+    {
+      legacy::PassManager PM;
+      PM.add(new LLPEAnalysisPass(&Analyses, true));
+      PM.run(M);
+    }
+
+    DenseMap<pid_t, uint32_t> workers;
+    uint32_t nextJob = 0;
+
+    while(nextJob < jobs.size() || !workers.empty()) {
+
+      if(nextJob < jobs.size() && workers.size() < maxWorkers) {
+
+	pid_t pid = fork();
+	if(pid == 0)
+	  _exit((parseBatchJobOptions(jobs[nextJob]) && runBatchJob(M, jobs[nextJob], Analyses)) ? 0 : 1);
+
+	if(pid != -1) {
+	  errs() << "Batch job " << (nextJob + 1) << "/" << jobs.size() << ": " << jobs[nextJob].output << "\n";
+	  workers[pid] = nextJob++;
+	  continue;
+	}
+
+	// Out of processes: try again once a running worker finishes, or give up on this job.
+	errs() << "fork failed: " << strerror(errno) << "\n";
+	if(workers.empty()) {
+	  errs() << "Batch job " << (nextJob + 1) << " failed\n";
+	  ++failed;
+	  ++nextJob;
+	  continue;
+	}
+
+      }
+
+      int status;
+      pid_t pid;
+      do {
+	pid = wait(&status);
+      } while(pid == -1 && errno == EINTR);
+
+      if(pid == -1) {
+
+	errs() << "wait failed: " << strerror(errno) << "\n";
+	for(DenseMap<pid_t, uint32_t>::iterator it = workers.begin(), itend = workers.end(); it != itend; ++it)
+	  errs() << "Batch job " << (it->second + 1) << " failed\n";
+	failed += workers.size() + (jobs.size() - nextJob);
+	break;
+
+      }
+
+      DenseMap<pid_t, uint32_t>::iterator findit = workers.find(pid);
+      if(findit == workers.end())
+	continue;
+
+      if(!(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+	errs() << "Batch job " << (findit->second + 1) << " failed\n";
+	++failed;
+      }
+      workers.erase(findit);
+
+    }
+
+    if(failed)
+      errs() << failed << " of " << jobs.size() << " batch jobs failed\n";
+
+    return false;
+
+  }
+
+  // Run each job on M itself and undo it afterwards, so that dominator trees and function
+  // descriptions built by one job serve the rest.
+  for(uint32_t i = 0; i < jobs.size(); ++i) {
+
+    errs() << "Batch job " << (i + 1) << "/" << jobs.size() << ": " << jobs[i].output << "\n";
+    if(!parseBatchJobOptions(jobs[i])) {
+      errs() << "Batch job " << (i + 1) << " failed: bad options\n";
+      ++failed;
+      continue;
+    }
+
+    LLPEModuleSnapshot Before;
+    snapshotModule(M, Before);
+
+    if(!runBatchJob(M, jobs[i], Analyses)) {
+      errs() << "Batch job " << (i + 1) << " failed\n";
+      ++failed;
+    }
+
+    if(!restoreModule(M, Before)) {
+      errs() << "Couldn't undo batch job " << (i + 1) << "; skipping the remaining " << (jobs.size() - (i + 1)) << " jobs\n";
+      failed += jobs.size() - (i + 1);
+      break;
+    }
+
+  }
+
+  if(failed)
+    errs() << failed << " of " << jobs.size() << " batch jobs failed\n";
+
+  // Every job has been undone, so the input module is as we found it.
+  return false;
+
+}
+
+// Keep the root specialised by a -llpe-multi configuration as an internal function named
+// after the configuration, and give the root back its name and users so that the next
+// configuration starts from the unspecialised program again. Root is the root function
+// of the earlier configurations, if any.
+static bool keepDispatchVariant(Module& M, LLPEModuleSnapshot& S, std::string& name, DispatchVariant& V, Function*& Root) {
+
+  Function* Renamed = 0;
+  for(std::vector<LLPEModuleSnapshot::FunctionState>::iterator it = S.functions.begin(),
+	itend = S.functions.end(); it != itend; ++it) {
+
+    if(it->F->getName() != it->name) {
+      if(Renamed)
+	return false;
+      Renamed = it->F;
+    }
+
+  }
+
+  if((!Renamed) || (Root && Renamed != Root))
+    return false;
+
+  if(!restoreFunctionNames(M, S))
+    return false;
+
+  Root = Renamed;
+  V.F->setName(Root->getName() + ".spec." + name);
+  V.F->setLinkage(GlobalValue::InternalLinkage);
+  return true;
+
+}
+
+bool LLPEMultiPass::runOnModule(Module& M) {
+
+  if(MultiConfigsFile.empty()) {
+    errs() << "-llpe-multi requires -llpe-multi-configs\n";
+    exit(1);
+  }
+
+  std::string configsPath = MultiConfigsFile;
+  std::vector<LLPEBatchJob> configs;
+  readBatchJobs(configsPath, configs);
+
+  // Every configuration specialises the same root, starting from the same program, so the
+  // per-function analyses built for one serve the rest.
+  LLPEFunctionAnalyses Analyses;
+  std::vector<DispatchVariant> variants;
+  Function* Root = 0;
+  uint32_t failed = 0;
+
+  for(uint32_t i = 0; i < configs.size(); ++i) {
+
+    errs() << "Configuration " << (i + 1) << "/" << configs.size() << ": " << configs[i].output << "\n";
+    if(!parseBatchJobOptions(configs[i])) {
+      errs() << "Configuration " << configs[i].output << " failed: bad options\n";
+      ++failed;
+      continue;
+    }
+
+    LLPEModuleSnapshot Before;
+    snapshotModule(M, Before);
+
+    DispatchVariant V;
+    if(runBatchJob(M, configs[i], Analyses, &V) && keepDispatchVariant(M, Before, configs[i].output, V, Root)) {
+      variants.push_back(V);
+      continue;
+    }
+
+    errs() << "Configuration " << configs[i].output << " failed\n";
+    ++failed;
+
+    if(!restoreModule(M, Before)) {
+      errs() << "Couldn't undo configuration " << configs[i].output << "\n";
+      exit(1);
+    }
+
+  }
+
+  if(failed)
+    errs() << failed << " of " << configs.size() << " configurations failed\n";
+
+  if(variants.empty())
+    return false;
+
+  // The unmodified root is the last resort.
+  Function* Dispatch = createDispatcher(Root, variants, Root);
+  Root->setName(Dispatch->getName() + ".fallback");
+  Root->setLinkage(GlobalValue::InternalLinkage);
+
+  return true;
+
+}
@@ -13,10 +13,12 @@
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
 #include "llvm/ADT/IntervalMap.h"
+#include "llvm/ADT/PointerIntPair.h"
 #include "llvm/IR/ValueMap.h"
 #include "llvm/ADT/SmallVector.h"
 #include "llvm/ADT/SmallSet.h"
 #include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/StringMap.h"
 #include "llvm/Pass.h"
 #include "llvm/IR/Value.h"
 #include "llvm/IR/BasicBlock.h"
@@ -37,6 +39,7 @@
 #include "llvm/Transforms/Utils/ValueMapper.h"
 
 #include <limits.h>
+#include <list>
 #include <string>
 #include <vector>
 
@@ -82,11 +85,9 @@ class TargetLibraryInfo;
 class ShadowBB;
 class TrackedStore;
 
-#ifndef LLVM_EFFICIENT_PRINTING
-class PersistPrinter { };
-#else
-class PersistPrinter; // Opaque here, defined in AsmWriter
-#endif
+class PersistPrinter; // Opaque here, defined in Print.cpp or AsmWriter
+class ReportWriter; // Defined in Report.cpp
+class ReportReader;
 
 inline void release_assert_fail(const char* str) {
 
@@ -130,8 +131,12 @@ struct IntegratorTag {
   IntegratorType type;
   void* ptr;
   IntegratorTag* parent;
+  // Created on demand by getTagChildren, when the GUI first expands this tag.
+  bool childrenCreated;
   std::vector<IntegratorTag*> children;
 
+IntegratorTag() : childrenCreated(false) { }
+
 };
 
 enum PathConditionTypes {
@@ -336,6 +341,33 @@ SeekFile() : name(), newOffset(0), MayDelete(false) { }
 
 };
 
+// A context that has yet to be committed, competing for the code size budget.
+struct BudgetCandidate {
+
+  InlineAttempt* IA;
+  // Index of the nearest candidate above this one, or -1; committing this one requires that one.
+  int32_t parentIdx;
+  uint64_t charge;
+  int64_t benefit;
+  bool picked;
+
+BudgetCandidate(InlineAttempt* _IA, int32_t _P, uint64_t _C, int64_t _B) : IA(_IA), parentIdx(_P), charge(_C), benefit(_B), picked(false) { }
+
+};
+
+// Analysis-order timestamps for a heap object that -llpe-heap-snapshot may replace with a global:
+// its allocation, its last recorded constant store and its first read that specialised code
+// will still perform.
+struct HeapSnapshotTimes {
+
+  uint64_t allocated;
+  uint64_t lastWrite;
+  uint64_t firstResidualRead;
+
+HeapSnapshotTimes() : allocated(0), lastWrite(0), firstResidualRead(ULLONG_MAX) { }
+
+};
+
 struct GlobalStats {
   
   uint32_t dynamicFunctions;
@@ -358,11 +390,19 @@ struct GlobalStats {
   uint32_t fileChecks;
   uint32_t threadChecks;
   uint32_t condChecks;
+  uint32_t budgetDisabledContexts;
+  uint32_t mergedFunctions;
+  uint32_t mergedInstructions;
+  uint64_t mergedBytesEstimate;
+  uint32_t snapshotAllocations;
+  uint32_t snapshotStores;
 
 GlobalStats() : dynamicFunctions(0), dynamicContexts(0), dynamicBlocks(0), dynamicInsts(0),
     disabledContexts(0), resolvedBranches(0), constantInstructions(0), pointerInstructions(0),
     setInstructions(0), unknownInstructions(0), deadInstructions(0), residualBlocks(0),
-    residualInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0) {}
+    residualInstructions(0), mallocChecks(0), fileChecks(0), threadChecks(0), condChecks(0),
+    budgetDisabledContexts(0), mergedFunctions(0), mergedInstructions(0), mergedBytesEstimate(0),
+    snapshotAllocations(0), snapshotStores(0) {}
 
   void print(raw_ostream& Out) {
 
@@ -383,6 +423,12 @@ GlobalStats() : dynamicFunctions(0), dynamicContexts(0), dynamicBlocks(0), dynam
     Out << "File checks: " << fileChecks << "\n";
     Out << "Thread checks: " << threadChecks << "\n";
     Out << "Cond checks: " << condChecks << "\n";
+    Out << "Contexts disabled by size budget: " << budgetDisabledContexts << "\n";
+    Out << "Merged duplicate functions: " << mergedFunctions << "\n";
+    Out << "Merged duplicate instructions: " << mergedInstructions << "\n";
+    Out << "Estimated bytes saved by merging: " << mergedBytesEstimate << "\n";
+    Out << "Heap allocations replaced by globals: " << snapshotAllocations << "\n";
+    Out << "Stores folded into global initialisers: " << snapshotStores << "\n";
 
   }
 
@@ -398,11 +444,43 @@ ArgStore(uint32_t hi) : heapIdx(hi) {}
 
 };
 
+// A specialised root and the arguments it was specialised for, which a dispatcher checks
+// before calling it: argument values, char* arguments compared as strings, and known argv
+// entries (index into argv, text).
+struct DispatchVariant {
+
+  Function* F;
+  std::vector<std::pair<uint32_t, Constant*> > guards;
+  std::vector<std::pair<uint32_t, std::string> > stringGuards;
+  int32_t argvIdx;
+  std::vector<std::pair<uint32_t, std::string> > argvStrings;
+
+DispatchVariant() : F(0), argvIdx(-1) {}
+
+};
+
+Function* createDispatcher(Function* Replaced, std::vector<DispatchVariant>& Variants, Function* Fallback);
+
+// Analyses of the unspecialised functions. A batch run (-llpe-batch) shares one of these
+// between jobs; descriptions that depended on one job's options are rebuilt for the next.
+struct LLPEFunctionAnalyses {
+
+  DenseMap<Function*, ShadowFunctionInvar*> functionInfo;
+  DenseMap<Function*, DominatorTree*> DTs;
+  // Functions whose functionInfo was built under per-function options, a block profile or
+  // the root's argv rewrite.
+  SmallPtrSet<Function*, 8> jobSpecific;
+
+};
+
 class LLPEAnalysisPass : public ModulePass {
 
  public:
 
-   DenseMap<Function*, ShadowFunctionInvar*> functionInfo;
+   LLPEFunctionAnalyses ownAnalyses;
+   LLPEFunctionAnalyses* functionAnalyses;
+   // Only fill functionAnalyses in for every function, specialising nothing (see -llpe-batch-parallel).
+   bool warmAnalysesOnly;
 
    SmallSet<Function*, 4> alwaysInline;
    SmallSet<Function*, 4> alwaysExplore;
@@ -421,11 +499,11 @@ class LLPEAnalysisPass : public ModulePass {
 
    InlineAttempt* RootIA;
 
-   DenseMap<const GlobalVariable*, std::string> GVCache;
-   DenseMap<const GlobalVariable*, std::string> GVCacheBrief;
-
-   DenseMap<const Function*, DenseMap<const Value*, std::string>* > functionTextCache;
-   DenseMap<const Function*, DenseMap<const Value*, std::string>* > briefFunctionTextCache;
+   // Bounded LRU cache of value text, keyed by (value, brief), most recently used first.
+   typedef PointerIntPair<const Value*, 1, bool> ValueTextKey;
+   typedef std::list<std::pair<ValueTextKey, std::string> > ValueTextList;
+   ValueTextList valueTextLRU;
+   DenseMap<ValueTextKey, ValueTextList::iterator> valueTextIndex;
 
    DenseMap<GlobalVariable*, uint64_t> shadowGlobalsIdx;
 
@@ -441,8 +519,6 @@ class LLPEAnalysisPass : public ModulePass {
    // Pass identifier
    static char ID;
 
-   DenseMap<Function*, DominatorTree*> DTs;
-
    ImprovedValSetMulti::MapTy::Allocator IMapAllocator;
 
    SmallPtrSet<Function*, 8> blacklistedFunctions;
@@ -490,6 +566,9 @@ class LLPEAnalysisPass : public ModulePass {
 
    std::vector<AllocData> heap;
    std::vector<FDGlobalState> fds;
+   // Names of files opened during specialisation; FDStates refer to them by index.
+   std::vector<std::string> fdFilenames;
+   StringMap<uint32_t> fdFilenameIds;
 
    RecyclingAllocator<BumpPtrAllocator, ImprovedValSetSingle> IVSAllocator;
 
@@ -497,10 +576,15 @@ class LLPEAnalysisPass : public ModulePass {
    bool enableSharing;
    bool verboseSharing;
    bool verbosePCs;
+   bool dumpDSE;
+   bool dumpTL;
    bool useGlobalInitialisers;
 
    Function* llioPreludeFn;
    int llioPreludeStackIdx;
+   // Instructions added to unspecialised functions (argv setup, the lliowd_init prelude),
+   // which a batch run removes again before the next job.
+   std::vector<Instruction*> inPlaceInsts;
    std::string llioConfigFile;
    std::vector<std::string> llioDependentFiles;
 
@@ -515,10 +599,32 @@ class LLPEAnalysisPass : public ModulePass {
    GlobalStats stats;
 
    DenseMap<IntegrationAttempt*, std::string> shortHeaders;
+   // Specialisation report (see Report.cpp), written in the background during the analysis
+   // and read back by the GUI.
+   std::string reportPath;
+   raw_fd_ostream* reportStream;
+   ReportWriter* reportWriter;
+   ReportReader* reportReader;
    DenseMap<ShadowInstruction*, TrackedStore*> trackedStores;
    DenseMap<ShadowInstruction*, TrackedAlloc*> trackedAllocs;
    DenseMap<Value*, uint32_t> committedHeapAllocations;
    DenseMap<Value*, uint32_t> committedFDs;
+   // Internal constant globals that committed memcpys read from, by content:
+   DenseMap<Constant*, GlobalVariable*> constantChunkSources;
+
+   // Heap objects that may be emitted as initialised globals: the constant stores made to each
+   // before it escaped, by heap index and offset, objects that cannot be treated that way,
+   // store instructions that wrote such constants, and their committed versions.
+   bool heapSnapshot;
+   DenseMap<uint32_t, std::vector<std::pair<uint64_t, Constant*> > > heapSnapshotWrites;
+   DenseSet<uint32_t> heapSnapshotVetoed;
+   DenseSet<ShadowInstruction*> heapSnapshotWriters;
+   std::vector<std::pair<uint32_t, WeakVH> > heapSnapshotStores;
+   // The analysis-order clock used to place those stores against reads of the same objects,
+   // and the spans of that order during which unspecialised code may run.
+   uint64_t heapSnapshotClock;
+   DenseMap<uint32_t, HeapSnapshotTimes> heapSnapshotTimes;
+   std::vector<std::pair<uint64_t, uint64_t> > heapSnapshotUnspecialised;
 
    std::vector<void*> IAs;
 
@@ -531,9 +637,51 @@ class LLPEAnalysisPass : public ModulePass {
    std::string statsFile;
    unsigned maxContexts;
 
-   explicit LLPEAnalysisPass() : ModulePass(ID), cacheDisabled(false) { 
-
+   // Outlined unspecialised function tails, shared between contexts, by (function, entry block index):
+   DenseMap<std::pair<Function*, uint32_t>, Function*> failedTails;
+   Function* getFailedTail(Function& F, uint32_t entryIdx, ArrayRef<BasicBlock*> blocks, ArrayRef<std::pair<Value*, ShadowInstIdx> > liveIns);
+
+   // Limit on estimated residual instructions, or 0 for none, and the amount spent so far:
+   uint64_t codeSizeBudget;
+   uint64_t codeSizeBudgetUsed;
+
+   // Block execution counts, used to weight the benefit model:
+   bool useBlockProfile;
+   bool useProfileMetadata;
+   DenseMap<const BasicBlock*, uint64_t> blockProfileCounts;
+   SmallPtrSet<const Function*, 8> blockProfileFunctions;
+
+   // With -llpe-dispatch, the specialised root is entered only when its arguments match the
+   // specialisation; otherwise an unmodified copy of the root runs. With deferDispatcher
+   // (set by -llpe-multi) the guards are only recorded, and the caller builds one dispatcher
+   // over several configurations' variants.
+   bool emitDispatcher;
+   bool deferDispatcher;
+   Function* dispatchFallback;
+   DispatchVariant dispatchVariant;
+   void prepareDispatcher(Function& F);
+   void createDispatcher();
+
+   explicit LLPEAnalysisPass(LLPEFunctionAnalyses* Shared = 0, bool WarmOnly = false) : ModulePass(ID), cacheDisabled(true) { 
+
+     functionAnalyses = Shared ? Shared : &ownAnalyses;
+     warmAnalysesOnly = WarmOnly;
+     RootIA = 0;
+     shadowGlobals = 0;
      mallocAlignment = 0;
+     useBlockProfile = false;
+     useProfileMetadata = false;
+     codeSizeBudget = 0;
+     codeSizeBudgetUsed = 0;
+     heapSnapshot = false;
+     heapSnapshotClock = 0;
+     emitDispatcher = false;
+     deferDispatcher = false;
+     dispatchFallback = 0;
+     reportStream = 0;
+     reportWriter = 0;
+     reportReader = 0;
+     persistPrinter = 0;
 
    }
 
@@ -545,12 +693,17 @@ class LLPEAnalysisPass : public ModulePass {
 
    // Caching text representations of instructions:
 
-   DenseMap<const Value*, std::string>& getFunctionCache(const Function* F, bool brief);
-   DenseMap<const GlobalVariable*, std::string>& getGVCache(bool brief);
-   void populateGVCaches(const Module*);
+   const std::string& getValueText(const Value* V, bool brief);
+   void clearValueCache();
    virtual void printValue(raw_ostream& ROS, const Value* V, bool brief);
    virtual void printValue(raw_ostream& ROS, ShadowValue V, bool brief);
    void disableValueCache();
+   void enableValueCache();
+
+   void openReport();
+   void queueReportRecord(uint64_t seq, std::string& record);
+   void closeReport();
+   void getReportDOT(uint64_t seq, bool brief, raw_ostream& Out);
 
    Constant* loadEnvironment(Module&, std::string&);
    void loadArgv(Function*, std::string&, unsigned argvidx, unsigned& argc);
@@ -613,12 +766,19 @@ class LLPEAnalysisPass : public ModulePass {
    unsigned getMallocAlignment();
 
    ShadowFunctionInvar* getFunctionInvarInfo(Function& F);
+   void forgetFunctionInvarInfo(Function* F);
+   void forgetJobSpecificInvarInfo(Function& Root);
+   void resetJobState();
+   void revertInPlaceChanges();
    ShadowLoopInvar* getLoopInfo(ShadowFunctionInvar* FInfo,
 				DenseMap<BasicBlock*, uint32_t>& BBIndices, 
 				const Loop* L,
 				DominatorTree*,
 				ShadowLoopInvar* Parent);
 
+   void loadBlockProfile(Module&, std::string&);
+   void setBlockProfileWeights(Function&, ShadowFunctionInvar&, LoopInfo*);
+
    void initShadowGlobals(Module&, uint32_t extraSlots);
    uint64_t getShadowGlobalIndex(GlobalVariable* GV) {
      return shadowGlobalsIdx[GV];
@@ -627,6 +787,9 @@ class LLPEAnalysisPass : public ModulePass {
    InlineAttempt* getRoot() { return RootIA; }
    IntegratorTag* getRootTag() { return rootTag; }
    void commit();
+   void mergeIdenticalCommitFunctions();
+   void snapshotHeapAllocations();
+   void noteHeapSnapshotUnspecialised(uint64_t From, uint64_t To);
 
    IntegratorTag* newTag() {
      
@@ -646,6 +809,10 @@ class LLPEAnalysisPass : public ModulePass {
 
    void fixNonLocalUses();
    void initGlobalFDStore();
+   uint32_t internFDFilename(const std::string&);
+   const std::string& getFDFilename(uint32_t id) {
+     return fdFilenames[id];
+   }
 
    const ShadowLoopInvar* applyIgnoreLoops(const ShadowLoopInvar*, Function*, ShadowFunctionInvar*);
 
@@ -737,14 +904,14 @@ inline ImprovedValSet* copyIV(const ImprovedValSet* IV) {
 
 inline bool copyImprovedVal(ShadowValue V, ImprovedValSet*& OutPB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
-    OutPB = copyIV(V.u.I->i.PB);
+    OutPB = copyIV(V.getInst()->i.PB);
     return IVIsInitialised(OutPB);
 
   case SHADOWVAL_ARG:
-    OutPB = copyIV(V.u.A->i.PB);
+    OutPB = copyIV(V.getArg()->i.PB);
     return IVIsInitialised(OutPB);
 
   case SHADOWVAL_GV:
@@ -908,7 +1075,16 @@ class IAWalker {
  protected:
   WLItem makeWL(uint32_t x, ShadowBB* y) { return std::make_pair(x, y); }
 
+  // Walks almost always (re)enter a block at its first instruction or its end, and mark
+  // those by stamping the block with this walk's epoch. Other entry points, and all entries
+  // for walkers that run nested within another or once the epoch counter is exhausted
+  // (epoch 0), use Visited.
+  uint32_t epoch;
+  static uint32_t nextEpoch;
+  static uint32_t activeWalkers;
   DenseSet<WLItem> Visited;
+  bool markVisited(const WLItem&);
+
   SmallVector<std::pair<WLItem, void*>, 8> Worklist1;
   SmallVector<std::pair<WLItem, void*>, 8> Worklist2;
 
@@ -936,12 +1112,27 @@ class IAWalker {
 
   bool doIgnoreEdges;
 
+  // Block epoch stamps belong to one job's ShadowBBs, so a new batch job may start again.
+  static void resetEpochs() {
+    release_assert(!activeWalkers);
+    nextEpoch = 0;
+  }
+
  IAWalker(void* IC = 0, bool ign = false) : PList(&Worklist1), CList(&Worklist2), initialContext(IC), doIgnoreEdges(ign) {
     
     Contexts.push_back(initialContext);
 
+    if(activeWalkers++ == 0 && nextEpoch != UINT32_MAX)
+      epoch = ++nextEpoch;
+    else
+      epoch = 0;
+
  }
 
+  virtual ~IAWalker() {
+    --activeWalkers;
+  }
+
   void walk();
   void queueWalkFrom(uint32_t idx, ShadowBB*, void* context, bool copyContext);
 
@@ -979,6 +1170,17 @@ class ForwardIAWalker : public IAWalker {
   
 };
 
+// One pass of a fused walk over the context tree; see IntegrationAttempt::runFusedPasses.
+// Contexts are visited after their children, so a pass may use what it computed for them.
+// flag is a per-context value the pass hands down the tree (e.g. whether its parent is enabled).
+struct FusedPass {
+
+  virtual bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) = 0;
+  virtual bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) = 0;
+  virtual void visit(IntegrationAttempt* Ctx, bool flag) = 0;
+
+};
+
 enum BarrierState {
 
   BARRIER_NONE,
@@ -1029,10 +1231,15 @@ protected:
   ShadowFunctionInvar* invarInfo;
 
   int64_t totalIntegrationGoodness;
+  // As above, excluding child calls and loops.
+  int64_t ownIntegrationGoodness;
   bool integrationGoodnessValid;
   uint64_t residualInstructionsHere;
 
   DenseMap<const ShadowLoopInvar*, PeelAttempt*> peelChildren;
+  // Call sites with a child InlineAttempt, in block then instruction order; maintained by
+  // setChildCall and walked by IAIterator.
+  SmallVector<ShadowInstruction*, 4> childCalls;
 
   uint32_t pendingEdges;
 
@@ -1061,6 +1268,7 @@ protected:
     F(_F),
     L(_L),
     totalIntegrationGoodness(0),
+    ownIntegrationGoodness(0),
     integrationGoodnessValid(false),
     peelChildren(1),
     pendingEdges(0),
@@ -1199,6 +1407,7 @@ protected:
   }
   virtual bool stackIncludesCallTo(Function*) = 0;
   bool shouldInlineFunction(ShadowInstruction*, Function*);
+  void setChildCall(ShadowInstruction* CI, InlineAttempt* IA);
   InlineAttempt* getOrCreateInlineAttempt(ShadowInstruction* CI, bool& created, bool& needsAnalyse);
   bool callCanExpand(ShadowInstruction* Call, InlineAttempt*& Result);
   bool analyseExpandableCall(ShadowInstruction* SI, bool& changed, bool inLoopAnalyser, bool inAnyLoop);
@@ -1234,7 +1443,7 @@ protected:
   virtual ReadFile* tryGetReadFile(ShadowInstruction* CI);
   bool tryPromoteOpenCall(ShadowInstruction* CI);
   bool tryResolveVFSCall(ShadowInstruction*);
-  bool executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename);
+  bool executeStatCall(ShadowInstruction* SI, Function* F, const std::string& Filename);
   WalkInstructionResult isVfsCallUsingFD(ShadowInstruction* VFSCall, ShadowInstruction* FD, bool ignoreClose);
   virtual void resolveReadCall(ShadowInstruction*, struct ReadFile);
   virtual void resolveSeekCall(ShadowInstruction*, struct SeekFile);
@@ -1290,6 +1499,9 @@ protected:
   virtual void findProfitableIntegration();
   virtual void findResidualFunctions(DenseSet<Function*>&, DenseMap<Function*, unsigned>&);
   int64_t getResidualInstructions();
+  void getChildBudgetCharge(bool live, uint64_t& charged, uint64_t& kept);
+  void getBudgetCandidates(int32_t parentIdx, std::vector<BudgetCandidate>& Candidates);
+  int64_t getOwnGoodnessIncludingLoops();
 
   // DOT export:
 
@@ -1300,16 +1512,15 @@ protected:
   void describeBlockAsDOT(ShadowBBInvar* BBI, ShadowBB* BB, const ShadowLoopInvar* deferEdgesOutside, SmallVector<std::string, 4>* deferredEdges, raw_ostream& Out, SmallVector<ShadowBBInvar*, 4>* forceSuccessors, bool brief, bool plain = false);
   void describeScopeAsDOT(const ShadowLoopInvar* DescribeL, uint32_t headerIdx, raw_ostream& Out, bool brief, SmallVector<std::string, 4>* deferredEdges);
   void describeLoopAsDOT(const ShadowLoopInvar* L, uint32_t headerIdx, raw_ostream& Out, bool brief);
-  void describeAsDOT(raw_ostream& Out, std::string& otherpath, bool brief);
+  void describeAsDOT(raw_ostream& Out, bool brief);
   std::string getValueColour(ShadowValue, std::string& textColour, bool plain = false);
   std::string getGraphPath(std::string prefix);
   void describeTreeAsDOT(std::string path);
   virtual bool getSpecialEdgeDescription(ShadowBBInvar* FromBB, ShadowBBInvar* ToBB, raw_ostream& Out) = 0;
   bool blockLiveInAnyScope(ShadowBBInvar* BB);
   virtual void printPathConditions(raw_ostream& Out, ShadowBBInvar* BBI, ShadowBB* BB);
-  void getSavedDotName(bool brief, std::string& Out);
-  void saveDOT2(bool brief);
   void saveDOT();
+  void writeReportRecord();
 
   void printWithCache(const Value* V, raw_ostream& ROS, bool brief = false) {
     pass->printValue(ROS, V, brief);
@@ -1328,6 +1539,7 @@ protected:
   unsigned getElimdInstructions();
   int64_t getTotalInstructionsIncludingLoops();
   IntegratorTag* createTag(IntegratorTag* parent);
+  void createTagChildren(IntegratorTag* myTag);
   virtual void addExtraTags(IntegratorTag* myTag);
 
   // Saving our results as a bitcode file:
@@ -1352,6 +1564,8 @@ protected:
   bool canSynthPointer(ShadowValue* I, ImprovedVal IV);
   void emitChunk(ShadowInstruction* I, BasicBlock* emitBB, SmallVector<IVSRange, 4>::iterator chunkBegin, SmallVector<IVSRange, 4>::iterator chunkEnd, SmallVector<Instruction*, 4>& newInstructions);
   bool trySynthMTI(ShadowInstruction* I, BasicBlock* emitBB);
+  bool getMergeableConstantStore(ShadowInstruction* I, ShadowValue& Base, int64_t& Offset, Constant*& C);
+  bool tryEmitConstantStoreRun(ShadowBB* BB, uint32_t idx, BasicBlock* emitBB, SmallPtrSet<ShadowInstruction*, 16>& Merged);
   Value* trySynthVal(ShadowValue* I, Type* targetType, ValSetType Ty, const ImprovedVal& IV, BasicBlock* emitBB);
   bool trySynthInst(ShadowInstruction* I, BasicBlock* emitBB, Value*& Result);
   bool trySynthArg(ShadowArg* A, BasicBlock* emitBB, Value*& Result);
@@ -1447,6 +1661,9 @@ protected:
   void TLAnalyseInstruction(ShadowInstruction&, bool commitDisabledHere, bool secondPass, bool inLoopAnalyser);
   bool requiresRuntimeCheck2(ShadowValue V, bool includeSpecialChecks);
   bool containsTentativeLoads();
+  bool isCheckpointInstruction(ShadowInstruction* SI);
+  bool isInCommittedPeel(ShadowBBInvar* BBI);
+  bool anyBlockLiveIn(const ShadowLoopInvar* LoopI);
   void addCheckpointFailedBlocks();
   void squashUnavailableObjects(ShadowInstruction& SI, ImprovedValSet*, bool inLoopAnalyser);
   void squashUnavailableObjects(ShadowInstruction& SI, bool inLoopAnalyser);
@@ -1463,9 +1680,14 @@ protected:
   void collectAllBlockStats();
   void collectBlockStats(ShadowBBInvar* BBI, ShadowBB* BB);
   void collectLoopStats(const ShadowLoopInvar*);
+  void collectStatsHere();
   void collectStats();
   virtual void preCommitStats(bool enabledHere);
 
+  // Fused walks over this context and its children:
+
+  void runFusedPasses(SmallVectorImpl<std::pair<FusedPass*, bool> >& Passes);
+
   void print(raw_ostream& OS) const;
   // Callable from GDB
   void dump() const;
@@ -1623,7 +1845,6 @@ class PeelAttempt {
    
    void describeTreeAsDOT(std::string path); 
 
-   void collectStats(); 
    void printHeader(raw_ostream& OS) const; 
    void printDebugHeader(raw_ostream& OS) const {
      printHeader(OS);
@@ -1652,6 +1873,7 @@ class PeelAttempt {
    bool containsTentativeLoads();
 
    IntegratorTag* createTag(IntegratorTag* parent);
+   void createTagChildren(IntegratorTag* myTag);
 
    void releaseCommittedChildren();
 
@@ -1731,6 +1953,9 @@ class InlineAttempt : public IntegrationAttempt {
   DominatorTree* DT;
   SmallDenseMap<uint32_t, uint32_t, 8>* blocksReachableOnFailure;
   std::vector<SmallVector<std::pair<BasicBlock*, uint32_t>, 1> > failedBlocks;
+  // If not INVALID_BLOCK_IDX, the only block where unspecialised code is entered; all failed paths
+  // then call a shared outlined copy of the function from there onwards.
+  uint32_t failedTailEntry;
   ValueToValueMapTy* failedBlockMap;
   // Indexes from CLONED instruction/block to replacement PHI node to use in that block.
   DenseMap<std::pair<Instruction*, BasicBlock*>, PHINode*>* PHIForwards;
@@ -1741,6 +1966,14 @@ class InlineAttempt : public IntegrationAttempt {
 
   ImprovedValSet* returnValue;
 
+  // Residual instructions charged against the code size budget by this context and its
+  // enabled, unshared descendants.
+  uint64_t budgetCharge;
+
+  // The heap snapshot clock when this context was first and last analysed.
+  uint64_t heapSnapshotEntry;
+  uint64_t heapSnapshotExit;
+
   bool isUnsharable() {
     return hasVFSOps || isModel || (sharing && !sharing->escapingMallocs.empty()) || Callers.empty();
   }
@@ -1854,7 +2087,13 @@ class InlineAttempt : public IntegrationAttempt {
   Value* getUnspecValue(uint32_t blockIdx, uint32_t instIdx, Value* V, BasicBlock* BB, Instruction* InsertBefore);
   BasicBlock::iterator commitFailedPHIs(BasicBlock* BB, BasicBlock::iterator BI, uint32_t BBIdx);
   void remapFailedBlock(BasicBlock::iterator BI, BasicBlock* BB, uint32_t blockIdx, uint32_t instIdx, bool skipTestedInst, bool skipTerm);
+  void emitFailedReturn(BasicBlock* BB, Value* Ret);
   virtual void commitSimpleFailedBlock(uint32_t i);
+  bool findFailedTailEntry(uint32_t& entryIdx);
+  void getFailedTailRegion(uint32_t entryIdx, SmallVector<uint32_t, 16>& region);
+  void getFailedTailLiveIns(SmallVector<uint32_t, 16>& region, SmallVector<std::pair<Value*, ShadowInstIdx>, 8>& liveIns);
+  void createFailedTailStub(uint32_t idx);
+  void commitFailedTailStub(uint32_t idx);
   virtual void popAllocas(OrdinaryLocalStore*);
   virtual void createFailedBlock(uint32_t idx);
   virtual void populateFailedBlock(uint32_t idx);
@@ -1877,13 +2116,15 @@ class InlineAttempt : public IntegrationAttempt {
 
   void gatherIndirectUsers();
   InlineAttempt* getStackFrameCtx(int32_t);
-  void prepareCommitCall();
+  void collectFinalisationStats();
+  void prepareCommitTree();
   void fixNonLocalStackUses();
   virtual void commitCFG();
   void releaseBackupStores();
   void releaseCommittedChildren();
 
   void postCommitOptimise();
+  void applyCodeSizeBudget();
   void finaliseAndCommit(bool inLoopAnalyser);
   void inheritCommitFunctionCall(bool);
 
@@ -1894,72 +2135,38 @@ class InlineAttempt : public IntegrationAttempt {
 struct IAIterator {
 
   const IntegrationAttempt* parent;
-  uint32_t blockIdx;
-  uint32_t instIdx;
+  uint32_t callIdx;
 
   std::pair<ShadowInstruction*, InlineAttempt*> D;
 
   IAIterator() {
-    blockIdx = 0;
-    instIdx = 0;
+    callIdx = 0;
     parent = 0;
   }
 
   IAIterator(const IntegrationAttempt* IA, bool isEnd) {
     
     parent = IA;
-    
-    if(isEnd) {
-      blockIdx = parent->nBBs;
-      instIdx = 0;
-    }
-    else {
-      blockIdx = 0;
-      instIdx = 0;
-      advanceToNextCall();
-    }
+    callIdx = isEnd ? parent->childCalls.size() : 0;
 
   }
 
-IAIterator(const IAIterator& other) : parent(other.parent), blockIdx(other.blockIdx), instIdx(other.instIdx) {}
-  
-  void advanceToNextCall() {
-
-    for(; blockIdx < parent->nBBs; ++blockIdx) {
-      
-      if(parent->BBs[blockIdx]) {
-      
-	for(; instIdx < parent->BBs[blockIdx]->insts.size(); ++instIdx) {
-	  
-	  if(parent->BBs[blockIdx]->insts[instIdx].typeSpecificData)
-	    return;
-	  
-	}
-
-      }
-
-      instIdx = 0;
-
-    }
-
-  }
+IAIterator(const IAIterator& other) : parent(other.parent), callIdx(other.callIdx) {}
 
   struct IAIterator& operator++() {
-    ++instIdx;
-    advanceToNextCall();
+    ++callIdx;
     return *this;
   }
 
   struct IAIterator operator++(int) {
     IAIterator cpy = *this;
-    ++instIdx;
-    advanceToNextCall();
+    ++callIdx;
     return cpy;
   }
 
   bool operator==(const IAIterator& other) {
 
-    return parent == other.parent && blockIdx == other.blockIdx && instIdx == other.instIdx;
+    return parent == other.parent && callIdx == other.callIdx;
 
   }
 
@@ -1971,8 +2178,8 @@ IAIterator(const IAIterator& other) : parent(other.parent), blockIdx(other.block
 
   const std::pair<ShadowInstruction*, InlineAttempt*>& operator*() {
 
-    release_assert(blockIdx < parent->nBBs);
-    ShadowInstruction* SI = &parent->BBs[blockIdx]->insts[instIdx];
+    release_assert(callIdx < parent->childCalls.size());
+    ShadowInstruction* SI = parent->childCalls[callIdx];
     D = std::make_pair(SI, (InlineAttempt*)SI->typeSpecificData);
     return D;
     
@@ -2008,11 +2215,11 @@ inline ShadowValue getStackAllocationWithIndex(InlineAttempt* IA, uint32_t i) {
 
 inline IntegrationAttempt* ShadowValue::getCtx() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
-    return u.A->IA;
+    return getArg()->IA;
   case SHADOWVAL_INST:
-    return u.I->parent->IA;
+    return getInst()->parent->IA;
   default:
     return 0;
   }
@@ -2029,13 +2236,13 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  Constant* intFromBytes(const uint64_t*, unsigned, unsigned, llvm::LLVMContext&);
  
  // Implemented in Transforms/Integrator/SimpleVFSEval.cpp, so only usable with -integrator
- bool getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors);
+ bool getFileBytes(const std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors);
 
  // Implemented in VMCore/AsmWriter.cpp, since that file contains a bunch of useful private classes
  // if LLVM has been patched appropriately; otherwise stubbed out with simple implementations in Print.cpp.
  PersistPrinter* getPersistPrinter(Module*);
- void getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<const Value*, std::string>& IMap, DenseMap<const Value*, std::string>& BriefMap);
- void getGVText(PersistPrinter*, const Module* M, DenseMap<const GlobalVariable*, std::string>& GVMap, DenseMap<const GlobalVariable*, std::string>& BriefGVMap);
+ void freePersistPrinter(PersistPrinter*);
+ void getValueText(PersistPrinter*, const Value* V, std::string& Out);
 
  bool isGlobalIdentifiedObject(ShadowValue VC);
  bool shouldQueueOnInst(Instruction* I, IntegrationAttempt* ICtx);
@@ -2087,7 +2294,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void truncateLeft(ImprovedValSetMulti::MapIt& it, uint64_t n, ImprovedValSetMulti::MapIt& replacementStart);
  bool canTruncate(const ImprovedValSetSingle& S);
 
- void readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet* store, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize);
+ void readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet* store, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize, DenseScalarArray** DenseOut = 0);
  void readValRangeMulti(ShadowValue& V, uint64_t Offset, uint64_t Size, ShadowBB* ReadBB, SmallVector<IVSRange, 4>& Results);
  void executeMemcpyInst(ShadowInstruction* MemcpySI);
  void executeVaCopyInst(ShadowInstruction* SI);
@@ -2098,7 +2305,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void executeFreeInst(ShadowInstruction* SI, Function*);
  void executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& SrcPtrSet, uint64_t Size, ShadowInstruction*);
  void executeVaStartInst(ShadowInstruction* SI);
- void executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size);
+ void executeReadInst(ShadowInstruction* ReadSI, const std::string& Filename, uint64_t FileOffset, uint64_t Size);
  void executeUnexpandedCall(ShadowInstruction* SI);
  bool clobberSyscallModLocations(Function* F, ShadowInstruction* SI);
  void executeWriteInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& ValPB, uint64_t PtrSize, ShadowInstruction*);
@@ -2120,7 +2327,8 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  ShadowValue& getAllocWithIdx(int32_t);
  AllocData& addHeapAlloc(ShadowInstruction*);
 
- IntegratorTag* searchFunctions(IntegratorTag* thisTag, std::string&, IntegratorTag*& startAt);
+ std::vector<IntegratorTag*>& getTagChildren(IntegratorTag* tag);
+ void buildTagSearchIndex(IntegratorTag* thisTag, std::vector<std::pair<std::string, IntegratorTag*> >& index);
 
  GlobalVariable* getStringArray(std::string& bytes, Module& M, bool addNull=false);
 
@@ -2133,7 +2341,9 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  Value* getValAsType(Value* V, Type* Ty, BasicBlock* insertAtEnd);
 
  void valueEscaped(ShadowValue, ShadowBB*);
- void intersectSets(DenseSet<ShadowValue>* Target, MutableArrayRef<DenseSet<ShadowValue>* > Merge);
+ bool mayExecuteRepeatedly(ShadowBB*);
+ void noteHeapSnapshotRead(const ImprovedValSetSingle&);
+ void noteHeapSnapshotCallRead(ShadowInstruction*);
 
  bool requiresRuntimeCheck(ShadowValue V, bool includeSpecialChecks);
  PHINode* makePHI(Type* Ty, const Twine& Name, BasicBlock* emitBB);
@@ -2143,7 +2353,7 @@ inline IntegrationAttempt* ShadowValue::getCtx() const {
  void escapePercent(std::string&);
 
  void clearAsExpectedChecks(ShadowBB*);
- void noteLLIODependency(std::string&);
+ void noteLLIODependency(const std::string&);
 
  const GlobalValue* getUnderlyingGlobal(const GlobalValue* V);
 
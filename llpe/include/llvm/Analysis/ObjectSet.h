@@ -0,0 +1,77 @@
+//===-- ObjectSet.h -------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Persistent sets of allocations (heap objects and stack allocas), used by the
+// OrdinaryStoreExtraState flag sets. Each set keeps one bitset tree per stack frame
+// (plus one for the heap) whose nodes are refcounted and copy-on-write like the
+// SharedTreeNodes in SharedTree.h, so copying a set only shares its roots, and
+// intersecting sets that descend from a common ancestor only visits subtrees that differ.
+
+#define OBJSETORDER 16
+#define OBJSETORDERLOG2 4
+// A leaf node holds OBJSETORDER 64-bit words, so covers 1024 allocation indices.
+#define OBJSETLEAFLOG2 10
+
+struct ObjectSetNode {
+
+  union {
+    ObjectSetNode* children[OBJSETORDER];
+    uint64_t bits[OBJSETORDER];
+  };
+  uint32_t refCount;
+
+ObjectSetNode() : refCount(1) {
+
+  memset(children, 0, sizeof(children));
+
+}
+
+};
+
+struct ObjectSetTree {
+
+  ObjectSetNode* root;
+  // Levels including the leaf level; 0 means empty.
+  uint32_t height;
+
+ObjectSetTree() : root(0), height(0) { }
+
+  bool count(uint32_t idx) const;
+  void insert(uint32_t idx);
+  void erase(uint32_t idx);
+  void clear();
+  void intersect(SmallVector<const ObjectSetTree*, 4>& others);
+  void getIndices(SmallVectorImpl<uint32_t>& out) const;
+
+};
+
+class ObjectSet {
+
+  // trees[0] holds heap objects; trees[n + 1] holds stack frame n's allocas.
+  SmallVector<ObjectSetTree, 4> trees;
+
+  void retainAll();
+  void releaseAll();
+
+ public:
+
+  ObjectSet() { }
+  ObjectSet(const ObjectSet& other) : trees(other.trees) { retainAll(); }
+  ~ObjectSet() { releaseAll(); }
+  ObjectSet& operator=(const ObjectSet& other);
+
+  bool count(const ShadowValue& V) const;
+  void insert(const ShadowValue& V);
+  void erase(const ShadowValue& V);
+  void clearFrame(int32_t frame);
+  // Keep only those objects that also occur in every member of others.
+  void intersect(ArrayRef<const ObjectSet*> others);
+  void getObjects(SmallVectorImpl<ShadowValue>& out) const;
+
+};
@@ -42,6 +42,12 @@ template<typename T> class ImmutableArray {
     return arr[size()-1];
   }
 
+  void release() {
+    delete[] arr;
+    arr = 0;
+    n = 0;
+  }
+
 };
 
 // Just a tagged union of the types of values that can come out of getOperand.
@@ -111,95 +117,178 @@ enum ValSetType {
 
 };
 
+// ShadowValues are packed into 8 bytes since they key many hash tables and make up most of
+// every ImprovedVal. The low three bits are a tag:
+//
+//   0: SHADOWVAL_INVAL (all bits zero)
+//   1-4: ShadowArg*, ShadowInstruction*, ShadowGV* or Value* in the remaining bits,
+//        relying on at least 8-byte alignment
+//   5: SHADOWVAL_PTRIDX, frame in bits 4-31 (signed) and idx in bits 32-63
+//   6: SHADOWVAL_FDIDX(64), laid out as PTRIDX with bit 3 set for FDIDX64
+//   7: constant integers, width in bits 3-4 and bit 5 set if bits 6-63 index boxedCIs
+//      rather than holding the (sign-extended) value directly
+//
+// The encoding is canonical, so equal values have equal bits.
+
+#define SVTAG_BITS 3
+#define SVTAG_MASK 7
+
+enum ShadowValTag {
+
+  SVTAG_INVAL,
+  SVTAG_ARG,
+  SVTAG_INST,
+  SVTAG_GV,
+  SVTAG_OTHER,
+  SVTAG_PTRIDX,
+  SVTAG_FDIDX,
+  SVTAG_CI
+
+};
+
 struct ShadowValue {
 
-  ShadowValType t;
-  union {
-    ShadowArg* A;
-    ShadowInstruction* I;
-    ShadowGV* GV;
-    Value* V;
-    struct {
-      int32_t frame;
-      uint32_t idx;
-    } PtrOrFd;
-    uint64_t CI;
-  } u;
-
-ShadowValue() : t(SHADOWVAL_INVAL) { u.V = 0; }
-ShadowValue(ShadowArg* _A) : t(SHADOWVAL_ARG) { u.A = _A; }
-ShadowValue(ShadowInstruction* _I) : t(SHADOWVAL_INST) { u.I = _I; }
-ShadowValue(ShadowGV* _GV) : t(SHADOWVAL_GV) { u.GV = _GV; }
-ShadowValue(Value* _V) : t(SHADOWVAL_OTHER) { u.V = _V; }
-ShadowValue(ShadowValType Ty, int32_t frame, uint32_t idx) : t(Ty) { u.PtrOrFd.frame = frame; u.PtrOrFd.idx = idx; }
-ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
-
-  static ShadowValue getPtrIdx(int32_t f, uint32_t i) { return ShadowValue(SHADOWVAL_PTRIDX, f, i); }
-  static ShadowValue getFdIdx(uint32_t i) { return ShadowValue(SHADOWVAL_FDIDX, -1, i); }
-  static ShadowValue getFdIdx64(uint32_t i) { return ShadowValue(SHADOWVAL_FDIDX64, -1, i); }
-  static ShadowValue getInt8(uint8_t i) { return ShadowValue(SHADOWVAL_CI8, i); }
-  static ShadowValue getInt16(uint16_t i) { return ShadowValue(SHADOWVAL_CI16, i); }
-  static ShadowValue getInt32(uint32_t i) { return ShadowValue(SHADOWVAL_CI32, i); }
-  static ShadowValue getInt64(uint64_t i) { return ShadowValue(SHADOWVAL_CI64, i); }
+  uint64_t bits;
+
+  // 64-bit constants too wide to store inline; see getInt.
+  static std::vector<uint64_t> boxedCIs;
+  static DenseMap<uint64_t, uint32_t> boxedCIIndex;
+  static uint64_t boxCI(uint64_t CI);
+
+  void setPtr(ShadowValTag tag, const void* P) {
+    assert(!(((uintptr_t)P) & SVTAG_MASK) && "Misaligned pointer in ShadowValue");
+    bits = ((uint64_t)(uintptr_t)P) | tag;
+  }
+  void* getPtr() const {
+    return (void*)(uintptr_t)(bits & ~(uint64_t)SVTAG_MASK);
+  }
+  ShadowValTag getTag() const {
+    return (ShadowValTag)(bits & SVTAG_MASK);
+  }
+
+ShadowValue() : bits(SVTAG_INVAL) { }
+ShadowValue(ShadowArg* _A) { setPtr(SVTAG_ARG, _A); }
+ShadowValue(ShadowInstruction* _I) { setPtr(SVTAG_INST, _I); }
+ShadowValue(ShadowGV* _GV) { setPtr(SVTAG_GV, _GV); }
+ShadowValue(Value* _V) { setPtr(SVTAG_OTHER, _V); }
+
+  static ShadowValue makePtrOrFd(ShadowValTag tag, bool is64, int32_t frame, uint32_t idx) {
+    ShadowValue SV;
+    SV.bits = (((uint64_t)idx) << 32) | (uint32_t)(((uint32_t)frame << 4) | (is64 ? 8 : 0) | tag);
+    assert(SV.getPtrOrFdFrame() == frame && "Frame number out of range");
+    return SV;
+  }
+
+  static ShadowValue makeCI(uint32_t width, uint64_t CI) {
+    ShadowValue SV;
+    uint64_t payload = CI << 6;
+    if((uint64_t)(((int64_t)payload) >> 6) != CI)
+      payload = (boxCI(CI) << 6) | 32;
+    SV.bits = payload | (width << 3) | SVTAG_CI;
+    return SV;
+  }
+
+  static ShadowValue getPtrIdx(int32_t f, uint32_t i) { return makePtrOrFd(SVTAG_PTRIDX, false, f, i); }
+  static ShadowValue getFdIdx(uint32_t i) { return makePtrOrFd(SVTAG_FDIDX, false, -1, i); }
+  static ShadowValue getFdIdx64(uint32_t i) { return makePtrOrFd(SVTAG_FDIDX, true, -1, i); }
+  static ShadowValue getInt8(uint8_t i) { return makeCI(0, i); }
+  static ShadowValue getInt16(uint16_t i) { return makeCI(1, i); }
+  static ShadowValue getInt32(uint32_t i) { return makeCI(2, i); }
+  static ShadowValue getInt64(uint64_t i) { return makeCI(3, i); }
   static ShadowValue getInt(Type*, uint64_t i);
 
+  ShadowValType getValType() const {
+    switch(getTag()) {
+    case SVTAG_INVAL:
+      return SHADOWVAL_INVAL;
+    case SVTAG_ARG:
+      return SHADOWVAL_ARG;
+    case SVTAG_INST:
+      return SHADOWVAL_INST;
+    case SVTAG_GV:
+      return SHADOWVAL_GV;
+    case SVTAG_OTHER:
+      return SHADOWVAL_OTHER;
+    case SVTAG_PTRIDX:
+      return SHADOWVAL_PTRIDX;
+    case SVTAG_FDIDX:
+      return (bits & 8) ? SHADOWVAL_FDIDX64 : SHADOWVAL_FDIDX;
+    default:
+      return (ShadowValType)(SHADOWVAL_CI8 + ((bits >> 3) & 3));
+    }
+  }
+
   bool isInval() const {
-    return t == SHADOWVAL_INVAL;
+    return getTag() == SVTAG_INVAL;
   }
   bool isArg() const {
-    return t == SHADOWVAL_ARG;
+    return getTag() == SVTAG_ARG;
   }
   bool isInst() const {
-    return t == SHADOWVAL_INST;
+    return getTag() == SVTAG_INST;
   }
   bool isVal() const {
-    return t == SHADOWVAL_OTHER;
+    return getTag() == SVTAG_OTHER;
   }
   bool isGV() const {
-    return t == SHADOWVAL_GV;
+    return getTag() == SVTAG_GV;
   }
   bool isPtrIdx() const {
-    return t == SHADOWVAL_PTRIDX;
+    return getTag() == SVTAG_PTRIDX;
   }
   bool isFdIdx() const {
-    return t == SHADOWVAL_FDIDX || t == SHADOWVAL_FDIDX64;
+    return getTag() == SVTAG_FDIDX;
   }
   bool isConstantInt() const {
-    return t == SHADOWVAL_CI8 || t == SHADOWVAL_CI16 || t == SHADOWVAL_CI32 || t == SHADOWVAL_CI64;
+    return getTag() == SVTAG_CI;
   }
   ShadowArg* getArg() const {
-    return t == SHADOWVAL_ARG ? u.A : 0;
+    return isArg() ? (ShadowArg*)getPtr() : 0;
   }
   ShadowInstruction* getInst() const {
-    return t == SHADOWVAL_INST ? u.I : 0;
+    return isInst() ? (ShadowInstruction*)getPtr() : 0;
   }
   Value* getVal() const {
-    return t == SHADOWVAL_OTHER ? u.V : 0;
+    return isVal() ? (Value*)getPtr() : 0;
   }
   ShadowGV* getGV() const {
-    return t == SHADOWVAL_GV ? u.GV : 0;
+    return isGV() ? (ShadowGV*)getPtr() : 0;
+  }
+  // Only valid for PTRIDX and FDIDX(64) values.
+  int32_t getPtrOrFdFrame() const {
+    return ((int32_t)(uint32_t)bits) >> 4;
+  }
+  uint32_t getPtrOrFdIdx() const {
+    return (uint32_t)(bits >> 32);
+  }
+  // Only valid for constant integers.
+  uint64_t getCIValue() const {
+    if(bits & 32)
+      return boxedCIs[bits >> 6];
+    return (uint64_t)(((int64_t)bits) >> 6);
   }
   bool getCI(uint64_t& Out) const {
     bool isci = isConstantInt();
     if(isci)
-      Out = u.CI;
+      Out = getCIValue();
     return isci;
   }
   bool getSignedCI(int64_t& Out) const {
     bool isci = isConstantInt();
     if(isci) {
-      switch(t) {
+      uint64_t CI = getCIValue();
+      switch(getValType()) {
       case SHADOWVAL_CI8:
-	Out = (int8_t)(uint8_t)u.CI;
+	Out = (int8_t)(uint8_t)CI;
 	break;
       case SHADOWVAL_CI16:
-	Out = (int16_t)(uint16_t)u.CI;
+	Out = (int16_t)(uint16_t)CI;
 	break;
       case SHADOWVAL_CI32:
-	Out = (int32_t)(uint32_t)u.CI;
+	Out = (int32_t)(uint32_t)CI;
 	break;
       case SHADOWVAL_CI64:
-	Out = (int64_t)(uint64_t)u.CI;
+	Out = (int64_t)(uint64_t)CI;
 	break;
       default:
 	llvm_unreachable("Bad integer type");
@@ -228,7 +317,7 @@ ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
     return getHeapKey();
   }
   int32_t getFd() const {
-    switch(t) {
+    switch(getValType()) {
     case SHADOWVAL_FDIDX:
     case SHADOWVAL_FDIDX64:
       return getHeapKey();
@@ -245,32 +334,7 @@ ShadowValue(ShadowValType Ty, uint64_t _CI) : t(Ty) { u.CI = _CI; }
 };
 
 inline bool operator==(ShadowValue V1, ShadowValue V2) {
-  if(V1.t != V2.t)
-    return false;
-  switch(V1.t) {
-  case SHADOWVAL_INVAL:
-    return true;
-  case SHADOWVAL_ARG:
-    return V1.u.A == V2.u.A;
-  case SHADOWVAL_INST:
-    return V1.u.I == V2.u.I;
-  case SHADOWVAL_GV:
-    return V1.u.GV == V2.u.GV;
-  case SHADOWVAL_OTHER:
-    return V1.u.V == V2.u.V;
-  case SHADOWVAL_PTRIDX:
-  case SHADOWVAL_FDIDX:
-  case SHADOWVAL_FDIDX64:
-    return V1.u.PtrOrFd.frame == V2.u.PtrOrFd.frame && V1.u.PtrOrFd.idx == V2.u.PtrOrFd.idx;
-  case SHADOWVAL_CI8:
-  case SHADOWVAL_CI16:
-  case SHADOWVAL_CI32:
-  case SHADOWVAL_CI64:
-    return V1.u.CI == V2.u.CI;
-  default:
-    release_assert(0 && "Bad SV type");
-    return false;
-  }
+  return V1.bits == V2.bits;
 }
 
 inline bool operator!=(ShadowValue V1, ShadowValue V2) {
@@ -278,31 +342,29 @@ inline bool operator!=(ShadowValue V1, ShadowValue V2) {
 }
 
 inline bool operator<(ShadowValue V1, ShadowValue V2) {
-  if(V1.t != V2.t)
-    return V1.t < V2.t;
-  switch(V1.t) {
+  ShadowValType t1 = V1.getValType(), t2 = V2.getValType();
+  if(t1 != t2)
+    return t1 < t2;
+  switch(t1) {
   case SHADOWVAL_INVAL:
     return false;
   case SHADOWVAL_ARG:
-    return V1.u.A < V2.u.A;
   case SHADOWVAL_INST:
-    return V1.u.I < V2.u.I;
   case SHADOWVAL_GV:
-    return V1.u.GV < V2.u.GV;
   case SHADOWVAL_OTHER:
-    return V1.u.V < V2.u.V;
+    return V1.getPtr() < V2.getPtr();
   case SHADOWVAL_PTRIDX:
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
-    if(V1.u.PtrOrFd.frame == V2.u.PtrOrFd.frame)
-      return V1.u.PtrOrFd.idx < V2.u.PtrOrFd.idx;
+    if(V1.getPtrOrFdFrame() == V2.getPtrOrFdFrame())
+      return V1.getPtrOrFdIdx() < V2.getPtrOrFdIdx();
     else
-      return V1.u.PtrOrFd.frame < V2.u.PtrOrFd.frame;
+      return V1.getPtrOrFdFrame() < V2.getPtrOrFdFrame();
   case SHADOWVAL_CI8:
   case SHADOWVAL_CI16:
   case SHADOWVAL_CI32:
   case SHADOWVAL_CI64:
-    return V1.u.CI < V2.u.CI;
+    return V1.getCIValue() < V2.getCIValue();
   default:
     release_assert(0 && "Bad SV type");
     return false;
@@ -321,12 +383,11 @@ inline bool operator>=(ShadowValue V1, ShadowValue V2) {
   return !(V1 < V2);
 }
 
-// Characteristics for using ShadowValues in hashsets (DenseSet, or as keys in DenseMaps)
+// Characteristics for using ShadowValues in hashsets (DenseSet, or as keys in DenseMaps).
+// Since the encoding is canonical the bits can be hashed and compared directly.
 template<> struct DenseMapInfo<ShadowValue> {
   
-  typedef DenseMapInfo<int> TypeInfo;
   typedef DenseMapInfo<void*> VoidInfo;
-  typedef DenseMapInfo<std::pair<int, void*> > PairInfo;
 
   static inline ShadowValue getEmptyKey() {
     return ShadowValue((Value*)VoidInfo::getEmptyKey());
@@ -337,33 +398,9 @@ template<> struct DenseMapInfo<ShadowValue> {
   }
 
   static unsigned getHashValue(const ShadowValue& V) {
-    void* hashPtr;
-    switch(V.t) {
-    case SHADOWVAL_INVAL:
-      hashPtr = 0; break;
-    case SHADOWVAL_ARG:
-      hashPtr = V.u.A; break;
-    case SHADOWVAL_INST:
-      hashPtr = V.u.I; break;
-    case SHADOWVAL_GV:
-      hashPtr = V.u.GV; break;
-    case SHADOWVAL_OTHER:
-      hashPtr = V.u.V; break;
-    case SHADOWVAL_PTRIDX:
-    case SHADOWVAL_FDIDX:
-    case SHADOWVAL_FDIDX64:
-      // Should work due to the union.
-      hashPtr = V.u.V; break;
-    case SHADOWVAL_CI8:
-    case SHADOWVAL_CI16:
-    case SHADOWVAL_CI32:
-    case SHADOWVAL_CI64:
-      hashPtr = (void*)V.u.CI; break;
-    default:
-      release_assert(0 && "Bad value type");
-      hashPtr = 0;
-    }
-    return PairInfo::getHashValue(std::make_pair((int)V.t, hashPtr));
+    // Mix the pointer bits as DenseMapInfo<void*> does, and the PtrOrFd index or high
+    // constant bits.
+    return (unsigned)((V.bits >> 4) ^ (V.bits >> 9) ^ (V.bits >> 32));
   }
 
   static bool isEqual(const ShadowValue& V1, const ShadowValue& V2) {
@@ -574,7 +611,7 @@ struct ImprovedValSetSingle : public ImprovedValSet {
 
   ImprovedValSetSingle& insert(ImprovedVal V) {
 
-    release_assert(V.V.t != SHADOWVAL_INVAL);
+    release_assert(!V.V.isInval());
 
     if(Overdef)
       return *this;
@@ -781,6 +818,166 @@ struct HalfOpenWithMerge {
 
 };
 
+// Known integer constants for the elements of a large uniformly-typed object (e.g. a lookup
+// table or a buffer filled by a loop), kept as raw bytes rather than as an IntervalMap
+// extent per element. Element i covers bytes [i * ElemSize, (i + 1) * ElemSize) of the object.
+// Storage only spans the elements written so far, starting at element Base, and grows as
+// needed; every known element lies in [DirtyStart, DirtyEnd). Unknown elements' bytes are kept
+// zeroed. Arrays are shared copy-on-write between multis, like their Maps.
+struct DenseScalarArray {
+
+  IntegerType* ElemTy;
+  uint32_t ElemSize;
+  uint32_t RefCount;
+  uint64_t NumElems;
+  uint64_t NumKnown;
+  uint64_t Base;
+  uint64_t DirtyStart;
+  uint64_t DirtyEnd;
+  std::vector<uint8_t> Data;
+  std::vector<bool> Known;
+
+DenseScalarArray(IntegerType* Ty, uint64_t N) : ElemTy(Ty), ElemSize(Ty->getBitWidth() / 8), RefCount(1), NumElems(N), NumKnown(0), Base(0), DirtyStart(0), DirtyEnd(0) { }
+
+DenseScalarArray(const DenseScalarArray& Other) : ElemTy(Other.ElemTy), ElemSize(Other.ElemSize), RefCount(1), NumElems(Other.NumElems), NumKnown(Other.NumKnown), Base(Other.Base), DirtyStart(Other.DirtyStart), DirtyEnd(Other.DirtyEnd), Data(Other.Data), Known(Other.Known) { }
+
+  DenseScalarArray* getReadableCopy() {
+    RefCount++;
+    return this;
+  }
+
+  void dropReference() {
+    if(!--RefCount)
+      delete this;
+  }
+
+  bool isKnown(uint64_t idx) const {
+    return idx >= Base && idx - Base < Known.size() && Known[idx - Base];
+  }
+
+  const uint8_t* getRaw(uint64_t idx) const {
+    return &Data[(idx - Base) * ElemSize];
+  }
+
+  uint64_t get(uint64_t idx) const {
+    const uint8_t* P = getRaw(idx);
+    switch(ElemSize) {
+    case 1:
+      return *P;
+    case 2:
+      return *((const uint16_t*)P);
+    case 4:
+      return *((const uint32_t*)P);
+    default:
+      return *((const uint64_t*)P);
+    }
+  }
+
+  // Make room for element idx. Storage at least doubles each time, towards whichever end
+  // idx lies beyond, so filling an object from either end takes linear time overall.
+  void reserve(uint64_t idx) {
+
+    uint64_t Stop = Base + Known.size();
+    if(idx >= Base && idx < Stop)
+      return;
+
+    uint64_t NewBase = Base, NewStop = Stop;
+    uint64_t Grow = std::max((uint64_t)Known.size(), (uint64_t)8);
+    if(Known.empty()) {
+      NewBase = idx;
+      NewStop = idx + 1;
+    }
+    else if(idx < Base)
+      NewBase = std::min(idx, Base > Grow ? Base - Grow : 0);
+    else
+      NewStop = std::min(std::max(idx + 1, Stop + Grow), std::max(NumElems, idx + 1));
+
+    std::vector<uint8_t> NewData((NewStop - NewBase) * ElemSize, 0);
+    std::vector<bool> NewKnown(NewStop - NewBase, false);
+    if(!Data.empty())
+      memcpy(&NewData[(Base - NewBase) * ElemSize], &Data[0], Data.size());
+    for(uint64_t i = 0, ilim = Known.size(); i != ilim; ++i)
+      NewKnown[(Base - NewBase) + i] = Known[i];
+
+    Data.swap(NewData);
+    Known.swap(NewKnown);
+    Base = NewBase;
+
+  }
+
+  // Note idx, whose bytes have just been written, as known.
+  void markKnown(uint64_t idx) {
+    if(Known[idx - Base])
+      return;
+    Known[idx - Base] = true;
+    if(!NumKnown++) {
+      DirtyStart = idx;
+      DirtyEnd = idx + 1;
+    }
+    else {
+      DirtyStart = std::min(DirtyStart, idx);
+      DirtyEnd = std::max(DirtyEnd, idx + 1);
+    }
+  }
+
+  void set(uint64_t idx, uint64_t Val) {
+    reserve(idx);
+    uint8_t* P = &Data[(idx - Base) * ElemSize];
+    switch(ElemSize) {
+    case 1:
+      *P = (uint8_t)Val;
+      break;
+    case 2:
+      *((uint16_t*)P) = (uint16_t)Val;
+      break;
+    case 4:
+      *((uint32_t*)P) = (uint32_t)Val;
+      break;
+    default:
+      *((uint64_t*)P) = Val;
+      break;
+    }
+    markKnown(idx);
+  }
+
+  void setRaw(uint64_t idx, const uint8_t* P) {
+    reserve(idx);
+    memcpy(&Data[(idx - Base) * ElemSize], P, ElemSize);
+    markKnown(idx);
+  }
+
+  void forget(uint64_t idx) {
+    if(isKnown(idx)) {
+      Known[idx - Base] = false;
+      memset(&Data[(idx - Base) * ElemSize], 0, ElemSize);
+      if(!--NumKnown)
+	DirtyStart = DirtyEnd = 0;
+    }
+  }
+
+  bool operator==(const DenseScalarArray& Other) const {
+
+    if(this == &Other)
+      return true;
+    if(ElemTy != Other.ElemTy || NumKnown != Other.NumKnown)
+      return false;
+    if(!NumKnown)
+      return true;
+
+    for(uint64_t idx = std::min(DirtyStart, Other.DirtyStart), idxlim = std::max(DirtyEnd, Other.DirtyEnd); idx != idxlim; ++idx) {
+      bool K = isKnown(idx);
+      if(K != Other.isKnown(idx))
+	return false;
+      if(K && memcmp(getRaw(idx), Other.getRaw(idx), ElemSize))
+	return false;
+    }
+
+    return true;
+
+  }
+
+};
+
 struct ImprovedValSetMulti : public ImprovedValSet {
 
   typedef IntervalMap<uint64_t, ImprovedValSetSingle, IntervalMapImpl::NodeSizer<uint64_t, ImprovedValSetSingle>::LeafSize, HalfOpenNoMerge> MapTy;
@@ -791,11 +988,18 @@ struct ImprovedValSetMulti : public ImprovedValSet {
   ImprovedValSet* Underlying;
   uint64_t CoveredBytes;
   uint64_t AllocSize;
+  // Known elements held as an array instead of in Map. Map never overlaps a known element.
+  DenseScalarArray* Dense;
+  // Element-sized integer writes made while Dense is null; see replaceRangeWithPB.
+  uint32_t ElemWrites;
 
   ImprovedValSetMulti(uint64_t ASize);
   ImprovedValSetMulti(const ImprovedValSetMulti& other);
 
-  virtual ~ImprovedValSetMulti() {}
+  virtual ~ImprovedValSetMulti() {
+    if(Dense)
+      Dense->dropReference();
+  }
 
   static bool classof(const ImprovedValSet* IVS) { return IVS->isMulti; }
   virtual bool dropReference();
@@ -1055,6 +1259,17 @@ struct ShadowGV {
   GlobalVariable* G;
   uint64_t storeSize;
   int32_t allocIdx;
+  // For constants, the initialiser flattened to bytes the first time it is read
+  // (see getConstImage), or null if it can't be read bytewise.
+  uint8_t* initImage;
+  uint32_t initImageSize;
+  bool initImageTried;
+
+ShadowGV() : G(0), storeSize(0), allocIdx(-1), initImage(0), initImageSize(0), initImageTried(false) { }
+
+  ~ShadowGV() {
+    delete[] initImage;
+  }
 
 };
 
@@ -1094,6 +1309,8 @@ struct ShadowBBInvar {
   ImmutableArray<ShadowInstructionInvar> insts;
   const ShadowLoopInvar* outerScope;
   const ShadowLoopInvar* naturalScope;
+  // Execution frequency relative to function entry, in units of profileWeightUnit.
+  uint64_t profileWeight;
 
   inline ShadowBBInvar* getPred(uint32_t i);
   inline uint32_t preds_size();
@@ -1103,14 +1320,16 @@ struct ShadowBBInvar {
 
 };
 
+#include "ObjectSet.h"
+
 struct OrdinaryStoreExtraState {
 
   // Objects that are certainly not effected by thread yields.
-  DenseSet<ShadowValue> threadLocalObjects;
+  ObjectSet threadLocalObjects;
   // Objects that are certainly not reachable from objects older than specialisation start
-  DenseSet<ShadowValue> noAliasOldObjects;
+  ObjectSet noAliasOldObjects;
   // Objects all of whose pointers are known, and therefore are not aliased by unknown pointers.
-  DenseSet<ShadowValue> unescapedObjects;
+  ObjectSet unescapedObjects;
 
   void copyFrom(const OrdinaryStoreExtraState& es) { *this = es; }
   static void doMerge(LocalStoreMap<LocStore, OrdinaryStoreExtraState>* toMap, 
@@ -1283,20 +1502,41 @@ struct TLStoreExtraState {
 
 struct FDState {
 
-  std::string filename;
+  // Index into LLPEAnalysisPass::fdFilenames; 0 is the empty name.
+  uint32_t filenameId;
   uint64_t pos;
   bool clean;
 
-FDState() : filename(""), pos((uint64_t)-1), clean(false) {}
-FDState(std::string fn) : filename(fn), pos(0), clean(false) {}
-FDState(const FDState& Other) : filename(Other.filename), pos(Other.pos), clean(Other.clean) {}
+FDState() : filenameId(0), pos((uint64_t)-1), clean(false) {}
+FDState(uint32_t fn) : filenameId(fn), pos(0), clean(false) {}
+
+};
+
+#define FDCHUNKSIZE 16
+
+// A run of FD states, shared between FDStores until one of them writes to it.
+struct FDStateChunk {
+
+  uint32_t refCount;
+  FDState fds[FDCHUNKSIZE];
+
+FDStateChunk() : refCount(1) {}
+FDStateChunk(const FDStateChunk& Other) : refCount(1) {
+  std::copy(Other.fds, Other.fds + FDCHUNKSIZE, fds);
+}
+
+  void dropReference() {
+    if(!(--refCount))
+      delete this;
+  }
 
 };
 
 struct FDStore {
 
   uint32_t refCount;
-  std::vector<FDState> fds;
+  uint32_t nFDs;
+  std::vector<FDStateChunk*> chunks;
 
   bool dropReference() {
 
@@ -1319,9 +1559,71 @@ struct FDStore {
     return new FDStore(*this);
 
   }
+
+  uint32_t size() const {
+    return nFDs;
+  }
+
+  const FDState& get(uint32_t fd) const {
+    return chunks[fd / FDCHUNKSIZE]->fds[fd % FDCHUNKSIZE];
+  }
+
+  // CoW break just the chunk holding fd.
+  FDState& getWritableFD(uint32_t fd) {
+
+    FDStateChunk*& Chunk = chunks[fd / FDCHUNKSIZE];
+    if(Chunk->refCount != 1) {
+      FDStateChunk* NewChunk = new FDStateChunk(*Chunk);
+      Chunk->dropReference();
+      Chunk = NewChunk;
+    }
+    return Chunk->fds[fd % FDCHUNKSIZE];
+
+  }
+
+  void resize(uint32_t n) {
+
+    if(n < nFDs) {
+
+      uint32_t keepChunks = (n + FDCHUNKSIZE - 1) / FDCHUNKSIZE;
+      for(uint32_t i = keepChunks, ilim = chunks.size(); i != ilim; ++i)
+	chunks[i]->dropReference();
+      chunks.resize(keepChunks);
+
+    }
+    else {
+
+      // The last chunk may still hold entries dropped by an earlier shrink.
+      for(uint32_t i = nFDs, ilim = std::min(n, (uint32_t)(chunks.size() * FDCHUNKSIZE)); i < ilim; ++i)
+	getWritableFD(i) = FDState();
+      while(chunks.size() * FDCHUNKSIZE < n)
+	chunks.push_back(new FDStateChunk());
+
+    }
+
+    nFDs = n;
+
+  }
+
+  void set(uint32_t fd, const FDState& S) {
+    if(fd >= nFDs)
+      resize(fd + 1);
+    getWritableFD(fd) = S;
+  }
+
+  void clear() {
+    resize(0);
+  }
   
-FDStore() : refCount(1), fds() {}
-FDStore(const FDStore& Other) : refCount(1), fds(Other.fds) {}
+FDStore() : refCount(1), nFDs(0), chunks() {}
+FDStore(const FDStore& Other) : refCount(1), nFDs(Other.nFDs), chunks(Other.chunks) {
+  for(std::vector<FDStateChunk*>::iterator it = chunks.begin(), itend = chunks.end(); it != itend; ++it)
+    (*it)->refCount++;
+}
+~FDStore() {
+  for(std::vector<FDStateChunk*>::iterator it = chunks.begin(), itend = chunks.end(); it != itend; ++it)
+    (*it)->dropReference();
+}
 
 };
 
@@ -1369,6 +1671,11 @@ struct ShadowBB {
   bool useSpecialVarargMerge;
   bool inAnyLoop;
 
+  // The last IAWalker epochs that queued this block from its first instruction and from
+  // its end respectively; see IAWalker::markVisited.
+  uint32_t walkEpochStart;
+  uint32_t walkEpochEnd;
+
   ~ShadowBB() {
 
     delete[] &(insts[0]);
@@ -1414,7 +1721,7 @@ struct ShadowBB {
   void setAllObjectsThreadGlobal();
   void clobberMayAliasOldObjects();
   void clobberGlobalObjects();
-  void clobberAllExcept(DenseSet<ShadowValue>& Save, bool verbose);
+  void clobberAllExcept(const ObjectSet& Save, bool verbose);
   BasicBlock* getCommittedBreakBlockAt(uint32_t);
   DSEMapPointer* getWritableDSEStore(ShadowValue O);
   TLMapPointer* getWritableTLStore(ShadowValue O);
@@ -1537,9 +1844,9 @@ extern Type* GInt64;
 
 inline const MDNode* ShadowValue::getTBAATag() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->I->getMetadata(LLVMContext::MD_tbaa);
+    return getInst()->invar->I->getMetadata(LLVMContext::MD_tbaa);
   default:
     return 0;
   }
@@ -1548,15 +1855,15 @@ inline const MDNode* ShadowValue::getTBAATag() const {
 
 inline Value* ShadowValue::getBareVal() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
-    return u.A->invar->A;
+    return getArg()->invar->A;
   case SHADOWVAL_INST:
-    return u.I->invar->I;
+    return getInst()->invar->I;
   case SHADOWVAL_GV:
-    return u.GV->G;
+    return getGV()->G;
   case SHADOWVAL_OTHER:
-    return u.V;
+    return getVal();
   default:
     release_assert(0 && "Bad value type in getBareVal");
     llvm_unreachable("Bad value type in getBareVal");
@@ -1566,9 +1873,9 @@ inline Value* ShadowValue::getBareVal() const {
 
 inline const ShadowLoopInvar* ShadowValue::getScope() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->parent->outerScope;
+    return getInst()->invar->parent->outerScope;
   default:
     return 0;
   }
@@ -1577,9 +1884,9 @@ inline const ShadowLoopInvar* ShadowValue::getScope() const {
 
 inline const ShadowLoopInvar* ShadowValue::getNaturalScope() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->parent->naturalScope;
+    return getInst()->invar->parent->naturalScope;
   default:
     return 0;
   }
@@ -1596,11 +1903,11 @@ inline bool ShadowValue::isIDObject() const {
 
 inline InstArgImprovement* ShadowValue::getIAI() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return &(u.I->i);
+    return &(getInst()->i);
   case SHADOWVAL_ARG:
-    return &(u.A->i);      
+    return &(getArg()->i);      
   default:
     return 0;
   }
@@ -1608,13 +1915,13 @@ inline InstArgImprovement* ShadowValue::getIAI() const {
 }
 
 inline LLVMContext& ShadowValue::getLLVMContext() const {
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    return u.I->invar->I->getContext();
+    return getInst()->invar->I->getContext();
   case SHADOWVAL_ARG:
-    return u.A->invar->A->getContext();
+    return getArg()->invar->A->getContext();
   case SHADOWVAL_GV:
-    return u.GV->G->getContext();
+    return getGV()->G->getContext();
   case SHADOWVAL_PTRIDX:
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
@@ -1625,17 +1932,17 @@ inline LLVMContext& ShadowValue::getLLVMContext() const {
   case SHADOWVAL_CI64:
     return GInt8->getContext();
   default:
-    return u.V->getContext();
+    return getVal()->getContext();
   }
 }
 
 inline void ShadowValue::setCommittedVal(Value* V) {
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_INST:
-    u.I->committedVal = V;
+    getInst()->committedVal = V;
     break;
   case SHADOWVAL_ARG:
-    u.A->committedVal = V;
+    getArg()->committedVal = V;
     break;
   default:
     release_assert(0 && "Can't replace a value");
@@ -1643,17 +1950,17 @@ inline void ShadowValue::setCommittedVal(Value* V) {
 }
 
 template<class X> inline bool val_is(ShadowValue V) {
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_OTHER:
-    return isa<X>(V.u.V);
+    return isa<X>(V.getVal());
   case SHADOWVAL_GV:
-    return isa<X>(V.u.GV->G);
+    return isa<X>(V.getGV()->G);
   case SHADOWVAL_INST:
-    return inst_is<X>(V.u.I);
+    return inst_is<X>(V.getInst());
   case SHADOWVAL_ARG: {
-    if(!V.u.A->invar)
+    if(!V.getArg()->invar)
       return false;
-    return isa<X>(V.u.A->invar->A);
+    return isa<X>(V.getArg()->invar->A);
   }
   default:
     release_assert(0 && "Bad value type in val_is");
@@ -1662,15 +1969,15 @@ template<class X> inline bool val_is(ShadowValue V) {
 }
 
 template<class X> inline X* dyn_cast_val(ShadowValue V) {
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_OTHER:
-    return dyn_cast<X>(V.u.V);
+    return dyn_cast<X>(V.getVal());
   case SHADOWVAL_GV:
-    return dyn_cast<X>(V.u.GV->G);
+    return dyn_cast<X>(V.getGV()->G);
   case SHADOWVAL_ARG:
-    return dyn_cast<X>(V.u.A->invar->A);
+    return dyn_cast<X>(V.getArg()->invar->A);
   case SHADOWVAL_INST:
-    return dyn_cast_inst<X>(V.u.I);
+    return dyn_cast_inst<X>(V.getInst());
   default:
     release_assert(0 && "Bad value type in dyn_cast_val");
     llvm_unreachable("Bad value type in dyn_cast_val");
@@ -1678,15 +1985,15 @@ template<class X> inline X* dyn_cast_val(ShadowValue V) {
 }
 
 template<class X> inline X* cast_val(ShadowValue V) {
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_OTHER:
-    return cast<X>(V.u.V);
+    return cast<X>(V.getVal());
   case SHADOWVAL_GV:
-    return cast<X>(V.u.GV->G);
+    return cast<X>(V.getGV()->G);
   case SHADOWVAL_ARG:
-    return cast<X>(V.u.A->invar->A);
+    return cast<X>(V.getArg()->invar->A);
   case SHADOWVAL_INST:
-    return cast_inst<X>(V.u.I);
+    return cast_inst<X>(V.getInst());
   default:
     release_assert(0 && "Cast of bad SV");
     llvm_unreachable("Cast of bad SV");
@@ -1696,14 +2003,14 @@ template<class X> inline X* cast_val(ShadowValue V) {
 static Constant* CIToConst(const ShadowValue V) {
 
   Type* CITy = V.getNonPointerType();
-  return ConstantInt::get(CITy, V.u.CI, true);
+  return ConstantInt::get(CITy, V.getCIValue(), true);
 
 }
 
 inline Constant* getSingleConstant(const ShadowValue V) {
 
-  if(V.t == SHADOWVAL_OTHER)
-    return cast<Constant>(V.u.V);  
+  if(V.getValType() == SHADOWVAL_OTHER)
+    return cast<Constant>(V.getVal());  
   else if(V.isConstantInt())
     return CIToConst(V);
   else {
@@ -1768,7 +2075,7 @@ inline ImprovedValSet* getIVSRef(ShadowValue V);
 
 inline bool hasConstReplacement(const ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_INST: 
@@ -1796,7 +2103,7 @@ inline bool hasConstReplacement(const ShadowValue SV) {
 
 inline Constant* getConstReplacement(ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_INST: 
@@ -1837,7 +2144,7 @@ inline bool tryGetConstantSignedInt(ShadowValue SV, int64_t& Out) {
     return true;
 
   ConstantInt* CI;
-  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.u.V))) {
+  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.getVal()))) {
 
     if(CI->getBitWidth() > 64)
       return false;
@@ -1856,7 +2163,7 @@ inline bool tryGetConstantInt(ShadowValue SV, uint64_t& Out) {
     return true;
 
   ConstantInt* CI;
-  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.u.V))) {
+  if(SV.isVal() && (CI = dyn_cast<ConstantInt>(SV.getVal()))) {
 
     if(CI->getBitWidth() > 64)
       return false;
@@ -1874,7 +2181,7 @@ inline bool tryGetConstantIntReplacement(ShadowValue SV, uint64_t& Out) {
   if(tryGetConstantInt(SV, Out))
     return true;
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_INST: 
@@ -1897,7 +2204,7 @@ inline void getIVOrSingleVal(ShadowValue V, ImprovedValSet*& IVS, std::pair<ValS
 
   IVS = 0;
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
   case SHADOWVAL_ARG:
@@ -1907,7 +2214,7 @@ inline void getIVOrSingleVal(ShadowValue V, ImprovedValSet*& IVS, std::pair<ValS
     Single = std::make_pair(ValSetTypePB, ImprovedVal(V, 0));
     break;
   case SHADOWVAL_OTHER:
-    Single = getValPB(V.u.V);
+    Single = getValPB(V.getVal());
     break;
   case SHADOWVAL_CI8:
   case SHADOWVAL_CI16:
@@ -1974,7 +2281,7 @@ inline bool IVMatchesVal(ShadowValue V, ImprovedValSet* IV) {
 
 inline bool getImprovedValSetSingle(ShadowValue V, ImprovedValSetSingle& OutPB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
   case SHADOWVAL_ARG:
@@ -2021,11 +2328,11 @@ inline bool getImprovedValSetSingle(ShadowValue V, ImprovedValSetSingle& OutPB)
 
 inline ImprovedValSet* tryGetIVSRef(ShadowValue V) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_INST:
-    return V.u.I->i.PB;
+    return V.getInst()->i.PB;
   case SHADOWVAL_ARG:
-    return V.u.A->i.PB;    
+    return V.getArg()->i.PB;    
   default:
     return 0;
   }
@@ -2034,7 +2341,7 @@ inline ImprovedValSet* tryGetIVSRef(ShadowValue V) {
 
 inline ImprovedValSet* getIVSRef(ShadowValue V) {
 
-  release_assert((V.t == SHADOWVAL_INST || V.t == SHADOWVAL_ARG) 
+  release_assert((V.getValType() == SHADOWVAL_INST || V.getValType() == SHADOWVAL_ARG) 
 		 && "getIVSRef only applicable to instructions and arguments");
   
   return tryGetIVSRef(V);
@@ -2044,7 +2351,7 @@ inline ImprovedValSet* getIVSRef(ShadowValue V) {
 // V must have an IVS.
 inline void addValToPB(ShadowValue& V, ImprovedValSetSingle& ResultPB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_INST:
   case SHADOWVAL_ARG:
@@ -2165,11 +2472,11 @@ inline bool mayBeReplaced(ShadowArg* SA) {
 
 inline bool mayBeReplaced(ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
   case SHADOWVAL_INST:
-    return mayBeReplaced(SV.u.I);
+    return mayBeReplaced(SV.getInst());
   case SHADOWVAL_ARG:
-    return mayBeReplaced(SV.u.A);
+    return mayBeReplaced(SV.getArg());
   default:
     return false;
   }
@@ -2207,14 +2514,14 @@ inline void setReplacement(ShadowArg* SA, Constant* C) {
 
 inline ShadowValue ShadowValue::stripPointerCasts() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
   case SHADOWVAL_GV:
     return *this;
   case SHADOWVAL_INST:
 
-    if(inst_is<CastInst>(u.I)) {
-      ShadowValue Op = u.I->getOperand(0);
+    if(inst_is<CastInst>(getInst())) {
+      ShadowValue Op = getInst()->getOperand(0);
       return Op.stripPointerCasts();
     }
     else {
@@ -2222,7 +2529,7 @@ inline ShadowValue ShadowValue::stripPointerCasts() const {
     }
 
   case SHADOWVAL_OTHER:
-    return u.V->stripPointerCasts();
+    return getVal()->stripPointerCasts();
   default:
     release_assert(0 && "Bad val type in stripPointerCasts");
     llvm_unreachable("Bad val type in stripPointerCasts");
@@ -2232,9 +2539,9 @@ inline ShadowValue ShadowValue::stripPointerCasts() const {
 
 inline bool ShadowValue::isNullOrConst() const {
 
-  if(t == SHADOWVAL_GV)
-    return u.GV->G->isConstant();
-  else if(t == SHADOWVAL_PTRIDX)
+  if(getValType() == SHADOWVAL_GV)
+    return getGV()->G->isConstant();
+  else if(getValType() == SHADOWVAL_PTRIDX)
     return false;
 
   return isa<ConstantPointerNull>(getBareVal());
@@ -2243,9 +2550,9 @@ inline bool ShadowValue::isNullOrConst() const {
 
 inline bool ShadowValue::isNullPointer() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_OTHER:
-    return isa<ConstantPointerNull>(u.V);
+    return isa<ConstantPointerNull>(getVal());
   default:
     return false;
   }
@@ -23,6 +23,8 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/GlobalVariable.h"
 #include "llvm/IR/Attributes.h"
+#include "llvm/IR/BasicBlock.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/MemoryBuffer.h"
 
@@ -133,6 +135,18 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
   }
 
   argc = lineStarts.size();
+
+  // Note the known arguments, which a dispatcher must compare against the real argv.
+  if(emitDispatcher) {
+
+    dispatchVariant.argvIdx = argvIdx;
+    for(unsigned i = 0; i < argc; ++i) {
+      if(lineStarts[i] != -1)
+	dispatchVariant.argvStrings.push_back(std::make_pair(i, std::string(argvtext.c_str() + lineStarts[i])));
+    }
+
+  }
+
   GlobalVariable* ArgvConsts = getStringArray(argvtext, *(F->getParent()));
 
   BasicBlock& EntryBB = F->getEntryBlock();
@@ -159,7 +173,8 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
       // Get a pointer into the real argv:
       Constant* gepArg = ConstantInt::get(Int64, i);
       Instruction* argvPtr = GetElementPtrInst::Create(BytePtr, &*Arg, gepArg, "argv_ptr", InsertBefore);
-      new StoreInst(stringPtr, argvPtr, InsertBefore);
+      inPlaceInsts.push_back(argvPtr);
+      inPlaceInsts.push_back(new StoreInst(stringPtr, argvPtr, InsertBefore));
 
     }
 
@@ -169,7 +184,8 @@ void LLPEAnalysisPass::loadArgv(Function* F, std::string& path, unsigned argvIdx
   Constant* gepArg = ConstantInt::get(Int64, argc);
   Instruction* argvEndPtr = GetElementPtrInst::Create(BytePtr, &*Arg, gepArg, "argv_end_ptr", InsertBefore);
   Constant* nullPtr = Constant::getNullValue(BytePtr);
-  new StoreInst(nullPtr, argvEndPtr, InsertBefore);
+  inPlaceInsts.push_back(argvEndPtr);
+  inPlaceInsts.push_back(new StoreInst(nullPtr, argvEndPtr, InsertBefore));
 
   F->addParamAttr(argvIdx, Attribute::NoAlias);
 
@@ -226,3 +242,159 @@ Constant* LLPEAnalysisPass::loadEnvironment(Module& M, std::string& path) {
   return getStringPtrArray(useenv, lineStarts, M);
   
 }
+
+// Keep an unmodified copy of root function F for a dispatcher to fall back to when the
+// program is run with arguments other than those we specialise for. If F is itself a
+// dispatcher left by an earlier run, the result chains through every variant in turn.
+void LLPEAnalysisPass::prepareDispatcher(Function& F) {
+
+  if(F.isVarArg()) {
+    errs() << "-llpe-dispatch: root function " << F.getName() << " is variadic\n";
+    exit(1);
+  }
+
+  ValueToValueMapTy VMap;
+  dispatchFallback = CloneFunction(&F, VMap);
+  dispatchFallback->setName(F.getName() + ".fallback");
+  dispatchFallback->setLinkage(GlobalValue::InternalLinkage);
+
+}
+
+// Compare runtime string Str against constant Expect, continuing at Match if they agree
+// and at Fail otherwise. Returns the block to emit the next test into.
+static BasicBlock* emitStringGuard(Value* Str, std::string& Expect, BasicBlock* BB, BasicBlock* Fail) {
+
+  LLVMContext& Ctx = BB->getContext();
+  Module* M = BB->getParent()->getParent();
+  Type* BytePtr = Type::getInt8PtrTy(Ctx);
+  Type* Int32 = Type::getInt32Ty(Ctx);
+
+  BasicBlock* CmpBB = BasicBlock::Create(Ctx, "dispatch_strcmp", BB->getParent());
+  BasicBlock* Next = BasicBlock::Create(Ctx, "dispatch_next", BB->getParent());
+
+  Value* IsNull = new ICmpInst(*BB, CmpInst::ICMP_EQ, Str, Constant::getNullValue(Str->getType()));
+  BranchInst::Create(Fail, CmpBB, IsNull, BB);
+
+  FunctionCallee StrcmpFn = M->getOrInsertFunction("strcmp", Int32, BytePtr, BytePtr);
+  GlobalVariable* ExpectG = getStringArray(Expect, *M, true);
+  Constant* ExpectPtr = ConstantExpr::getBitCast(ExpectG, BytePtr);
+  Value* StrPtr = Str->getType() == BytePtr ? Str : new BitCastInst(Str, BytePtr, "", CmpBB);
+
+  Value* CmpArgs[] = { StrPtr, ExpectPtr };
+  Value* Cmp = CallInst::Create(StrcmpFn, ArrayRef<Value*>(CmpArgs, 2), "", CmpBB);
+  Value* IsEqual = new ICmpInst(*CmpBB, CmpInst::ICMP_EQ, Cmp, ConstantInt::get(Int32, 0));
+  BranchInst::Create(Next, Fail, IsEqual, CmpBB);
+
+  return Next;
+
+}
+
+// Call Target with Args at the end of BB and return its result.
+static void emitDispatchCall(Function* Target, std::vector<Value*>& Args, BasicBlock* BB) {
+
+  CallInst* Call = CallInst::Create(Target, Args, "", BB);
+  if(Target->getReturnType()->isVoidTy())
+    ReturnInst::Create(BB->getContext(), BB);
+  else
+    ReturnInst::Create(BB->getContext(), Call, BB);
+
+}
+
+// Replace Replaced by a dispatcher that tries each variant in turn, calling the first whose
+// guards match the actual arguments, and Fallback if none do. Replaced's name and users pass
+// to the dispatcher. Environment specialisation substitutes a fixed environment rather than
+// assuming one, and file contents and path conditions are checked by the specialised code
+// itself, so those need no guard here.
+Function* llvm::createDispatcher(Function* Replaced, std::vector<DispatchVariant>& Variants, Function* Fallback) {
+
+  LLVMContext& Ctx = Replaced->getContext();
+
+  Function* Dispatch = Function::Create(Replaced->getFunctionType(), Replaced->getLinkage(), "", Replaced->getParent());
+  Dispatch->takeName(Replaced);
+  Dispatch->copyAttributesFrom(Replaced);
+  Replaced->replaceAllUsesWith(Dispatch);
+
+  std::vector<Value*> Args;
+  for(Function::arg_iterator it = Dispatch->arg_begin(), itend = Dispatch->arg_end(); it != itend; ++it)
+    Args.push_back(&*it);
+
+  uint32_t nValueGuards = 0, nStringGuards = 0;
+  BasicBlock* BB = BasicBlock::Create(Ctx, "dispatch", Dispatch);
+
+  for(std::vector<DispatchVariant>::iterator V = Variants.begin(), VE = Variants.end(); V != VE; ++V) {
+
+    BasicBlock* FailBB = BasicBlock::Create(Ctx, "dispatch_fallback", Dispatch);
+
+    // Plain values first: this includes argc, which must be checked before reading argv.
+    Value* Match = ConstantInt::getTrue(Ctx);
+    for(std::vector<std::pair<uint32_t, Constant*> >::iterator it = V->guards.begin(),
+	  itend = V->guards.end(); it != itend; ++it) {
+
+      Value* Arg = Args[it->first];
+      Constant* Expect = it->second;
+      if(Expect->getType() != Arg->getType()) {
+	if(Expect->getType()->isIntegerTy() && Arg->getType()->isIntegerTy())
+	  Expect = ConstantExpr::getIntegerCast(Expect, Arg->getType(), true);
+	else
+	  Expect = ConstantExpr::getBitCast(Expect, Arg->getType());
+      }
+
+      Value* Eq = new ICmpInst(*BB, CmpInst::ICMP_EQ, Arg, Expect);
+      Match = BinaryOperator::CreateAnd(Match, Eq, "", BB);
+
+    }
+
+    BasicBlock* Next = BasicBlock::Create(Ctx, "dispatch_next", Dispatch);
+    BranchInst::Create(Next, FailBB, Match, BB);
+    BB = Next;
+
+    for(std::vector<std::pair<uint32_t, std::string> >::iterator it = V->stringGuards.begin(),
+	  itend = V->stringGuards.end(); it != itend; ++it)
+      BB = emitStringGuard(Args[it->first], it->second, BB, FailBB);
+
+    if(V->argvIdx != -1) {
+
+      Type* BytePtr = Type::getInt8PtrTy(Ctx);
+      Value* Argv = Args[V->argvIdx];
+      for(std::vector<std::pair<uint32_t, std::string> >::iterator it = V->argvStrings.begin(),
+	    itend = V->argvStrings.end(); it != itend; ++it) {
+
+	Value* Idx = ConstantInt::get(Type::getInt64Ty(Ctx), it->first);
+	Value* ArgPtr = GetElementPtrInst::Create(BytePtr, Argv, Idx, "argv_ptr", BB);
+	Value* Arg = new LoadInst(BytePtr, ArgPtr, "", BB);
+	BB = emitStringGuard(Arg, it->second, BB, FailBB);
+
+      }
+
+    }
+
+    emitDispatchCall(V->F, Args, BB);
+    BB = FailBB;
+
+    nValueGuards += V->guards.size();
+    nStringGuards += V->stringGuards.size() + V->argvStrings.size();
+
+  }
+
+  emitDispatchCall(Fallback, Args, BB);
+
+  errs() << "Created dispatcher " << Dispatch->getName() << " (" << Variants.size() << " variants, "
+	 << nValueGuards << " value, " << nStringGuards << " string guards)\n";
+
+  return Dispatch;
+
+}
+
+// Replace the committed root by a dispatcher over the arguments recorded by parseArgs, falling
+// back to the copy made by prepareDispatcher.
+void LLPEAnalysisPass::createDispatcher() {
+
+  Function* SpecF = RootIA->CommitF;
+  dispatchVariant.F = SpecF;
+  std::vector<DispatchVariant> Variants(1, dispatchVariant);
+
+  Function* Dispatch = llvm::createDispatcher(SpecF, Variants, dispatchFallback);
+  SpecF->setName(Dispatch->getName() + ".spec");
+  SpecF->setLinkage(GlobalValue::InternalLinkage);
+
+}
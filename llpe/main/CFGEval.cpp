@@ -282,7 +282,7 @@ bool IntegrationAttempt::checkBlockOutgoingEdges(ShadowInstruction* SI) {
   ConstantInt* ConstCondition = dyn_cast_or_null<ConstantInt>(getConstReplacement(Condition));
   if(!ConstCondition) {
 
-    if(Condition.t == SHADOWVAL_INST || Condition.t == SHADOWVAL_ARG) {
+    if(Condition.getValType() == SHADOWVAL_INST || Condition.getValType() == SHADOWVAL_ARG) {
 
       // Switch statements can operate on a ptrtoint operand, of which only ptrtoint(null) is useful:
       if(ImprovedValSetSingle* IVS = dyn_cast_or_null<ImprovedValSetSingle>(getIVSRef(Condition))) {
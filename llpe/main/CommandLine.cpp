@@ -49,6 +49,7 @@ static cl::opt<bool> SkipBenefitAnalysis("skip-benefit-analysis");
 static cl::opt<bool> SkipDIE("skip-llpe-die");
 static cl::opt<bool> SkipTL("skip-check-elim");
 static cl::opt<unsigned> MaxContexts("llpe-stop-after", cl::init(0));
+static cl::opt<unsigned> CodeSizeBudget("llpe-code-size-budget", cl::init(0));
 static cl::opt<bool> VerboseOverdef("llpe-verbose-overdef");
 static cl::opt<bool> EnableFunctionSharing("llpe-enable-sharing");
 static cl::opt<bool> VerboseFunctionSharing("llpe-verbose-sharing");
@@ -70,12 +71,17 @@ static cl::opt<std::string> LLIOPreludeFn("llpe-prelude-fn", cl::init(""));
 static cl::opt<int> LLIOPreludeStackIdx("llpe-prelude-stackidx", cl::init(-1));
 static cl::opt<std::string> LLIOConfFile("llpe-write-llio-conf", cl::init(""));
 static cl::opt<std::string> StatsFile("llpe-stats-file", cl::init(""));
+static cl::opt<std::string> ReportFile("llpe-report", cl::init(""));
 static cl::list<std::string> NeverInline("llpe-never-inline", cl::ZeroOrMore);
 static cl::opt<bool> SingleThreaded("llpe-single-threaded");
 static cl::opt<bool> OmitChecks("llpe-omit-checks");
 static cl::opt<bool> OmitMallocChecks("llpe-omit-malloc-checks");
 static cl::list<std::string> SplitFunctions("llpe-force-split");
 static cl::opt<bool> EmitFakeDebug("llpe-emit-fake-debug");
+static cl::opt<std::string> BlockProfileFile("llpe-block-profile", cl::init(""));
+static cl::opt<bool> UseProfileMetadata("llpe-use-profile-metadata");
+static cl::opt<bool> HeapSnapshot("llpe-heap-snapshot");
+static cl::opt<bool> EmitDispatcher("llpe-dispatch");
 
 static void dieEnvUsage() {
 
@@ -621,8 +627,22 @@ void LLPEAnalysisPass::parsePathConditions(cl::list<std::string>& L, PathConditi
 void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstants, uint32_t& argvIdxOut) {
 
   this->statsFile = StatsFile;
+  this->reportPath = ReportFile;
   this->mallocAlignment = MallocAlignment;
   this->maxContexts = MaxContexts;
+  this->codeSizeBudget = CodeSizeBudget;
+  this->heapSnapshot = HeapSnapshot;
+
+  // Must precede anything that builds function invariants, as these record block weights.
+  this->useProfileMetadata = UseProfileMetadata;
+  this->useBlockProfile = UseProfileMetadata || BlockProfileFile != "";
+  if(BlockProfileFile != "")
+    loadBlockProfile(*F.getParent(), BlockProfileFile);
+
+  // Must precede loadArgv, which rewrites the root's entry block.
+  this->emitDispatcher = EmitDispatcher || deferDispatcher;
+  if(EmitDispatcher && !deferDispatcher)
+    prepareDispatcher(F);
   
   if(EnvFileAndIdx != "") {
 
@@ -653,6 +673,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
     CHECK_ARG(argcIdx, argConstants);
     argConstants[argcIdx] = ConstantInt::get(Type::getInt32Ty(F.getContext()), argc);
     argvIdxOut = argvIdx;
+    if(emitDispatcher)
+      dispatchVariant.guards.push_back(std::make_pair((uint32_t)argcIdx, argConstants[argcIdx]));
 
   }
 
@@ -679,6 +701,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
       Constant* ArgC = ConstantInt::getSigned(ArgTy, arg);
       CHECK_ARG(idx, argConstants);
       argConstants[idx] = ArgC;
+      if(emitDispatcher)
+	dispatchVariant.guards.push_back(std::make_pair((uint32_t)idx, ArgC));
 
     }
     else if(PointerType* ArgTyP = dyn_cast<PointerType>(ArgTy)) {
@@ -695,6 +719,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 	Constant* StrPtr = ConstantExpr::getGetElementPtr(0, GStr, GEPArgs, 2);
 	CHECK_ARG(idx, argConstants);
 	argConstants[idx] = StrPtr;
+	if(emitDispatcher)
+	  dispatchVariant.stringGuards.push_back(std::make_pair((uint32_t)idx, Param));
 
       }
       else if(ElemTy->isFunctionTy()) {
@@ -720,6 +746,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
 
 	CHECK_ARG(idx, argConstants);
 	argConstants[idx] = Found;
+	if(emitDispatcher)
+	  dispatchVariant.guards.push_back(std::make_pair((uint32_t)idx, Found));
 
       }
       else {
@@ -1196,6 +1224,8 @@ void LLPEAnalysisPass::parseArgs(Function& F, std::vector<Constant*>& argConstan
   this->enableSharing = EnableFunctionSharing;
   this->verboseSharing = VerboseFunctionSharing;
   this->verbosePCs = VerbosePathConditions;
+  this->dumpDSE = DumpDSE;
+  this->dumpTL = DumpTL;
   this->programSingleThreaded = SingleThreaded;
   this->useGlobalInitialisers = UseGlobalInitialisers;
   this->omitChecks = OmitChecks;
@@ -16,10 +16,20 @@
 #include "llvm/IR/Dominators.h"
 #include "llvm/Support/MathExtras.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 extern cl::opt<bool> VerboseNames;
 
+// Checks against at least this many integer candidates are lowered to a switch or bit test
+// rather than a chain of compares.
+static cl::opt<unsigned> CheckSwitchThreshold("llpe-check-switch-threshold", cl::init(3));
+
+// Route unspecialised paths through one outlined copy of the function tail where possible,
+// rather than cloning it into every context.
+static cl::opt<bool> ShareFailedTails("llpe-share-failed-tails");
+
 // Functions relating to conditional specialisation
 // (that is, situations where the specialiser assumes some condition, specialises according to it,
 //  and at commit time must synthesise duplicate successor blocks: specialised, and unmodified).
@@ -71,6 +81,10 @@ void InlineAttempt::markBlockAndSuccsReachableUnspecialised(uint32_t idx, uint32
 
   (*blocksReachableOnFailure)[idx] = instIdx;
 
+  // The failure happens somewhere between our first analysis and now.
+  if(pass->heapSnapshot)
+    pass->noteHeapSnapshotUnspecialised(heapSnapshotEntry, ++pass->heapSnapshotClock);
+
   // Mark all successors reachable too.
   ShadowBBInvar* BBI = getBBInvar(idx);
   for(uint32_t i = 0, ilim = BBI->succIdxs.size(); i != ilim; ++i)
@@ -310,9 +324,7 @@ void IntegrationAttempt::applyPathCondition(PathCondition* it, PathConditionType
       pass->fds.push_back(FDGlobalState(0, /* is a fifo */ true));
       /* Pseudo FD is born waiting for a representitive value */
       pass->fds.back().isCommitted = true; 
-      if(FDS->fds.size() <= newId)
-	FDS->fds.resize(newId + 1);
-      FDS->fds[newId] = FDState(std::string(fname));
+      FDS->set(newId, FDState(pass->internFDFilename(fname)));
 
       ImprovedValSetSingle writeVal;
       writeVal.set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
@@ -548,6 +560,9 @@ void InlineAttempt::initFailedBlockCommit() {
   PHIForwards = new DenseMap<std::pair<Instruction*, BasicBlock*>, PHINode*>();
   ForwardingPHIs = new DenseSet<PHINode*>();
 
+  if(!findFailedTailEntry(failedTailEntry))
+    failedTailEntry = INVALID_BLOCK_IDX;
+
 }
 
 void IntegrationAttempt::finishFailedBlockCommit() {}
@@ -1573,6 +1588,10 @@ void InlineAttempt::createForwardingPHIs(ShadowInstructionInvar& OrigSI, Instruc
   // We should start merging from the block after wherever NewI is defined, and use NewI rather than anything 
   // directly derived from OrigSI when forwarding.
 
+  // A shared failed tail takes its values as call arguments: there are no cloned users to forward to.
+  if(failedTailEntry != INVALID_BLOCK_IDX)
+    return;
+
   std::vector<std::pair<Instruction*, uint32_t> > predBlocks(1, std::make_pair(NewI, OrigSI.idx));
 
   // 1. Find the predecessor blocks for each user, setting the vector cell for each (original program)
@@ -2007,50 +2026,27 @@ void InlineAttempt::remapFailedBlock(BasicBlock::iterator BI, BasicBlock* BB, ui
     ReturnInst* RI = dyn_cast<ReturnInst>(BI);
     if(RI && !isRootMainCall()) {
 
-      if(failedReturnBlock) {
-
-	// Rewrite into a branch to and contribution to the failed return phi node.
-	if(failedReturnPHI) {
-	  
-	  ReturnInst* OrigRI = cast<ReturnInst>(SII.I);
-	  Value* V = OrigRI->getOperand(0);
-	  Value* Ret = getUnspecValue(SII.operandIdxs[0].blockIdx, SII.operandIdxs[0].instIdx, V, BB, RI);
-	  release_assert(Ret);
-	  failedReturnPHI->addIncoming(Ret, BB);
+      // The return value is needed for the failed return phi node if committed inline,
+      // or to return alongside the failure flag if committed out of line.
+      bool needRet;
+      if(failedReturnBlock)
+	needRet = !!failedReturnPHI;
+      else
+	needRet = !F.getFunctionType()->getReturnType()->isVoidTy();
 
-	}
+      Value* Ret = 0;
+      if(needRet) {
 
-	RI->eraseFromParent();
-	BranchInst::Create(failedReturnBlock, BB);
+	ReturnInst* OrigRI = cast<ReturnInst>(SII.I);
+	Value* V = OrigRI->getOperand(0);
+	Ret = getUnspecValue(SII.operandIdxs[0].blockIdx, SII.operandIdxs[0].instIdx, V, BB, RI);
+	release_assert(Ret);
 
       }
-      else {
 
-	// Out-of-line commit
-	release_assert(CommitF);
-	Value* Ret;
-	Constant* FailFlag = ConstantInt::getFalse(BB->getContext());
-	
-	if(F.getFunctionType()->getReturnType()->isVoidTy())
-	  Ret = FailFlag;
-	else {
-
-	  ReturnInst* OrigRI = cast<ReturnInst>(SII.I);
-	  Value* V = OrigRI->getOperand(0);
-	  Ret = getUnspecValue(SII.operandIdxs[0].blockIdx, SII.operandIdxs[0].instIdx, V, BB, RI);
-	  StructType* retType = cast<StructType>(CommitF->getFunctionType()->getReturnType());
-	  Type* normalRet = Ret->getType();
-	  Constant* undefRet = UndefValue::get(normalRet);
-	  Value* aggTemplate = ConstantStruct::get(retType, {undefRet, FailFlag});
-	  Ret = InsertValueInst::Create(aggTemplate, Ret, 0, VerboseNames ? "fail_ret" : "", RI);
-
-	}
-	
-	// Existing RI might have wrong operand count, so replace it.
-	ReturnInst::Create(BB->getContext(), Ret, RI);
-	RI->eraseFromParent();
-
-      }
+      // Existing RI might have wrong operand count, so replace it.
+      RI->eraseFromParent();
+      emitFailedReturn(BB, Ret);
 
       // Bail out since we just ate the loop's controlling iterator
       return;
@@ -2103,6 +2099,43 @@ void InlineAttempt::remapFailedBlock(BasicBlock::iterator BI, BasicBlock* BB, ui
 
 }
 
+// Terminate unspecialised block BB by returning Ret (0 if unused) from this context, having
+// failed: rewritten into a branch to and contribution to the failed return phi node if committed
+// inline, or a return with the success flag clear if committed out of line.
+void InlineAttempt::emitFailedReturn(BasicBlock* BB, Value* Ret) {
+
+  if(failedReturnBlock) {
+
+    if(failedReturnPHI)
+      failedReturnPHI->addIncoming(Ret, BB);
+
+    BranchInst::Create(failedReturnBlock, BB);
+
+  }
+  else {
+
+    // Out-of-line commit
+    release_assert(CommitF);
+    Constant* FailFlag = ConstantInt::getFalse(BB->getContext());
+	
+    if(F.getFunctionType()->getReturnType()->isVoidTy())
+      Ret = FailFlag;
+    else {
+
+      StructType* retType = cast<StructType>(CommitF->getFunctionType()->getReturnType());
+      Type* normalRet = Ret->getType();
+      Constant* undefRet = UndefValue::get(normalRet);
+      Value* aggTemplate = ConstantStruct::get(retType, {undefRet, FailFlag});
+      Ret = InsertValueInst::Create(aggTemplate, Ret, 0, VerboseNames ? "fail_ret" : "", BB);
+
+    }
+
+    ReturnInst::Create(BB->getContext(), Ret, BB);
+
+  }
+
+}
+
 // Emit an unspecialised basic block that is known to have no specialised companions.
 void IntegrationAttempt::commitSimpleFailedBlock(uint32_t i) { }
 
@@ -2111,6 +2144,11 @@ void InlineAttempt::commitSimpleFailedBlock(uint32_t i) {
   if(failedBlocks.empty() || failedBlocks[i].empty())
     return;
 
+  if(i == failedTailEntry) {
+    commitFailedTailStub(i);
+    return;
+  }
+
   release_assert(failedBlocks[i].size() == 1 && "commitSimpleFailedBlock with a split block?");
 
   BasicBlock* CommitBB = failedBlocks[i].front().first;
@@ -2239,6 +2277,13 @@ void InlineAttempt::createFailedBlock(uint32_t idx) {
   if(it == blocksReachableOnFailure->end())
     return;
 
+  // Only the entry to a shared tail is materialised here.
+  if(failedTailEntry != INVALID_BLOCK_IDX) {
+    if(idx == failedTailEntry)
+      createFailedTailStub(idx);
+    return;
+  }
+
   uint32_t createFailedBlockFrom = it->second;
 
   ShadowBBInvar* BBI = getBBInvar(idx);
@@ -2303,6 +2348,269 @@ void InlineAttempt::createFailedBlock(uint32_t idx) {
 
 }
 
+// Shared failed tails: if unspecialised code is only ever entered at the top of one block, and
+// nothing downstream of that has a specialised companion, then every failed path in this context
+// just runs the original function from that block onwards. Emit that code once per (function, block)
+// as an outlined function taking the region's live-in values, and have each such context branch to
+// a stub that merges the live-ins as usual and calls it, instead of cloning the whole region again.
+
+bool InlineAttempt::findFailedTailEntry(uint32_t& entryIdx) {
+
+  if((!ShareFailedTails) || (!blocksReachableOnFailure) || F.isVarArg())
+    return false;
+
+  entryIdx = INVALID_BLOCK_IDX;
+
+  for(SmallDenseMap<uint32_t, uint32_t, 8>::iterator it = blocksReachableOnFailure->begin(),
+	itend = blocksReachableOnFailure->end(); it != itend; ++it) {
+
+    // Mid-block entries (e.g. after a failed check) need the split-block machinery.
+    if(it->second != 0)
+      return false;
+
+    // A specialised companion might branch into its failed twin anywhere.
+    ShadowBBInvar* BBI = getBBInvar(it->first);
+    if(hasSpecialisedCompanion(BBI))
+      return false;
+
+    // Unwinding out of the tail would skip this context's own exception handling.
+    if(isa<ResumeInst>(BBI->BB->getTerminator()))
+      return false;
+
+    bool internalPreds = false, externalPreds = false;
+    for(uint32_t i = 0, ilim = BBI->predIdxs.size(); i != ilim; ++i) {
+
+      if(blocksReachableOnFailure->count(BBI->predIdxs[i]))
+	internalPreds = true;
+      else
+	externalPreds = true;
+
+    }
+
+    if(externalPreds) {
+
+      // The entry's phis become arguments, so it can't also be a merge within the tail.
+      if(entryIdx != INVALID_BLOCK_IDX || internalPreds || BBI->BB->isEHPad())
+	return false;
+      entryIdx = it->first;
+
+    }
+
+  }
+
+  if(entryIdx == INVALID_BLOCK_IDX)
+    return false;
+
+  // The tail is keyed by its entry block, so it must be exactly what that block reaches.
+  SmallVector<uint32_t, 16> region;
+  getFailedTailRegion(entryIdx, region);
+  return region.size() == blocksReachableOnFailure->size();
+
+}
+
+// Blocks reachable from entryIdx, entry first and the rest in order.
+void InlineAttempt::getFailedTailRegion(uint32_t entryIdx, SmallVector<uint32_t, 16>& region) {
+
+  DenseSet<uint32_t> seen;
+  seen.insert(entryIdx);
+  region.push_back(entryIdx);
+
+  for(uint32_t i = 0; i != region.size(); ++i) {
+
+    ShadowBBInvar* BBI = getBBInvar(region[i]);
+    for(uint32_t j = 0, jlim = BBI->succIdxs.size(); j != jlim; ++j) {
+      if(seen.insert(BBI->succIdxs[j]).second)
+	region.push_back(BBI->succIdxs[j]);
+    }
+
+  }
+
+  std::sort(region.begin() + 1, region.end());
+
+}
+
+// Values used in the region but defined outside it: first the entry block's phis, which the stub
+// computes, then arguments and instructions from dominating blocks in order of first use.
+void InlineAttempt::getFailedTailLiveIns(SmallVector<uint32_t, 16>& region, SmallVector<std::pair<Value*, ShadowInstIdx>, 8>& liveIns) {
+
+  DenseSet<uint32_t> inRegion;
+  for(uint32_t i = 0, ilim = region.size(); i != ilim; ++i)
+    inRegion.insert(region[i]);
+
+  SmallPtrSet<Value*, 16> seen;
+
+  ShadowBBInvar* EntryBBI = getBBInvar(region[0]);
+  uint32_t firstNonPHI = 0;
+  for(uint32_t ilim = EntryBBI->insts.size(); firstNonPHI != ilim && isa<PHINode>(EntryBBI->insts[firstNonPHI].I); ++firstNonPHI) {
+    liveIns.push_back(std::make_pair(EntryBBI->insts[firstNonPHI].I, ShadowInstIdx(region[0], firstNonPHI)));
+    seen.insert(EntryBBI->insts[firstNonPHI].I);
+  }
+
+  for(uint32_t i = 0, ilim = region.size(); i != ilim; ++i) {
+
+    ShadowBBInvar* BBI = getBBInvar(region[i]);
+    for(uint32_t j = (i == 0 ? firstNonPHI : 0), jlim = BBI->insts.size(); j != jlim; ++j) {
+
+      ShadowInstructionInvar& SII = BBI->insts[j];
+      for(uint32_t k = 0, klim = SII.operandIdxs.size(); k != klim; ++k) {
+
+	Value* V = SII.I->getOperand(k);
+	ShadowInstIdx& op = SII.operandIdxs[k];
+
+	if(op.blockIdx == INVALID_BLOCK_IDX) {
+	  if(!isa<Argument>(V))
+	    continue;
+	}
+	else if(inRegion.count(op.blockIdx))
+	  continue;
+
+	if(seen.insert(V).second)
+	  liveIns.push_back(std::make_pair(V, op));
+
+      }
+
+    }
+
+  }
+
+}
+
+// Create the stand-in for the tail's entry block: just its phi nodes for now, populated
+// from specialised predecessors like any other failed block's.
+void InlineAttempt::createFailedTailStub(uint32_t idx) {
+
+  ShadowBBInvar* BBI = getBBInvar(idx);
+
+  std::string Name;
+  if(VerboseNames) {
+    raw_string_ostream RSO(Name);
+    RSO << getCommittedBlockPrefix() << BBI->BB->getName() << " (failed tail)";
+  }
+
+  BasicBlock* NewBB = createBasicBlock(F.getContext(), Name, CommitF, false, true);
+
+  for(BasicBlock::iterator it = BBI->BB->begin(); isa<PHINode>(it); ++it) {
+
+    Instruction* NewI = it->clone();
+    if(VerboseNames && it->hasName())
+      NewI->setName(it->getName());
+    NewBB->getInstList().push_back(NewI);
+    (*failedBlockMap)[&*it] = NewI;
+
+  }
+
+  failedBlocks[idx].push_back(std::make_pair(NewBB, 0));
+  (*failedBlockMap)[BBI->BB] = NewBB;
+
+}
+
+// Populate the stub's phis, then call the shared tail with the live-ins and return its result.
+void InlineAttempt::commitFailedTailStub(uint32_t idx) {
+
+  BasicBlock* StubBB = failedBlocks[idx].front().first;
+  commitFailedPHIs(StubBB, skipMergePHIs(StubBB->begin()), idx);
+
+  SmallVector<uint32_t, 16> region;
+  getFailedTailRegion(idx, region);
+
+  SmallVector<std::pair<Value*, ShadowInstIdx>, 8> liveIns;
+  getFailedTailLiveIns(region, liveIns);
+
+  SmallVector<BasicBlock*, 16> regionBlocks;
+  for(uint32_t i = 0, ilim = region.size(); i != ilim; ++i)
+    regionBlocks.push_back(getBBInvar(region[i])->BB);
+
+  Function* TailF = pass->getFailedTail(F, idx, regionBlocks, liveIns);
+
+  std::vector<Value*> Args;
+  for(uint32_t i = 0, ilim = liveIns.size(); i != ilim; ++i)
+    Args.push_back(UndefValue::get(liveIns[i].first->getType()));
+
+  CallInst* CI = CallInst::Create(TailF, Args, "", StubBB);
+
+  for(uint32_t i = 0, ilim = liveIns.size(); i != ilim; ++i) {
+
+    ShadowInstIdx& op = liveIns[i].second;
+    Value* V = getUnspecValue(op.blockIdx, op.instIdx, liveIns[i].first, StubBB, CI);
+    release_assert(V);
+    CI->setArgOperand(i, V);
+
+  }
+
+  Value* Ret = F.getFunctionType()->getReturnType()->isVoidTy() ? 0 : CI;
+
+  if(!hasFailedReturnPath())
+    new UnreachableInst(F.getContext(), StubBB);
+  else if(isRootMainCall())
+    ReturnInst::Create(F.getContext(), Ret, StubBB);
+  else
+    emitFailedReturn(StubBB, Ret);
+
+}
+
+// Outline blocks (entry first) as a function taking liveIns as arguments, or return the copy made
+// for an earlier context. Debug info is dropped, as the tail has no subprogram of its own.
+Function* LLPEAnalysisPass::getFailedTail(Function& F, uint32_t entryIdx, ArrayRef<BasicBlock*> blocks, ArrayRef<std::pair<Value*, ShadowInstIdx> > liveIns) {
+
+  Function*& TailF = failedTails[std::make_pair(&F, entryIdx)];
+  if(TailF)
+    return TailF;
+
+  std::vector<Type*> ArgTypes;
+  for(uint32_t i = 0, ilim = liveIns.size(); i != ilim; ++i)
+    ArgTypes.push_back(liveIns[i].first->getType());
+
+  FunctionType* FT = FunctionType::get(F.getReturnType(), ArgTypes, false);
+  TailF = Function::Create(FT, GlobalValue::InternalLinkage, F.getName() + ".failtail", getGlobalModule());
+
+  // Only reached when specialisation assumptions fail. Keep it out of line so that it stays shared.
+  TailF->addFnAttr(Attribute::Cold);
+  TailF->addFnAttr(Attribute::NoInline);
+  if(F.hasPersonalityFn())
+    TailF->setPersonalityFn(F.getPersonalityFn());
+
+  ValueToValueMapTy VMap;
+
+  Function::arg_iterator AI = TailF->arg_begin();
+  for(uint32_t i = 0, ilim = liveIns.size(); i != ilim; ++i, ++AI) {
+    VMap[liveIns[i].first] = &*AI;
+    if(VerboseNames)
+      AI->setName(liveIns[i].first->getName());
+  }
+
+  for(uint32_t i = 0, ilim = blocks.size(); i != ilim; ++i)
+    VMap[blocks[i]] = BasicBlock::Create(F.getContext(), VerboseNames ? blocks[i]->getName() : "", TailF);
+
+  for(uint32_t i = 0, ilim = blocks.size(); i != ilim; ++i) {
+
+    BasicBlock* NewBB = cast<BasicBlock>(VMap[blocks[i]]);
+
+    // The entry block's phis were mapped to arguments above.
+    BasicBlock::iterator II = i == 0 ? blocks[i]->getFirstNonPHI()->getIterator() : blocks[i]->begin();
+    for(BasicBlock::iterator IE = blocks[i]->end(); II != IE; ++II) {
+
+      if(isa<DbgInfoIntrinsic>(II))
+	continue;
+
+      Instruction* NewI = II->clone();
+      if(VerboseNames && II->hasName())
+	NewI->setName(II->getName());
+      NewI->setDebugLoc(DebugLoc());
+      NewBB->getInstList().push_back(NewI);
+      VMap[&*II] = NewI;
+
+    }
+
+  }
+
+  for(Function::iterator FI = TailF->begin(), FE = TailF->end(); FI != FE; ++FI)
+    for(BasicBlock::iterator II = FI->begin(), IE = FI->end(); II != IE; ++II)
+      RemapInstruction(&*II, VMap, RF_NoModuleLevelChanges | RF_IgnoreMissingLocals);
+
+  return TailF;
+
+}
+
 // Find the emitted-program BasicBlock containing the unspecialised variant of blockIdx / instIdx.
 BasicBlock* InlineAttempt::getSubBlockForInst(uint32_t blockIdx, uint32_t instIdx) {
 
@@ -2508,6 +2816,11 @@ void InlineAttempt::populateFailedBlock(uint32_t idx) {
   if(failedBlocks.empty() || failedBlocks[idx].empty())
     return;
 
+  if(idx == failedTailEntry) {
+    commitFailedTailStub(idx);
+    return;
+  }
+
   ShadowBBInvar* BBI = getBBInvar(idx);
 
   SmallVector<std::pair<BasicBlock*, uint32_t>, 1>::iterator it, endit, lastit;
@@ -2710,11 +3023,95 @@ Instruction* IntegrationAttempt::emitCompositeCheck(Value* realInst, Value* CV,
 
 }
 
+// If IVS is a set of integer constants of realInst's type, large enough to be worth lowering
+// as a switch or bit test, gather them in Cases.
+static bool getIntCheckCases(Value* realInst, const ImprovedValSetSingle* IVS, SmallVector<ConstantInt*, 8>& Cases) {
+
+  IntegerType* ITy = dyn_cast<IntegerType>(realInst->getType());
+  if((!ITy) || ITy->getBitWidth() > 64)
+    return false;
+
+  if(IVS->Overdef || IVS->SetType != ValSetTypeScalar || 
+     IVS->Values.size() < CheckSwitchThreshold || IVS->Values.size() < 2)
+    return false;
+
+  SmallPtrSet<ConstantInt*, 8> Seen;
+
+  for(uint32_t j = 0, jlim = IVS->Values.size(); j != jlim; ++j) {
+
+    const ShadowValue& V = IVS->Values[j].V;
+    if(!(V.isConstantInt() || (V.isVal() && isa<ConstantInt>(V.getVal()))))
+      return false;
+
+    ConstantInt* CI = cast<ConstantInt>(getSingleConstant(V));
+    if(CI->getType() != ITy)
+      return false;
+
+    if(Seen.insert(CI).second)
+      Cases.push_back(CI);
+
+  }
+
+  return true;
+
+}
+
+// Can Cases be tested with a single shift-and-mask in the checked value's own width?
+// If so give the smallest case and the mask of cases relative to it.
+static bool getBitTestMask(SmallVector<ConstantInt*, 8>& Cases, uint64_t& MinVal, uint64_t& Mask) {
+
+  uint64_t MaxVal = 0;
+  MinVal = ULLONG_MAX;
+
+  for(SmallVector<ConstantInt*, 8>::iterator it = Cases.begin(), itend = Cases.end(); it != itend; ++it) {
+
+    uint64_t Val = (*it)->getZExtValue();
+    MinVal = std::min(MinVal, Val);
+    MaxVal = std::max(MaxVal, Val);
+
+  }
+
+  if(MaxVal - MinVal >= Cases[0]->getBitWidth())
+    return false;
+
+  Mask = 0;
+  for(SmallVector<ConstantInt*, 8>::iterator it = Cases.begin(), itend = Cases.end(); it != itend; ++it)
+    Mask |= (((uint64_t)1) << ((*it)->getZExtValue() - MinVal));
+
+  return true;
+
+}
+
+// Synthesise (realInst - MinVal) <u width && ((Mask >> (realInst - MinVal)) & 1).
+// The select keeps an over-wide shift (poison) from reaching the result.
+static Value* emitBitTestCheck(Value* realInst, uint64_t MinVal, uint64_t Mask, BasicBlock* emitBB) {
+
+  IntegerType* ITy = cast<IntegerType>(realInst->getType());
+  
+  Value* Rebased = realInst;
+  if(MinVal)
+    Rebased = BinaryOperator::CreateSub(realInst, ConstantInt::get(ITy, MinVal), VerboseNames ? "checkrebase" : "", emitBB);
+
+  Value* InRange = new ICmpInst(*emitBB, CmpInst::ICMP_ULT, Rebased, ConstantInt::get(ITy, ITy->getBitWidth()), 
+				VerboseNames ? "checkrange" : "");
+  Value* Shifted = BinaryOperator::CreateLShr(ConstantInt::get(ITy, Mask), Rebased, "", emitBB);
+  Value* Bit = new TruncInst(Shifted, Type::getInt1Ty(emitBB->getContext()), VerboseNames ? "checkbit" : "", emitBB);
+  
+  return SelectInst::Create(InRange, Bit, ConstantInt::getFalse(emitBB->getContext()), VerboseNames ? "bitcheck" : "", emitBB);
+
+}
+
 // Synth a check that realInst == IVS, or if IVS is looser than a constant value, realInst satisfies IVS.
 Value* IntegrationAttempt::emitCompareCheck(Value* realInst, const ImprovedValSetSingle* IVS, BasicBlock* emitBB) {
 
   release_assert(isa<Instruction>(realInst) && "Checked instruction must be residualised");
 
+  // Dense small-integer sets: test membership with a single shift rather than a compare per value.
+  SmallVector<ConstantInt*, 8> Cases;
+  uint64_t MinVal, Mask;
+  if(getIntCheckCases(realInst, IVS, Cases) && getBitTestMask(Cases, MinVal, Mask))
+    return emitBitTestCheck(realInst, MinVal, Mask, emitBB);
+
   Value* thisCheck = 0;
   // If IVS is a set, synthesise a big-or check.
   for(uint32_t j = 0, jlim = IVS->Values.size(); j != jlim; ++j) {
@@ -2937,12 +3334,31 @@ IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterat
 
   CommittedBlock& emitCB = *(emitIt++);
   BasicBlock* emitBB = emitCB.specBlock;
-  Value* Check;
+  Value* Check = 0;
+
+  // A sparse set of integer candidates is tested by switching on the value directly,
+  // giving the backend the chance to use a jump table or binary search.
+  SmallVector<ConstantInt*, 8> SwitchCases;
+  Value* SwitchOn = 0;
 
   if(inst_is<MemTransferInst>(SI))
     Check = emitMemcpyCheck(SI, emitBB);
-  else
-    Check = emitAsExpectedCheck(SI, emitBB);
+  else {
+
+    // Not for invokes: the normal destination may have PHIs, which would need an incoming
+    // value for every case edge.
+    ImprovedValSetSingle* IVS = dyn_cast<ImprovedValSetSingle>(SI->i.PB);
+    uint64_t MinVal, Mask;
+    if(IVS && !inst_is<InvokeInst>(SI)) {
+      Value* realInst = getCommittedValue(ShadowValue(SI));
+      if(getIntCheckCases(realInst, IVS, SwitchCases) && !getBitTestMask(SwitchCases, MinVal, Mask))
+	SwitchOn = realInst;
+    }
+
+    if(!SwitchOn)
+      Check = emitAsExpectedCheck(SI, emitBB);
+
+  }
     
   BasicBlock* successTarget; 
   BasicBlock* failTarget;
@@ -2985,8 +3401,20 @@ IntegrationAttempt::emitOrdinaryInstCheck(SmallVector<CommittedBlock, 1>::iterat
     
   }
 
-  release_assert(successTarget && failTarget && Check);
-  BranchInst::Create(successTarget, failTarget, Check, emitBB);
+  if(SwitchOn) {
+
+    release_assert(successTarget && failTarget);
+    SwitchInst* Switch = SwitchInst::Create(SwitchOn, failTarget, SwitchCases.size(), emitBB);
+    for(SmallVector<ConstantInt*, 8>::iterator it = SwitchCases.begin(), itend = SwitchCases.end(); it != itend; ++it)
+      Switch->addCase(*it, successTarget);
+
+  }
+  else {
+
+    release_assert(successTarget && failTarget && Check);
+    BranchInst::Create(successTarget, failTarget, Check, emitBB);
+
+  }
 
   return emitIt;
 
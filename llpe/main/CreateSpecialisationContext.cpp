@@ -12,6 +12,8 @@
 #include "llvm/IR/Module.h"
 #include "llvm/Support/Debug.h"
 
+#include <algorithm>
+
 #define DEBUG_TYPE "llpe-misc"
 
 using namespace llvm;
@@ -204,6 +206,28 @@ static void mainPhaseProgress() {
 
 }
 
+static bool childCallPrecedes(ShadowInstruction* SI1, ShadowInstruction* SI2) {
+
+  if(SI1->parent->invar->idx != SI2->parent->invar->idx)
+    return SI1->parent->invar->idx < SI2->parent->invar->idx;
+  return SI1->invar->idx < SI2->invar->idx;
+
+}
+
+// Make IA the context for call SI, recording SI in childCalls if it had none before.
+void IntegrationAttempt::setChildCall(ShadowInstruction* SI, InlineAttempt* IA) {
+
+  if(!SI->typeSpecificData) {
+    // Calls are usually discovered in block order, so this is normally an append.
+    SmallVector<ShadowInstruction*, 4>::iterator insertit =
+      std::upper_bound(childCalls.begin(), childCalls.end(), SI, childCallPrecedes);
+    childCalls.insert(insertit, SI);
+  }
+
+  SI->typeSpecificData = IA;
+
+}
+
 // Get an existing specialisation context representing the call made by SI, or try to create one.
 // 'created' is set if the context is new; 'needsAnalyse' is set to false if we have reused
 // a context that already existed and had the same preconditions as this call-site (only possible when function sharing is on)
@@ -235,7 +259,7 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
     }
     if(pass->verboseSharing)
       errs() << "SHARE: " << itcache(SI) << " #" << Share->SeqNumber << " (refs: " << Share->Callers.size() << ")\n";
-    SI->typeSpecificData = Share;
+    setChildCall(SI, Share);
     return Share;
   }
 
@@ -249,7 +273,7 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
       InlineAttempt* Unshared = Result->getWritableCopyFrom(SI);
       if(pass->verboseSharing)
 	errs() << "BREAK: " << itcache(SI) << " #" << Result->SeqNumber << " -> #" << Unshared->SeqNumber << "\n";
-      SI->typeSpecificData = Unshared;
+      setChildCall(SI, Unshared);
       created = true;
       return Unshared;
     }
@@ -269,7 +293,7 @@ InlineAttempt* IntegrationAttempt::getOrCreateInlineAttempt(ShadowInstruction* S
 
   InlineAttempt* IA = new InlineAttempt(pass, *FCalled, SI, this->nesting_depth + 1);
   IA->isModel = isModel;
-  SI->typeSpecificData = IA;
+  setChildCall(SI, IA);
 
   checkTargetStack(SI, IA);
 
@@ -83,7 +83,7 @@ public:
        UserInA->blocksReachableOnFailure->count(UserI->parent->invar->idx)) {
 
       if((!V.isInst()) || 
-	 UserI->parent != V.u.I->parent ||
+	 UserI->parent != V.getInst()->parent ||
 	 UserI->parent->IA->hasSplitInsts(UserI->parent)) {
 
 	maybeLive = true;
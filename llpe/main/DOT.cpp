@@ -65,7 +65,7 @@ std::string IntegrationAttempt::getValueColour(ShadowValue SV, std::string& text
   }
 
   if(val_is<CallInst>(SV) || val_is<InvokeInst>(SV)) {
-    if(SV.u.I->typeSpecificData)
+    if(SV.getInst()->typeSpecificData)
       return "yellow";
     else
       return "pink";
@@ -758,48 +758,17 @@ void IntegrationAttempt::describeScopeAsDOT(const ShadowLoopInvar* DescribeL, ui
 
 }
 
-// If we'll need DOT files for the user interface they are saved as specialisation proceeds.
-void IntegrationAttempt::getSavedDotName(bool brief, std::string& Out) {
-
-  raw_string_ostream RSO(Out);
-  RSO << ihp_workdir << "/" << SeqNumber;
-  if(brief)
-    RSO << "-brief";
-  RSO << ".dot";
-
-}
-
-// Save a graph representation of this context.
-void IntegrationAttempt::saveDOT2(bool brief) {
-
-  std::string filename;
-  getSavedDotName(brief, filename);
-  std::error_code error;
-  raw_fd_ostream RFO(filename.c_str(), error, sys::fs::F_None);
-
-  if(error) {
-
-    errs() << "Failed to open " << filename << ": " << error.message() << "\n";
-    return;
-
-  }
-
-  std::string ignored;
-  describeAsDOT(RFO, ignored, brief);
-
-}
-
-// Save both brief and full representations of this context for the UI.
+// Save this context's graphs and results to the specialisation report, which the UI
+// renders from once the analysis is finished (see Report.cpp).
 void IntegrationAttempt::saveDOT() {
 
-  if(!IHPSaveDOTFiles)
+  if(!pass->reportWriter)
     return;
   
   if(isCommitted())
     return;
 
-  saveDOT2(true);
-  saveDOT2(false);
+  writeReportRecord();
 
   for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it)
     it->second->saveDOT();
@@ -818,12 +787,12 @@ void IntegrationAttempt::saveDOT() {
 
 }
 
-void IntegrationAttempt::describeAsDOT(raw_ostream& Out, std::string& othername, bool brief) {
+void IntegrationAttempt::describeAsDOT(raw_ostream& Out, bool brief) {
 
   if(isCommitted()) {
 
-    // Use existing DOT.
-    getSavedDotName(brief, othername);
+    // Use the DOT saved before commit.
+    pass->getReportDOT(SeqNumber, brief, Out);
     return;
 
   }
@@ -878,8 +847,7 @@ void IntegrationAttempt::describeTreeAsDOT(std::string path) {
 
   }
 
-  std::string ign;
-  describeAsDOT(os, ign, false);
+  describeAsDOT(os, false);
 
   for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it) {
 
@@ -93,12 +93,19 @@ struct tagComp {
 
 };
 
+// Tags are created lazily: a context's tag is created when its parent's children are
+// first asked for, so the GUI only builds the parts of the tree the user opens.
 IntegratorTag* IntegrationAttempt::createTag(IntegratorTag* parent) {
 
   IntegratorTag* myTag = pass->newTag();
   myTag->ptr = (void*)this;
   myTag->type = IntegratorTypeIA;
   myTag->parent = parent;
+  return myTag;
+
+}
+
+void IntegrationAttempt::createTagChildren(IntegratorTag* myTag) {
   
   for(IAIterator it = child_calls_begin(this),
 	it2 = child_calls_end(this); it != it2; ++it) {
@@ -121,8 +128,6 @@ IntegratorTag* IntegrationAttempt::createTag(IntegratorTag* parent) {
   tagComp C(this);
   std::sort(myTag->children.begin(), myTag->children.end(), C);
 
-  return myTag;
-
 }
 
 IntegratorTag* PeelAttempt::createTag(IntegratorTag* parent) {
@@ -131,6 +136,11 @@ IntegratorTag* PeelAttempt::createTag(IntegratorTag* parent) {
   myTag->ptr = (void*)this;
   myTag->type = IntegratorTypePA;
   myTag->parent = parent;
+  return myTag;
+
+}
+
+void PeelAttempt::createTagChildren(IntegratorTag* myTag) {
   
   for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), 
 	it2 = Iterations.end(); it != it2; ++it) {
@@ -140,42 +150,33 @@ IntegratorTag* PeelAttempt::createTag(IntegratorTag* parent) {
 
   }
 
-  return myTag;
-
 }
 
-IntegratorTag* llvm::searchFunctions(IntegratorTag* thisTag, std::string& search, IntegratorTag*& startAt) {
+std::vector<IntegratorTag*>& llvm::getTagChildren(IntegratorTag* tag) {
 
-  if(startAt == thisTag) {
-    
-    startAt = 0;
-
-  }
-  else if(!startAt) {
-    
-    if(thisTag->type == IntegratorTypeIA) {
-
-      IntegrationAttempt* IA = (IntegrationAttempt*)thisTag->ptr;
-
-      if(IA->getShortHeader().find(search) != std::string::npos) {
-      
-	return thisTag;
+  if(!tag->childrenCreated) {
 
-      }
-
-    }
+    if(tag->type == IntegratorTypeIA)
+      ((IntegrationAttempt*)tag->ptr)->createTagChildren(tag);
+    else
+      ((PeelAttempt*)tag->ptr)->createTagChildren(tag);
+    tag->childrenCreated = true;
 
   }
 
-  for(std::vector<IntegratorTag*>::iterator it = thisTag->children.begin(), 
-	itend = thisTag->children.end(); it != itend; ++it) {
+  return tag->children;
+
+}
 
-    if(IntegratorTag* SubRes = searchFunctions(*it, search, startAt))
-      return SubRes;
+// List every context's short header in tree order, for the GUI's search. This creates
+// all remaining tags, so the GUI only builds the index when first asked to search.
+void llvm::buildTagSearchIndex(IntegratorTag* thisTag, std::vector<std::pair<std::string, IntegratorTag*> >& index) {
 
-  }
+  if(thisTag->type == IntegratorTypeIA)
+    index.push_back(std::make_pair(((IntegrationAttempt*)thisTag->ptr)->getShortHeader(), thisTag));
 
-  return 0;
+  std::vector<IntegratorTag*>& children = getTagChildren(thisTag);
+  for(std::vector<IntegratorTag*>::iterator it = children.begin(), itend = children.end(); it != itend; ++it)
+    buildTagSearchIndex(*it, index);
 
 }
-
@@ -112,7 +112,7 @@ bool IntegrationAttempt::getMergeValue(SmallVector<ShadowValue, 4>& Vals, Improv
   bool anyMultis = false;
   for(SmallVector<ShadowValue, 4>::iterator it = Vals.begin(), it2 = Vals.end(); it != it2; ++it) {
 
-    switch(it->t) {
+    switch(it->getValType()) {
     case SHADOWVAL_ARG:
     case SHADOWVAL_INST:
       anyMultis |= isa<ImprovedValSetMulti>(getIVSRef(*it));
@@ -594,15 +594,15 @@ bool IntegrationAttempt::tryFoldNonConstCmp(ShadowInstruction* SI, std::pair<Val
 // Helper: Do we know V refers to a particular object?
 bool llvm::isGlobalIdentifiedObject(ShadowValue V) {
   
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_PTRIDX:
     return true;
   case SHADOWVAL_ARG:
-    return V.u.A->IA->isRootMainCall();
+    return V.getArg()->IA->isRootMainCall();
   case SHADOWVAL_GV:
     return true;
   case SHADOWVAL_OTHER:
-    return isIdentifiedObject(V.u.V);
+    return isIdentifiedObject(V.getVal());
   case SHADOWVAL_CI8:
   case SHADOWVAL_CI16:
   case SHADOWVAL_CI32:
@@ -761,16 +761,16 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
   bool op0Null = SVIsNull(op0);
   bool op1Null = SVIsNull(op1);
 
-  bool op0Fun = (op0.isVal() && isa<Function>(op0.u.V->stripPointerCasts()));
-  bool op1Fun = (op1.isVal() && isa<Function>(op1.u.V->stripPointerCasts()));
+  bool op0Fun = (op0.isVal() && isa<Function>(op0.getVal()->stripPointerCasts()));
+  bool op1Fun = (op1.isVal() && isa<Function>(op1.getVal()->stripPointerCasts()));
 
   bool op0UGO = isGlobalIdentifiedObject(op0);
   bool op1UGO = isGlobalIdentifiedObject(op1);
 
   bool comparingHeapPointer = false;
-  if(op0UGO && op0.isPtrIdx() && op0.u.PtrOrFd.frame == -1)
+  if(op0UGO && op0.isPtrIdx() && op0.getPtrOrFdFrame() == -1)
     comparingHeapPointer = true;
-  else if(op1UGO && op1.isPtrIdx() && op1.u.PtrOrFd.frame == -1)
+  else if(op1UGO && op1.isPtrIdx() && op1.getPtrOrFdFrame() == -1)
     comparingHeapPointer = true;
 
   // Don't check the types here because we need to accept cases like comparing a ptrtoint'd pointer
@@ -862,13 +862,13 @@ bool IntegrationAttempt::tryFoldPointerCmp(ShadowInstruction* SI, std::pair<ValS
 // in the pointer being temporarily negated during pointer arithmetic.
 static bool tryGetNegatedPointer(ShadowValue checkOp, uint64_t& SubOp0, ShadowValue& SubOp1Base, int64_t& SubOp1Offset) {
 
-  if((!checkOp.isInst()) || checkOp.u.I->invar->I->getOpcode() != Instruction::Sub)
+  if((!checkOp.isInst()) || checkOp.getInst()->invar->I->getOpcode() != Instruction::Sub)
     return false;
 
-  if(!tryGetConstantInt(checkOp.u.I->getOperand(0), SubOp0))
+  if(!tryGetConstantInt(checkOp.getInst()->getOperand(0), SubOp0))
     return false;
 
-  ShadowInstruction* SubOp1 = checkOp.u.I->getOperand(1).getInst();
+  ShadowInstruction* SubOp1 = checkOp.getInst()->getOperand(1).getInst();
   if(!SubOp1)
     return false;
 
@@ -1353,9 +1353,9 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
 
       if(ImpType == ValSetTypeFD) {
 	if(DestTy->isIntegerTy(32))
-	  Improved.V.t = SHADOWVAL_FDIDX;
+	  Improved.V = ShadowValue::getFdIdx(Improved.V.getPtrOrFdIdx());
 	else
-	  Improved.V.t = SHADOWVAL_FDIDX64;
+	  Improved.V = ShadowValue::getFdIdx64(Improved.V.getPtrOrFdIdx());
       }
 
       return;
@@ -1514,7 +1514,7 @@ void IntegrationAttempt::tryEvaluateResult(ShadowInstruction* SI,
     }
 
     release_assert(Ops[0].second.V.isVal());
-    Constant* Agg = cast<Constant>(Ops[0].second.V.u.V);
+    Constant* Agg = cast<Constant>(Ops[0].second.V.getVal());
     Constant* Ext = ConstantFoldExtractValueInstruction(Agg, cast<ExtractValueInst>(SI->invar->I)->getIndices());
     if(Ext) {
       ImpType = ValSetTypeScalar;
@@ -1704,10 +1704,10 @@ bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, Improved
 
   ShadowValue OpV = SI->getOperand(OpIdx);
 
-  switch(OpV.t) {
+  switch(OpV.getValType()) {
   case SHADOWVAL_OTHER:
     
-    Ops[OpIdx] = getValPB(OpV.u.V);
+    Ops[OpIdx] = getValPB(OpV.getVal());
     return tryEvaluateOrdinaryInst(SI, NewPB, Ops, OpIdx+1);
 
   case SHADOWVAL_GV:
@@ -2283,7 +2283,7 @@ bool IntegrationAttempt::tryEvaluateOrdinaryInst(ShadowInstruction* SI, Improved
   for(uint32_t i = 0, ilim = SI->getNumOperands(); i != ilim && !anyMultis; ++i) {
     
     ShadowValue OpV = SI->getOperand(i);
-    switch(OpV.t) {
+    switch(OpV.getValType()) {
     case SHADOWVAL_INST:
     case SHADOWVAL_ARG:
       anyMultis |= isa<ImprovedValSetMulti>(getIVSRef(OpV));
@@ -0,0 +1,249 @@
+//===-- Finalise.cpp ------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// Fused walks over the context tree for the finalisation passes run by
+// InlineAttempt::finaliseAndCommit. Each pass used to recurse over the whole tree by
+// itself; here every context is visited once, children first, and each pass that
+// reaches it runs its per-context step while the context's blocks are still in cache.
+//
+// Passes may only be fused if the per-context step of each depends on nothing but that
+// context and results already computed for its children. findProfitableIntegration
+// (which prunes the tree as it disables contexts) and runDIE (which must interleave
+// parent and child instructions in reverse topological order) are therefore still
+// run by themselves.
+
+#include "llvm/Analysis/LLPE.h"
+
+using namespace llvm;
+
+// Visit this context's children for each pass in Passes that enters them, then visit this
+// context with every pass. Each pass carries the flag value it gave this context.
+void IntegrationAttempt::runFusedPasses(SmallVectorImpl<std::pair<FusedPass*, bool> >& Passes) {
+
+  SmallVector<std::pair<FusedPass*, bool>, 4> ChildPasses;
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    ChildPasses.clear();
+    for(uint32_t i = 0, ilim = Passes.size(); i != ilim; ++i) {
+
+      bool childFlag = Passes[i].second;
+      if(Passes[i].first->entersCall(this, Passes[i].second, it->first, it->second, childFlag))
+	ChildPasses.push_back(std::make_pair(Passes[i].first, childFlag));
+
+    }
+
+    if(!ChildPasses.empty())
+      it->second->runFusedPasses(ChildPasses);
+
+  }
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = it->second;
+
+    for(uint32_t iter = 0, iterlim = LPA->Iterations.size(); iter != iterlim; ++iter) {
+
+      ChildPasses.clear();
+      for(uint32_t i = 0, ilim = Passes.size(); i != ilim; ++i) {
+
+	bool childFlag = Passes[i].second;
+	if(Passes[i].first->entersIteration(this, Passes[i].second, LPA, iter, childFlag))
+	  ChildPasses.push_back(std::make_pair(Passes[i].first, childFlag));
+
+      }
+
+      if(!ChildPasses.empty())
+	LPA->Iterations[iter]->runFusedPasses(ChildPasses);
+
+    }
+
+  }
+
+  for(uint32_t i = 0, ilim = Passes.size(); i != ilim; ++i)
+    Passes[i].first->visit(this, Passes[i].second);
+
+}
+
+// countTentativeInstructions, over uncommitted contexts and the iterations of terminated loops.
+struct CountTentativePass : public FusedPass {
+
+  bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) {
+    return !Child->isCommitted();
+  }
+
+  bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) {
+    return LPA->isTerminated() && !LPA->Iterations[iter]->isCommitted();
+  }
+
+  void visit(IntegrationAttempt* Ctx, bool flag) {
+    Ctx->countTentativeInstructions();
+  }
+
+};
+
+// collectStatsHere, over uncommitted calls and all loop iterations.
+struct CollectStatsPass : public FusedPass {
+
+  bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) {
+    return !Child->isCommitted();
+  }
+
+  bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) {
+    return true;
+  }
+
+  void visit(IntegrationAttempt* Ctx, bool flag) {
+    Ctx->collectStatsHere();
+  }
+
+};
+
+// prepareCommit, over enabled contexts. Iterations of a loop that did not terminate
+// are committed as a general-case loop, but all but the last are still prepared.
+struct PrepareCommitPass : public FusedPass {
+
+  bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) {
+    return Child->isEnabled() && !Child->isCommitted();
+  }
+
+  bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) {
+
+    if(!LPA->isEnabled())
+      return false;
+
+    uint32_t iterLimit = LPA->Iterations.size();
+    if(LPA->Iterations.back()->iterStatus != IterationStatusFinal)
+      --iterLimit;
+    return iter < iterLimit;
+
+  }
+
+  void visit(IntegrationAttempt* Ctx, bool flag) {
+    Ctx->prepareCommit();
+  }
+
+};
+
+// preCommitStats, over every context; the flag says whether the context will be committed.
+// Committed contexts are visited (InlineAttempts still count as functions) but not entered.
+struct PreCommitStatsPass : public FusedPass {
+
+  bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) {
+
+    childFlag = flag && Child->isEnabled();
+    return !Parent->isCommitted();
+
+  }
+
+  bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) {
+
+    // If the loop wasn't known-terminated we would have analysed and committed a general
+    // iteration, which is part of this context not a child.
+    childFlag = flag && LPA->isTerminated() && LPA->isEnabled();
+    return !Parent->isCommitted();
+
+  }
+
+  void visit(IntegrationAttempt* Ctx, bool flag) {
+    Ctx->preCommitStats(flag);
+  }
+
+};
+
+// addCheckpointFailedBlocks, over enabled calls that don't need a check themselves and the
+// iterations of loops committed per iteration.
+struct CheckpointFailedBlocksPass : public FusedPass {
+
+  bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) {
+
+    return Child->isEnabled() && !Child->isCommitted() && !Parent->isInCommittedPeel(SI->parent->invar) &&
+      !Parent->isCheckpointInstruction(SI);
+
+  }
+
+  bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) {
+    return LPA->isTerminated() && LPA->isEnabled() && !LPA->Iterations[iter]->isCommitted() && Parent->anyBlockLiveIn(LPA->L);
+  }
+
+  void visit(IntegrationAttempt* Ctx, bool flag) {
+    Ctx->addCheckpointFailedBlocks();
+  }
+
+};
+
+// findSaveSplits, over enabled contexts. A function that must be committed out of line is
+// split without counting its children.
+struct SaveSplitsPass : public FusedPass {
+
+  bool entersChildrenOf(IntegrationAttempt* Parent) {
+
+    InlineAttempt* ParentIA = Parent->getFunctionRoot();
+    return ParentIA != Parent || !ParentIA->mustCommitOutOfLine();
+
+  }
+
+  bool entersCall(IntegrationAttempt* Parent, bool flag, ShadowInstruction* SI, InlineAttempt* Child, bool& childFlag) {
+    return Child->isEnabled() && !Child->isCommitted() && entersChildrenOf(Parent);
+  }
+
+  bool entersIteration(IntegrationAttempt* Parent, bool flag, PeelAttempt* LPA, uint32_t iter, bool& childFlag) {
+
+    return LPA->isEnabled() && LPA->isTerminated() && !LPA->Iterations[iter]->isCommitted() &&
+      entersChildrenOf(Parent);
+
+  }
+
+  void visit(IntegrationAttempt* Ctx, bool flag) {
+    Ctx->findSaveSplits();
+  }
+
+};
+
+// Stats for this context and all of its uncommitted children.
+void IntegrationAttempt::collectStats() {
+
+  CollectStatsPass Stats;
+  SmallVector<std::pair<FusedPass*, bool>, 4> Passes;
+  Passes.push_back(std::make_pair(&Stats, false));
+  runFusedPasses(Passes);
+
+}
+
+// countTentativeInstructions and collectStats, which findProfitableIntegration relies on.
+void InlineAttempt::collectFinalisationStats() {
+
+  CountTentativePass CountTentative;
+  CollectStatsPass Stats;
+  SmallVector<std::pair<FusedPass*, bool>, 4> Passes;
+  Passes.push_back(std::make_pair(&CountTentative, false));
+  Passes.push_back(std::make_pair(&Stats, false));
+  runFusedPasses(Passes);
+
+}
+
+// prepareCommit, preCommitStats (if a stats file is wanted), addCheckpointFailedBlocks and
+// findSaveSplits, in that order within each context. This context is known to be enabled.
+void InlineAttempt::prepareCommitTree() {
+
+  PrepareCommitPass PrepareCommit;
+  PreCommitStatsPass PreCommitStats;
+  CheckpointFailedBlocksPass CheckpointFailedBlocks;
+  SaveSplitsPass SaveSplits;
+
+  SmallVector<std::pair<FusedPass*, bool>, 4> Passes;
+  Passes.push_back(std::make_pair(&PrepareCommit, false));
+  if(!pass->statsFile.empty())
+    Passes.push_back(std::make_pair(&PreCommitStats, true));
+  Passes.push_back(std::make_pair(&CheckpointFailedBlocks, false));
+  Passes.push_back(std::make_pair(&SaveSplits, false));
+  runFusedPasses(Passes);
+
+}
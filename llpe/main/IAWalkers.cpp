@@ -46,11 +46,13 @@ BackwardIAWalker::BackwardIAWalker(uint32_t instIdx, ShadowBB* BB, bool skipFirs
   
   WLItem firstItem = makeWL(instIdx, BB);
 
-  if(AlreadyVisited)
-    Visited = *AlreadyVisited;
+  if(AlreadyVisited) {
+    for(DenseSet<WLItem>::iterator it = AlreadyVisited->begin(), itend = AlreadyVisited->end(); it != itend; ++it)
+      markVisited(*it);
+  }
 
   PList->push_back(std::make_pair(firstItem, initialCtx));
-  Visited.insert(firstItem);
+  markVisited(firstItem);
 
 }
 
@@ -242,6 +244,35 @@ void IntegrationAttempt::visitNormalPredecessorsBW(ShadowBB* FromBB, ShadowBBVis
 
 }
 
+uint32_t IAWalker::nextEpoch = 0;
+uint32_t IAWalker::activeWalkers = 0;
+
+// Mark wl visited, returning false if it already was.
+bool IAWalker::markVisited(const WLItem& wl) {
+
+  if(epoch) {
+
+    uint32_t* mark;
+    if(wl.first == 0)
+      mark = &wl.second->walkEpochStart;
+    else if(wl.first == wl.second->insts.size())
+      mark = &wl.second->walkEpochEnd;
+    else
+      mark = 0;
+
+    if(mark) {
+      if(*mark == epoch)
+	return false;
+      *mark = epoch;
+      return true;
+    }
+
+  }
+
+  return Visited.insert(wl).second;
+
+}
+
 // Add block BB, instruction idx to the queue of blocks to explore from.
 void IAWalker::queueWalkFrom(uint32_t idx, ShadowBB* BB, void* Ctx, bool shouldCopyContext) {
 
@@ -249,7 +280,7 @@ void IAWalker::queueWalkFrom(uint32_t idx, ShadowBB* BB, void* Ctx, bool shouldC
 
   WLItem wl = makeWL(idx, BB);
 
-  if(Visited.insert(wl).second) {
+  if(markVisited(wl)) {
     if(shouldCopyContext) {
       Ctx = copyContext(Ctx);
       Contexts.push_back(Ctx);
@@ -398,7 +429,7 @@ ForwardIAWalker::ForwardIAWalker(uint32_t idx, ShadowBB* BB, bool skipFirst, voi
 
   WLItem firstWL = makeWL(idx, BB);
 
-  Visited.insert(firstWL);
+  markVisited(firstWL);
   PList->push_back(std::make_pair(firstWL, initialCtx));
   
 }
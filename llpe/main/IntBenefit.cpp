@@ -14,13 +14,24 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Constants.h"
 #include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <sstream>
 
 using namespace llvm;
 
 const uint32_t eliminatedInstructionPoints = 2;
 const uint32_t extraInstructionPoints = 1;
 
+// Profile weights are fixed-point: a block with weight profileWeightUnit runs once per call
+// to its function. The limit keeps a few very hot blocks from overflowing the goodness sums.
+const uint64_t profileWeightUnit = 256;
+const uint64_t profileWeightLimit = profileWeightUnit * 1000000;
+
 static uint32_t intBenefitProgressN = 0;
 const uint32_t intBenefitProgressLimit = 1000;
 
@@ -48,6 +59,115 @@ int64_t IntegrationAttempt::getTotalInstructionsIncludingLoops() {
   return improvableInstructionsIncludingLoops;
 }
 
+// Read a block-count profile: one "function,block,count" line per block. Blocks of a listed
+// function that are not themselves listed are taken never to run; unlisted functions are
+// weighted as if every block ran once per call.
+void LLPEAnalysisPass::loadBlockProfile(Module& M, std::string& path) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer>> MB = MemoryBuffer::getFile(path);
+  if(std::error_code ec = MB.getError()) {
+
+    errs() << "Failed to load block profile from " << path << ": " << ec.message() << "\n";
+    exit(1);
+
+  }
+
+  std::istringstream istr((*MB)->getBuffer().str());
+  std::string line;
+
+  while(std::getline(istr, line)) {
+
+    if(line.empty() || line[0] == '#')
+      continue;
+
+    std::string fName, bbName, countStr;
+    {
+      std::istringstream lstr(line);
+      std::getline(lstr, fName, ',');
+      std::getline(lstr, bbName, ',');
+      std::getline(lstr, countStr, ',');
+    }
+
+    char* end;
+    uint64_t count = strtoull(countStr.c_str(), &end, 10);
+    if(fName.empty() || bbName.empty() || countStr.empty() || *end) {
+
+      errs() << "-llpe-block-profile: bad line '" << line << "', expected function,block,count\n";
+      exit(1);
+
+    }
+
+    Function* F = M.getFunction(fName);
+    if(!F || F->isDeclaration()) {
+
+      errs() << "Warning: block profile names unknown function " << fName << "\n";
+      continue;
+
+    }
+
+    BasicBlock* BB = 0;
+    for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE && !BB; ++FI) {
+      if(FI->getName() == bbName)
+	BB = &*FI;
+    }
+
+    if(!BB) {
+
+      errs() << "Warning: block profile names unknown block " << bbName << " in " << fName << "\n";
+      continue;
+
+    }
+
+    blockProfileCounts[BB] += count;
+    blockProfileFunctions.insert(F);
+
+  }
+
+}
+
+static uint64_t getRelativeWeight(uint64_t count, uint64_t entryCount) {
+
+  if(!entryCount)
+    return count ? profileWeightLimit : 0;
+
+  double weight = ((double)count / (double)entryCount) * profileWeightUnit;
+  if(weight >= (double)profileWeightLimit)
+    return profileWeightLimit;
+  return (uint64_t)weight;
+
+}
+
+// Give each block of F its expected execution count per call, taken from the block-count
+// profile if F appears there, or else from PGO metadata (e.g. applied from a .profdata file
+// by opt -pgo-instr-use) if requested.
+void LLPEAnalysisPass::setBlockProfileWeights(Function& F, ShadowFunctionInvar& SFI, LoopInfo* LI) {
+
+  for(uint32_t i = 0, ilim = SFI.BBs.size(); i != ilim; ++i)
+    SFI.BBs[i].profileWeight = profileWeightUnit;
+
+  if(!useBlockProfile)
+    return;
+
+  if(blockProfileFunctions.count(&F)) {
+
+    uint64_t entryCount = blockProfileCounts.lookup(&F.getEntryBlock());
+    for(uint32_t i = 0, ilim = SFI.BBs.size(); i != ilim; ++i)
+      SFI.BBs[i].profileWeight = getRelativeWeight(blockProfileCounts.lookup(SFI.BBs[i].BB), entryCount);
+
+  }
+  else if(useProfileMetadata && F.hasProfileData()) {
+
+    BranchProbabilityInfo BPI(F, *LI);
+    BlockFrequencyInfo BFI(F, BPI, *LI);
+
+    uint64_t entryFreq = BFI.getEntryFreq();
+    for(uint32_t i = 0, ilim = SFI.BBs.size(); i != ilim; ++i)
+      SFI.BBs[i].profileWeight = getRelativeWeight(BFI.getBlockFreq(SFI.BBs[i].BB).getFrequency(), entryFreq);
+
+  }
+
+}
+
 // getResidualInstructions: return a best-case residual instruction count, where we assume
 // that any code size increase will cause us to opt not to unroll a loop.
 
@@ -222,14 +342,34 @@ void IntegrationAttempt::findProfitableIntegration() {
   totalIntegrationGoodness = 0;
   int64_t childIntegrationGoodness = 0;
 
+  // Profile weights count every iteration of a block's loops, but a peeled iteration's
+  // blocks run once per entry to its loop, so share the weight between the iterations.
+  int64_t weightDivisor = profileWeightUnit;
+  if(pass->useBlockProfile) {
+
+    for(IntegrationAttempt* IA = this; IA->L; ) {
+      IntegrationAttempt* Parent = static_cast<PeelIteration*>(IA)->parent;
+      weightDivisor *= Parent->getPeelAttempt(IA->L)->Iterations.size();
+      IA = Parent;
+    }
+
+  }
+
   for(IAIterator it = child_calls_begin(this), it2 = child_calls_end(this); it != it2; ++it) {
 
     if(!it->second->isEnabled())
       continue;
     it->second->findProfitableIntegration();
     if(it->second->isEnabled()) {
-      totalIntegrationGoodness += it->second->totalIntegrationGoodness;
-      childIntegrationGoodness += it->second->totalIntegrationGoodness;
+
+      // A call's goodness is per call; scale it by how often its call site runs.
+      int64_t childGoodness = it->second->totalIntegrationGoodness;
+      if(pass->useBlockProfile)
+	childGoodness = (childGoodness * (int64_t)it->first->parent->invar->profileWeight) / weightDivisor;
+
+      totalIntegrationGoodness += childGoodness;
+      childIntegrationGoodness += childGoodness;
+
     }
 
   }
@@ -247,15 +387,15 @@ void IntegrationAttempt::findProfitableIntegration() {
   }
 
   // OK, calculate own integration goodness:
-  // 1. Points for residual instructions introduced:
-  int64_t newInstPenalty = extraInstructionPoints * getResidualInstructions();
-  totalIntegrationGoodness -= newInstPenalty;
-
-  // 2. Points for instructions which *would* be performed but are eliminated.
+  // 1. Points for instructions which *would* be performed but are eliminated.
   // This differs from the elimdInstructions value in that dead blocks are not counted
   // since they wouldn't get run at all.
+  // 2. Points for residual instructions introduced.
+  // Given a block profile, both are scaled by how often each block runs, so a context is
+  // judged by expected runtime gain rather than static instruction counts.
 
-  int64_t timeBonus = 0;
+  int64_t weightedBonus = 0;
+  int64_t weightedPenalty = 0;
 
   for(uint32_t i = 0; i < nBBs; ++i) {
 
@@ -277,13 +417,15 @@ void IntegrationAttempt::findProfitableIntegration() {
 
     if(L == BBL) {
 
+      int64_t weight = (int64_t)BB->invar->profileWeight;
+
       for(uint32_t j = 0; j < BB->insts.size(); ++j) {
 
 	ShadowInstruction* I = &(BB->insts[j]);
-	if(willBeReplacedOrDeleted(ShadowValue(I))) {
-	  totalIntegrationGoodness += eliminatedInstructionPoints;
-	  timeBonus += eliminatedInstructionPoints;
-	}
+	if(willBeReplacedOrDeleted(ShadowValue(I)))
+	  weightedBonus += eliminatedInstructionPoints * weight;
+	else if(pass->useBlockProfile && instructionCounts(I->invar->I))
+	  weightedPenalty += extraInstructionPoints * weight;
 
       }
 
@@ -291,6 +433,16 @@ void IntegrationAttempt::findProfitableIntegration() {
 
   }
 
+  int64_t timeBonus = weightedBonus / weightDivisor;
+  int64_t newInstPenalty;
+  if(pass->useBlockProfile)
+    newInstPenalty = weightedPenalty / weightDivisor;
+  else
+    newInstPenalty = extraInstructionPoints * getResidualInstructions();
+
+  ownIntegrationGoodness = timeBonus - newInstPenalty;
+  totalIntegrationGoodness += ownIntegrationGoodness;
+
   integrationGoodnessValid = true;
 
   intBenefitProgress();
@@ -440,14 +592,8 @@ void PeelIteration::collectAllLoopStats() {
 
 }
 
-void PeelAttempt::collectStats() {
-
-  for(std::vector<PeelIteration*>::iterator it = Iterations.begin(), it2 = Iterations.end(); it != it2; ++it)
-    (*it)->collectStats();
-
-}
-
-void IntegrationAttempt::collectStats() {
+// Stats for this context alone; collectStats covers its children too.
+void IntegrationAttempt::collectStatsHere() {
 
   improvedInstructions = 0;
   improvableInstructions = 0;
@@ -456,12 +602,4 @@ void IntegrationAttempt::collectStats() {
   collectAllBlockStats();
   collectAllLoopStats();
 
-  for(IAIterator it = child_calls_begin(this), it2 = child_calls_end(this); it != it2; ++it) {
-    if(!it->second->isCommitted())
-      it->second->collectStats();
-  }
-
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::const_iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it)
-    it->second->collectStats();
-
 }
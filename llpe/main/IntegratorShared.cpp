@@ -195,7 +195,7 @@ std::pair<ValSetType, ImprovedVal> llvm::getValPB(Value* V) {
 	if(!Op1.second.V.isGV())
 	  break;
 
-	uint64_t GlobalAlign = Op1.second.V.u.GV->G->getAlignment();
+	uint64_t GlobalAlign = Op1.second.V.getGV()->G->getAlignment();
 	if(GlobalAlign == 0 || GlobalAlign == 1)
 	  break;
 
@@ -383,6 +383,9 @@ void ImprovedValSetMulti::print(raw_ostream& RSO, bool brief) const {
 
   }
 
+  if(Dense)
+    RSO << "Dense " << *Dense->ElemTy << " x " << Dense->NumElems << " (" << Dense->NumKnown << " known)\n";
+
   RSO << "}\n";
 
   if(Underlying) {
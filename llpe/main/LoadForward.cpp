@@ -26,12 +26,20 @@
 #include "llvm/Analysis/MemoryBuiltins.h"
 #include "llvm/Analysis/ConstantFolding.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/CommandLine.h"
 #include "llvm/Support/Debug.h"
+#include "llvm/Support/Host.h"
 
 #include <memory>
 
 using namespace llvm;
 
+static cl::opt<unsigned> StoreFlattenDepth("llpe-store-flatten-depth", cl::init(16));
+static cl::opt<unsigned> StoreFlattenExtents("llpe-store-flatten-extents", cl::init(1024));
+static cl::opt<unsigned> DenseStoreMinSize("llpe-dense-store-min-size", cl::init(256));
+static cl::opt<unsigned> DenseStoreMinWrites("llpe-dense-store-min-writes", cl::init(16));
+static cl::opt<unsigned> ConstImageMinSize("llpe-const-image-min-size", cl::init(64));
+
 // Bug check: make sure null pointer values haven't been accidentally annotated as scalars.
 static void checkIVSNull(ImprovedValSetSingle& IVS) {
 
@@ -50,9 +58,9 @@ static void checkIVSNull(ImprovedValSetSingle& IVS) {
 // We use an IntervalMap (named Map) to describe how component IVSes are laid out.
 // They might describe a whole object, or if Underlying is set describe an overlay
 // atop that map.
-ImprovedValSetMulti::ImprovedValSetMulti(uint64_t ASize) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(0), CoveredBytes(0), AllocSize(ASize) { }
+ImprovedValSetMulti::ImprovedValSetMulti(uint64_t ASize) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(0), CoveredBytes(0), AllocSize(ASize), Dense(0), ElemWrites(0) { }
 
-ImprovedValSetMulti::ImprovedValSetMulti(const ImprovedValSetMulti& other) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(other.Underlying), CoveredBytes(other.CoveredBytes), AllocSize(other.AllocSize) {
+ImprovedValSetMulti::ImprovedValSetMulti(const ImprovedValSetMulti& other) : ImprovedValSet(true), Map(GlobalIHP->IMapAllocator), MapRefCount(1), Underlying(other.Underlying), CoveredBytes(other.CoveredBytes), AllocSize(other.AllocSize), Dense(other.Dense ? other.Dense->getReadableCopy() : 0), ElemWrites(other.ElemWrites) {
 
   if(Underlying)
     Underlying = Underlying->getReadableCopy();
@@ -84,6 +92,11 @@ bool llvm::operator==(const ImprovedValSetMulti& PB1, const ImprovedValSetMulti&
   if(it1 != it1end || it2 != it2end)
     return false;
 
+  if((!PB1.Dense) != (!PB2.Dense))
+    return false;
+  if(PB1.Dense && !(*PB1.Dense == *PB2.Dense))
+    return false;
+
   return true;
 
 }
@@ -133,6 +146,84 @@ bool IntegrationAttempt::tryResolveLoadFromVararg(ShadowInstruction* LoadI, Impr
 
 }
 
+// Flatten a constant global's initialiser to bytes the first time it is read, so loads
+// from big tables are a byte extraction rather than a walk over the initialiser.
+// Returns null for small globals and for initialisers that can't be read bytewise,
+// e.g. because they contain pointers. Undef and padding bytes read as zero.
+static const uint8_t* getConstImage(ShadowGV* G) {
+
+  if(G->initImageTried)
+    return G->initImage;
+  G->initImageTried = true;
+
+  Constant* Init = G->G->getInitializer();
+  uint64_t Size = GlobalTD->getTypeStoreSize(Init->getType());
+  if(Size < ConstImageMinSize || Size > UINT32_MAX || containsPointerTypes(Init->getType()))
+    return 0;
+
+  uint8_t* Image = new uint8_t[Size]();
+
+  // A data array's raw values are already laid out as the target would have them
+  // if host and target agree on byte order.
+  ConstantDataSequential* CDS = dyn_cast<ConstantDataSequential>(Init);
+  if(CDS && GlobalTD->isLittleEndian() == sys::IsLittleEndianHost) {
+    StringRef Raw = CDS->getRawDataValues();
+    release_assert(Raw.size() == Size);
+    memcpy(Image, Raw.data(), Size);
+  }
+  else if(!XXXReadDataFromGlobal(Init, 0, Image, Size, *GlobalTD)) {
+    delete[] Image;
+    return 0;
+  }
+
+  G->initImage = Image;
+  G->initImageSize = (uint32_t)Size;
+  return Image;
+
+}
+
+// Read a Size-byte integer of type Ty from a constant image.
+static ShadowValue getConstImageInt(const uint8_t* Bytes, uint64_t Size, Type* Ty) {
+
+  uint64_t Val = 0;
+  bool little = GlobalTD->isLittleEndian();
+  for(uint64_t i = 0; i != Size; ++i)
+    Val |= ((uint64_t)Bytes[i]) << (8 * (little ? i : (Size - i - 1)));
+
+  return ShadowValue::getInt(Ty, Val);
+
+}
+
+// Try to read a LoadTy from a constant global's image; returns false if we can't.
+static bool tryReadConstImage(ShadowGV* SGV, int64_t Offset, uint64_t LoadSize, Type* LoadTy, ImprovedValSetSingle& Result) {
+
+  const uint8_t* Image = getConstImage(SGV);
+  if(!Image)
+    return false;
+
+  const uint8_t* Bytes = Image + Offset;
+
+  if(LoadTy->isIntegerTy() && LoadSize <= 8 && LoadTy->getIntegerBitWidth() == LoadSize * 8) {
+    Result.mergeOne(ValSetTypeScalar, ImprovedVal(getConstImageInt(Bytes, LoadSize, LoadTy)));
+    return true;
+  }
+
+  if(containsPointerTypes(LoadTy))
+    return false;
+
+  // constFromBytes reads whole words, so give it an aligned, padded copy.
+  SmallVector<uint64_t, 4> Buffer((LoadSize + 7) / 8, 0);
+  memcpy(Buffer.data(), Bytes, LoadSize);
+  Constant* C = constFromBytes((unsigned char*)Buffer.data(), LoadTy, GlobalTD);
+  if(!C)
+    return false;
+
+  std::pair<ValSetType, ImprovedVal> V = getValPB(C);
+  Result.mergeOne(V.first, V.second);
+  return true;
+
+}
+
 // Check if the load address (Ptr) refers to a cosntant; if so populate Result.
 bool IntegrationAttempt::tryResolveLoadFromConstant(ShadowInstruction* LoadI, ImprovedVal Ptr, ImprovedValSetSingle& Result) {
 
@@ -153,6 +244,9 @@ bool IntegrationAttempt::tryResolveLoadFromConstant(ShadowInstruction* LoadI, Im
 	return true;
       }
       
+      if(tryReadConstImage(SGV, Ptr.Offset, LoadSize, LoadI->getType(), Result))
+	return true;
+
       // getConstSubVal does the merge with Result.
       getConstSubVal(ShadowValue(GV->getInitializer()), Ptr.Offset, LoadSize, LoadI->getType(), Result);
       return true;
@@ -340,6 +434,13 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 
   if(error.get())
     pass->optimisticForwardStatus[LI] = *error;
+
+  // Unless the load yields a constant it will be performed at runtime.
+  if(pass->heapSnapshot) {
+    ImprovedValSetSingle* NewIVS = dyn_cast_or_null<ImprovedValSetSingle>(NewPB);
+    if(!(NewIVS && NewIVS->SetType == ValSetTypeScalar && !NewIVS->Overdef && NewIVS->Values.size() == 1))
+      noteHeapSnapshotRead(LoadPtrPB);
+  }
    
   return ret;
 
@@ -349,27 +450,27 @@ bool IntegrationAttempt::tryForwardLoadPB(ShadowInstruction* LI, ImprovedValSet*
 // Return -1 if this is a non-pointer or unknown pointer.
 int32_t ShadowValue::getHeapKey() const {
 
-  switch(t) {
+  switch(getValType()) {
 
   case SHADOWVAL_GV:
-    release_assert(!u.GV->G->isConstant());
-    return u.GV->allocIdx;
+    release_assert(!getGV()->G->isConstant());
+    return getGV()->allocIdx;
   case SHADOWVAL_OTHER:
     {
-      Function* KeyF = cast<Function>(u.V);
+      Function* KeyF = cast<Function>(getVal());
       SpecialLocationDescriptor& sd = GlobalIHP->specialLocations[KeyF];
       return sd.heapIdx;
     }
   case SHADOWVAL_ARG:
-    release_assert((u.A->IA->isRootMainCall()) && "getHeapKey on arg other than root argv?");
-    return GlobalIHP->argStores[u.A->invar->A->getArgNo()].heapIdx;
+    release_assert((getArg()->IA->isRootMainCall()) && "getHeapKey on arg other than root argv?");
+    return GlobalIHP->argStores[getArg()->invar->A->getArgNo()].heapIdx;
   case SHADOWVAL_INST:
     release_assert(0 && "Unsafe reference to heap key of instruction");
     llvm_unreachable("Unsafe reference to heap key of instruction");
   case SHADOWVAL_PTRIDX:
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
-    return u.PtrOrFd.idx;
+    return getPtrOrFdIdx();
   default:
     return -1;
 
@@ -379,13 +480,13 @@ int32_t ShadowValue::getHeapKey() const {
 
 uint64_t ShadowValue::getAllocSize(OrdinaryLocalStore* M) const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_PTRIDX:
     return getAllocData(M)->storeSize;
   case SHADOWVAL_GV:
-    return u.GV->storeSize;
+    return getGV()->storeSize;
   case SHADOWVAL_OTHER:
-    return GlobalIHP->specialLocations[cast<Function>(u.V)].storeSize;
+    return GlobalIHP->specialLocations[cast<Function>(getVal())].storeSize;
   case SHADOWVAL_ARG:
     // Arg objects currently of unknown size
     return ULONG_MAX;
@@ -411,18 +512,18 @@ uint64_t llvm::getAllocSize(InlineAttempt* IA, uint32_t idx) {
 
 uint64_t ShadowValue::getAllocSize(IntegrationAttempt* IA) const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_PTRIDX:
-    if(u.PtrOrFd.frame == -1) // Heap or special object?
+    if(getPtrOrFdFrame() == -1) // Heap or special object?
       return getAllocSize((OrdinaryLocalStore*)0);
     else { // Stack object?
       uint32_t i;
       InlineAttempt* InA;
-      release_assert(u.PtrOrFd.frame <= IA->stack_depth);
+      release_assert(getPtrOrFdFrame() <= IA->stack_depth);
       for(i = 0, InA = IA->getFunctionRoot(); 
-	  u.PtrOrFd.frame < InA->stack_depth; 
+	  getPtrOrFdFrame() < InA->stack_depth; 
 	  ++i, InA = InA->activeCaller->parent->IA->getFunctionRoot()) { }
-      return InA->localAllocas[u.PtrOrFd.idx].storeSize;
+      return InA->localAllocas[getPtrOrFdIdx()].storeSize;
     }
   default:
     return getAllocSize((OrdinaryLocalStore*)0);
@@ -442,7 +543,7 @@ int32_t ShadowValue::getFrameNo() const {
 
   release_assert((!isInst()) && "Unsafe reference to alloc instruction");
   if(isPtrIdx())
-    return u.PtrOrFd.frame;
+    return getPtrOrFdFrame();
   else
     return -1;
 
@@ -487,6 +588,251 @@ static int logReadDepth(ImprovedValSet* IVS, uint32_t depth) {
   
 }
 
+// Get the value of known element idx of D.
+static ImprovedValSetSingle getDenseElement(const DenseScalarArray* D, uint64_t idx) {
+
+  return ImprovedValSetSingle(ImprovedVal(ShadowValue::getInt(D->ElemTy, D->get(idx))), ValSetTypeScalar);
+
+}
+
+// Get M's dense array, copying it first if it is shared with another multi.
+static DenseScalarArray* getWritableDense(ImprovedValSetMulti* M) {
+
+  if(M->Dense->RefCount != 1) {
+    DenseScalarArray* Copy = new DenseScalarArray(*M->Dense);
+    M->Dense->dropReference();
+    M->Dense = Copy;
+  }
+
+  return M->Dense;
+
+}
+
+static void releaseDense(ImprovedValSetMulti* M) {
+
+  if(M->Dense)
+    M->Dense->dropReference();
+  M->Dense = 0;
+  M->ElemWrites = 0;
+
+}
+
+// Extent lists read with a DenseScalarArray to collect into (see readMultiGapFrom) describe runs
+// of known dense elements with an uninitialised value; the elements themselves are in the array.
+static bool isDenseRun(const ImprovedValSetSingle& V) {
+
+  return !V.isInitialised();
+
+}
+
+// Get the element type and value if NewVal is a single known integer exactly Size bytes wide.
+static bool getDenseElementVal(const ImprovedValSetSingle& NewVal, uint64_t Size, IntegerType*& Ty, uint64_t& Val) {
+
+  if(NewVal.Overdef || NewVal.SetType != ValSetTypeScalar || NewVal.Values.size() != 1)
+    return false;
+  if(Size != 1 && Size != 2 && Size != 4 && Size != 8)
+    return false;
+
+  ShadowValue V = NewVal.Values[0].V;
+  if(V.isConstantInt()) {
+
+    Ty = cast<IntegerType>(V.getNonPointerType());
+    Val = V.getCIValue();
+
+  }
+  else if(ConstantInt* CI = dyn_cast_or_null<ConstantInt>(V.getVal())) {
+
+    if(CI->getBitWidth() > 64)
+      return false;
+    Ty = CI->getType();
+    Val = CI->getZExtValue();
+
+  }
+  else {
+
+    return false;
+
+  }
+
+  return Ty->getBitWidth() == Size * 8;
+
+}
+
+// Can an element of type Ty at M[Offset] be stored in M->Dense? Large objects get a dense array
+// once DenseStoreMinWrites such element writes have been made to them.
+static bool canWriteDenseElem(ImprovedValSetMulti* M, IntegerType* Ty, uint64_t Offset) {
+
+  if(!M->Dense) {
+
+    uint64_t Size = Ty->getBitWidth() / 8;
+    if(M->AllocSize < DenseStoreMinSize || M->AllocSize % Size || Offset % Size || Offset + Size > M->AllocSize)
+      return false;
+    if(++M->ElemWrites < DenseStoreMinWrites)
+      return false;
+
+    LFV3(errs() << "Create dense array of " << *Ty << " for multi " << M << "\n");
+    M->Dense = new DenseScalarArray(Ty, M->AllocSize / Size);
+
+  }
+
+  DenseScalarArray* D = M->Dense;
+  return D->ElemTy == Ty && !(Offset % D->ElemSize) && (Offset / D->ElemSize) < D->NumElems;
+
+}
+
+// Can M[Offset:Offset+Size] = NewVal be stored in M->Dense?
+static bool canWriteDense(ImprovedValSetMulti* M, const ImprovedValSetSingle& NewVal, uint64_t Offset, uint64_t Size, uint64_t& Val) {
+
+  IntegerType* Ty;
+  if(!getDenseElementVal(NewVal, Size, Ty, Val))
+    return false;
+
+  return canWriteDenseElem(M, Ty, Offset);
+
+}
+
+// Forget M's dense elements overlapping [Offset, Offset+Size). Those not wholly inside the range
+// move to the Map, where clearRange can truncate them.
+static void forgetDenseRange(ImprovedValSetMulti* M, uint64_t Offset, uint64_t Size) {
+
+  DenseScalarArray* D = M->Dense;
+  uint64_t LastByte = Offset + Size;
+
+  if(Offset == 0 && LastByte >= D->NumElems * D->ElemSize) {
+
+    M->CoveredBytes -= D->NumKnown * D->ElemSize;
+    releaseDense(M);
+    return;
+
+  }
+
+  uint64_t FirstElem = std::max(D->DirtyStart, Offset / D->ElemSize);
+  uint64_t LastElem = std::min(D->DirtyEnd, (LastByte + D->ElemSize - 1) / D->ElemSize);
+  if(FirstElem >= LastElem)
+    return;
+
+  D = getWritableDense(M);
+  for(uint64_t idx = FirstElem; idx < LastElem; ++idx) {
+
+    if(!D->isKnown(idx))
+      continue;
+
+    uint64_t ElemStart = idx * D->ElemSize, ElemStop = ElemStart + D->ElemSize;
+    if(ElemStart < Offset || ElemStop > LastByte) {
+      M->Map.insert(ElemStart, ElemStop, getDenseElement(D, idx));
+      // Net effect on CoveredBytes is nil.
+    }
+    else {
+      M->CoveredBytes -= D->ElemSize;
+    }
+
+    D->forget(idx);
+
+  }
+
+}
+
+// Populate M, which must be empty, with the in-order extent list Vals. Runs holds the elements
+// of any dense runs in Vals, and is taken over by M.
+static void fillMultiFromExtents(ImprovedValSetMulti* M, SmallVector<IVSRange, 4>& Vals, DenseScalarArray* Runs) {
+
+  release_assert(!M->Dense);
+  if(Runs) {
+    if(Runs->NumKnown)
+      M->Dense = Runs;
+    else
+      Runs->dropReference();
+  }
+
+  ImprovedValSetMulti::MapIt insertit = M->Map.end();
+  for(SmallVector<IVSRange, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend; ++it) {
+
+    uint64_t Val;
+    if(isDenseRun(it->second))
+      continue;
+    else if(canWriteDense(M, it->second, it->first.first, it->first.second - it->first.first, Val))
+      getWritableDense(M)->set(it->first.first / M->Dense->ElemSize, Val);
+    else {
+      insertit.insert(it->first.first, it->first.second, it->second);
+      insertit = M->Map.end();
+    }
+
+  }
+
+}
+
+// Replace M's chain of Underlying maps down to (but not including) Bottom with a single
+// extent list in M. M keeps its identity and its contents, so it may be shared: its other
+// users, and getCommonAncestor's search for M or Bottom, are unaffected.
+static void flattenMultiOver(ImprovedValSetMulti* M, ImprovedValSet* Bottom) {
+
+  SmallVector<IVSRange, 4> Vals;
+  DenseScalarArray* Runs = 0;
+  readValRangeMultiFrom(0, M->AllocSize, M, Vals, Bottom, M->AllocSize, &Runs);
+
+  LFV3(errs() << "Flatten multi " << M << " over " << Bottom << "\n");
+
+  M->Map.clear();
+  releaseDense(M);
+  M->CoveredBytes = 0;
+
+  fillMultiFromExtents(M, Vals, Runs);
+  for(SmallVector<IVSRange, 4>::iterator it = Vals.begin(), itend = Vals.end(); it != itend; ++it)
+    M->CoveredBytes += (it->first.second - it->first.first);
+
+  ImprovedValSet* OldUnderlying = M->Underlying;
+  if(M->CoveredBytes == M->AllocSize)
+    M->Underlying = 0;
+  else
+    M->Underlying = Bottom->getReadableCopy();
+  OldUnderlying->dropReference();
+
+}
+
+// Top has just been stacked on an existing store. Objects written a little at a time in a long
+// loop stack many such overlays, making every read that falls through them slower, so once the
+// chain is deeper than StoreFlattenDepth or its overlays hold more than StoreFlattenExtents
+// extents, flatten its lower half into one map. The upper half, where common ancestors of
+// diverging stores are usually found, is left alone, as is the bottom store (often the object as
+// it stood before the loop, and so likewise shared).
+static void boundStoreChain(ImprovedValSetMulti* Top) {
+
+  // Chain gets the overlays above Bottom, which is either a single or a multi with no Underlying.
+  SmallVector<ImprovedValSetMulti*, 16> Chain;
+  ImprovedValSet* Bottom = Top;
+
+  while(ImprovedValSetMulti* M = dyn_cast<ImprovedValSetMulti>(Bottom)) {
+
+    if(!M->Underlying)
+      break;
+    Chain.push_back(M);
+    Bottom = M->Underlying;
+
+  }
+
+  if(Chain.size() < 3)
+    return;
+
+  // The lowest overlay holds the result of any earlier flattening, so isn't counted: otherwise a
+  // large object would be flattened again every time an overlay was added.
+  uint64_t extents = 0;
+  if(Chain.size() <= StoreFlattenDepth) {
+
+    for(uint32_t i = 0, ilim = Chain.size() - 1; i != ilim && extents <= StoreFlattenExtents; ++i) {
+      for(ImprovedValSetMulti::ConstMapIt it = Chain[i]->Map.begin(), itend = Chain[i]->Map.end();
+	  it != itend && extents <= StoreFlattenExtents; ++it)
+	++extents;
+    }
+
+    if(extents <= StoreFlattenExtents)
+      return;
+
+  }
+
+  flattenMultiOver(Chain[Chain.size() / 2], Bottom);
+
+}
+
 // Get a writable symbolic object for V, to be written at Offset - Offset+Size.
 // willWriteSingleObject permits a shortcut in which we allocate space for a single object instead of an extent-list
 // as needed for structs etc.
@@ -498,13 +844,13 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
 
   if(V.isVal()) {
 
-    if(isa<UndefValue>(V.u.V))
+    if(isa<UndefValue>(V.getVal()))
       return 0;
 
   }
   else if(V.isGV()) {
 
-    if(V.u.GV->G->isConstant())
+    if(V.getGV()->G->isConstant())
       return 0;
 
   }
@@ -594,6 +940,7 @@ LocStore* ShadowBB::getWritableStoreFor(ShadowValue& V, int64_t Offset, uint64_t
 	NewIMap->Underlying = ret->store;
 	// M's refcount remains unchanged, it's just now referenced as a base rather than
 	// being directly used here.
+	boundStoreChain(NewIMap);
       }
       ret->store = NewIMap;
 	
@@ -699,6 +1046,32 @@ Constant* llvm::extractAggregateMemberAt(Constant* FromC, int64_t Offset, Type*
 
 }
 
+// If D's known elements exactly cover [Offset, Offset+Size), spanning more than one, read them
+// as a ConstantDataArray without building a PartialVal.
+static bool readDenseRun(const DenseScalarArray* D, uint64_t Offset, uint64_t Size, ImprovedValSetSingle& Result) {
+
+  if(Offset % D->ElemSize || Size % D->ElemSize || Size <= D->ElemSize)
+    return false;
+
+  uint64_t FirstElem = Offset / D->ElemSize, NumElems = Size / D->ElemSize;
+  if(FirstElem + NumElems > D->NumElems)
+    return false;
+
+  if(FirstElem < D->DirtyStart || FirstElem + NumElems > D->DirtyEnd)
+    return false;
+
+  for(uint64_t idx = FirstElem, idxlim = FirstElem + NumElems; idx != idxlim; ++idx) {
+    if(!D->isKnown(idx))
+      return false;
+  }
+
+  // Known elements are always within D's storage, so the run is contiguous there.
+  StringRef Raw((const char*)D->getRaw(FirstElem), Size);
+  Result = ImprovedValSetSingle(ImprovedVal(ShadowValue(ConstantDataArray::getRaw(Raw, NumElems, D->ElemTy))), ValSetTypeScalar);
+  return true;
+
+}
+
 // Try to read V[Offset:Offset+Size], which has symbolic object 'store', in the context of ReadBB.
 // The result is written to Result, or to ResultPV if it is necessary to build the result bytewise, e.g. because the read type doesn't match the write type
 // or the read is fed by multiple stores.
@@ -711,14 +1084,42 @@ void llvm::readValRangeFrom(ShadowValue& V, uint64_t Offset, uint64_t Size, Shad
   uint64_t IVSSize = ReadBB->getAllocSize(V);
   ImprovedValSetMulti* IVM;
   ImprovedValSetMulti::MapIt it;
+  ImprovedValSetSingle DenseElem;
 
   LFV3(errs() << "Read range " << Offset << "-" << (Offset+Size) << "\n");
 
+  if(!IVS) {
+
+    IVM = cast<ImprovedValSetMulti>(store);
+
+    // Check for a dense element that wholly defines the target value, or a run of them:
+    if(DenseScalarArray* D = IVM->Dense) {
+
+      uint64_t idx = Offset / D->ElemSize;
+      if(D->isKnown(idx) && Offset + Size <= (idx + 1) * D->ElemSize) {
+
+	DenseElem = getDenseElement(D, idx);
+	IVS = &DenseElem;
+	IVSSize = D->ElemSize;
+	Offset -= (idx * D->ElemSize);
+	LFV3(errs() << "Read fully defined by dense element " << idx << "\n");
+
+      }
+      else if((!ResultPV) && readDenseRun(D, Offset, Size, Result)) {
+
+	LFV3(errs() << "Read fully defined by dense elements\n");
+	return;
+
+      }
+
+    }
+
+  }
+
   if(!IVS) {
 
     // Check for a multi-member that wholly defines the target value:
 
-    IVM = cast<ImprovedValSetMulti>(store);
     it = IVM->Map.find(Offset);
 
     if(it != IVM->Map.end() && it.start() <= Offset && it.stop() >= (Offset + Size)) {
@@ -849,6 +1250,33 @@ void llvm::readValRangeFrom(ShadowValue& V, uint64_t Offset, uint64_t Size, Shad
     }
 
   }
+
+  // Dense elements don't overlap the Map, so can be added in any order.
+  if(DenseScalarArray* D = IVM->Dense) {
+
+    uint64_t LastElem = std::min(D->DirtyEnd, (Offset + Size + D->ElemSize - 1) / D->ElemSize);
+    for(uint64_t idx = std::max(D->DirtyStart, Offset / D->ElemSize); idx < LastElem; ++idx) {
+
+      if(!D->isKnown(idx))
+	continue;
+
+      if(!ResultPV)
+	ResultPV = new PartialVal(Size);
+
+      uint64_t ElemStart = idx * D->ElemSize;
+      uint64_t FirstReadByte = std::max(Offset, ElemStart);
+      uint64_t LastReadByte = std::min(Offset + Size, ElemStart + D->ElemSize);
+
+      if(!addIVSToPartialVal(getDenseElement(D, idx), FirstReadByte - ElemStart, FirstReadByte - Offset, LastReadByte - FirstReadByte, ResultPV, error)) {
+	delete ResultPV;
+	ResultPV = 0;
+	Result.setOverdef();
+	return;
+      }
+
+    }
+
+  }
   
   if((!ResultPV) || !ResultPV->isComplete()) {
       
@@ -1040,7 +1468,7 @@ bool ImprovedValSetSingle::coerceToType(Type* Target, uint64_t TargetSize, std::
 
     if(isa<UndefValue>(FromC)) {
 
-      Values[i].V.u.V = UndefValue::get(Target);
+      Values[i].V = ShadowValue(UndefValue::get(Target));
       if(Target->isPointerTy())
 	SetType = ValSetTypePB;
       else
@@ -1121,10 +1549,149 @@ static ImprovedValSetSingle getOverdefFor(ImprovedValSet* IV) {
 
 }
 
+// Might BB's instructions run more than once per run of the specialised program? True within
+// unexpanded loops, shared functions, and anywhere if the root function is not main.
+bool llvm::mayExecuteRepeatedly(ShadowBB* BB) {
+
+  IntegrationAttempt* IA = BB->IA;
+  if(BB->invar->naturalScope != IA->L)
+    return true;
+
+  while(1) {
+
+    InlineAttempt* InA = IA->getFunctionRoot();
+
+    if(InA != IA) {
+
+      // Peeled iteration: fine as long as the loop sits directly within its parent's scope.
+      IntegrationAttempt* Parent = IA->getUniqueParent();
+      if(IA->L->parent != Parent->L)
+	return true;
+      IA = Parent;
+
+    }
+    else {
+
+      if(InA->isShared())
+	return true;
+
+      IntegrationAttempt* Parent = InA->getUniqueParent();
+      if(!Parent)
+	return InA != GlobalIHP->getRoot() || !InA->isRootMainCall();
+
+      if(InA->Callers[0]->parent->invar->naturalScope != Parent->L)
+	return true;
+      IA = Parent;
+
+    }
+
+  }
+
+}
+
+static bool isSnapshotCandidate(const ShadowValue& V, ShadowBB* BB) {
+
+  return V.isPtrIdx() && V.getFrameNo() == -1 && BB->localStore->es.unescapedObjects.count(V);
+
+}
+
+// Something other than a plain constant store is writing to V. If it is a heap object that
+// has not escaped yet, its contents cannot be represented by a global's initialiser.
+static void noteHeapSnapshotClobber(const ShadowValue& V, ShadowBB* BB) {
+
+  if(GlobalIHP->heapSnapshot && isSnapshotCandidate(V, BB))
+    GlobalIHP->heapSnapshotVetoed.insert(V.getHeapKey());
+
+}
+
+// Note a read of the objects in PtrSet that specialised code will still perform. Any constant
+// store recorded after it would already show in the global's initialiser when it runs.
+void llvm::noteHeapSnapshotRead(const ImprovedValSetSingle& PtrSet) {
+
+  if(PtrSet.isWhollyUnknown() || PtrSet.SetType != ValSetTypePB)
+    return;
+
+  for(SmallVector<ImprovedVal, 1>::const_iterator it = PtrSet.Values.begin(), itend = PtrSet.Values.end(); it != itend; ++it) {
+
+    if(!(it->V.isPtrIdx() && it->V.getFrameNo() == -1))
+      continue;
+
+    DenseMap<uint32_t, HeapSnapshotTimes>::iterator findit = GlobalIHP->heapSnapshotTimes.find(it->V.getHeapKey());
+    if(findit != GlobalIHP->heapSnapshotTimes.end() && findit->second.firstResidualRead == ULLONG_MAX)
+      findit->second.firstResidualRead = ++GlobalIHP->heapSnapshotClock;
+
+  }
+
+}
+
+// Calls that are not expanded may read memory through any pointer argument. memcpy and
+// memmove note their source in executeCopyInst, and memset reads nothing.
+void llvm::noteHeapSnapshotCallRead(ShadowInstruction* SI) {
+
+  if(inst_is<MemIntrinsic>(SI))
+    return;
+
+  for(uint32_t i = 0, ilim = SI->getNumArgOperands(); i != ilim; ++i) {
+
+    ImprovedValSetSingle ArgPB;
+    if(getImprovedValSetSingle(SI->getCallArgOperand(i), ArgPB))
+      noteHeapSnapshotRead(ArgPB);
+
+  }
+
+}
+
+// Record the constant stores made to heap objects before they escape, which -llpe-heap-snapshot
+// may fold into a global initialiser. Anything else writing to such an object rules it out,
+// as does a constant store that is not certain to run, since the initialiser would show it on
+// every path.
+static void noteHeapSnapshotWrite(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, ImprovedValSetSingle& ValPB, uint64_t PtrSize, ShadowInstruction* WriteSI) {
+
+  // Writes through unknown pointers cannot affect unescaped objects.
+  if(PtrSet.isWhollyUnknown())
+    return;
+
+  ShadowBB* BB = WriteSI->parent;
+
+  Constant* C = 0;
+  if(Ptr && 
+     isa<StoreInst>(WriteSI->invar->I) &&
+     PtrSet.Values.size() == 1 &&
+     PtrSet.Values[0].Offset != LLONG_MAX &&
+     PtrSet.Values[0].Offset >= 0 &&
+     BB->isMarkedCertain() &&
+     !mayExecuteRepeatedly(BB)) {
+
+    C = getSingleConstant(&ValPB);
+    if(C && (C->getType()->isPointerTy() || GlobalTD->getTypeStoreSize(C->getType()) != PtrSize))
+      C = 0;
+
+  }
+
+  for(SmallVector<ImprovedVal, 1>::iterator it = PtrSet.Values.begin(), itend = PtrSet.Values.end(); it != itend; ++it) {
+
+    if(!isSnapshotCandidate(it->V, BB))
+      continue;
+
+    if(C) {
+      GlobalIHP->heapSnapshotWrites[it->V.getHeapKey()].push_back(std::make_pair((uint64_t)it->Offset, C));
+      GlobalIHP->heapSnapshotWriters.insert(WriteSI);
+      GlobalIHP->heapSnapshotTimes[it->V.getHeapKey()].lastWrite = ++GlobalIHP->heapSnapshotClock;
+    }
+    else {
+      GlobalIHP->heapSnapshotVetoed.insert(it->V.getHeapKey());
+    }
+
+  }
+
+}
+
 void llvm::executeStoreInst(ShadowInstruction* StoreSI) {
 
   // Get written location:
   ShadowBB* StoreBB = StoreSI->parent;
+  if(GlobalIHP->heapSnapshot)
+    GlobalIHP->heapSnapshotWriters.erase(StoreSI);
   ShadowValue Ptr = StoreSI->getOperand(1);
   uint64_t PtrSize = GlobalTD->getTypeStoreSize(StoreSI->invar->I->getOperand(0)->getType());
 
@@ -1413,7 +1980,7 @@ bool llvm::executeCmpXchg(ShadowInstruction* SI, ImprovedValSet*& OldPB, bool& l
 
 uint64_t ShadowValue::getValSize() const {
 
-  switch(t) {
+  switch(getValType()) {
 
   case SHADOWVAL_FDIDX: // int32
     return 4;
@@ -1809,7 +2376,12 @@ void llvm::replaceRangeWithPB(ImprovedValSet* Target, const ImprovedValSetSingle
       Size = M->AllocSize - Offset;
 
     clearRange(M, Offset, Size);
-    M->Map.insert(Offset, Offset + Size, NewVal);
+
+    uint64_t Val;
+    if(canWriteDense(M, NewVal, Offset, Size, Val))
+      getWritableDense(M)->set(Offset / M->Dense->ElemSize, Val);
+    else
+      M->Map.insert(Offset, Offset + Size, NewVal);
 
     M->CoveredBytes += Size;
     if(M->Underlying && M->CoveredBytes == M->AllocSize) {
@@ -1827,6 +2399,9 @@ void llvm::replaceRangeWithPB(ImprovedValSet* Target, const ImprovedValSetSingle
 // M is a symbolic memory object. Clear M[Offset:Offset+Size].
 void llvm::clearRange(ImprovedValSetMulti* M, uint64_t Offset, uint64_t Size) {
 
+  if(M->Dense)
+    forgetDenseRange(M, Offset, Size);
+
   ImprovedValSetMulti::MapIt found = M->Map.find(Offset);
   if(found == M->Map.end())
     return;
@@ -1938,6 +2513,11 @@ void llvm::replaceRangeWithPBs(ImprovedValSet* Target, const SmallVector<IVSRang
     for(unsigned i = 0, iend = NewVals.size(); i != iend; ++i) {
 
       const IVSRange& RangeVal = NewVals[i];
+      uint64_t Val;
+      if(canWriteDense(M, RangeVal.second, RangeVal.first.first, RangeVal.first.second - RangeVal.first.first, Val)) {
+	getWritableDense(M)->set(RangeVal.first.first / M->Dense->ElemSize, Val);
+	continue;
+      }
       it.insert(RangeVal.first.first, RangeVal.first.second, RangeVal.second);
       ++it;
 
@@ -2091,11 +2671,89 @@ bool llvm::canTruncate(const ImprovedValSetSingle& S) {
   
 }
 
+// Read IVM[Offset:Offset+Size], which has no Map entries, into 'Results': known dense elements
+// are used directly and the rest is deferred to IVM->Underlying, or is undefined if there is none.
+// If DenseOut is given, whole known elements are copied into *DenseOut (allocated on first use)
+// and described in Results as dense runs rather than as an extent per element.
+static void readMultiGapFrom(ImprovedValSetMulti* IVM, uint64_t Offset, uint64_t Size, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize, DenseScalarArray** DenseOut) {
+
+  DenseScalarArray* D = IVM->Dense;
+  uint64_t LastByte = Offset + Size;
+
+  while(Offset != LastByte) {
+
+    uint64_t idx = D ? Offset / D->ElemSize : 0;
+    bool inDense = D && idx < D->DirtyEnd;
+
+    if(inDense && D->isKnown(idx)) {
+
+      uint64_t ElemStart = idx * D->ElemSize;
+      uint64_t Stop = std::min(LastByte, ElemStart + D->ElemSize);
+      if(Offset == ElemStart && Stop == ElemStart + D->ElemSize) {
+
+	if(DenseOut && !*DenseOut)
+	  *DenseOut = new DenseScalarArray(D->ElemTy, D->NumElems);
+
+	if(DenseOut && (*DenseOut)->ElemTy == D->ElemTy && idx < (*DenseOut)->NumElems) {
+
+	  (*DenseOut)->setRaw(idx, D->getRaw(idx));
+	  if(!Results.empty() && isDenseRun(Results.back().second) && Results.back().first.second == ElemStart)
+	    Results.back().first.second = Stop;
+	  else
+	    Results.push_back(IVSR(ElemStart, Stop, ImprovedValSetSingle()));
+
+	}
+	else {
+
+	  Results.push_back(IVSR(ElemStart, Stop, getDenseElement(D, idx)));
+
+	}
+
+      }
+      else
+	getIVSSubVals(getDenseElement(D, idx), Offset - ElemStart, Stop - Offset, ElemStart, Results);
+      Offset = Stop;
+      continue;
+
+    }
+
+    // Find the end of this run of unknown elements:
+    uint64_t Stop = LastByte;
+    if(inDense) {
+
+      for(idx = std::max(idx + 1, D->DirtyStart); idx < D->DirtyEnd && idx * D->ElemSize < LastByte && !D->isKnown(idx); ++idx) { }
+      if(idx < D->DirtyEnd)
+	Stop = std::min(LastByte, idx * D->ElemSize);
+
+    }
+
+    if(!IVM->Underlying) {
+
+      // No underlying map means undefined value below.
+      Type* UndefType = IntegerType::get(GInt8Ptr->getContext(), (Stop - Offset) * 8);
+      Value* UD = UndefValue::get(UndefType);
+      Results.push_back(IVSR(Offset, Stop, ImprovedValSetSingle(ImprovedVal(UD), ValSetTypeScalar)));
+
+    }
+    else {
+
+      LFV3(errs() << "Defer to underlying map " << IVM->Underlying << " for range " << Offset << "-" << Stop << "\n");
+      readValRangeMultiFrom(Offset, Stop - Offset, IVM->Underlying, Results, ignoreBelowStore, ASize, DenseOut);
+
+    }
+
+    Offset = Stop;
+
+  }
+
+}
+
 // 'store' is a symbolic memory object.
 // Read store[Offset:Offset+Size] into extent-list 'Results'.
 // ASize is the total size of 'store'. If 'ignoreBelowStore' is set and 'store' is an IVSMulti
 //   (which can be a stack of overlaid extent lists), treat 'ignoreBelowStore' as the bottom of the stack.
-void llvm::readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet* store, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize) {
+// If 'DenseOut' is set, dense elements are collected there as described at readMultiGapFrom.
+void llvm::readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet* store, SmallVector<IVSRange, 4>& Results, ImprovedValSet* ignoreBelowStore, uint64_t ASize, DenseScalarArray** DenseOut) {
 
   if(!store) {
     
@@ -2160,22 +2818,9 @@ void llvm::readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet*
       if(it.start() != Offset) {
 
 	release_assert(it.start() > Offset && "Overlapping-on-left should be caught already");
-	// Gap -- defer this bit to our parent map. If there is none, the value is undefined here.
-
-	if(!IVM->Underlying) {
-
-	  uint64_t UndefSize = it.start() - Offset;
-	  Type* UndefType = IntegerType::get(GInt8Ptr->getContext(), UndefSize * 8);
-	  Value* UD = UndefValue::get(UndefType);
-	  Results.push_back(IVSR(Offset, Offset + UndefSize, ImprovedValSetSingle(ImprovedVal(UD), ValSetTypeScalar)));
-
-	}
-	else {
-
-	  LFV3(errs() << "Defer to underlying map " << IVM->Underlying << " for range " << Offset << "-" << it.start() << "\n");
-	  readValRangeMultiFrom(Offset, it.start() - Offset, IVM->Underlying, Results, ignoreBelowStore, ASize);
+	// Gap -- use dense elements or defer this bit to our parent map.
 
-	}
+	readMultiGapFrom(IVM, Offset, it.start() - Offset, Results, ignoreBelowStore, ASize, DenseOut);
 
 	Size -= (it.start() - Offset);
 	Offset = it.start();
@@ -2208,25 +2853,8 @@ void llvm::readValRangeMultiFrom(uint64_t Offset, uint64_t Size, ImprovedValSet*
     }
 
     // Check for gap on the right:
-    if(Size != 0) {
-
-      if(!IVM->Underlying) {
-
-	// No underlying map means undefined value below.
-	uint64_t UndefSize = Size - Offset;
-	Type* UndefType = IntegerType::get(GInt8Ptr->getContext(), UndefSize * 8);
-	Value* UD = UndefValue::get(UndefType);
-	Results.push_back(IVSR(Offset, Offset + Size, ImprovedValSetSingle(ImprovedVal(UD), ValSetTypeScalar)));	
-	
-      }
-      else {
-
-	LFV3(errs() << "Defer to underlying map " << IVM->Underlying << " for range " << Offset << "-" << (Offset+Size) << " (end path)\n");      
-	readValRangeMultiFrom(Offset, Size, IVM->Underlying, Results, ignoreBelowStore, ASize);
-
-      }
-
-    }
+    if(Size != 0)
+      readMultiGapFrom(IVM, Offset, Size, Results, ignoreBelowStore, ASize, DenseOut);
 
   }
 
@@ -2245,6 +2873,18 @@ void llvm::readValRangeMulti(ShadowValue& V, uint64_t Offset, uint64_t Size, Sha
     
     if(G->G->isConstant()) {
 
+      // Word-sized reads come straight from the image. Anything else keeps the initialiser's
+      // own types (e.g. a struct's members), which a byte array would lose.
+      const uint8_t* Image = getConstImage(G);
+      if(Image && (Size == 1 || Size == 2 || Size == 4 || Size == 8) && Offset + Size <= G->initImageSize) {
+
+	Type* IntTy = Type::getIntNTy(G->G->getContext(), Size * 8);
+	ImprovedValSetSingle IVS(ImprovedVal(getConstImageInt(Image + Offset, Size, IntTy)), ValSetTypeScalar);
+	Results.push_back(IVSR(Offset, Offset + Size, IVS));
+	return;
+
+      }
+
       getConstSubVals(ShadowValue(G->G->getInitializer()), Offset, Size, 0, Results);
       return;
 
@@ -2429,6 +3069,8 @@ static void executeMallocInst2(ShadowInstruction* SI, AllocatorFn& param) {
   SI->parent->IA->noteMalloc(SI);
 
   AllocData& AD = addHeapAlloc(SI);
+  if(GlobalIHP->heapSnapshot)
+    GlobalIHP->heapSnapshotTimes[AD.allocIdx].allocated = ++GlobalIHP->heapSnapshotClock;
   executeAllocInst(SI, AD, allocType, AllocSize ? AllocSize->getLimitedValue() : ULONG_MAX, -1, GlobalIHP->heap.size() - 1);
   
 }
@@ -2440,10 +3082,54 @@ void llvm::executeMallocLikeInst(ShadowInstruction* SI) {
 
 }
 
+// Code we can't see into may free any heap object that has escaped by the time it runs.
+static void vetoEscapedHeapSnapshots(ShadowBB* BB) {
+
+  const ObjectSet& Unescaped = BB->localStore->es.unescapedObjects;
+  for(DenseMap<uint32_t, std::vector<std::pair<uint64_t, Constant*> > >::iterator it = GlobalIHP->heapSnapshotWrites.begin(),
+	itend = GlobalIHP->heapSnapshotWrites.end(); it != itend; ++it) {
+
+    if(!Unescaped.count(ShadowValue::getPtrIdx(-1, it->first)))
+      GlobalIHP->heapSnapshotVetoed.insert(it->first);
+
+  }
+
+}
+
+// Freed or reallocated objects can't be replaced by globals, escaped or not. A pointer we know
+// nothing about may refer to any object that has escaped by now.
+static void noteHeapSnapshotFree(ShadowInstruction* SI, ShadowValue Ptr) {
+
+  if(!GlobalIHP->heapSnapshot)
+    return;
+
+  ImprovedValSetSingle PtrSet;
+  if(getImprovedValSetSingle(Ptr, PtrSet) && !PtrSet.isWhollyUnknown()) {
+
+    if(PtrSet.SetType != ValSetTypePB)
+      return;
+
+    for(SmallVector<ImprovedVal, 1>::iterator it = PtrSet.Values.begin(), itend = PtrSet.Values.end(); it != itend; ++it) {
+
+      if(it->V.isPtrIdx() && it->V.getFrameNo() == -1)
+	GlobalIHP->heapSnapshotVetoed.insert(it->V.getHeapKey());
+
+    }
+
+    return;
+
+  }
+
+  vetoEscapedHeapSnapshots(SI->parent);
+
+}
+
 void llvm::executeFreeInst(ShadowInstruction* SI, Function* FreeF) {
 
   DeallocatorFn& De = GlobalIHP->deallocatorFunctions[FreeF];
 
+  noteHeapSnapshotFree(SI, SI->getCallArgOperand(De.arg));
+
   ShadowInstruction* FreedPtr = SI->getCallArgOperand(De.arg).getInst();
   if(!FreedPtr)
     return;
@@ -2469,6 +3155,8 @@ void llvm::executeReallocInst(ShadowInstruction* SI, Function* F) {
 
   ReallocatorFn& Re = GlobalIHP->reallocatorFunctions[F];
 
+  noteHeapSnapshotFree(SI, SI->getCallArgOperand(Re.ptrArg));
+
   if(!SI->i.PB) {
     
     // Only alloc the first time; always carry out the copy implied by realloc.
@@ -2550,6 +3238,7 @@ static void checkStore(ImprovedValSet* IV, ShadowValue&) { }
 
 void llvm::writeExtents(SmallVector<IVSRange, 4>& copyValues, ShadowValue& Ptr, int64_t Offset, uint64_t Size, ShadowBB* BB) {
 
+  noteHeapSnapshotClobber(Ptr, BB);
   LocStore* Store = BB->getWritableStoreFor(Ptr, Offset, Size, copyValues.size() == 1);
   release_assert(Store && "Non-writable location in writeExtents?");
   replaceRangeWithPBs(Store->store, copyValues, (uint64_t)Offset, Size);
@@ -2566,6 +3255,10 @@ void llvm::executeCopyInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, Impro
 
   GlobalIHP->memcpyValues.erase(CopySI);
 
+  // The residual copy, if it survives, reads its source.
+  if(GlobalIHP->heapSnapshot)
+    noteHeapSnapshotRead(SrcPtrSet);
+
   // No need to check the copy instruction is as expected in any of the coming failure cases.
   CopySI->isThreadLocal = TLS_NEVERCHECK;
 
@@ -2692,6 +3385,7 @@ void llvm::executeVaStartInst(ShadowInstruction* SI) {
   ImprovedValSetSingle StackBase = ImprovedValSetSingle(ImprovedVal(ShadowValue(SI), ImprovedVal::va_baseptr), ValSetTypeVarArg);
   vaStartVals.push_back(IVSR(16, 24, StackBase));
 
+  noteHeapSnapshotClobber(PtrSet.Values[0].V, BB);
   LocStore* Store = BB->getWritableStoreFor(PtrSet.Values[0].V, PtrSet.Values[0].Offset, 24, false);
   release_assert(Store && "Non-writable location in executeVaStartInst?");
   replaceRangeWithPBs(Store->store, vaStartVals, (uint64_t)PtrSet.Values[0].Offset, 24);
@@ -2699,7 +3393,7 @@ void llvm::executeVaStartInst(ShadowInstruction* SI) {
 
 }
 
-void llvm::executeReadInst(ShadowInstruction* ReadSI, std::string& Filename, uint64_t FileOffset, uint64_t Size) {
+void llvm::executeReadInst(ShadowInstruction* ReadSI, const std::string& Filename, uint64_t FileOffset, uint64_t Size) {
 
   LFV3(errs() << "Start read inst\n");
 
@@ -2841,13 +3535,13 @@ static void visitReachableObjects(const ImprovedValSetSingle& Ptr, ShadowBB* BB,
 
     const ShadowValue& ThisPtr = Ptr.Values[i].V;
 
-    switch(ThisPtr.t) {
+    switch(ThisPtr.getValType()) {
     case SHADOWVAL_GV:
-      if(ThisPtr.u.GV->G->isConstant())
+      if(ThisPtr.getGV()->G->isConstant())
 	continue;
       break;
     case SHADOWVAL_OTHER:
-      release_assert(ThisPtr.isNullPointer() || isa<UndefValue>(ThisPtr.u.V) || isFunction(ThisPtr.u.V));
+      release_assert(ThisPtr.isNullPointer() || isa<UndefValue>(ThisPtr.getVal()) || isFunction(ThisPtr.getVal()));
       continue;
     default:
       break;
@@ -3224,7 +3918,7 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
     executeWriteInst(0, OD, OD, MemoryLocation::UnknownSize, SI);
     // Functions that clobber FD state happen to be the same.
     FDStore* FDS = SI->parent->getWritableFDStore();
-    FDS->fds.clear();
+    FDS->clear();
     
   }
     
@@ -3238,16 +3932,18 @@ void llvm::executeUnexpandedCall(ShadowInstruction* SI) {
 
   }
 
+  // ...and it may free them, or anything else that has escaped.
+  if(GlobalIHP->heapSnapshot)
+    vetoEscapedHeapSnapshots(SI->parent);
+
 }
 
 void ShadowBB::setAllObjectsMayAliasOld() {
 
   localStore = localStore->getWritableFrameList();
 
-  DenseSet<ShadowValue>* preservePtr[1] = { &localStore->es.unescapedObjects };
-
-  intersectSets(&localStore->es.noAliasOldObjects,
-		MutableArrayRef<DenseSet<ShadowValue>* >(preservePtr));
+  const ObjectSet* preservePtr[1] = { &localStore->es.unescapedObjects };
+  localStore->es.noAliasOldObjects.intersect(preservePtr);
 
 }
 
@@ -3257,10 +3953,8 @@ void ShadowBB::setAllObjectsThreadGlobal() {
 
   // Preserve unescaped objects from losing their thread-local status.
   
-  DenseSet<ShadowValue>* preservePtr[1] = { &localStore->es.unescapedObjects };
-
-  intersectSets(&localStore->es.threadLocalObjects, 
-		MutableArrayRef<DenseSet<ShadowValue>* >(preservePtr));
+  const ObjectSet* preservePtr[1] = { &localStore->es.unescapedObjects };
+  localStore->es.threadLocalObjects.intersect(preservePtr);
 
 }
 
@@ -3268,11 +3962,14 @@ void ShadowBB::setAllObjectsThreadGlobal() {
 // This is used when e.g. writing through an unknown pointer, but one which is known
 // not to alias objects that predate specialistion, or not to alias unescaped
 // thread-local objects, or...
-void ShadowBB::clobberAllExcept(DenseSet<ShadowValue>& Save, bool verbose) {
+void ShadowBB::clobberAllExcept(const ObjectSet& Save, bool verbose) {
 
   std::vector<std::pair<ShadowValue, ImprovedValSet*> > SaveVals;
 
-  for(DenseSet<ShadowValue>::iterator it = Save.begin(), itend = Save.end(); it != itend; ++it) {
+  SmallVector<ShadowValue, 16> SaveObjects;
+  Save.getObjects(SaveObjects);
+
+  for(SmallVector<ShadowValue, 16>::iterator it = SaveObjects.begin(), itend = SaveObjects.end(); it != itend; ++it) {
 
     LocStore* CurrentVal = getReadableStoreFor(*it);
     if(!CurrentVal)
@@ -3402,7 +4099,7 @@ void IntegrationAttempt::inheritDiagnosticsFrom(IntegrationAttempt* Other) {
 // (compare the case where the loop is unrolled and each iteration considered individually)
 static bool isVagueAllocation(ShadowValue V, ShadowBB* CtxBB) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
 
   case SHADOWVAL_ARG:
   case SHADOWVAL_OTHER:
@@ -3432,6 +4129,9 @@ void llvm::executeWriteInst(ShadowValue* Ptr, ImprovedValSetSingle& PtrSet, Impr
 
   checkIVSNull(ValPB);
 
+  if(GlobalIHP->heapSnapshot)
+    noteHeapSnapshotWrite(Ptr, PtrSet, ValPB, PtrSize, WriteSI);
+
   // Perform the store
 
   if(PtrSet.isWhollyUnknown()) {
@@ -3732,6 +4432,57 @@ static void mergeValues(ImprovedValSetSingle& consumeVal, ImprovedValSetSingle&
 
 }
 
+// Replace the dense run at 'it' in Vals, whose elements are in D, with an extent per element,
+// dropping those that end before From (i.e. have already been merged).
+static void expandDenseRun(SmallVector<IVSRange, 4>& Vals, SmallVector<IVSRange, 4>::iterator& it, SmallVector<IVSRange, 4>::iterator& itend, DenseScalarArray* D, uint64_t From) {
+
+  uint64_t pos = it - Vals.begin();
+  SmallVector<IVSRange, 4> Elems;
+  for(uint64_t idx = std::max(it->first.first, From) / D->ElemSize, idxlim = it->first.second / D->ElemSize; idx != idxlim; ++idx)
+    Elems.push_back(IVSR(idx * D->ElemSize, (idx + 1) * D->ElemSize, getDenseElement(D, idx)));
+
+  Vals.erase(it);
+  Vals.insert(Vals.begin() + pos, Elems.begin(), Elems.end());
+  it = Vals.begin() + pos;
+  itend = Vals.end();
+
+}
+
+// Merge elements [FirstElem, LastElem) of same-typed dense arrays A and B. Elements that agree
+// are copied to *Merged and described in MergedVals as dense runs; the rest get merged values.
+static void mergeDenseElems(DenseScalarArray* A, DenseScalarArray* B, uint64_t FirstElem, uint64_t LastElem, DenseScalarArray** Merged, SmallVector<IVSRange, 4>& MergedVals, OrdinaryMerger* Visitor) {
+
+  if(!*Merged)
+    *Merged = new DenseScalarArray(A->ElemTy, A->NumElems);
+  DenseScalarArray* M = *Merged;
+  uint32_t ES = A->ElemSize;
+
+  for(uint64_t idx = FirstElem; idx != LastElem; ++idx) {
+
+    uint64_t ElemStart = idx * ES;
+
+    if(M->ElemTy == A->ElemTy && idx < M->NumElems && !memcmp(A->getRaw(idx), B->getRaw(idx), ES)) {
+
+      M->setRaw(idx, A->getRaw(idx));
+      if(!MergedVals.empty() && isDenseRun(MergedVals.back().second) && MergedVals.back().first.second == ElemStart)
+	MergedVals.back().first.second = ElemStart + ES;
+      else
+	MergedVals.push_back(IVSR(ElemStart, ElemStart + ES, ImprovedValSetSingle()));
+
+    }
+    else {
+
+      ImprovedValSetSingle AVal = getDenseElement(A, idx);
+      ImprovedValSetSingle BVal = getDenseElement(B, idx);
+      mergeValues(AVal, BVal, Visitor);
+      MergedVals.push_back(IVSR(ElemStart, ElemStart + ES, AVal));
+
+    }
+
+  }
+
+}
+
 // Merge whole block-local stores mergeFrom and mergeTo.
 void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uint64_t ASize, OrdinaryMerger* Visitor) {
 
@@ -3786,9 +4537,10 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
   {
     SmallVector<IVSRange, 4> LHSVals;
     SmallVector<IVSRange, 4> RHSVals;
+    DenseScalarArray *LHSDense = 0, *RHSDense = 0, *MergedDense = 0;
 
-    readValRangeMultiFrom(0, ASize, mergeToStore->store, LHSVals, LHSAncestor, ASize);
-    readValRangeMultiFrom(0, ASize, mergeFromStore->store, RHSVals, RHSAncestor, ASize);
+    readValRangeMultiFrom(0, ASize, mergeToStore->store, LHSVals, LHSAncestor, ASize, &LHSDense);
+    readValRangeMultiFrom(0, ASize, mergeFromStore->store, RHSVals, RHSAncestor, ASize, &RHSDense);
 	  
     SmallVector<IVSRange, 4> MergedVals;
     // Algorithm:
@@ -3796,6 +4548,8 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
     // Where neither ancestor covers, leave blank for deferral.
     // Where only one covers, get that subrange from the common ancestor store.
     // Where granularity of coverage differs, break apart into subvals.
+    // Dense runs are merged element-wise straight from the arrays where the other side (or the
+    // base) has a same-typed dense run too; otherwise they are broken into an extent per element.
 
     SmallVector<IVSRange, 4>::iterator LHSit = LHSVals.begin(), RHSit = RHSVals.begin();
     SmallVector<IVSRange, 4>::iterator LHSitend = LHSVals.end(), RHSitend = RHSVals.end();
@@ -3823,8 +4577,13 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
 
       }
       SmallVector<IVSRange, 4>::iterator& consumeit = *consumeNext;
+      SmallVector<IVSRange, 4>::iterator& consumeend = (consumeNext == &LHSit ? LHSitend : RHSitend);
       SmallVector<IVSRange, 4>::iterator& otherit = (consumeNext == &LHSit ? RHSit : LHSit);
       SmallVector<IVSRange, 4>::iterator& otherend = (consumeNext == &LHSit ? RHSitend : LHSitend);
+      SmallVector<IVSRange, 4>& consumeVals = (consumeNext == &LHSit ? LHSVals : RHSVals);
+      SmallVector<IVSRange, 4>& otherVals = (consumeNext == &LHSit ? RHSVals : LHSVals);
+      DenseScalarArray* consumeDense = (consumeNext == &LHSit ? LHSDense : RHSDense);
+      DenseScalarArray* otherDense = (consumeNext == &LHSit ? RHSDense : LHSDense);
 
       LFV3(errs() << "Consume from " << ((consumeNext == &LHSit) ? "LHS" : "RHS") << " val at " << consumeit->first.first << "-" << consumeit->first.second << "\n");
 
@@ -3865,16 +4624,45 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
 	  
 	SmallVector<IVSRange, 4> baseVals;
 
-	readValRangeMultiFrom(LastOffset, stopAt - LastOffset, LHSAncestor, baseVals, 0, ASize);
+	if(isDenseRun(consumeit->second)) {
+
+	  uint32_t ES = consumeDense->ElemSize;
+	  DenseScalarArray* baseDense = 0;
+	  bool merged = false;
 
-	for(SmallVector<IVSRange, 4>::iterator baseit = baseVals.begin(), baseend = baseVals.end();
-	    baseit != baseend; ++baseit) {
+	  if(!(LastOffset % ES) && !(stopAt % ES)) {
 
-	  ImprovedValSetSingle subVal;
-	  getIVSSubVal(consumeit->second, baseit->first.first - consumeit->first.first, baseit->first.second - baseit->first.first, subVal);
-	  mergeValues(subVal, baseit->second, Visitor);
-	  MergedVals.push_back(IVSR(baseit->first.first, baseit->first.second, subVal));
+	    readValRangeMultiFrom(LastOffset, stopAt - LastOffset, LHSAncestor, baseVals, 0, ASize, &baseDense);
+	    if(baseVals.size() == 1 && isDenseRun(baseVals[0].second) && baseDense->ElemTy == consumeDense->ElemTy) {
+	      mergeDenseElems(consumeDense, baseDense, LastOffset / ES, stopAt / ES, &MergedDense, MergedVals, Visitor);
+	      merged = true;
+	    }
+
+	  }
+
+	  if(baseDense)
+	    baseDense->dropReference();
+
+	  if(!merged) {
+	    expandDenseRun(consumeVals, consumeit, consumeend, consumeDense, LastOffset);
+	    continue;
+	  }
+
+	}
+	else {
+
+	  readValRangeMultiFrom(LastOffset, stopAt - LastOffset, LHSAncestor, baseVals, 0, ASize);
+
+	  for(SmallVector<IVSRange, 4>::iterator baseit = baseVals.begin(), baseend = baseVals.end();
+	      baseit != baseend; ++baseit) {
+
+	    ImprovedValSetSingle subVal;
+	    getIVSSubVal(consumeit->second, baseit->first.first - consumeit->first.first, baseit->first.second - baseit->first.first, subVal);
+	    mergeValues(subVal, baseit->second, Visitor);
+	    MergedVals.push_back(IVSR(baseit->first.first, baseit->first.second, subVal));
 		    
+	  }
+
 	}
 
 	LastOffset = stopAt;
@@ -3887,6 +4675,32 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
 	LFV3(errs() << "Merge two vals " << LastOffset << "-" << consumeit->first.second << "\n");
 
 	// Both entries are defined here, case (c), so consumeit finishes equal or sooner.
+	if(isDenseRun(consumeit->second) || isDenseRun(otherit->second)) {
+
+	  if(isDenseRun(consumeit->second) && isDenseRun(otherit->second) &&
+	     consumeDense->ElemTy == otherDense->ElemTy && !(LastOffset % consumeDense->ElemSize)) {
+
+	    uint64_t Stop = consumeit->first.second;
+	    mergeDenseElems(consumeDense, otherDense, LastOffset / consumeDense->ElemSize, Stop / consumeDense->ElemSize, &MergedDense, MergedVals, Visitor);
+	    LastOffset = Stop;
+	    if(Stop == otherit->first.second)
+	      ++otherit;
+	    ++consumeit;
+
+	  }
+	  else {
+
+	    if(isDenseRun(consumeit->second))
+	      expandDenseRun(consumeVals, consumeit, consumeend, consumeDense, LastOffset);
+	    if(isDenseRun(otherit->second))
+	      expandDenseRun(otherVals, otherit, otherend, otherDense, LastOffset);
+
+	  }
+
+	  continue;
+
+	}
+
 	ImprovedValSetSingle consumeVal;
 	getIVSSubVal(consumeit->second, LastOffset - consumeit->first.first, consumeit->first.second - LastOffset, consumeVal);
 		
@@ -3942,6 +4756,7 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
       ImprovedValSetMulti* M = cast<ImprovedValSetMulti>(mergeToStore->store);
       LFV3(errs() << "Using existing writable multi " << M << "\n");
       M->Map.clear();
+      releaseDense(M);
       if(M->Underlying)
 	M->Underlying->dropReference();
       newStore = M;
@@ -3953,15 +4768,12 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
     }	
 
     newStore->Underlying = newUnderlying;
+    fillMultiFromExtents(newStore, MergedVals, MergedDense);
 
-    ImprovedValSetMulti::MapIt insertit = newStore->Map.end();
-    for(SmallVector<IVSRange, 4>::iterator finalit = MergedVals.begin(), finalitend = MergedVals.end();
-	finalit != finalitend; ++finalit) {
-
-      insertit.insert(finalit->first.first, finalit->first.second, finalit->second);
-      insertit = newStore->Map.end();
-	
-    }
+    if(LHSDense)
+      LHSDense->dropReference();
+    if(RHSDense)
+      RHSDense->dropReference();
 
     LFV3(errs() << "Merge result:\n");
     LFV3(newStore->print(errs()));
@@ -3972,6 +4784,50 @@ void LocStore::mergeStores(LocStore* mergeFromStore, LocStore* mergeToStore, uin
 
 }
 
+// Write D's known elements over M a run at a time, copying them to M's own dense array where
+// it can take them.
+static void writeDenseElems(ImprovedValSetMulti* M, DenseScalarArray* D) {
+
+  for(uint64_t idx = D->DirtyStart; idx < D->DirtyEnd;) {
+
+    if(!D->isKnown(idx)) {
+      ++idx;
+      continue;
+    }
+
+    uint64_t RunEnd = idx + 1;
+    while(RunEnd < D->DirtyEnd && D->isKnown(RunEnd))
+      ++RunEnd;
+
+    uint64_t Offset = idx * D->ElemSize, Size = (RunEnd - idx) * D->ElemSize;
+    if(Offset + Size > M->AllocSize)
+      M->AllocSize = Offset + Size;
+
+    clearRange(M, Offset, Size);
+
+    for(; idx != RunEnd; ++idx) {
+
+      if(canWriteDenseElem(M, D->ElemTy, idx * D->ElemSize))
+	getWritableDense(M)->setRaw(idx, D->getRaw(idx));
+      else
+	M->Map.insert(idx * D->ElemSize, (idx + 1) * D->ElemSize, getDenseElement(D, idx));
+
+    }
+
+    M->CoveredBytes += Size;
+
+  }
+
+  if(M->Underlying && M->CoveredBytes == M->AllocSize) {
+
+    // M now defines the whole object: drop the underlying object as it never shows through.
+    M->Underlying->dropReference();
+    M->Underlying = 0;
+
+  }
+
+}
+
 // If store merging has left a common base store with only single reference, merge down.
 void LocStore::simplifyStore(LocStore* LS) {
 
@@ -3996,6 +4852,9 @@ void LocStore::simplifyStore(LocStore* LS) {
 	  
     }
 
+    if(IVM->Dense)
+      writeDenseElems(IVM2, IVM->Dense);
+
     // IVM2 becomes the new head.
     LS->store = IVM2;
     delete IVM;
@@ -4009,94 +4868,28 @@ void LocStore::simplifyStore(LocStore* LS) {
 
 }
 
-static bool sizeLT(const DenseSet<ShadowValue>* a, const DenseSet<ShadowValue>* b) {
-
-  return a->size() < b->size();
-
-}
-
-// mergeBegin -> mergeEnd are already listed smallest set first.
-void llvm::intersectSets(DenseSet<ShadowValue>* Target, MutableArrayRef<DenseSet<ShadowValue>* > Merge) {
-
-  SmallVector<ShadowValue, 8> toKeep;
-
-  MutableArrayRef<DenseSet<ShadowValue>* >::iterator mergeBegin = Merge.begin(), mergeEnd = Merge.end();
-  std::sort(mergeBegin, mergeEnd, sizeLT);
-
-  if(Target->size() < (*mergeBegin)->size()) {
-
-    for(DenseSet<ShadowValue>::iterator it = Target->begin(), itend = Target->end(); it != itend; ++it) {
-
-      bool keepThis = true;
-      for(MutableArrayRef<DenseSet<ShadowValue>* >::iterator findit = mergeBegin; findit != mergeEnd && keepThis; ++findit) {
-
-	if(!(*findit)->count(*it))
-	  keepThis = false;
-
-      }
-
-      if(keepThis)
-	toKeep.push_back(*it);
-
-    }
-
-  }
-  else {
-
-    MutableArrayRef<DenseSet<ShadowValue>* >::iterator othersBegin = mergeBegin;
-    ++othersBegin;
-
-    for(DenseSet<ShadowValue>::iterator it = (*mergeBegin)->begin(), 
-	  itend = (*mergeBegin)->end(); it != itend; ++it) {
-
-      bool keepThis = Target->count(*it);
-      for(MutableArrayRef<DenseSet<ShadowValue>* >::iterator findit = othersBegin; findit != mergeEnd && keepThis; ++findit) {
-
-	if(!(*findit)->count(*it))
-	  keepThis = false;
-
-      }
-
-      if(keepThis)
-	toKeep.push_back(*it);
-      
-    }
-    
-  }
-
-  Target->clear();
-  Target->insert(toKeep.begin(), toKeep.end());
-
-}
-
 // Debug dump functions:
 
-static void dumpSets(OrdinaryLocalStore* Map) {
+static void dumpSet(const char* Name, const ObjectSet& Set) {
 
-  errs() << "Not-old:\n";
-  for(DenseSet<ShadowValue>::iterator it = Map->es.noAliasOldObjects.begin(), itend = Map->es.noAliasOldObjects.end(); it != itend; ++it) {
+  errs() << Name << ":\n";
+
+  SmallVector<ShadowValue, 16> Objects;
+  Set.getObjects(Objects);
+  for(SmallVector<ShadowValue, 16>::iterator it = Objects.begin(), itend = Objects.end(); it != itend; ++it) {
 
     errs() << itcache(*it) << "\n";
     
   }
   errs() << "\n\n";
 
-  errs() << "Thread-local:\n";
-  for(DenseSet<ShadowValue>::iterator it = Map->es.threadLocalObjects.begin(), itend = Map->es.threadLocalObjects.end(); it != itend; ++it) {
-
-    errs() << itcache(*it) << "\n";
-
-  }
-  errs() << "\n\n";
+}
 
+static void dumpSets(OrdinaryLocalStore* Map) {
 
-  errs() << "Unescaped:\n";
-  for(DenseSet<ShadowValue>::iterator it = Map->es.unescapedObjects.begin(), itend = Map->es.unescapedObjects.end(); it != itend; ++it) {
-	
-    errs() << itcache(*it) << "\n";
-	
-  }
-  errs() << "\n\n";
+  dumpSet("Not-old", Map->es.noAliasOldObjects);
+  dumpSet("Thread-local", Map->es.threadLocalObjects);
+  dumpSet("Unescaped", Map->es.unescapedObjects);
 
 }
 
@@ -4117,32 +4910,33 @@ void OrdinaryStoreExtraState::doMerge(OrdinaryLocalStore* toMap,
   
   // All flag sets should be big-intersected.
   
+  // The sets are persistent, so predecessors that share their ancestors' sets
+  // cost only as much as the objects whose flags differ.
+  
   {
 
-    SmallVector<DenseSet<ShadowValue>*, 4> NAOSets;
+    SmallVector<const ObjectSet*, 4> NAOSets;
     for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it)
       NAOSets.push_back(&(*it)->es.noAliasOldObjects);
-    intersectSets(&toMap->es.noAliasOldObjects, NAOSets);
+    toMap->es.noAliasOldObjects.intersect(NAOSets);
 
   }
 
   {
 
-    SmallVector<DenseSet<ShadowValue>*, 4> TLSets;
+    SmallVector<const ObjectSet*, 4> TLSets;
     for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it)
       TLSets.push_back(&(*it)->es.threadLocalObjects);
-    intersectSets(&toMap->es.threadLocalObjects, TLSets);
-
-
+    toMap->es.threadLocalObjects.intersect(TLSets);
 
   }
 
   {
 
-    SmallVector<DenseSet<ShadowValue>*, 4> EscSets;
+    SmallVector<const ObjectSet*, 4> EscSets;
     for(SmallVector<OrdinaryLocalStore*, 4>::iterator it = fromBegin; it != fromEnd; ++it)
       EscSets.push_back(&(*it)->es.unescapedObjects);
-    intersectSets(&toMap->es.unescapedObjects, EscSets);
+    toMap->es.unescapedObjects.intersect(EscSets);
 
   }
 
@@ -4200,14 +4994,10 @@ void PeelIteration::popAllocas(OrdinaryLocalStore*) { }
 
 void InlineAttempt::popAllocas(OrdinaryLocalStore* map) {
 
-  for(uint32_t i = 0, ilim = localAllocas.size(); i != ilim; ++i) {
-
-    ShadowValue SV = ShadowValue::getPtrIdx(stack_depth, i);
-    map->es.unescapedObjects.erase(SV);
-    map->es.noAliasOldObjects.erase(SV);
-    map->es.threadLocalObjects.erase(SV);
-
-  }
+  // Every object in this frame's slot is one of our allocas.
+  map->es.unescapedObjects.clearFrame(stack_depth);
+  map->es.noAliasOldObjects.clearFrame(stack_depth);
+  map->es.threadLocalObjects.clearFrame(stack_depth);
  
 }
 
@@ -4267,10 +5057,10 @@ bool PeelIteration::ctxContains(IntegrationAttempt* IA) {
 AllocData* ShadowValue::getAllocData(OrdinaryLocalStore* Map) const {
 
   release_assert(isPtrIdx());
-  if(u.PtrOrFd.frame == -1)
-    return &GlobalIHP->heap[u.PtrOrFd.idx];
+  if(getPtrOrFdFrame() == -1)
+    return &GlobalIHP->heap[getPtrOrFdIdx()];
   else
-    return &Map->frames[u.PtrOrFd.frame]->IA->localAllocas[u.PtrOrFd.idx];
+    return &Map->frames[getPtrOrFdFrame()]->IA->localAllocas[getPtrOrFdIdx()];
 
 }
 
@@ -4278,10 +5068,10 @@ AllocData* IntegrationAttempt::getAllocData(ShadowValue V) {
 
   release_assert(V.isPtrIdx());
   
-  if(V.u.PtrOrFd.frame == -1)
-    return &GlobalIHP->heap[V.u.PtrOrFd.idx];
+  if(V.getPtrOrFdFrame() == -1)
+    return &GlobalIHP->heap[V.getPtrOrFdIdx()];
   else
-    return &getFunctionRoot()->getStackFrameCtx(V.u.PtrOrFd.frame)->localAllocas[V.u.PtrOrFd.idx];
+    return &getFunctionRoot()->getStackFrameCtx(V.getPtrOrFdFrame())->localAllocas[V.getPtrOrFdIdx()];
 
 }
 
@@ -4289,7 +5079,7 @@ ShadowInstruction* IntegrationAttempt::getAllocInst(ShadowValue V) {
 
   AllocData* AD = getAllocData(V);
   release_assert(!AD->isCommitted);
-  return AD->allocValue.u.I;
+  return AD->allocValue.getInst();
 
 }
 
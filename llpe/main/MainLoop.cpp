@@ -76,8 +76,14 @@ bool InlineAttempt::analyseWithArgs(ShadowInstruction* SI, bool inLoopAnalyser,
 bool InlineAttempt::analyseNoArgs(bool inLoopAnalyser, bool inAnyLoop, uint32_t parent_stack_depth) {
 
   uint32_t new_stack_depth = (invarInfo->frameSize == -1) ? parent_stack_depth : parent_stack_depth + 1;
+  if(pass->heapSnapshot && !heapSnapshotEntry)
+    heapSnapshotEntry = ++pass->heapSnapshotClock;
+
   bool ret = analyse(inLoopAnalyser, inAnyLoop, new_stack_depth);
 
+  if(pass->heapSnapshot)
+    heapSnapshotExit = ++pass->heapSnapshotClock;
+
   returnValue = 0;
 
   if(!F.getFunctionType()->getReturnType()->isVoidTy()) {
@@ -718,6 +724,9 @@ bool IntegrationAttempt::analyseInstruction(ShadowInstruction* SI, bool inLoopAn
       }
       else {
 
+	if(pass->heapSnapshot)
+	  noteHeapSnapshotCallRead(SI);
+
 	// For special calls like malloc this might define a return value;
 	// for others it is responsible for placing an Overdef return.
 	executeUnexpandedCall(SI);
@@ -1010,6 +1019,10 @@ void InlineAttempt::executeCall(uint32_t parent_stack_depth) {
   uint32_t new_stack_depth = (invarInfo->frameSize == -1) ? parent_stack_depth : parent_stack_depth + 1;
   execute(new_stack_depth);
 
+  // A shared context's span covers all of its calls.
+  if(pass->heapSnapshot)
+    heapSnapshotExit = ++pass->heapSnapshotClock;
+
 }
 
 // Similarly, execute but do not re-analyse a loop.
@@ -31,7 +31,8 @@ static bool isHeapPointer(ShadowValue V) {
 
 }
 
-// Count stats for this function or loop context.
+// Count stats for this function or loop context. Child contexts are counted separately
+// by InlineAttempt::prepareCommitTree.
 void IntegrationAttempt::preCommitStats(bool enabledHere) {
 
   if(isCommitted())
@@ -149,26 +150,6 @@ void IntegrationAttempt::preCommitStats(bool enabledHere) {
 
   }
 
-  // Accumulate stats for our child calls:
-  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
-    
-    it->second->preCommitStats(enabledHere && it->second->isEnabled());
-
-  }
-
-  // Accumulate stats for our child loops:
-  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
-	itend = peelChildren.end(); it != itend; ++it) {
-
-    bool enabled = enabledHere && it->second->isTerminated() && it->second->isEnabled();
-
-    // If the loop wasn't known-terminated we would have analysed and committed a general
-    // iteration, which is part of this context not a child.
-    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
-      it->second->Iterations[i]->preCommitStats(enabled);
-
-  }
-
 }
 
 // Count how many instructions we ended up actually emitting, including
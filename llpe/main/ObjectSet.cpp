@@ -0,0 +1,435 @@
+//===-- ObjectSet.cpp -----------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// This file implements the persistent allocation sets declared in ObjectSet.h.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
+
+using namespace llvm;
+
+static uint32_t getRequiredObjSetHeight(uint32_t idx) {
+
+  uint32_t height = 1;
+  idx >>= OBJSETLEAFLOG2;
+
+  while(idx) {
+    idx >>= OBJSETORDERLOG2;
+    ++height;
+  }
+
+  return height;
+
+}
+
+// Get the child (or for a leaf, word) of a node at height that covers idx.
+static uint32_t getObjSetSlot(uint32_t idx, uint32_t height) {
+
+  if(height == 1)
+    return (idx >> 6) & (OBJSETORDER - 1);
+  else
+    return (idx >> (OBJSETLEAFLOG2 + ((height - 2) * OBJSETORDERLOG2))) & (OBJSETORDER - 1);
+
+}
+
+static void dropObjSetNode(ObjectSetNode* node, uint32_t height) {
+
+  if(--node->refCount)
+    return;
+
+  if(height > 1) {
+    for(uint32_t i = 0; i < OBJSETORDER; ++i) {
+      if(node->children[i])
+	dropObjSetNode(node->children[i], height - 1);
+    }
+  }
+
+  delete node;
+
+}
+
+static ObjectSetNode* getWritableObjSetNode(ObjectSetNode* node, uint32_t height) {
+
+  if(node->refCount == 1)
+    return node;
+
+  // COW break this node, sharing its children.
+  ObjectSetNode* newNode = new ObjectSetNode();
+
+  if(height == 1) {
+    memcpy(newNode->bits, node->bits, sizeof(newNode->bits));
+  }
+  else {
+
+    for(uint32_t i = 0; i < OBJSETORDER; ++i) {
+      if(node->children[i]) {
+	node->children[i]->refCount++;
+	newNode->children[i] = node->children[i];
+      }
+    }
+
+  }
+
+  --node->refCount;
+  return newNode;
+
+}
+
+bool ObjectSetTree::count(uint32_t idx) const {
+
+  if(!root || getRequiredObjSetHeight(idx) > height)
+    return false;
+
+  ObjectSetNode* node = root;
+  for(uint32_t h = height; h > 1; --h) {
+    node = node->children[getObjSetSlot(idx, h)];
+    if(!node)
+      return false;
+  }
+
+  return !!(node->bits[getObjSetSlot(idx, 1)] & (1ULL << (idx & 63)));
+
+}
+
+void ObjectSetTree::insert(uint32_t idx) {
+
+  uint32_t newHeight = getRequiredObjSetHeight(idx);
+
+  if(!root) {
+
+    root = new ObjectSetNode();
+    height = newHeight;
+
+  }
+  else if(height < newHeight) {
+
+    // The new root nodes take over our reference to the old root.
+    for(; height < newHeight; ++height) {
+      ObjectSetNode* newRoot = new ObjectSetNode();
+      newRoot->children[0] = root;
+      root = newRoot;
+    }
+
+  }
+  else {
+
+    root = getWritableObjSetNode(root, height);
+
+  }
+
+  ObjectSetNode* node = root;
+  for(uint32_t h = height; h > 1; --h) {
+
+    ObjectSetNode*& child = node->children[getObjSetSlot(idx, h)];
+    if(!child)
+      child = new ObjectSetNode();
+    else
+      child = getWritableObjSetNode(child, h - 1);
+    node = child;
+
+  }
+
+  node->bits[getObjSetSlot(idx, 1)] |= (1ULL << (idx & 63));
+
+}
+
+void ObjectSetTree::erase(uint32_t idx) {
+
+  if(!count(idx))
+    return;
+
+  root = getWritableObjSetNode(root, height);
+
+  ObjectSetNode* node = root;
+  for(uint32_t h = height; h > 1; --h) {
+    ObjectSetNode*& child = node->children[getObjSetSlot(idx, h)];
+    child = getWritableObjSetNode(child, h - 1);
+    node = child;
+  }
+
+  node->bits[getObjSetSlot(idx, 1)] &= ~(1ULL << (idx & 63));
+
+}
+
+void ObjectSetTree::clear() {
+
+  if(root)
+    dropObjSetNode(root, height);
+  root = 0;
+  height = 0;
+
+}
+
+// Intersect node with others, all of the same height. A null other is the empty set.
+// Subtrees shared with every other are skipped, so the cost is proportional to the
+// parts of the trees that differ.
+static void intersectObjSetNode(ObjectSetNode*& node, SmallVector<ObjectSetNode*, 4>& others, uint32_t height) {
+
+  SmallVector<ObjectSetNode*, 4> differing;
+
+  for(SmallVector<ObjectSetNode*, 4>::iterator it = others.begin(), itend = others.end(); it != itend; ++it) {
+
+    if(!*it) {
+      dropObjSetNode(node, height);
+      node = 0;
+      return;
+    }
+
+    if(*it != node)
+      differing.push_back(*it);
+
+  }
+
+  if(differing.empty())
+    return;
+
+  std::sort(differing.begin(), differing.end());
+  differing.erase(std::unique(differing.begin(), differing.end()), differing.end());
+
+  node = getWritableObjSetNode(node, height);
+  bool empty = true;
+
+  if(height == 1) {
+
+    for(uint32_t i = 0; i < OBJSETORDER; ++i) {
+      for(SmallVector<ObjectSetNode*, 4>::iterator it = differing.begin(), itend = differing.end(); it != itend; ++it)
+	node->bits[i] &= (*it)->bits[i];
+      if(node->bits[i])
+	empty = false;
+    }
+
+  }
+  else {
+
+    for(uint32_t i = 0; i < OBJSETORDER; ++i) {
+
+      if(!node->children[i])
+	continue;
+
+      SmallVector<ObjectSetNode*, 4> otherChildren;
+      for(SmallVector<ObjectSetNode*, 4>::iterator it = differing.begin(), itend = differing.end(); it != itend; ++it)
+	otherChildren.push_back((*it)->children[i]);
+
+      intersectObjSetNode(node->children[i], otherChildren, height - 1);
+      if(node->children[i])
+	empty = false;
+
+    }
+
+  }
+
+  if(empty) {
+    dropObjSetNode(node, height);
+    node = 0;
+  }
+
+}
+
+void ObjectSetTree::intersect(SmallVector<const ObjectSetTree*, 4>& others) {
+
+  if(!root)
+    return;
+
+  uint32_t minHeight = height;
+  for(SmallVector<const ObjectSetTree*, 4>::iterator it = others.begin(), itend = others.end(); it != itend; ++it) {
+
+    if(!(*it)->root) {
+      clear();
+      return;
+    }
+
+    minHeight = std::min(minHeight, (*it)->height);
+
+  }
+
+  // Indices beyond the range of a shorter tree can't survive, so cut this tree down to
+  // its lowest-indexed subtree of that height.
+  while(height > minHeight) {
+
+    ObjectSetNode* child = root->children[0];
+    if(child)
+      child->refCount++;
+    dropObjSetNode(root, height);
+    root = child;
+    --height;
+
+    if(!root) {
+      height = 0;
+      return;
+    }
+
+  }
+
+  SmallVector<ObjectSetNode*, 4> otherNodes;
+  for(SmallVector<const ObjectSetTree*, 4>::iterator it = others.begin(), itend = others.end(); it != itend; ++it) {
+
+    ObjectSetNode* node = (*it)->root;
+    for(uint32_t h = (*it)->height; h > minHeight && node; --h)
+      node = node->children[0];
+    otherNodes.push_back(node);
+
+  }
+
+  intersectObjSetNode(root, otherNodes, height);
+  if(!root)
+    height = 0;
+
+}
+
+static void getObjSetIndices(ObjectSetNode* node, uint32_t height, uint32_t base, SmallVectorImpl<uint32_t>& out) {
+
+  if(height == 1) {
+
+    for(uint32_t i = 0; i < OBJSETORDER; ++i) {
+      for(uint64_t word = node->bits[i]; word; word &= (word - 1))
+	out.push_back(base + (i * 64) + countTrailingZeros(word));
+    }
+
+  }
+  else {
+
+    uint32_t shift = OBJSETLEAFLOG2 + ((height - 2) * OBJSETORDERLOG2);
+    for(uint32_t i = 0; i < OBJSETORDER; ++i) {
+      if(node->children[i])
+	getObjSetIndices(node->children[i], height - 1, base + (i << shift), out);
+    }
+
+  }
+
+}
+
+void ObjectSetTree::getIndices(SmallVectorImpl<uint32_t>& out) const {
+
+  if(root)
+    getObjSetIndices(root, height, 0, out);
+
+}
+
+void ObjectSet::retainAll() {
+
+  for(SmallVector<ObjectSetTree, 4>::iterator it = trees.begin(), itend = trees.end(); it != itend; ++it) {
+    if(it->root)
+      it->root->refCount++;
+  }
+
+}
+
+void ObjectSet::releaseAll() {
+
+  for(SmallVector<ObjectSetTree, 4>::iterator it = trees.begin(), itend = trees.end(); it != itend; ++it)
+    it->clear();
+
+}
+
+ObjectSet& ObjectSet::operator=(const ObjectSet& other) {
+
+  if(this == &other)
+    return *this;
+
+  releaseAll();
+  trees = other.trees;
+  retainAll();
+  return *this;
+
+}
+
+bool ObjectSet::count(const ShadowValue& V) const {
+
+  if(!V.isPtrIdx())
+    return false;
+
+  uint32_t slot = V.getPtrOrFdFrame() + 1;
+  if(slot >= trees.size())
+    return false;
+
+  return trees[slot].count(V.getPtrOrFdIdx());
+
+}
+
+void ObjectSet::insert(const ShadowValue& V) {
+
+  release_assert(V.isPtrIdx() && "Object set entries must be allocations");
+
+  uint32_t slot = V.getPtrOrFdFrame() + 1;
+  if(slot >= trees.size())
+    trees.resize(slot + 1);
+
+  trees[slot].insert(V.getPtrOrFdIdx());
+
+}
+
+void ObjectSet::erase(const ShadowValue& V) {
+
+  if(!V.isPtrIdx())
+    return;
+
+  uint32_t slot = V.getPtrOrFdFrame() + 1;
+  if(slot < trees.size())
+    trees[slot].erase(V.getPtrOrFdIdx());
+
+}
+
+void ObjectSet::clearFrame(int32_t frame) {
+
+  uint32_t slot = frame + 1;
+  if(slot >= trees.size())
+    return;
+
+  trees[slot].clear();
+  while(!trees.empty() && !trees.back().root)
+    trees.pop_back();
+
+}
+
+void ObjectSet::intersect(ArrayRef<const ObjectSet*> others) {
+
+  for(uint32_t i = 0, ilim = trees.size(); i != ilim; ++i) {
+
+    if(!trees[i].root)
+      continue;
+
+    SmallVector<const ObjectSetTree*, 4> otherTrees;
+    bool missing = false;
+
+    for(ArrayRef<const ObjectSet*>::iterator it = others.begin(), itend = others.end(); it != itend && !missing; ++it) {
+
+      if(i >= (*it)->trees.size())
+	missing = true;
+      else
+	otherTrees.push_back(&(*it)->trees[i]);
+
+    }
+
+    if(missing)
+      trees[i].clear();
+    else
+      trees[i].intersect(otherTrees);
+
+  }
+
+  while(!trees.empty() && !trees.back().root)
+    trees.pop_back();
+
+}
+
+void ObjectSet::getObjects(SmallVectorImpl<ShadowValue>& out) const {
+
+  for(uint32_t i = 0, ilim = trees.size(); i != ilim; ++i) {
+
+    SmallVector<uint32_t, 16> indices;
+    trees[i].getIndices(indices);
+    for(SmallVector<uint32_t, 16>::iterator it = indices.begin(), itend = indices.end(); it != itend; ++it)
+      out.push_back(ShadowValue::getPtrIdx(((int32_t)i) - 1, *it));
+
+  }
+
+}
@@ -11,7 +11,12 @@
 
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Analysis/LLPECopyPaste.h"
 
+#include "llvm/Transforms/Utils/FunctionComparator.h"
 #include "llvm/Transforms/Utils/Local.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/CommandLine.h"
@@ -19,6 +24,10 @@
 using namespace llvm;
 
 static cl::opt<bool> SkipPostCommit("int-skip-post-commit");
+static cl::opt<bool> SkipMergeCommitFunctions("llpe-skip-merge-functions");
+
+// Rough machine code size of one IR instruction, for reporting the effect of merging.
+const uint64_t estimatedBytesPerInstruction = 4;
 
 // These optimisations fold a committed residual-code function into a neater form.
 // We do this as we go because in certain cases it can dramatically reduce the amount
@@ -293,3 +302,239 @@ void InlineAttempt::postCommitOptimise() {
   }
    
 }
+
+// Does F contain a committed allocation or FD creation? AllocData and FDGlobalState keep raw
+// pointers to these, and each stands for a distinct object even if the code around it matches.
+static bool holdsCommittedObject(Function* F, const DenseMap<Value*, uint32_t>& HeapAllocs, const DenseMap<Value*, uint32_t>& FDs) {
+
+  for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI) {
+
+    for(BasicBlock::iterator II = FI->begin(), IE = FI->end(); II != IE; ++II) {
+
+      if(HeapAllocs.count(&*II) || FDs.count(&*II))
+	return true;
+
+    }
+
+  }
+
+  return false;
+
+}
+
+// Committing the same callee in several contexts often yields identical residual functions, once
+// all the differences between the contexts have been specialised away. Find these by structural
+// hash, confirm with FunctionComparator and redirect users of each duplicate to the first copy.
+// Repeat until nothing changes, as merging callees can make their callers identical too.
+// Functions that allocate a heap object or open an FD are never merged away.
+
+void LLPEAnalysisPass::mergeIdenticalCommitFunctions() {
+
+  if(SkipMergeCommitFunctions)
+    return;
+
+  bool changed = true;
+  while(changed) {
+
+    changed = false;
+
+    GlobalNumberState GN;
+    DenseMap<FunctionComparator::FunctionHash, SmallVector<Function*, 2> > Buckets;
+    SmallVector<Function*, 4> Kept;
+
+    for(SmallVector<Function*, 4>::iterator it = commitFunctions.begin(),
+	  itend = commitFunctions.end(); it != itend; ++it) {
+
+      Function* F = *it;
+      if(F->isDeclaration()) {
+	Kept.push_back(F);
+	continue;
+      }
+
+      SmallVector<Function*, 2>& Candidates = Buckets[FunctionComparator::functionHash(*F)];
+
+      // The root's residual function is about to take over the original's name, and anything
+      // externally visible might be compared by address, so these can be kept but not replaced.
+      Function* Canonical = 0;
+      if(F != RootIA->CommitF && F->hasLocalLinkage() && !holdsCommittedObject(F, committedHeapAllocations, committedFDs)) {
+
+	for(SmallVector<Function*, 2>::iterator candit = Candidates.begin(),
+	      candend = Candidates.end(); candit != candend && !Canonical; ++candit) {
+
+	  if(FunctionComparator(F, *candit, &GN).compare() == 0)
+	    Canonical = *candit;
+
+	}
+
+      }
+
+      if(!Canonical) {
+	Candidates.push_back(F);
+	Kept.push_back(F);
+	continue;
+      }
+
+      uint32_t instCount = 0;
+      for(Function::iterator FI = F->begin(), FE = F->end(); FI != FE; ++FI)
+	instCount += FI->size();
+
+      ++stats.mergedFunctions;
+      stats.mergedInstructions += instCount;
+      stats.mergedBytesEstimate += instCount * estimatedBytesPerInstruction;
+
+      F->replaceAllUsesWith(Canonical);
+      F->eraseFromParent();
+      changed = true;
+
+    }
+
+    commitFunctions = Kept;
+
+  }
+
+}
+
+// Note that unspecialised code may run (because a check fails or a context is not committed)
+// at some point of the analysis order between From and To.
+void LLPEAnalysisPass::noteHeapSnapshotUnspecialised(uint64_t From, uint64_t To) {
+
+  if((!heapSnapshotUnspecialised.empty()) && heapSnapshotUnspecialised.back().first == From) {
+    heapSnapshotUnspecialised.back().second = std::max(heapSnapshotUnspecialised.back().second, To);
+    return;
+  }
+
+  heapSnapshotUnspecialised.push_back(std::make_pair(From, To));
+
+}
+
+// Could anything see a heap object's contents between its allocation and last constant store,
+// or free it? Specialised code only reads it through residual loads, copies and calls, and
+// frees noted during analysis have vetoed it already. Unspecialised code may read or free
+// anything it can reach, so none may run once the object exists.
+static bool heapSnapshotObserved(const HeapSnapshotTimes& T, const std::vector<std::pair<uint64_t, uint64_t> >& Unspecialised) {
+
+  if(T.firstResidualRead < T.lastWrite)
+    return true;
+
+  for(std::vector<std::pair<uint64_t, uint64_t> >::const_iterator it = Unspecialised.begin(),
+	itend = Unspecialised.end(); it != itend; ++it) {
+
+    if(it->second > T.allocated)
+      return true;
+
+  }
+
+  return false;
+
+}
+
+// With -llpe-heap-snapshot, a heap allocation that runs once, is never freed, and whose every
+// write before it escaped stored a constant on a certain path is replaced by an internal global
+// initialised with those constants. The committed versions of those stores are then redundant.
+// Objects whose intermediate contents may be read are excluded, since the global shows only the
+// final contents, and so are objects that calls we did not expand or unspecialised code might
+// free, since free() of a global is undefined.
+
+void LLPEAnalysisPass::snapshotHeapAllocations() {
+
+  if(!heapSnapshot)
+    return;
+
+  // Unless the root is main, it returns to code we never saw.
+  if(!getRoot()->isRootMainCall())
+    noteHeapSnapshotUnspecialised(getRoot()->heapSnapshotExit, ULLONG_MAX);
+
+  DenseMap<uint32_t, SmallVector<Instruction*, 4> > committedStores;
+  for(std::vector<std::pair<uint32_t, WeakVH> >::iterator it = heapSnapshotStores.begin(),
+	itend = heapSnapshotStores.end(); it != itend; ++it) {
+
+    if(Instruction* I = cast_or_null<Instruction>((Value*)it->second))
+      committedStores[it->first].push_back(I);
+
+  }
+
+  for(DenseMap<uint32_t, std::vector<std::pair<uint64_t, Constant*> > >::iterator it = heapSnapshotWrites.begin(),
+	itend = heapSnapshotWrites.end(); it != itend; ++it) {
+
+    uint32_t heapIdx = it->first;
+    if(heapSnapshotVetoed.count(heapIdx))
+      continue;
+
+    if(heapSnapshotObserved(heapSnapshotTimes[heapIdx], heapSnapshotUnspecialised))
+      continue;
+
+    AllocData& AD = heap[heapIdx];
+    if(AD.allocVague || AD.storeSize == 0 || AD.storeSize > UINT_MAX)
+      continue;
+
+    CallInst* AllocI = dyn_cast_or_null<CallInst>(AD.committedVal);
+    if(!AllocI)
+      continue;
+
+    // Every byte must have been given the same value by every write, so that it doesn't
+    // matter which of them ran or in what order. Unwritten bytes start as zero.
+    std::vector<unsigned char> Bytes(AD.storeSize, 0);
+    std::vector<bool> Written(AD.storeSize, false);
+    bool consistent = true;
+
+    for(std::vector<std::pair<uint64_t, Constant*> >::iterator writeit = it->second.begin(),
+	  writeend = it->second.end(); writeit != writeend && consistent; ++writeit) {
+
+      uint64_t Offset = writeit->first;
+      uint64_t Size = GlobalTD->getTypeStoreSize(writeit->second->getType());
+      if(Offset + Size > AD.storeSize) {
+	consistent = false;
+	break;
+      }
+
+      std::vector<unsigned char> WriteBytes(Size, 0);
+      if(!XXXReadDataFromGlobal(writeit->second, 0, WriteBytes.data(), Size, *GlobalTD)) {
+	consistent = false;
+	break;
+      }
+
+      for(uint64_t i = 0; i != Size && consistent; ++i) {
+
+	if(Written[Offset + i] && Bytes[Offset + i] != WriteBytes[i])
+	  consistent = false;
+	Bytes[Offset + i] = WriteBytes[i];
+	Written[Offset + i] = true;
+
+      }
+
+    }
+
+    if(!consistent)
+      continue;
+
+    LLVMContext& Ctx = AllocI->getContext();
+    Constant* Init = ConstantDataArray::get(Ctx, ArrayRef<uint8_t>(Bytes.data(), Bytes.size()));
+    GlobalVariable* GV = new GlobalVariable(*getGlobalModule(), Init->getType(), false,
+					    GlobalValue::InternalLinkage, Init, "spec_heap");
+    // Specialisation may have relied on the promised malloc alignment.
+    unsigned Align = getMallocAlignment();
+    GV->setAlignment(MaybeAlign(Align ? Align : 16));
+
+    // Contexts committed before the allocation refer to it through placeholders, which
+    // fixNonLocalUses won't patch once committedVal is gone.
+    Constant* GVPtr = ConstantExpr::getPointerCast(GV, AllocI->getType());
+    patchReferences(AD.PatchRefs, GVPtr);
+
+    committedHeapAllocations.erase(AllocI);
+    AllocI->replaceAllUsesWith(GVPtr);
+    AllocI->eraseFromParent();
+    AD.committedVal = 0;
+    ++stats.snapshotAllocations;
+
+    SmallVector<Instruction*, 4>& Stores = committedStores[heapIdx];
+    for(SmallVector<Instruction*, 4>::iterator storeit = Stores.begin(),
+	  storeend = Stores.end(); storeit != storeend; ++storeit) {
+
+      (*storeit)->eraseFromParent();
+      ++stats.snapshotStores;
+
+    }
+
+  }
+
+}
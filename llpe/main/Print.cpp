@@ -11,9 +11,10 @@
 // Otherwise the operator<< implementation completely indexes the bitcode file on every run.
 // This is also punitively expensive for the DOT output code.
 
-// Per default this is implemented simply using LLVM's basic operator<<(Instruction&). To get an efficient
-// implementation see utils/fast-printing.patch which must be applied to VMCore/AsmWriter.cpp and 
-// LLVM_EFFICIENT_PRINTING defined to disable the simple implementations below.
+// Text is rendered one value at a time when first printed and kept in a bounded LRU cache.
+// Per default rendering uses Value::print with a persistent ModuleSlotTracker. Define
+// LLVM_EFFICIENT_PRINTING to supply getPersistPrinter, freePersistPrinter and getValueText from a patched
+// AsmWriter instead.
 
 #include "llvm/Analysis/LLPE.h"
 
@@ -21,68 +22,64 @@
 #include "llvm/IR/BasicBlock.h"
 #include "llvm/IR/Function.h"
 #include "llvm/IR/Module.h"
+#include "llvm/IR/ModuleSlotTracker.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Support/FormattedStream.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
-// Build a mapping from every Instruction in F to its text representation, perhaps the brief version.
-DenseMap<const Value*, std::string>& LLPEAnalysisPass::getFunctionCache(const Function* F, bool brief) {
+static cl::opt<unsigned> PrintCacheSize("llpe-print-cache-size", cl::init(16384));
 
-  DenseMap<const Function*, DenseMap<const Value*, std::string>* >& Map = brief ? briefFunctionTextCache : functionTextCache;
-  DenseMap<const Function*, DenseMap<const Value*, std::string>* >::iterator FI = Map.find(F);
-  
-  if(FI == Map.end()) {
-    DenseMap<const Value*, std::string>* FullMap = functionTextCache[F] = new DenseMap<const Value*, std::string>();
-    DenseMap<const Value*, std::string>* BriefMap = briefFunctionTextCache[F] = new DenseMap<const Value*, std::string>();
-    getInstructionsText(persistPrinter, F, *FullMap, *BriefMap);
-    return brief ? *BriefMap : *FullMap;
+// Get the text representation of V, perhaps the brief version, rendering it on demand
+// and keeping the most recently used PrintCacheSize entries.
+const std::string& LLPEAnalysisPass::getValueText(const Value* V, bool brief) {
+
+  ValueTextKey Key(V, brief);
+  DenseMap<ValueTextKey, ValueTextList::iterator>::iterator findit = valueTextIndex.find(Key);
+
+  if(findit != valueTextIndex.end()) {
+    valueTextLRU.splice(valueTextLRU.begin(), valueTextLRU, findit->second);
+    return findit->second->second;
+  }
+
+  valueTextLRU.push_front(std::make_pair(Key, std::string()));
+  std::string& Text = valueTextLRU.front().second;
+  valueTextIndex[Key] = valueTextLRU.begin();
+
+  if(brief && isa<Instruction>(V) && !V->getType()->isVoidTy()) {
+    const std::string& FullText = getValueText(V, false);
+    Text = FullText.substr(0, FullText.find("=") - 1);
   }
   else {
-    return *(FI->second);
+    llvm::getValueText(persistPrinter, V, Text);
   }
 
-}
+  while(valueTextLRU.size() > std::max((unsigned)PrintCacheSize, 2U)) {
+    valueTextIndex.erase(valueTextLRU.back().first);
+    valueTextLRU.pop_back();
+  }
 
-// Build a mapping for every GlobalValue to its text representation.
-void LLPEAnalysisPass::populateGVCaches(const Module* M) {
-  
-  getGVText(persistPrinter, M, GVCache, GVCacheBrief);
+  return Text;
 
 }
 
-DenseMap<const GlobalVariable*, std::string>& LLPEAnalysisPass::getGVCache(bool brief) {
+void LLPEAnalysisPass::clearValueCache() {
 
-  return brief ? GVCacheBrief : GVCache;
+  valueTextLRU.clear();
+  valueTextIndex.clear();
 
 }
 
 // Use the text-representation cache to describe *V.
 void LLPEAnalysisPass::printValue(raw_ostream& ROS, const Value* V, bool brief) {
 
-  if(!cacheDisabled) {
-
-    if(isa<Instruction>(V) || isa<Argument>(V)) {
-
-      const Function* VF;
-      if(const Instruction* I = dyn_cast<Instruction>(V))
-	VF = I->getParent()->getParent();
-      else
-	VF = cast<Argument>(V)->getParent();
+  if(!cacheDisabled && (isa<Instruction>(V) || isa<Argument>(V) || isa<GlobalVariable>(V))) {
 
-      DenseMap<const Value*, std::string>& Map = getFunctionCache(VF, brief);
-      ROS << Map[V];
-      return;
-
-    }
-    else if(const GlobalVariable* GV = dyn_cast<GlobalVariable>(V)) {
-
-      DenseMap<const GlobalVariable*, std::string>& Map = getGVCache(brief);
-      ROS << Map[GV];
-      return;
-
-    }
+    ROS << getValueText(V, brief);
+    return;
 
   }
 
@@ -95,6 +92,14 @@ void LLPEAnalysisPass::printValue(raw_ostream& ROS, const Value* V, bool brief)
 
     }
 
+    // Name instructions and arguments as the cache's brief text would:
+    if(isa<Argument>(V) || (isa<Instruction>(V) && !V->getType()->isVoidTy())) {
+
+      V->printAsOperand(ROS, false);
+      return;
+
+    }
+
     // Otherwise print in full:
 
   }
@@ -110,7 +115,7 @@ void LLPEAnalysisPass::printValue(raw_ostream& Stream, ShadowValue V, bool brief
     Stream << "NULL";
   }
   else if(V.isConstantInt()) {
-    Stream << (*V.getNonPointerType()) << " " << V.u.CI;
+    Stream << (*V.getNonPointerType()) << " " << V.getCIValue();
   }
   else if(Value* V2 = V.getVal()) {
     printValue(Stream, V2, brief);
@@ -127,28 +132,35 @@ void LLPEAnalysisPass::printValue(raw_ostream& Stream, ShadowValue V, bool brief
     printValue(Stream, GV->G, brief);
   }
   else if(V.isPtrIdx()) {
-    if(V.u.PtrOrFd.frame == -1)
-      Stream << "G/H alloc " << V.u.PtrOrFd.idx;
+    if(V.getPtrOrFdFrame() == -1)
+      Stream << "G/H alloc " << V.getPtrOrFdIdx();
     else
-      Stream << "S alloc " << V.u.PtrOrFd.frame << " / " << V.u.PtrOrFd.idx;
+      Stream << "S alloc " << V.getPtrOrFdFrame() << " / " << V.getPtrOrFdIdx();
   }
   else if(V.isFdIdx()) {
     Stream << "FD ";
-    if(V.t == SHADOWVAL_FDIDX64)
+    if(V.getValType() == SHADOWVAL_FDIDX64)
       Stream << "[64] ";
-    Stream << V.u.PtrOrFd.idx;
+    Stream << V.getPtrOrFdIdx();
   }
 
 }
 
-// This never happens at present. Might be appropriate if you wanted to print Values that do and don't
-// occur in the original program interchangably.
+// The cache is off by default, since batch runs print little; it is enabled when a report
+// (which the GUI always writes), the stats file, a dump or a verbose option will print values repeatedly.
 void LLPEAnalysisPass::disableValueCache() {
 
   cacheDisabled = true;
+  clearValueCache();
   
 }
 
+void LLPEAnalysisPass::enableValueCache() {
+
+  cacheDisabled = false;
+
+}
+
 // Print a dead-store-elimination map entry, which indicates whether or not a particular store instruction
 // is needed, has been committed as a concrete instruction, etc.
 void DSEMapPointer::print(raw_ostream& RSO, bool brief) {
@@ -214,61 +226,29 @@ namespace llvm {
 // hasn't been patched to make this much more efficient. This becomes a problem
 // once we get beyond hundreds of instructions.
 
-PersistPrinter* llvm::getPersistPrinter(Module*) { return new PersistPrinter(); }
-
-void llvm::getInstructionsText(PersistPrinter*, const Function* IF, DenseMap<const Value*, std::string>& IMap, DenseMap<const Value*, std::string>& BriefMap) {
-
-  for(Function::const_iterator FI = IF->begin(), FE = IF->end(); FI != FE; ++FI) {
-
-    const BasicBlock *BB = &*FI;
-    for(BasicBlock::const_iterator BI = BB->begin(), BE = BB->end(); BI != BE; ++BI) {
-
-      const Instruction* I = &*BI;
-      std::string instText;
-      {
-	raw_string_ostream RSO(instText);
-	RSO << *I;
-      }
-
-      IMap[I] = instText;
-      if(I->getType()->isVoidTy())
-	BriefMap[I] = instText;
-      else
-	BriefMap[I] = instText.substr(0, instText.find("=") - 1);
+class llvm::PersistPrinter {
 
-    }
+public:
 
-  }
+  // Keeps slot numbering for the most recently printed function, which is
+  // only recomputed when we print a value from a different function.
+  ModuleSlotTracker MST;
 
-  for(Function::const_arg_iterator AI = IF->arg_begin(), AE = IF->arg_end(); AI != AE; ++AI) {
+  PersistPrinter(Module* M) : MST(M, false) { }
 
-    std::string argText;
-    {
-      raw_string_ostream RSO(argText);
-      RSO << *AI;
-    }
+};
 
-    IMap[(const Argument*)AI] = argText;
-    BriefMap[(const Argument*)AI] = argText;
+PersistPrinter* llvm::getPersistPrinter(Module* M) { return new PersistPrinter(M); }
 
-  }
+void llvm::freePersistPrinter(PersistPrinter* PP) { delete PP; }
 
-}
+void llvm::getValueText(PersistPrinter* PP, const Value* V, std::string& Out) {
 
-void llvm::getGVText(PersistPrinter*, const Module* M, DenseMap<const GlobalVariable*, std::string>& GVMap, DenseMap<const GlobalVariable*, std::string>& BriefGVMap) {
+  raw_string_ostream RSO(Out);
 
-  for(Module::const_global_iterator it = M->global_begin(), itend = M->global_end(); it != itend; ++it) {
-
-    std::string GVText;
-    {
-      raw_string_ostream RSO(GVText);
-      RSO << *it;
-    }
-
-    GVMap[&*it] = GVText;
-    BriefGVMap[&*it] = GVText;
-
-  }
+  if(const Argument* A = dyn_cast<Argument>(V))
+    PP->MST.incorporateFunction(*A->getParent());
+  V->print(RSO, PP->MST);
 
 }
 
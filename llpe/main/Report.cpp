@@ -0,0 +1,508 @@
+//===-- Report.cpp --------------------------------------------------------===//
+//
+//                                  LLPE
+//
+// This file is distributed under the University of Illinois Open Source
+// License. See LICENSE.txt for details.
+//
+//===----------------------------------------------------------------------===//
+
+// The specialisation report: a single line-delimited JSON file describing every
+// context as it stood just before it was committed, i.e. its place in the context tree,
+// per-block liveness, per-instruction results, edge states and its brief and full DOT
+// graphs. The GUI renders contexts from it, and since it is self-contained it can be
+// reopened later (e.g. by utils/llpe-report.py) without rerunning the analysis.
+//
+// Format: the first line is a header object {"llpe-report": 1}; then one context record
+// per line; then a trailer line {"index": [[seq, offset, length], ...], "root": seq}
+// giving the byte range of each record, so a reader can map the file and parse only
+// the contexts it wants.
+//
+// With -llpe-report-compress-kb=N, a record longer than N KB is stored instead as
+// {"seq": seq, "size": bytes, "zlib": base64} where the base64 string holds the original
+// record, zlib-compressed.
+
+#include "llvm/Analysis/LLPE.h"
+
+#include "llvm/Support/Base64.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include <zlib.h>
+
+using namespace llvm;
+
+static cl::opt<unsigned> ReportQueueMB("llpe-report-queue-mb", cl::init(64));
+static cl::opt<unsigned> ReportCompressKB("llpe-report-compress-kb", cl::init(0));
+
+// Replace a long record with its compressed form (see above). On failure the record
+// is left as it was.
+static void compressRecord(uint64_t seq, std::string& text) {
+
+  uLongf ZSize = compressBound(text.size());
+  std::string Z(ZSize, '\0');
+  if(compress2((Bytef*)&Z[0], &ZSize, (const Bytef*)text.data(), text.size(), Z_DEFAULT_COMPRESSION) != Z_OK)
+    return;
+  Z.resize(ZSize);
+
+  std::string Wrapped;
+  {
+    raw_string_ostream RSO(Wrapped);
+    RSO << json::Value(json::Object({{"seq", (int64_t)seq}, {"size", (int64_t)text.size()}, {"zlib", encodeBase64(Z)}}));
+  }
+  text.swap(Wrapped);
+
+}
+
+static int getBase64Digit(char c) {
+
+  if(c >= 'A' && c <= 'Z')
+    return c - 'A';
+  if(c >= 'a' && c <= 'z')
+    return c - 'a' + 26;
+  if(c >= '0' && c <= '9')
+    return c - '0' + 52;
+  if(c == '+')
+    return 62;
+  if(c == '/')
+    return 63;
+  return -1;
+
+}
+
+// Undo compressRecord. Returns false if the record is damaged.
+static bool decompressRecord(StringRef Base64, uint64_t Size, std::string& Out) {
+
+  std::string Z;
+  uint32_t acc = 0, bits = 0;
+  for(StringRef::iterator it = Base64.begin(), itend = Base64.end(); it != itend && *it != '='; ++it) {
+
+    int digit = getBase64Digit(*it);
+    if(digit == -1)
+      return false;
+    acc = (acc << 6) | digit;
+    bits += 6;
+    if(bits >= 8) {
+      bits -= 8;
+      Z.push_back((char)((acc >> bits) & 0xff));
+    }
+
+  }
+
+  // zlib expands its input at most about 1032 times, so a larger size can only come from
+  // a damaged record, and must not be allocated.
+  if(Size > (uint64_t)Z.size() * 1032 + 64)
+    return false;
+
+  Out.resize(Size);
+  uLongf OutSize = Size;
+  if(uncompress((Bytef*)&Out[0], &OutSize, (const Bytef*)Z.data(), Z.size()) != Z_OK || OutSize != Size)
+    return false;
+
+  return true;
+
+}
+
+// Writes queued records on a background thread, so the analysis only waits for file
+// I/O when more than ReportQueueMB of records are outstanding. Records are rendered on
+// the analysis thread, since they read context state that commit is about to free, but
+// are compressed here.
+class llvm::ReportWriter {
+
+  struct Record {
+
+    uint64_t seq;
+    std::string text;
+
+  };
+
+  raw_fd_ostream& Out;
+  std::mutex lock;
+  std::condition_variable cv;
+  std::deque<Record> records;
+  uint64_t queuedBytes;
+  bool finished;
+  json::Array index;
+  std::thread worker;
+
+  void run();
+
+public:
+
+  ReportWriter(raw_fd_ostream& _Out) : Out(_Out), queuedBytes(0), finished(false), worker(&ReportWriter::run, this) { }
+  void queue(uint64_t seq, std::string& text);
+  void finish(uint64_t rootSeq);
+
+};
+
+void ReportWriter::run() {
+
+  while(true) {
+
+    Record R;
+
+    {
+      std::unique_lock<std::mutex> G(lock);
+      cv.wait(G, [this] { return finished || !records.empty(); });
+      if(records.empty())
+	return;
+      R = std::move(records.front());
+      records.pop_front();
+    }
+
+    uint64_t queuedSize = R.text.size();
+    if(ReportCompressKB && R.text.size() > ((uint64_t)ReportCompressKB) * 1024)
+      compressRecord(R.seq, R.text);
+
+    index.push_back(json::Array({(int64_t)R.seq, (int64_t)Out.tell(), (int64_t)R.text.size()}));
+    Out << R.text << "\n";
+
+    {
+      std::lock_guard<std::mutex> G(lock);
+      queuedBytes -= queuedSize;
+    }
+    cv.notify_all();
+
+  }
+
+}
+
+void ReportWriter::queue(uint64_t seq, std::string& text) {
+
+  uint64_t limit = ((uint64_t)ReportQueueMB) * 1024 * 1024;
+
+  std::unique_lock<std::mutex> G(lock);
+  // A single record bigger than the limit is allowed once the queue has drained.
+  cv.wait(G, [&] { return records.empty() || queuedBytes + text.size() <= limit; });
+
+  queuedBytes += text.size();
+  records.push_back(Record());
+  records.back().seq = seq;
+  records.back().text.swap(text);
+
+  G.unlock();
+  cv.notify_all();
+
+}
+
+// Write everything outstanding, stop the worker thread and append the index.
+void ReportWriter::finish(uint64_t rootSeq) {
+
+  {
+    std::lock_guard<std::mutex> G(lock);
+    finished = true;
+  }
+  cv.notify_all();
+  worker.join();
+
+  Out << json::Value(json::Object({{"index", std::move(index)}, {"root", (int64_t)rootSeq}})) << "\n";
+
+}
+
+// Maps a finished report and finds records through its index.
+class llvm::ReportReader {
+
+  std::unique_ptr<MemoryBuffer> Buffer;
+  DenseMap<uint64_t, std::pair<uint64_t, uint64_t> > index;
+
+public:
+
+  bool open(const std::string& path);
+  bool getRecord(uint64_t seq, json::Value& Out);
+
+};
+
+bool ReportReader::open(const std::string& path) {
+
+  ErrorOr<std::unique_ptr<MemoryBuffer> > MB = MemoryBuffer::getFile(path, -1, false);
+  if(!MB) {
+    errs() << "Failed to open report " << path << ": " << MB.getError().message() << "\n";
+    return false;
+  }
+  Buffer = std::move(MB.get());
+
+  StringRef Data = Buffer->getBuffer().rtrim("\n");
+  StringRef Trailer = Data.substr(Data.rfind('\n') + 1);
+
+  Expected<json::Value> V = json::parse(Trailer);
+  if(!V) {
+    errs() << "Malformed report " << path << ": " << toString(V.takeError()) << "\n";
+    return false;
+  }
+
+  json::Object* O = V->getAsObject();
+  json::Array* Entries = O ? O->getArray("index") : 0;
+  if(!Entries) {
+    errs() << "Report " << path << " has no index (was it finished?)\n";
+    return false;
+  }
+
+  for(json::Array::iterator it = Entries->begin(), itend = Entries->end(); it != itend; ++it) {
+
+    json::Array* E = it->getAsArray();
+    if(!E || E->size() != 3)
+      continue;
+
+    Optional<int64_t> Seq = (*E)[0].getAsInteger();
+    Optional<int64_t> Offset = (*E)[1].getAsInteger();
+    Optional<int64_t> Length = (*E)[2].getAsInteger();
+    if(!(Seq && Offset && Length) || *Offset < 0 || *Length < 0 ||
+       (uint64_t)*Offset + (uint64_t)*Length > Buffer->getBufferSize())
+      continue;
+
+    index[*Seq] = std::make_pair(*Offset, *Length);
+
+  }
+
+  return true;
+
+}
+
+bool ReportReader::getRecord(uint64_t seq, json::Value& Out) {
+
+  DenseMap<uint64_t, std::pair<uint64_t, uint64_t> >::iterator findit = index.find(seq);
+  if(findit == index.end())
+    return false;
+
+  Expected<json::Value> V = json::parse(Buffer->getBuffer().substr(findit->second.first, findit->second.second));
+  if(!V) {
+    consumeError(V.takeError());
+    return false;
+  }
+
+  // Compressed record?
+  if(json::Object* O = V->getAsObject()) {
+
+    Optional<StringRef> Z = O->getString("zlib");
+    Optional<int64_t> Size = O->getInteger("size");
+    if(Z && Size) {
+
+      std::string Text;
+      if(*Size < 0 || !decompressRecord(*Z, *Size, Text))
+	return false;
+
+      V = json::parse(Text);
+      if(!V) {
+	consumeError(V.takeError());
+	return false;
+      }
+
+    }
+
+  }
+
+  Out = std::move(*V);
+  return true;
+
+}
+
+void LLPEAnalysisPass::openReport() {
+
+  std::error_code error;
+  raw_fd_ostream* RFO = new raw_fd_ostream(reportPath.c_str(), error, sys::fs::F_None);
+  if(error) {
+    errs() << "Failed to open " << reportPath << ": " << error.message() << "\n";
+    exit(1);
+  }
+
+  *RFO << json::Value(json::Object({{"llpe-report", 1}})) << "\n";
+  reportWriter = new ReportWriter(*RFO);
+  reportStream = RFO;
+
+}
+
+void LLPEAnalysisPass::queueReportRecord(uint64_t seq, std::string& record) {
+
+  reportWriter->queue(seq, record);
+
+}
+
+// Called before anything (i.e. the GUI) reads the report.
+void LLPEAnalysisPass::closeReport() {
+
+  if(!reportWriter)
+    return;
+
+  reportWriter->finish(RootIA ? RootIA->SeqNumber : 0);
+  delete reportWriter;
+  reportWriter = 0;
+  delete reportStream;
+  reportStream = 0;
+
+}
+
+// Write the DOT graph saved for context seq.
+void LLPEAnalysisPass::getReportDOT(uint64_t seq, bool brief, raw_ostream& Out) {
+
+  if(!reportReader) {
+    reportReader = new ReportReader();
+    if(!reportReader->open(reportPath)) {
+      delete reportReader;
+      reportReader = 0;
+    }
+  }
+
+  json::Value Record(nullptr);
+  if(reportReader && reportReader->getRecord(seq, Record)) {
+    if(json::Object* O = Record.getAsObject()) {
+      if(Optional<StringRef> DOT = O->getString(brief ? "brief" : "full")) {
+	Out << *DOT;
+	return;
+      }
+    }
+  }
+
+  Out << "digraph \"Missing\" {\n\tlabel = \"No saved graph for context " << seq << "\"\n}\n";
+
+}
+
+// Strings in the report must be valid UTF-8; IR names needn't be.
+static json::Value jsonString(StringRef S) {
+
+  if(json::isUTF8(S))
+    return json::Value(S);
+  else
+    return json::Value(json::fixUTF8(S));
+
+}
+
+static const char* getBBStatusName(ShadowBB* BB) {
+
+  if(!BB)
+    return "dead";
+
+  switch(BB->status) {
+  case BBSTATUS_CERTAIN:
+    return "certain";
+  case BBSTATUS_ASSUMED:
+    return "assumed";
+  case BBSTATUS_IGNORED:
+    return "ignored";
+  default:
+    return "unknown";
+  }
+
+}
+
+// Describe this context as a report record and queue it for writing.
+void IntegrationAttempt::writeReportRecord() {
+
+  json::Object Record;
+
+  Record["seq"] = (int64_t)SeqNumber;
+  Record["function"] = jsonString(F.getName());
+  if(L)
+    Record["loop"] = jsonString(getBBInvar(L->headerIdx)->BB->getName());
+  Record["short"] = jsonString(getShortHeader());
+  Record["enabled"] = isEnabled();
+
+  {
+    std::string header;
+    raw_string_ostream RSO(header);
+    printHeader(RSO);
+    Record["header"] = jsonString(RSO.str());
+  }
+
+  json::Array Children;
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it)
+    Children.push_back((int64_t)it->second->SeqNumber);
+  Record["children"] = std::move(Children);
+
+  json::Array Loops;
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    json::Array Iterations;
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
+      Iterations.push_back((int64_t)it->second->Iterations[i]->SeqNumber);
+
+    Loops.push_back(json::Object({{"header", jsonString(getBBInvar(it->first->headerIdx)->BB->getName())},
+				  {"terminated", it->second->isTerminated()},
+				  {"iterations", std::move(Iterations)}}));
+
+  }
+  Record["loops"] = std::move(Loops);
+
+  json::Array Blocks;
+  for(uint32_t i = 0; i != nBBs; ++i) {
+
+    ShadowBBInvar* BBI = getBBInvar(i + BBsOffset);
+    ShadowBB* BB = BBs[i];
+
+    json::Object Block;
+    Block["name"] = jsonString(BBI->BB->getName());
+    Block["status"] = getBBStatusName(BB);
+
+    if(BB) {
+
+      json::Array Insts;
+      for(uint32_t j = 0, jlim = BBI->insts.size(); j != jlim; ++j) {
+
+	ShadowValue SV(&BB->insts[j]);
+	std::string text, result;
+	{
+	  raw_string_ostream RSO(text);
+	  RSO << itcache(SV);
+	}
+	{
+	  raw_string_ostream RSO(result);
+	  printRHS(SV, RSO);
+	}
+
+	Insts.push_back(json::Object({{"text", jsonString(text)}, {"result", jsonString(result)}, {"deleted", willBeDeleted(SV)}}));
+
+      }
+      Block["insts"] = std::move(Insts);
+
+    }
+
+    json::Array Edges;
+    for(uint32_t j = 0, jlim = BBI->succIdxs.size(); j != jlim; ++j) {
+
+      ShadowBBInvar* SuccBBI = getBBInvar(BBI->succIdxs[j]);
+      const char* state;
+      if(edgeIsDead(BBI, SuccBBI))
+	state = "dead";
+      else if(edgeBranchesToUnspecialisedCode(BBI, SuccBBI))
+	state = "unspecialised";
+      else
+	state = "live";
+
+      Edges.push_back(json::Object({{"to", jsonString(SuccBBI->BB->getName())}, {"state", state}}));
+
+    }
+    Block["edges"] = std::move(Edges);
+
+    Blocks.push_back(std::move(Block));
+
+  }
+  Record["blocks"] = std::move(Blocks);
+
+  for(uint32_t i = 0; i != 2; ++i) {
+
+    bool brief = (i == 0);
+    std::string DOT;
+    {
+      raw_string_ostream RSO(DOT);
+      describeAsDOT(RSO, brief);
+    }
+    Record[brief ? "brief" : "full"] = jsonString(DOT);
+
+  }
+
+  std::string text;
+  {
+    raw_string_ostream RSO(text);
+    RSO << json::Value(std::move(Record));
+  }
+
+  pass->queueReportRecord(SeqNumber, text);
+
+}
@@ -36,6 +36,10 @@ using namespace llvm;
 // Name the output basic blocks for easier debugging? Significantly increases output size.
 cl::opt<bool> VerboseNames("int-verbose-names");
 
+// Runs of constant stores to consecutive bytes of one object, at least this long, are
+// committed as a single memset or memcpy.
+static cl::opt<unsigned> MergeStoresMinBytes("llpe-merge-stores-min-bytes", cl::init(64));
+
 static uint32_t SaveProgressN = 0;
 const uint32_t SaveProgressLimit = 1000;
 
@@ -53,32 +57,12 @@ static void SaveProgress() {
 
 // Prepare for the commit: remove instruction mappings that are (a) invalid to write to the final program
 // and (b) difficult to reason about once the loop structures start to be modified by unrolling and so on.
-
-void InlineAttempt::prepareCommitCall() {
-
-  if(isCommitted())
-    return;
-
-  IntegrationAttempt::prepareCommit();
-
-}
+// Enabled children are prepared beforehand by prepareCommitTree.
 
 void IntegrationAttempt::prepareCommit() {
-  
-  for(IAIterator it = child_calls_begin(this), it2 = child_calls_end(this); it != it2; ++it) {
-
-    if(!it->second->isEnabled())
-      continue;
-
-    it->second->prepareCommitCall();
-
-  }
 
   for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(), it2 = peelChildren.end(); it != it2; ++it) {
 
-    unsigned iterCount = it->second->Iterations.size();
-    unsigned iterLimit = (it->second->Iterations.back()->iterStatus == IterationStatusFinal) ? iterCount : iterCount - 1;
-
     if(!it->second->isEnabled()) {
     
       if(it->second->isTerminated()) {
@@ -109,14 +93,6 @@ void IntegrationAttempt::prepareCommit() {
 
       }
 
-      continue;
-      
-    }
-
-    for(unsigned i = 0; i < iterLimit; ++i) {
-
-      it->second->Iterations[i]->prepareCommit();
-
     }
 
   }  
@@ -566,23 +542,23 @@ void IntegrationAttempt::commitCFG() {
 // Convert a shadow-value to the value we should refer to in the committed program.
 Value* IntegrationAttempt::getCommittedValue(ShadowValue SV) {
 
-  switch(SV.t) {
+  switch(SV.getValType()) {
   case SHADOWVAL_OTHER:
-    return SV.u.V;
+    return SV.getVal();
   case SHADOWVAL_GV:
-    return SV.u.GV->G;
+    return SV.getGV()->G;
   case SHADOWVAL_INST: 
     {
-      release_assert(SV.u.I->committedVal && "Instruction depends on uncommitted instruction");
-      return SV.u.I->committedVal;
+      release_assert(SV.getInst()->committedVal && "Instruction depends on uncommitted instruction");
+      return SV.getInst()->committedVal;
     }
   case SHADOWVAL_ARG:
     {
       // It can be valid to find a root function argument without committed value
       // as they are pseudo-allocations that will be patched in later.
-      release_assert((SV.u.A->committedVal || SV.u.A->IA->isRootMainCall()) && 
+      release_assert((SV.getArg()->committedVal || SV.getArg()->IA->isRootMainCall()) && 
 		     "Instruction depends on uncommitted instruction");
-      return SV.u.A->committedVal;
+      return SV.getArg()->committedVal;
     }
   case SHADOWVAL_PTRIDX:
     {
@@ -592,7 +568,7 @@ Value* IntegrationAttempt::getCommittedValue(ShadowValue SV) {
   case SHADOWVAL_FDIDX:
   case SHADOWVAL_FDIDX64:
     {
-      FDGlobalState& FDS = pass->fds[SV.u.PtrOrFd.idx];
+      FDGlobalState& FDS = pass->fds[SV.getPtrOrFdIdx()];
       return FDS.CommittedVal;
     }
   case SHADOWVAL_CI8:
@@ -1973,12 +1949,16 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
   if(getBaseObject(ShadowValue(I), Base) && 
      Base.isPtrIdx() && 
      (AD = getAllocData(Base)) && 
-     AD->allocValue.u.I == I) {
+     AD->allocValue.getInst() == I) {
 
     AD->committedVal = newI;
     AD->isCommitted = true;
-    if(Base.getFrameNo() == -1)
+    if(Base.getFrameNo() == -1) {
       pass->committedHeapAllocations[newI] = Base.getHeapKey();
+      // A single global can only stand in for an allocation that runs once.
+      if(pass->heapSnapshot && mayExecuteRepeatedly(BB))
+	pass->heapSnapshotVetoed.insert(Base.getHeapKey());
+    }
 
   }
 
@@ -1995,6 +1975,27 @@ Instruction* IntegrationAttempt::emitInst(ShadowBB* BB, ShadowInstruction* I, Ba
 
   }
 
+  // If it's a constant store that may become part of a heap object's initialiser, note the
+  // committed instruction, which is deleted if that object is replaced by a global.
+  if(pass->heapSnapshot && isa<StoreInst>(newI) && pass->heapSnapshotWriters.count(I)) {
+
+    ImprovedValSetSingle PtrSet;
+    if(getImprovedValSetSingle(I->getOperand(1), PtrSet) && 
+       PtrSet.SetType == ValSetTypePB && 
+       PtrSet.Values.size() == 1 &&
+       PtrSet.Values[0].V.isPtrIdx() &&
+       PtrSet.Values[0].V.getFrameNo() == -1) {
+
+      uint32_t heapIdx = PtrSet.Values[0].V.getHeapKey();
+      if(mayExecuteRepeatedly(BB))
+	pass->heapSnapshotVetoed.insert(heapIdx);
+      else
+	pass->heapSnapshotStores.push_back(std::make_pair(heapIdx, WeakVH(newI)));
+
+    }
+
+  }
+
   {
 
     // Don't use forwardableOpenCalls here because surrogates for FDs need recording too.
@@ -2211,7 +2212,7 @@ bool IntegrationAttempt::canSynthVal(ShadowValue* I, ValSetType Ty, const Improv
   if(Ty == ValSetTypeScalar)
     return true;
   else if(Ty == ValSetTypeFD) {
-    return ((!I) || (!I->isInst()) || (I->u.I != pass->fds[IV.V.u.PtrOrFd.idx].SI)) 
+    return ((!I) || (!I->isInst()) || (I->getInst() != pass->fds[IV.V.getPtrOrFdIdx()].SI)) 
       && IV.V.objectAvailable();
   }
   else if(Ty == ValSetTypePB) {
@@ -2245,7 +2246,7 @@ Value* IntegrationAttempt::trySynthVal(ShadowValue* I, Type* targetType, ValSetT
     
     if(canSynthVal(I, Ty, IV)) {
       
-      FDGlobalState& FDS = pass->fds[IV.V.u.PtrOrFd.idx];
+      FDGlobalState& FDS = pass->fds[IV.V.getPtrOrFdIdx()];
       if(!FDS.CommittedVal) {
 
 	// Open instruction not committed yet. Create a 'select' instruction that will be patched
@@ -2298,6 +2299,58 @@ static Instruction* emitMemcpyInst(Value* To, Value* From, uint64_t Size, BasicB
 
 }
 
+// Write a residual memset to emitBB.
+static Instruction* emitMemsetInst(Value* To, uint8_t Byte, uint64_t Size, BasicBlock* emitBB) {
+
+  Type* BytePtr = Type::getInt8PtrTy(emitBB->getContext());
+  Type* Int64Ty = Type::getInt64Ty(emitBB->getContext());
+  Constant* MemsetSize = ConstantInt::get(Int64Ty, Size);
+
+  Type *Tys[2] = {BytePtr, Int64Ty};
+  Function *MemSetFn = Intrinsic::getDeclaration(getGlobalModule(),
+						 Intrinsic::memset, 
+						 ArrayRef<Type*>(Tys, 2));
+
+  Value *CallArgs[] = {
+    To, ConstantInt::get(Type::getInt8Ty(emitBB->getContext()), Byte), MemsetSize,
+    ConstantInt::get(Type::getInt32Ty(emitBB->getContext()), 1),
+    ConstantInt::get(Type::getInt1Ty(emitBB->getContext()), 0)
+  };
+	
+  return CallInst::Create(MemSetFn, ArrayRef<Value*>(CallArgs, 5), "", emitBB);
+
+}
+
+// Write constant C, Size bytes long, through To: as a memset if it is plain data with every byte
+// the same, or else as a memcpy from an internal constant global. Chunks with the same content
+// share a global.
+static Instruction* emitConstantChunk(Value* To, Constant* C, uint64_t Size, BasicBlock* emitBB) {
+
+  // Pointers can't be read bytewise; those always need a copy.
+  std::vector<unsigned char> Bytes(Size, 0);
+  if(Size != 0 && Size <= UINT_MAX && XXXReadDataFromGlobal(C, 0, Bytes.data(), Size, *GlobalTD)) {
+
+    bool isSplat = true;
+    for(uint64_t i = 1; i != Size && isSplat; ++i)
+      isSplat = Bytes[i] == Bytes[0];
+
+    if(isSplat)
+      return emitMemsetInst(To, Bytes[0], Size, emitBB);
+
+  }
+
+  GlobalVariable*& CopyFrom = GlobalIHP->constantChunkSources[C];
+  if(!CopyFrom) {
+    CopyFrom = new GlobalVariable(*getGlobalModule(), C->getType(), 
+				  true, GlobalValue::InternalLinkage, C);
+    CopyFrom->setUnnamedAddr(GlobalValue::UnnamedAddr::Global);
+  }
+
+  Constant* CopyFromPtr = ConstantExpr::getBitCast(CopyFrom, Type::getInt8PtrTy(emitBB->getContext()));
+  return emitMemcpyInst(To, CopyFromPtr, Size, emitBB);
+
+}
+
 // Emit code to write (chunkBegin-chunkEnd] to I's first operand. This might be a simple
 // store, or might need a memcpy call from a composite-typed object.
 // newInstructions accumulates the stores, calls and casts required to do this,
@@ -2339,11 +2392,8 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
 
       release_assert(isa<Constant>(newVal));
 
-      // Emit memcpy from single constant.
-      GlobalVariable* CopyFrom = new GlobalVariable(*getGlobalModule(), newVal->getType(), 
-						    true, GlobalValue::InternalLinkage, cast<Constant>(newVal));
-      Constant* CopyFromPtr = ConstantExpr::getBitCast(CopyFrom, BytePtr);
-      newInstructions.push_back(emitMemcpyInst(targetPtrSynth, CopyFromPtr, elSize, emitBB));
+      // Emit memset or memcpy from single constant.
+      newInstructions.push_back(emitConstantChunk(targetPtrSynth, cast<Constant>(newVal), elSize, emitBB));
 
     }
     else {
@@ -2357,7 +2407,7 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
   }
   else {
 
-    // Emit as memcpy-from-packed-struct.
+    // Emit as memset, or memcpy-from-packed-struct.
     SmallVector<Type*, 4> Types;
     SmallVector<Constant*, 4> Copy;
     uint64_t lastOffset = 0;
@@ -2375,16 +2425,146 @@ void IntegrationAttempt::emitChunk(ShadowInstruction* I, BasicBlock* emitBB, Sma
 
     StructType* SType = StructType::get(emitBB->getContext(), Types, /*isPacked=*/true);
     Constant* CS = ConstantStruct::get(SType, Copy);
-    GlobalVariable* GCS = new GlobalVariable(*getGlobalModule(), SType, 
-					     true, GlobalValue::InternalLinkage, CS);
-    Constant* GCSPtr = ConstantExpr::getBitCast(GCS, BytePtr);
 
-    newInstructions.push_back(emitMemcpyInst(targetPtrSynth, GCSPtr, lastOffset - chunkBegin->first.first, emitBB));
+    newInstructions.push_back(emitConstantChunk(targetPtrSynth, CS, lastOffset - chunkBegin->first.first, emitBB));
 
   }
 
 }
 
+// Is I a store of a known constant to a known offset in a known object, that can be committed
+// as part of a bigger write? Stores that DSE or the heap snapshot may delete later must stay
+// as they are.
+bool IntegrationAttempt::getMergeableConstantStore(ShadowInstruction* I, ShadowValue& Base, int64_t& Offset, Constant*& C) {
+
+  if((!inst_is<StoreInst>(I)) || willBeDeleted(ShadowValue(I)))
+    return false;
+
+  if(!cast<StoreInst>(I->invar->I)->isSimple())
+    return false;
+
+  if(GlobalIHP->trackedStores.count(I) || pass->heapSnapshotWriters.count(I))
+    return false;
+
+  C = getConstReplacement(I->getOperand(0));
+  if(!C)
+    return false;
+
+  // Stores are laid end to end by store size, the constant we build by alloc size.
+  if(GlobalTD->getTypeStoreSize(C->getType()) != GlobalTD->getTypeAllocSize(C->getType()))
+    return false;
+
+  return getBaseAndConstantOffset(I->getOperand(1), Base, Offset);
+
+}
+
+// Does I only load from or store to an object other than Base? Then the run of stores to Base
+// can be written before it.
+static bool accessesOnlyOtherObject(ShadowInstruction* I, const ShadowValue& Base) {
+
+  uint32_t PtrOp;
+  if(inst_is<LoadInst>(I) && cast<LoadInst>(I->invar->I)->isSimple())
+    PtrOp = 0;
+  else if(inst_is<StoreInst>(I) && cast<StoreInst>(I->invar->I)->isSimple())
+    PtrOp = 1;
+  else
+    return false;
+
+  ShadowValue ThisBase;
+  int64_t ThisOffset;
+  return getBaseAndConstantOffset(I->getOperand(PtrOp), ThisBase, ThisOffset) && ThisBase != Base;
+
+}
+
+// If BB->insts[idx] begins a run of constant stores to consecutive bytes of one object,
+// separated only by instructions that don't touch memory or only touch other known objects
+// (e.g. straight-line code initialising two arrays at once), emit the whole run as one memset
+// or memcpy in place of its first store and add its members to Merged. Runs never cross
+// blocks, so a loop's peeled iterations are not merged with each other.
+bool IntegrationAttempt::tryEmitConstantStoreRun(ShadowBB* BB, uint32_t idx, BasicBlock* emitBB, SmallPtrSet<ShadowInstruction*, 16>& Merged) {
+
+  ShadowInstruction* First = &BB->insts[idx];
+  ShadowValue Base;
+  int64_t Offset;
+  Constant* C;
+
+  if(!getMergeableConstantStore(First, Base, Offset, C))
+    return false;
+
+  SmallVector<std::pair<ShadowInstruction*, Constant*>, 16> Run;
+  Run.push_back(std::make_pair(First, C));
+  int64_t nextOffset = Offset + GlobalTD->getTypeStoreSize(C->getType());
+
+  for(uint32_t i = idx + 1, ilim = BB->insts.size(); i != ilim; ++i) {
+
+    ShadowInstruction* I = &BB->insts[i];
+    ShadowValue ThisBase;
+    int64_t ThisOffset;
+
+    if(getMergeableConstantStore(I, ThisBase, ThisOffset, C)) {
+
+      // A store to another object is left in place (or merged into a run of its own).
+      if(ThisBase != Base)
+	continue;
+      if(ThisOffset != nextOffset)
+	break;
+
+      Run.push_back(std::make_pair(I, C));
+      nextOffset += GlobalTD->getTypeStoreSize(C->getType());
+      continue;
+
+    }
+
+    // The stores after this one will be written early, so anything between must not be
+    // able to observe the object written.
+    if(inst_is<CallInst>(I) || inst_is<InvokeInst>(I) || I->isTerminator())
+      break;
+    if(willBeDeleted(ShadowValue(I)))
+      continue;
+    if(requiresRuntimeCheck(ShadowValue(I), false))
+      break;
+    if(accessesOnlyOtherObject(I, Base))
+      continue;
+    if(I->invar->I->mayReadOrWriteMemory() || I->invar->I->mayHaveSideEffects())
+      break;
+
+  }
+
+  if(Run.size() < 2 || (uint64_t)(nextOffset - Offset) < MergeStoresMinBytes)
+    return false;
+
+  SmallVector<Type*, 16> Types;
+  SmallVector<Constant*, 16> Copy;
+  Type* UniqueType = Run[0].second->getType();
+
+  for(SmallVector<std::pair<ShadowInstruction*, Constant*>, 16>::iterator it = Run.begin(), itend = Run.end(); it != itend; ++it) {
+
+    Types.push_back(it->second->getType());
+    Copy.push_back(it->second);
+    if(Types.back() != UniqueType)
+      UniqueType = 0;
+    Merged.insert(it->first);
+
+  }
+
+  Constant* Init;
+  if(UniqueType)
+    Init = ConstantArray::get(ArrayType::get(UniqueType, Copy.size()), Copy);
+  else
+    Init = ConstantStruct::get(StructType::get(emitBB->getContext(), Types, /*isPacked=*/true), Copy);
+
+  // Write through the first store's own pointer, which is available here.
+  ConstantInt* ignFailValue = 0;
+  BasicBlock* failBlock = 0;
+  Value* To = getCommittedValueOrBlock(First, 1, ignFailValue, failBlock);
+  release_assert(To && !failBlock);
+  To = getValAsType(To, Type::getInt8PtrTy(emitBB->getContext()), emitBB);
+
+  First->committedVal = emitConstantChunk(To, Init, nextOffset - Offset, emitBB);
+  return true;
+
+}
+
 // Can a memcpy or memmove (a memory-transfer instruction, MTI) be synthesised (i.e. do we know
 // the unique objects it writes and where it writes them?)
 bool IntegrationAttempt::canSynthMTI(ShadowInstruction* I) {
@@ -2718,11 +2898,18 @@ void IntegrationAttempt::commitLoopInstructions(const ShadowLoopInvar* ScopeL, u
     }
 
     // Emit instructions for this block (using the same j index as before)
+    // Runs of constant stores are written together as they are met.
+    SmallPtrSet<ShadowInstruction*, 16> mergedStores;
     for(; j < BB->insts.size(); ++j) {
 
       ShadowInstruction* I = &(BB->insts[j]);
       I->committedVal = 0;
-      emitOrSynthInst(I, BB, emitBlockIt);
+
+      if(mergedStores.count(I))
+	continue;
+
+      if(!tryEmitConstantStoreRun(BB, j, emitBlockIt->specBlock, mergedStores))
+	emitOrSynthInst(I, BB, emitBlockIt);
 
       // This only emits "check as expected" checks: simple comparisons that ensure a value
       // determined during specialisation matches the real value.
@@ -3248,6 +3435,7 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 
   delete[] BBs;
   BBs = 0;
+  childCalls.clear();
 
   commitState = COMMIT_FREED;
 
@@ -3258,11 +3446,12 @@ void IntegrationAttempt::releaseMemoryPostCommit() {
 // a general-case analysis for this function instead of a per-iteration one.
 void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
 
-  countTentativeInstructions();
-  collectStats();
+  // Count runtime checks and improved instructions over the whole tree.
+  collectFinalisationStats();
 	
   // This call will disable the context if it's not a good idea.
   findProfitableIntegration();
+  applyCodeSizeBudget();
 
   if(isEnabled()) {
 
@@ -3270,17 +3459,9 @@ void InlineAttempt::finaliseAndCommit(bool inLoopAnalyser) {
     // that the context would not be committed: we don't need those after all.
     releaseBackupStores();
 
-    // Create residual blocks for disabled loops
-    prepareCommitCall();
-
-    if(!pass->statsFile.empty())
-      preCommitStats(true);
-
-    // Note any tests that require failed blocks.
-    addCheckpointFailedBlocks();
-
-    // Decide whether to commit in or out of line:
-    findSaveSplits();
+    // In one walk over the tree: create residual blocks for disabled loops, count stats,
+    // note any tests that require failed blocks and decide whether to commit in or out of line.
+    prepareCommitTree();
 
     // Find dead instructions.
     runDIE();
@@ -3366,12 +3547,17 @@ void LLPEAnalysisPass::commit() {
 
       Type* Void = Type::getVoidTy(preludeBlock->getContext());
       Constant* WDInit = cast<Constant>(getGlobalModule()->getOrInsertFunction("lliowd_init", Void).getCallee());
-      CallInst::Create(WDInit, ArrayRef<Value*>(), "", &*it);
+      CallInst* InitCall = CallInst::Create(WDInit, ArrayRef<Value*>(), "", &*it);
+      if(preludeBlock->getParent() == llioPreludeFn)
+	inPlaceInsts.push_back(InitCall);
 
     }
 
   }
 
+  snapshotHeapAllocations();
+  mergeIdenticalCommitFunctions();
+
   // If requested, write verbose stats about this specialisation attempt.
   if(!statsFile.empty()) {
 
@@ -3398,6 +3584,11 @@ void LLPEAnalysisPass::commit() {
   RootIA->CommitF->takeName(&(RootIA->F));
   RootIA->F.setName(oldFName);
 
+  // With deferDispatcher the caller collects dispatchVariant and builds the dispatcher itself.
+  dispatchVariant.F = RootIA->CommitF;
+  if(emitDispatcher && !deferDispatcher)
+    createDispatcher();
+
   errs() << "\n";
 
 }
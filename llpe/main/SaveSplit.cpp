@@ -335,7 +335,8 @@ uint64_t IntegrationAttempt::findSaveSplits() {
     
   }
 
-  // Count residual instructions belonging to our child contexts.
+  // Count residual instructions belonging to our child contexts, which InlineAttempt::prepareCommitTree
+  // has already visited.
 
   for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
 	itend = peelChildren.end(); it != itend; ++it) {
@@ -345,7 +346,7 @@ uint64_t IntegrationAttempt::findSaveSplits() {
 
     for(std::vector<PeelIteration*>::iterator iterit = it->second->Iterations.begin(),
 	  iteritend = it->second->Iterations.end(); iterit != iteritend; ++iterit)
-      residualInstructionsHere += (*iterit)->findSaveSplits();
+      residualInstructionsHere += (*iterit)->residualInstructionsHere;
 
   }
 
@@ -354,7 +355,7 @@ uint64_t IntegrationAttempt::findSaveSplits() {
     if(!it->second->isEnabled())
       continue;
 
-    residualInstructionsHere += it->second->findSaveSplits();
+    residualInstructionsHere += it->second->residualInstructionsHere;
 
   }
 
@@ -368,12 +369,12 @@ void IntegrationAttempt::addPatchRequest(ShadowValue Needed, Instruction* PatchI
 
   std::pair<WeakVH, uint32_t> PRQ(WeakVH(PatchI), PatchOp);
 
-  switch(Needed.t) {
+  switch(Needed.getValType()) {
 
     // Forwarding a root-function argument, which can be considered a globally-unique object.
   case SHADOWVAL_ARG: {
-    release_assert(Needed.u.A->IA->isRootMainCall());
-    ArgStore& AS = GlobalIHP->argStores[Needed.u.A->invar->A->getArgNo()];
+    release_assert(Needed.getArg()->IA->isRootMainCall());
+    ArgStore& AS = GlobalIHP->argStores[Needed.getArg()->invar->A->getArgNo()];
     AS.PatchRefs.push_back(PRQ);
     break;
   }
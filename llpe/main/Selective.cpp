@@ -16,6 +16,8 @@
 #include "llvm/IR/Instructions.h"
 #include "llvm/Support/Debug.h"
 
+#include <algorithm>
+
 using namespace llvm;
 
 // Will this specialsiation context be committed (return true), or just used to inform others (false)?
@@ -58,6 +60,9 @@ void InlineAttempt::setEnabled(bool en, bool skipStats) {
   if(isPathCondition)
     return;
 
+  if(pass->heapSnapshot && enabled && !en)
+    pass->noteHeapSnapshotUnspecialised(heapSnapshotEntry, heapSnapshotExit);
+
   enabled = en;
 
   if(!skipStats)
@@ -73,10 +78,207 @@ void PeelIteration::setEnabled(bool en, bool skipStats) {
 
 void PeelAttempt::setEnabled(bool en, bool skipStats) {
 
+  // The loop will run unspecialised somewhere within its function's span.
+  if(pass->heapSnapshot && enabled && !en) {
+    InlineAttempt* Root = parent->getFunctionRoot();
+    pass->noteHeapSnapshotUnspecialised(Root->heapSnapshotEntry, Root->heapSnapshotExit);
+  }
+
   enabled = en;
 
 }
 
+// Sum the budget charged by the committed callees below this context (looking through
+// uncommitted callees and unrolled loop iterations), and the part of that which is still
+// to be committed, i.e. is reached only through enabled contexts and terminated loops.
+// Shared callees stay committed whatever happens to any one caller, so they are never
+// refunded through their callers.
+void IntegrationAttempt::getChildBudgetCharge(bool live, uint64_t& charged, uint64_t& kept) {
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    InlineAttempt* Child = it->second;
+    if(Child->isShared())
+      continue;
+
+    if(Child->isCommitted()) {
+      charged += Child->budgetCharge;
+      if(live && Child->isEnabled())
+	kept += Child->budgetCharge;
+    }
+    else {
+      Child->getChildBudgetCharge(live && Child->isEnabled(), charged, kept);
+    }
+
+  }
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = it->second;
+    bool liveLoop = live && LPA->isEnabled() && LPA->isTerminated();
+
+    for(uint32_t i = 0, ilim = LPA->Iterations.size(); i != ilim; ++i)
+      LPA->Iterations[i]->getChildBudgetCharge(liveLoop, charged, kept);
+
+  }
+
+}
+
+// Goodness of this context and its unrolled loop iterations, excluding callees.
+int64_t IntegrationAttempt::getOwnGoodnessIncludingLoops() {
+
+  int64_t total = ownIntegrationGoodness;
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = it->second;
+    if((!LPA->isEnabled()) || !LPA->isTerminated())
+      continue;
+
+    for(uint32_t i = 0, ilim = LPA->Iterations.size(); i != ilim; ++i)
+      total += LPA->Iterations[i]->getOwnGoodnessIncludingLoops();
+
+  }
+
+  return total;
+
+}
+
+// Gather the enabled, uncommitted, unshared callees below this context, which will be
+// committed along with it if at all. Parents precede their children in Candidates.
+void IntegrationAttempt::getBudgetCandidates(int32_t parentIdx, std::vector<BudgetCandidate>& Candidates) {
+
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
+
+    InlineAttempt* Child = it->second;
+    if((!Child->isEnabled()) || Child->isCommitted() || Child->isShared())
+      continue;
+
+    int64_t residual = Child->getResidualInstructions();
+    Candidates.push_back(BudgetCandidate(Child, parentIdx, residual > 0 ? (uint64_t)residual : 0,
+					 Child->getOwnGoodnessIncludingLoops()));
+    Child->getBudgetCandidates(Candidates.size() - 1, Candidates);
+
+  }
+
+  for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
+	itend = peelChildren.end(); it != itend; ++it) {
+
+    PeelAttempt* LPA = it->second;
+    if((!LPA->isEnabled()) || !LPA->isTerminated())
+      continue;
+
+    for(uint32_t i = 0, ilim = LPA->Iterations.size(); i != ilim; ++i)
+      LPA->Iterations[i]->getBudgetCandidates(parentIdx, Candidates);
+
+  }
+
+}
+
+// Contexts that must be kept come first, then the best benefit per residual instruction.
+struct BudgetCandidateOrder {
+
+  std::vector<BudgetCandidate>& Candidates;
+  BudgetCandidateOrder(std::vector<BudgetCandidate>& C) : Candidates(C) { }
+
+  bool operator()(uint32_t a, uint32_t b) const {
+
+    BudgetCandidate& A = Candidates[a];
+    BudgetCandidate& B = Candidates[b];
+    if(A.IA->containsCheckedReads != B.IA->containsCheckedReads)
+      return A.IA->containsCheckedReads;
+    return ((double)A.benefit / (double)(A.charge + 1)) > ((double)B.benefit / (double)(B.charge + 1));
+
+  }
+
+};
+
+// Enforce -llpe-code-size-budget. When a context is finalised, it and the uncommitted callees
+// that would be committed with it compete for the remaining budget: they are picked greedily by
+// benefit per residual instruction, where picking a callee means picking the contexts above it
+// too. Those left out are disabled. Callees committed earlier are already paid for; any that
+// will now not be used, because a context or loop above them was disabled, are refunded.
+void InlineAttempt::applyCodeSizeBudget() {
+
+  if(!pass->codeSizeBudget)
+    return;
+
+  uint64_t charged = 0, kept = 0;
+  getChildBudgetCharge(isEnabled(), charged, kept);
+  release_assert(pass->codeSizeBudgetUsed >= charged - kept);
+  pass->codeSizeBudgetUsed -= (charged - kept);
+
+  if(!isEnabled()) {
+    budgetCharge = 0;
+    return;
+  }
+
+  std::vector<BudgetCandidate> Candidates;
+  int64_t residual = getResidualInstructions();
+  Candidates.push_back(BudgetCandidate(this, -1, residual > 0 ? (uint64_t)residual : 0, getOwnGoodnessIncludingLoops()));
+  getBudgetCandidates(0, Candidates);
+
+  std::vector<uint32_t> Order;
+  for(uint32_t i = 0, ilim = Candidates.size(); i != ilim; ++i)
+    Order.push_back(i);
+  std::stable_sort(Order.begin(), Order.end(), BudgetCandidateOrder(Candidates));
+
+  for(std::vector<uint32_t>::iterator it = Order.begin(), itend = Order.end(); it != itend; ++it) {
+
+    if(Candidates[*it].picked)
+      continue;
+
+    uint64_t cost = 0;
+    for(int32_t i = *it; i != -1 && !Candidates[i].picked; i = Candidates[i].parentIdx)
+      cost += Candidates[i].charge;
+
+    if(pass->codeSizeBudgetUsed + cost > pass->codeSizeBudget && !Candidates[*it].IA->containsCheckedReads)
+      continue;
+
+    for(int32_t i = *it; i != -1 && !Candidates[i].picked; i = Candidates[i].parentIdx)
+      Candidates[i].picked = true;
+    pass->codeSizeBudgetUsed += cost;
+
+  }
+
+  // Disable those left out, parents first; anything below a disabled context goes with it.
+  // The root, shared functions and path conditions can't be disabled, so are paid for anyway.
+  uint64_t pickedCharge = 0;
+  for(uint32_t i = 0, ilim = Candidates.size(); i != ilim; ++i) {
+
+    BudgetCandidate& C = Candidates[i];
+
+    if(!C.picked) {
+
+      if(C.parentIdx != -1 && !Candidates[C.parentIdx].picked)
+	continue;
+
+      C.IA->setEnabled(false, true);
+      if(!C.IA->isEnabled()) {
+	++pass->stats.budgetDisabledContexts;
+	continue;
+      }
+
+      C.picked = true;
+      pass->codeSizeBudgetUsed += C.charge;
+
+    }
+
+    pickedCharge += C.charge;
+
+  }
+
+  uint64_t newCharged = 0, newKept = 0;
+  getChildBudgetCharge(isEnabled(), newCharged, newKept);
+  release_assert(kept >= newKept);
+  pass->codeSizeBudgetUsed -= (kept - newKept);
+
+  budgetCharge = isEnabled() ? pickedCharge + newKept : 0;
+
+}
+
 // Will this specialisation context be committed in a different residual function
 // to its parent?
 bool InlineAttempt::commitsOutOfLine() {
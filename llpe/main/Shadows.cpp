@@ -186,6 +186,7 @@ void LLPEAnalysisPass::initShadowGlobals(Module& M, uint32_t extraSlots) {
   uint32_t nGlobals = std::distance(M.global_begin(), M.global_end());
   // extraSlots are reserved for new globals we know will be introduced between now and specialisation start.
   nGlobals += extraSlots;
+  delete[] shadowGlobals;
   shadowGlobals = new ShadowGV[nGlobals];
 
   // Assign them all numbers before computing initialisers, because the initialiser can
@@ -259,6 +260,7 @@ static const GlobalVariable* getGlobalVar(const Value* V) {
 ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   // Already described?
+  DenseMap<Function*, ShadowFunctionInvar*>& functionInfo = functionAnalyses->functionInfo;
   DenseMap<Function*, ShadowFunctionInvar*>::iterator findit = functionInfo.find(&F);
   if(findit != functionInfo.end())
     return findit->second;
@@ -491,13 +493,15 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
   // all loops consist of that block + L->getBlocks().size() further, contiguous blocks,
   // making is-in-loop easy to compute.
 
-  DominatorTree* thisDT = DTs[&F];
+  DominatorTree* thisDT = functionAnalyses->DTs[&F];
 
   for(LoopInfo::iterator it = LI->begin(), it2 = LI->end(); it != it2; ++it) {
     ShadowLoopInvar* newL = getLoopInfo(&RetInfo, BBIndices, *it, thisDT, 0);
     RetInfo.TopLevelLoops.push_back(newL);
   }
 
+  setBlockProfileWeights(F, RetInfo, LI);
+
   // Count alloca instructions at the start of the function; this will control how
   // large the std::vector that represents the frame will be initialised.
   RetInfo.frameSize = 0;
@@ -507,7 +511,7 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
   // "&& RootIA" checks whether we're inside the initial context creation, in which case we should
   // allocate a frame whether or not main can ever allocate to avoid the frame index underflowing
   // in some circumstances.
-  if((!RetInfo.frameSize) && RootIA) {
+  if((!RetInfo.frameSize) && (RootIA || warmAnalysesOnly)) {
 
     // Magic value indicating the function will never alloca anything and we can skip all frame processing.
     RetInfo.frameSize = -1;
@@ -522,10 +526,96 @@ ShadowFunctionInvar* LLPEAnalysisPass::getFunctionInvarInfo(Function& F) {
 
   }
 
+  // Note descriptions that another batch job must not reuse: the root's (its entry block
+  // was rewritten and its frame forced) and any shaped by this job's loop options or profile.
+  bool loopOptions = ignoreLoops.count(&F) || ignoreLoopsWithChildren.count(&F) || alwaysIterLoops.count(&F);
+  for(DenseMap<std::pair<Function*, BasicBlock*>, BasicBlock*>::iterator it = optimisticLoopMap.begin(),
+	itend = optimisticLoopMap.end(); it != itend && !loopOptions; ++it) {
+    if(it->first.first == &F)
+      loopOptions = true;
+  }
+
+  if(((!RootIA) && !warmAnalysesOnly) || useBlockProfile || loopOptions)
+    functionAnalyses->jobSpecific.insert(&F);
+
   return RetInfoP;
 
 }
 
+static void deleteLoopInvar(ShadowLoopInvar* L) {
+
+  for(SmallVector<ShadowLoopInvar*, 1>::iterator it = L->childLoops.begin(), itend = L->childLoops.end(); it != itend; ++it)
+    deleteLoopInvar(*it);
+  delete L;
+
+}
+
+// Discard F's description, if any, so that the next getFunctionInvarInfo rebuilds it.
+void LLPEAnalysisPass::forgetFunctionInvarInfo(Function* F) {
+
+  DenseMap<Function*, ShadowFunctionInvar*>::iterator findit = functionAnalyses->functionInfo.find(F);
+  if(findit == functionAnalyses->functionInfo.end())
+    return;
+
+  ShadowFunctionInvar* SFI = findit->second;
+  functionAnalyses->functionInfo.erase(findit);
+  functionAnalyses->jobSpecific.erase(F);
+
+  for(uint32_t i = 0, ilim = SFI->BBs.size(); i != ilim; ++i) {
+
+    ShadowBBInvar& SBB = SFI->BBs[i];
+    for(uint32_t j = 0, jlim = SBB.insts.size(); j != jlim; ++j) {
+      SBB.insts[j].operandIdxs.release();
+      SBB.insts[j].userIdxs.release();
+      SBB.insts[j].operandBBs.release();
+    }
+    SBB.insts.release();
+    SBB.succIdxs.release();
+    SBB.predIdxs.release();
+
+  }
+
+  for(uint32_t i = 0, ilim = SFI->Args.size(); i != ilim; ++i)
+    SFI->Args[i].userIdxs.release();
+
+  for(SmallVector<ShadowLoopInvar*, 4>::iterator it = SFI->TopLevelLoops.begin(), itend = SFI->TopLevelLoops.end(); it != itend; ++it)
+    deleteLoopInvar(*it);
+
+  SFI->BBs.release();
+  SFI->Args.release();
+  delete SFI->pathConditions;
+  delete SFI;
+
+}
+
+// Called once this job's options are known, before any function is described: drop descriptions
+// that a previous job (or this one) would see differently, and the previous job's path conditions.
+void LLPEAnalysisPass::forgetJobSpecificInvarInfo(Function& Root) {
+
+  std::vector<Function*> stale(functionAnalyses->jobSpecific.begin(), functionAnalyses->jobSpecific.end());
+  stale.push_back(&Root);
+
+  for(DenseMap<Function*, ShadowFunctionInvar*>::iterator it = functionAnalyses->functionInfo.begin(),
+	itend = functionAnalyses->functionInfo.end(); it != itend; ++it) {
+
+    Function* F = it->first;
+    if(useBlockProfile || ignoreLoops.count(F) || ignoreLoopsWithChildren.count(F) || alwaysIterLoops.count(F))
+      stale.push_back(F);
+
+    delete it->second->pathConditions;
+    it->second->pathConditions = 0;
+
+  }
+
+  for(DenseMap<std::pair<Function*, BasicBlock*>, BasicBlock*>::iterator it = optimisticLoopMap.begin(),
+	itend = optimisticLoopMap.end(); it != itend; ++it)
+    stale.push_back(it->first.first);
+
+  for(std::vector<Function*>::iterator it = stale.begin(), itend = stale.end(); it != itend; ++it)
+    forgetFunctionInvarInfo(*it);
+
+}
+
 // Prepare the context-specific data structures, tying them to known invariant information.
 
 void InlineAttempt::prepareShadows() {
@@ -624,6 +714,8 @@ ShadowBB* IntegrationAttempt::createBB(uint32_t blockIdx) {
     newBB->succsAlive[i] = false;
   newBB->status = BBSTATUS_UNKNOWN;
   newBB->IA = this;
+  newBB->walkEpochStart = 0;
+  newBB->walkEpochEnd = 0;
 
   ShadowInstruction* insts = new ShadowInstruction[newBB->invar->insts.size()];
   for(uint32_t i = 0, ilim = newBB->invar->insts.size(); i != ilim; ++i) {
@@ -721,6 +813,21 @@ ShadowInstruction* IntegrationAttempt::getInst(ShadowInstructionInvar* SII) {
 
 }
 
+std::vector<uint64_t> ShadowValue::boxedCIs;
+DenseMap<uint64_t, uint32_t> ShadowValue::boxedCIIndex;
+
+// Intern a constant whose top bits don't sign-extend from bit 57, returning its boxedCIs index.
+// Only 64-bit constants can need this (and never -1 or -2, which DenseMap reserves), and
+// few distinct ones occur in practice.
+uint64_t ShadowValue::boxCI(uint64_t CI) {
+
+  std::pair<DenseMap<uint64_t, uint32_t>::iterator, bool> ins = boxedCIIndex.insert(std::make_pair(CI, boxedCIs.size()));
+  if(ins.second)
+    boxedCIs.push_back(CI);
+  return ins.first->second;
+
+}
+
 // Create an integer shadow value, using a cheap representation for common types.
 // This is needed because specialisation can generate many intermediate values
 // and LLVM Constants are uniqued and live forever.
@@ -837,11 +944,11 @@ bool FDGlobalState::isAvailable() {
 // Is this shadow-value generally available for committed code to reference?
 bool ShadowValue::objectAvailable() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_OTHER: 
     {
       // Special locations (e.g. TLS) are purely symbolic; they can't be represented in a specialised program.
-      if(Function* F = dyn_cast<Function>(u.V))
+      if(Function* F = dyn_cast<Function>(getVal()))
 	return !GlobalIHP->specialLocations.count(F);
       else
 	return true;
@@ -852,16 +959,16 @@ bool ShadowValue::objectAvailable() const {
     return true;
   case SHADOWVAL_INST:
     // Allocations made within a path condition assertion are symbolic.
-    if(u.I->parent->IA->getFunctionRoot()->isPathCondition)
+    if(getInst()->parent->IA->getFunctionRoot()->isPathCondition)
       return false;
     // Disabled contexts won't be committed.
-    if(!u.I->parent->IA->allAncestorsEnabled())
+    if(!getInst()->parent->IA->allAncestorsEnabled())
       return false;
     return true;
   case SHADOWVAL_PTRIDX:
     // Stack-allocated members are necessarily available from any context
     // that can conceivably reach them.
-    if(u.PtrOrFd.frame != -1)
+    if(getPtrOrFdFrame() != -1)
       return true;
     else {
       // Malloc is non-const global:
@@ -1048,15 +1155,15 @@ IntegrationAttempt* InlineAttempt::getIAForScopeFalling(const ShadowLoopInvar* S
 // Get the Type this non-pointer ShadowValue will take when (if) synthesised.
 Type* ShadowValue::getNonPointerType() const {
 
-  switch(t) {
+  switch(getValType()) {
   case SHADOWVAL_ARG:
-    return u.A->getType();
+    return getArg()->getType();
   case SHADOWVAL_INST:
-    return u.I->getType();
+    return getInst()->getType();
   case SHADOWVAL_GV:
-    return u.GV->G->getType();
+    return getGV()->G->getType();
   case SHADOWVAL_OTHER:
-    return u.V->getType();
+    return getVal()->getType();
   case SHADOWVAL_FDIDX:
     return GInt32;
   case SHADOWVAL_FDIDX64:
@@ -1079,7 +1186,7 @@ Type* ShadowValue::getNonPointerType() const {
 // Get the Type this ShadowValue will take when (if) synthesised.
 Type* IntegrationAttempt::getValueType(ShadowValue V) {
 
-  switch(V.t) {
+  switch(V.getValType()) {
   case SHADOWVAL_PTRIDX:
     {
       AllocData* AD = getAllocData(V);
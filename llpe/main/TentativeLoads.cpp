@@ -171,7 +171,7 @@ static void markGoodBytes(ShadowValue GoodPtr, uint64_t Len, bool contextEnabled
     return;
 
   // Constants are always good.
-  if(PtrTarget.second.V.isGV() &&  PtrTarget.second.V.u.GV->G->isConstant())
+  if(PtrTarget.second.V.isGV() &&  PtrTarget.second.V.getGV()->G->isConstant())
     return;
 
   SmallVector<std::pair<uint64_t, uint64_t>, 1> addRanges;
@@ -350,7 +350,7 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
     ShadowValue SV(SI);
     ShadowValue Base;
     getBaseObject(SV, Base);
-    markGoodBytes(ShadowValue(SI), SI->parent->IA->getFunctionRoot()->localAllocas[Base.u.PtrOrFd.idx].storeSize, contextEnabled, SI->parent);
+    markGoodBytes(ShadowValue(SI), SI->parent->IA->getFunctionRoot()->localAllocas[Base.getPtrOrFdIdx()].storeSize, contextEnabled, SI->parent);
 
   }
   else if(LoadInst* LI = dyn_cast_inst<LoadInst>(SI)) {
@@ -437,7 +437,7 @@ static void updateTLStore(ShadowInstruction* SI, bool contextEnabled) {
 	    ShadowValue Base;
 	    getBaseObject(SV, Base);
 
-	    markGoodBytes(SV, GlobalIHP->heap[Base.u.PtrOrFd.idx].storeSize, contextEnabled, SI->parent);
+	    markGoodBytes(SV, GlobalIHP->heap[Base.getPtrOrFdIdx()].storeSize, contextEnabled, SI->parent);
 
 	  }
 
@@ -503,7 +503,7 @@ static bool shouldCheckRead(ImprovedVal& Ptr, uint64_t Size, ShadowBB* BB) {
     return false;
 
   // Read from constant global?
-  if(Ptr.V.isGV() && Ptr.V.u.GV->G->isConstant())
+  if(Ptr.V.isGV() && Ptr.V.getGV()->G->isConstant())
     return false;
 
   bool verbose = false;
@@ -1280,8 +1280,8 @@ void IntegrationAttempt::findTentativeLoadsInLoop(const ShadowLoopInvar* L, bool
 
 }
 
-// Stats interface -- count instructions that need a runtime check. Recurse into uncommitted
-// child contexts.
+// Stats interface -- count instructions that need a runtime check. Uncommitted child contexts
+// have already been counted by InlineAttempt::collectFinalisationStats.
 void IntegrationAttempt::countTentativeInstructions() {
 
   if(isCommitted())
@@ -1327,26 +1327,18 @@ void IntegrationAttempt::countTentativeInstructions() {
 
   checkedInstructionsChildren = checkedInstructionsHere;
 
-  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it) {
-
-    it->second->countTentativeInstructions();
+  for(IAIterator it = child_calls_begin(this), itend = child_calls_end(this); it != itend; ++it)
     checkedInstructionsChildren += it->second->checkedInstructionsChildren;
 
-  }
-
   for(DenseMap<const ShadowLoopInvar*, PeelAttempt*>::iterator it = peelChildren.begin(),
 	itend = peelChildren.end(); it != itend; ++it) {
 
     if(!it->second->isTerminated())
       continue;
 
-    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i) {
-     
-      it->second->Iterations[i]->countTentativeInstructions();
+    for(uint32_t i = 0, ilim = it->second->Iterations.size(); i != ilim; ++i)
       checkedInstructionsChildren += it->second->Iterations[i]->checkedInstructionsChildren;
 
-    }
-
   }
 
 }
@@ -1382,7 +1374,7 @@ bool llvm::requiresRuntimeCheck(ShadowValue V, bool includeSpecialChecks) {
   if(!V.isInst())
     return false;
 
-  return V.u.I->parent->IA->requiresRuntimeCheck2(V, includeSpecialChecks);
+  return V.getInst()->parent->IA->requiresRuntimeCheck2(V, includeSpecialChecks);
 
 }
 
@@ -1390,7 +1382,7 @@ bool llvm::requiresRuntimeCheck(ShadowValue V, bool includeSpecialChecks) {
 bool IntegrationAttempt::requiresRuntimeCheck2(ShadowValue V, bool includeSpecialChecks) {
 
   release_assert(V.isInst());
-  ShadowInstruction* SI = V.u.I;
+  ShadowInstruction* SI = V.getInst();
 
   // Nothing to check?
   if(SI->getType()->isVoidTy())
@@ -1450,8 +1442,41 @@ bool IntegrationAttempt::requiresRuntimeCheck2(ShadowValue V, bool includeSpecia
 
 }
 
+// Is BBI part of a child loop that will be committed per iteration, and so whose
+// checkpoints belong to the iteration contexts?
+bool IntegrationAttempt::isInCommittedPeel(ShadowBBInvar* BBI) {
+
+  if(BBI->naturalScope == L)
+    return false;
+
+  PeelAttempt* LPA = getPeelAttempt(immediateChildLoop(L, BBI->naturalScope));
+  return LPA && LPA->isTerminated() && LPA->isEnabled();
+
+}
+
+bool IntegrationAttempt::anyBlockLiveIn(const ShadowLoopInvar* LoopI) {
+
+  for(uint32_t i = LoopI->headerIdx, ilim = BBsOffset + nBBs; i < ilim && LoopI->contains(getBBInvar(i)->naturalScope); ++i) {
+    if(getBB(i))
+      return true;
+  }
+
+  return false;
+
+}
+
+// Does SI need a checkpoint itself? If so, any call context it has doesn't add one.
+bool IntegrationAttempt::isCheckpointInstruction(ShadowInstruction* SI) {
+
+  return requiresRuntimeCheck2(ShadowValue(SI), false) || SI->needsRuntimeCheck == RUNTIME_CHECK_READ_MEMCMP ||
+    SI->needsRuntimeCheck == RUNTIME_CHECK_READ_LLIOWD;
+
+}
+
 // Note basic blocks which must have unspecialised versions available,
-// in case we fail a runtime check and bail to unspecialised code.
+// in case we fail a runtime check and bail to unspecialised code. Enabled child contexts
+// have already been visited by InlineAttempt::prepareCommitTree, including the iterations
+// of loops that will be committed per iteration (whose blocks we skip here).
 void IntegrationAttempt::addCheckpointFailedBlocks() {
 
   if(isCommitted())
@@ -1466,26 +1491,15 @@ void IntegrationAttempt::addCheckpointFailedBlocks() {
     if(!BB)
       continue;
 
-    if(BBI->naturalScope != L) {
+    if(isInCommittedPeel(BBI)) {
 
+      // Skip past the loop blocks.
       const ShadowLoopInvar* subL = immediateChildLoop(L, BBI->naturalScope);
-      PeelAttempt* LPA;
-
-      if((LPA = getPeelAttempt(subL)) && LPA->isTerminated() && LPA->isEnabled()) {
-
-	// We'll emit specialised code per iteration. Check for spec-to-unspec edges
-	// in each such iteration.
-	for(uint32_t k = 0, klim = LPA->Iterations.size(); k != klim; ++k)
-	  LPA->Iterations[k]->addCheckpointFailedBlocks();	
-
-	// Skip past the loop blocks.
-	while(i != ilim && subL->contains(getBBInvar(i)->naturalScope))
-	  ++i;
-	--i;
-	continue;
+      while(i != ilim && subL->contains(getBBInvar(i)->naturalScope))
+	++i;
+      --i;
+      continue;
 	
-      }
-
     }
 
     // For each instruction in this block:
@@ -1517,9 +1531,6 @@ void IntegrationAttempt::addCheckpointFailedBlocks() {
       }
       else if((IA = getInlineAttempt(SI)) && IA->isEnabled()) {
 
-	// Recurse into child call context.
-	IA->addCheckpointFailedBlocks();
-
 	// If the call may bail to unspecialised code internally we'll need to bail ourselves
 	// after it returns.
 	if(IA->hasFailedReturnPath()) {
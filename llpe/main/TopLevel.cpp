@@ -57,13 +57,17 @@ InlineAttempt::InlineAttempt(LLPEAnalysisPass* Pass, Function& F,
   instructionsCommitted = false;
   emittedAlloca = false;
   blocksReachableOnFailure = 0;
+  failedTailEntry = INVALID_BLOCK_IDX;
   CommitF = 0;
   targetCallInfo = 0;
   integrationGoodnessValid = false;
   backupTlStore = 0;
   backupDSEStore = 0;
+  budgetCharge = 0;
+  heapSnapshotEntry = 0;
+  heapSnapshotExit = 0;
   isStackTop = false;
-  DT = pass->DTs[&F];
+  DT = pass->functionAnalyses->DTs[&F];
   if(_CI) {
     Callers.push_back(_CI);
     uniqueParent = _CI->parent->IA;
@@ -140,6 +144,7 @@ IntegrationAttempt::~IntegrationAttempt() {
   }
 
   delete[] BBs;
+  childCalls.clear();
 
 }
 
@@ -194,11 +199,27 @@ PeelAttempt::~PeelAttempt() {
 
 // Free all memory belonging to the pass. The specialisation contexts' destructors will take care of the real work.
 void LLPEAnalysisPass::releaseMemory(void) {
+  closeReport();
+  if(reportReader) {
+    delete reportReader;
+    reportReader = 0;
+  }
+
   if(RootIA) {
     delete RootIA;
     RootIA = 0;
   }
 
+  clearValueCache();
+  if(persistPrinter) {
+    freePersistPrinter(persistPrinter);
+    persistPrinter = 0;
+  }
+
+  // Also frees the constant globals' cached images.
+  delete[] shadowGlobals;
+  shadowGlobals = 0;
+
   std::string command;
   raw_string_ostream ROS(command);
   ROS << "rm -rf " << ihp_workdir;
@@ -209,7 +230,37 @@ void LLPEAnalysisPass::releaseMemory(void) {
     errs() << "Warning: failed to delete " << ihp_workdir << "\n";
 
   }
-  
+
+}
+
+extern int nLoopsWritten;
+
+// Batch mode runs the pass several times in one process. Clear the process-wide state a
+// previous job may have left behind, and the pass state that options would otherwise inherit.
+void LLPEAnalysisPass::resetJobState() {
+
+  strcpy(ihp_workdir, "/tmp/ihp_XXXXXX");
+  SpecialFunctionMap.clear();
+  ShadowValue::boxedCIs.clear();
+  ShadowValue::boxedCIIndex.clear();
+  IAWalker::resetEpochs();
+  nLoopsWritten = 0;
+  GlobalIHP = 0;
+
+  reportPath.clear();
+  statsFile.clear();
+  inPlaceInsts.clear();
+
+}
+
+// Remove the instructions this job added to unspecialised functions, so that the module
+// and the function descriptions in functionAnalyses can serve the next batch job.
+void LLPEAnalysisPass::revertInPlaceChanges() {
+
+  for(std::vector<Instruction*>::reverse_iterator it = inPlaceInsts.rbegin(), itend = inPlaceInsts.rend(); it != itend; ++it)
+    (*it)->eraseFromParent();
+  inPlaceInsts.clear();
+
 }
 
 // Run a simple possible-allocation-sites exploration of V, used in finding out whether root
@@ -457,6 +508,8 @@ namespace llvm {
 
 bool LLPEAnalysisPass::runOnModule(Module& M) {
 
+  resetJobState();
+
   if(!mkdtemp(ihp_workdir)) {
     errs() << "Failed to create " << ihp_workdir << "\n";
     exit(1);
@@ -476,14 +529,30 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
 
   initMRInfo(&M);
   
+  // Dominator trees survive from earlier batch jobs: no job changes an unspecialised
+  // function's CFG.
   for(Module::iterator MI = M.begin(), ME = M.end(); MI != ME; MI++) {
 
-    if(!MI->isDeclaration()) {
+    if((!MI->isDeclaration()) && !functionAnalyses->DTs.count(&*MI)) {
       DominatorTree* NewDT = new DominatorTree();
       NewDT->recalculate(*MI);
-      DTs[&*MI] = NewDT;
+      functionAnalyses->DTs[&*MI] = NewDT;
+    }
+
+  }
+
+  // Describe every function under default options, so that forked batch workers
+  // inherit the descriptions rather than each building its own.
+  if(warmAnalysesOnly) {
+
+    initShadowGlobals(M, 0);
+    for(Module::iterator MI = M.begin(), ME = M.end(); MI != ME; MI++) {
+      if(!MI->isDeclaration())
+	getFunctionInvarInfo(*MI);
     }
 
+    return false;
+
   }
 
   Function* FoundF = M.getFunction(RootFunctionName);
@@ -509,11 +578,22 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   uint32_t argvIdx = 0xffffffff;
   parseArgs(F, argConstants, argvIdx);
 
-  populateGVCaches(&M);
+  // The GUI always reads its graphs from a report; otherwise only write one if asked.
+  if(reportPath.empty() && IHPSaveDOTFiles)
+    reportPath = std::string(ihp_workdir) + "/report.jsonl";
+
+  // Only keep value text around if something will print it repeatedly.
+  if(!reportPath.empty() || verboseOverdef || verboseSharing || verbosePCs || dumpDSE || dumpTL || !statsFile.empty())
+    enableValueCache();
+
+  if(!reportPath.empty())
+    openReport();
+
   initSpecialFunctionsMap(M);
   // Last parameter: reserve extra GV slots for the constants that path condition parsing will produce.
   initShadowGlobals(M, getStringPathConditionCount());
   initBlacklistedFunctions(M);
+  forgetJobSpecificInvarInfo(F);
 
   InlineAttempt* IA = new InlineAttempt(this, F, 0, 0);
   if(targetCallStack.size()) {
@@ -566,6 +646,9 @@ bool LLPEAnalysisPass::runOnModule(Module& M) {
   IA->finaliseAndCommit(false);
   fixNonLocalUses();
   errs() << "\n";
+
+  // Make sure the GUI sees every context's record.
+  closeReport();
   
   if(IHPSaveDOTFiles) {
 
@@ -153,17 +153,30 @@ void FDStoreMerger::merge2(FDStore* mergeTo, FDStore* mergeFrom)  {
   // Simple merge rule: FDs only defined on one path or the other go away entirely,
   // FDs with conflicting positions go to pos -1 (unknown), all others stay.
 
-  mergeTo->fds.resize(std::min(mergeTo->fds.size(), mergeFrom->fds.size()));
+  uint32_t newSize = std::min(mergeTo->size(), mergeFrom->size());
+  mergeTo->resize(newSize);
 
-  for(uint32_t i = 0, ilim = mergeTo->fds.size(); i != ilim; ++i) {
+  for(uint32_t c = 0, clim = mergeTo->chunks.size(); c != clim; ++c) {
 
-    if(mergeFrom->fds[i].pos != mergeTo->fds[i].pos)
-      mergeTo->fds[i].pos = (uint64_t)-1;
-    // 'clean' means we're confident that FD positions and files are as expected;
-    // there's no need to check they're as expected e.g. due to another thread using
-    // the FD in the meantime, or another thread or program altering the file.
-    if(!mergeFrom->fds[i].clean)
-      mergeTo->fds[i].clean = false;
+    // Chunks still shared by both stores can't differ.
+    if(mergeTo->chunks[c] == mergeFrom->chunks[c])
+      continue;
+
+    for(uint32_t i = c * FDCHUNKSIZE, ilim = std::min(newSize, (c + 1) * FDCHUNKSIZE); i != ilim; ++i) {
+
+      const FDState& From = mergeFrom->get(i);
+      bool posDiffers = From.pos != mergeTo->get(i).pos;
+      // 'clean' means we're confident that FD positions and files are as expected;
+      // there's no need to check they're as expected e.g. due to another thread using
+      // the FD in the meantime, or another thread or program altering the file.
+      bool loseClean = (!From.clean) && mergeTo->get(i).clean;
+
+      if(posDiffers)
+	mergeTo->getWritableFD(i).pos = (uint64_t)-1;
+      if(loseClean)
+	mergeTo->getWritableFD(i).clean = false;
+
+    }
 
   }
 
@@ -280,7 +293,7 @@ void llvm::doCallFDStoreMerge(ShadowBB* CallerBB, InlineAttempt* CallIA) {
 
 // Simple hack to avoid obviously-pointless specialisation. Of course these could mount
 // elsewhere and this should be configurable.
-static bool filenameIsForbidden(std::string& s) {
+static bool filenameIsForbidden(const std::string& s) {
 
   return s.empty() || s.find("/proc/") == 0 || s.find("/sys/") == 0 || s.find("/dev/") == 0;
 
@@ -341,9 +354,7 @@ bool IntegrationAttempt::tryPromoteOpenCall(ShadowInstruction* SI) {
 	    FDStore* FDS = SI->parent->getWritableFDStore();
 	    uint32_t newId = pass->fds.size();
 	    pass->fds.push_back(FDGlobalState(SI, /* not a fifo */ false));
-	    if(FDS->fds.size() <= newId)
-	      FDS->fds.resize(newId + 1);
-	    FDS->fds[newId] = FDState(Filename);
+	    FDS->set(newId, FDState(pass->internFDFilename(Filename)));
 	    
 	    cast<ImprovedValSetSingle>(SI->i.PB)->set(ImprovedVal(ShadowValue::getFdIdx(newId)), ValSetTypeFD);
 
@@ -412,7 +423,7 @@ static uint32_t getFD(ShadowValue V) {
   if(VPB.Overdef || VPB.Values.size() != 1 || VPB.SetType != ValSetTypeFD)
     return (uint32_t)-1;
 
-  return VPB.Values[0].V.u.PtrOrFd.idx;
+  return VPB.Values[0].V.getPtrOrFdIdx();
 
 }
 
@@ -446,7 +457,7 @@ static AliasResult aliasesFD(ShadowValue V, ShadowInstruction* FD) {
 
 // Add 'Filename' to the list of files we've consumed from in generating the specialised program,
 // and therefore which must be watched for concurrent alteration to ensure correctness.
-void llvm::noteLLIODependency(std::string& Filename) {
+void llvm::noteLLIODependency(const std::string& Filename) {
   
   std::vector<std::string>::iterator findit = 
     std::find(GlobalIHP->llioDependentFiles.begin(), GlobalIHP->llioDependentFiles.end(), Filename);
@@ -457,7 +468,7 @@ void llvm::noteLLIODependency(std::string& Filename) {
 }
 
 // Try to run '[f]stat' call SI, which calls F, and investigates file 'Filename'.
-bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, std::string& Filename) {
+bool IntegrationAttempt::executeStatCall(ShadowInstruction* SI, Function* F, const std::string& Filename) {
 
   struct stat file_stat;
   int stat_ret = ::stat(Filename.c_str(), &file_stat);
@@ -555,15 +566,17 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
  
   // Operates on an unknown FD?
   if(FD == (uint32_t)-1 && perturbsFDs) {
-    fdStore->fds.clear();
+    fdStore->clear();
     return true;
   }
 
   // Operates on an FD not opened on this path?
-  if(SI->parent->fdStore->fds.size() <= FD)
+  if(fdStore->size() <= FD)
     return true;
 
-  FDState& FDS = SI->parent->fdStore->fds[FD];
+  // Only FDs that change are CoW broken, through getWritableFD.
+  const FDState& FDS = fdStore->get(FD);
+  const std::string& Filename = pass->getFDFilename(FDS.filenameId);
 
   if(F->getName() == "isatty") {
 
@@ -587,7 +600,7 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     if((!tryGetConstantIntReplacement(SI->getCallArgOperand(2), seekWhence64)) || 
        (!tryGetConstantIntReplacement(SI->getCallArgOperand(1), intOffset))) {
     
-      FDS.pos = (uint32_t)-1;
+      fdStore->getWritableFD(FD).pos = (uint32_t)-1;
       return true;
 
     }
@@ -606,9 +619,9 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     case SEEK_END:
       {
 	struct stat file_stat;
-	if(::stat(FDS.filename.c_str(), &file_stat) == -1) {
+	if(::stat(Filename.c_str(), &file_stat) == -1) {
 	  
-	  LPDEBUG("Failed to stat " << FDS.filename << "\n");
+	  LPDEBUG("Failed to stat " << Filename << "\n");
 	  return true;
 	  
 	}
@@ -626,14 +639,14 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     // Doesn't matter what came before, resolve this call here.
     setReplacement(SI, ConstantInt::get(FT->getParamType(1), intOffset));
-    resolveSeekCall(SI, SeekFile(FDS.filename, intOffset));
-    FDS.pos = intOffset;
+    resolveSeekCall(SI, SeekFile(Filename, intOffset));
+    fdStore->getWritableFD(FD).pos = intOffset;
     return true;
 
   }
   else if(F->getName() == "fstat") {
 
-    return executeStatCall(SI, F, FDS.filename);
+    return executeStatCall(SI, F, Filename);
 
   }
   else if(F->getName() == "close") {
@@ -649,26 +662,26 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     uint64_t ucBytes;
 
     if(!tryGetConstantIntReplacement(readBytes, ucBytes)) {
-      FDS.pos = (uint64_t)-1;
+      fdStore->getWritableFD(FD).pos = (uint64_t)-1;
       return true;
     }
     
     int64_t cBytes = (int64_t)ucBytes;
 
-    if(filenameIsForbidden(FDS.filename)) {
-      FDS.pos = (uint64_t)-1;
+    if(filenameIsForbidden(Filename)) {
+      fdStore->getWritableFD(FD).pos = (uint64_t)-1;
       return true;
     }
 
     struct stat file_stat;
-    if(::stat(FDS.filename.c_str(), &file_stat) == -1) {
-      LPDEBUG("Failed to stat " << FDS.filename << "\n");
-      FDS.pos = (uint64_t)-1;
+    if(::stat(Filename.c_str(), &file_stat) == -1) {
+      LPDEBUG("Failed to stat " << Filename << "\n");
+      fdStore->getWritableFD(FD).pos = (uint64_t)-1;
       return true;
     }
 
     if(!(file_stat.st_mode & S_IFREG)) {
-      FDS.pos = (uint64_t)-1;
+      fdStore->getWritableFD(FD).pos = (uint64_t)-1;
       return true;
     }
 
@@ -684,7 +697,7 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     bool isFifo = pass->fds[FD].isFifo;
 
-    resolveReadCall(SI, ReadFile(FDS.filename, FDS.pos, cBytes, isFifo));
+    resolveReadCall(SI, ReadFile(Filename, FDS.pos, cBytes, isFifo));
     if(isFifo)
       pass->resolvedReadCalls[SI].needsSeek = false;
     
@@ -692,10 +705,10 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
     setReplacement(SI, ConstantInt::get(Type::getInt64Ty(F->getContext()), cBytes));
 
     // Write the relevant data into the symbolic store.
-    executeReadInst(SI, FDS.filename, FDS.pos, cBytes);
+    executeReadInst(SI, Filename, FDS.pos, cBytes);
 
     if(!isFifo)
-      noteLLIODependency(FDS.filename);
+      noteLLIODependency(Filename);
 
     if(isFifo)
       SI->needsRuntimeCheck = RUNTIME_CHECK_READ_MEMCMP;
@@ -704,9 +717,10 @@ bool IntegrationAttempt::tryResolveVFSCall(ShadowInstruction* SI) {
 
     this->containsCheckedReads = true;
 
-    FDS.pos += cBytes;
+    FDState& NewFDS = fdStore->getWritableFD(FD);
+    NewFDS.pos += cBytes;
     if(ElimRedundantChecks && !isFifo)
-      FDS.clean = true;
+      NewFDS.clean = true;
 
   }
 
@@ -1039,7 +1053,7 @@ void IntegrationAttempt::tryKillAllVFSOps() {
 
 // Read strFileName[realFilePos : realFilePos + realBytes] as an array of i8 typed Constants.
 // 'errors' will carry a verbose error report. Return true on success.
-bool llvm::getFileBytes(std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors) {
+bool llvm::getFileBytes(const std::string& strFileName, uint64_t realFilePos, uint64_t realBytes, std::vector<Constant*>& arrayBytes, LLVMContext& Context, std::string& errors) {
 
   FILE* fp = fopen(strFileName.c_str(), "r");
   if(!fp) {
@@ -1087,14 +1101,30 @@ void LLPEAnalysisPass::initGlobalFDStore() {
   // Reserve a slot for stdin.
   fds.push_back(FDGlobalState(true /* is a fifo */));
 
+  // Filename 0 is the empty name given to unopened FDs.
+  if(fdFilenames.empty())
+    internFDFilename(std::string());
+
+}
+
+uint32_t LLPEAnalysisPass::internFDFilename(const std::string& Name) {
+
+  StringMap<uint32_t>::iterator it = fdFilenameIds.find(Name);
+  if(it != fdFilenameIds.end())
+    return it->second;
+
+  uint32_t id = fdFilenames.size();
+  fdFilenames.push_back(Name);
+  fdFilenameIds[Name] = id;
+  return id;
+
 }
 
 void IntegrationAttempt::initialiseFDStore(FDStore* S) {
 
   // Initialise stdin with position 0
-  S->fds.push_back(FDState());
-  S->fds[0].filename = SpecStdIn;
-  S->fds[0].pos = 0;
-  S->fds[0].clean = false;
+  FDState StdIn(pass->internFDFilename(SpecStdIn));
+  StdIn.clean = false;
+  S->set(0, StdIn);
 
 }
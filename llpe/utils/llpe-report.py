@@ -0,0 +1,105 @@
+#!/usr/bin/python
+
+# Read a specialisation report written by LLPE (-llpe-report, or the GUI's working copy)
+# without rerunning the analysis. The report is mapped and only the records asked for
+# are parsed, using the index on its last line. See main/Report.cpp for the format.
+#
+#   llpe-report.py report.jsonl                 print the context tree
+#   llpe-report.py report.jsonl --show SEQ      print a context's blocks, results and edges
+#   llpe-report.py report.jsonl --dot SEQ       print a context's brief DOT graph (--full for the full one)
+
+from __future__ import print_function
+
+import argparse
+import base64
+import json
+import mmap
+import sys
+import zlib
+
+parser = argparse.ArgumentParser(description="Read an LLPE specialisation report")
+parser.add_argument("report")
+parser.add_argument("--show", type=int, metavar="SEQ")
+parser.add_argument("--dot", type=int, metavar="SEQ")
+parser.add_argument("--full", action="store_true", help="With --dot, print the full rather than brief graph")
+args = parser.parse_args()
+
+class Report(object):
+
+	def __init__(self, path):
+
+		self.f = open(path, "rb")
+		self.map = mmap.mmap(self.f.fileno(), 0, access=mmap.ACCESS_READ)
+		header = json.loads(self.map[:self.map.find(b"\n")].decode("utf-8"))
+		if header.get("llpe-report") != 1:
+			raise Exception("%s is not an LLPE report" % path)
+
+		end = len(self.map)
+		while end > 0 and self.map[end - 1:end] == b"\n":
+			end -= 1
+		trailer = json.loads(self.map[self.map.rfind(b"\n", 0, end) + 1:end].decode("utf-8"))
+		if "index" not in trailer:
+			raise Exception("%s has no index (was it finished?)" % path)
+
+		# Skip damaged index entries rather than failing on them.
+		self.index = {}
+		for entry in trailer["index"]:
+			if not (isinstance(entry, list) and len(entry) == 3 and all(isinstance(x, int) and x >= 0 for x in entry)):
+				continue
+			seq, off, length = entry
+			if off + length <= len(self.map):
+				self.index[seq] = (off, length)
+		self.root = trailer["root"]
+
+	def get(self, seq):
+
+		if seq not in self.index:
+			raise Exception("No context %d in the report" % seq)
+		off, length = self.index[seq]
+		r = json.loads(self.map[off:off + length].decode("utf-8"))
+		if "zlib" in r:
+			# Written with -llpe-report-compress-kb
+			r = json.loads(zlib.decompress(base64.b64decode(r["zlib"])).decode("utf-8"))
+		return r
+
+def print_tree(report, seq, depth):
+
+	if seq not in report.index:
+		print("%s[%d] (not saved)" % ("  " * depth, seq))
+		return
+
+	r = report.get(seq)
+	print("%s[%d] %s%s" % ("  " * depth, seq, r["short"], "" if r["enabled"] else " (disabled)"))
+
+	for child in r["children"]:
+		print_tree(report, child, depth + 1)
+	for loop in r["loops"]:
+		print("%sLoop %s (%s, %d iterations)" % ("  " * (depth + 1), loop["header"], "terminated" if loop["terminated"] else "not terminated", len(loop["iterations"])))
+		for it in loop["iterations"]:
+			print_tree(report, it, depth + 2)
+
+def show(report, seq):
+
+	r = report.get(seq)
+	print(r["header"])
+
+	for block in r["blocks"]:
+		print("\n%s (%s)" % (block["name"], block["status"]))
+		for inst in block.get("insts", []):
+			line = "  " + inst["text"].strip()
+			if inst["result"]:
+				line += "  ->  " + inst["result"]
+			if inst["deleted"]:
+				line += "  [deleted]"
+			print(line)
+		for edge in block["edges"]:
+			print("  => %s (%s)" % (edge["to"], edge["state"]))
+
+report = Report(args.report)
+
+if args.dot is not None:
+	sys.stdout.write(report.get(args.dot)["full" if args.full else "brief"])
+elif args.show is not None:
+	show(report, args.show)
+else:
+	print_tree(report, report.root, 0)
@@ -0,0 +1,27 @@
+// Loads after a yield point are checked at runtime. Each load here can see one of three
+// table entries, so its check tests membership of a set: the dense set is tested with a
+// shift-and-mask, the sparse one with a switch. Built with -llpe-yield-function=yield.
+
+int dense[3] = { 1, 2, 4 };
+int sparse[3] = { 3, 17, 1000 };
+
+__attribute__((noinline)) void yield(void) { }
+
+int main(int argc, char** argv) {
+
+  int k;
+  if(argc == 1)
+    k = 0;
+  else if(argc == 2)
+    k = 1;
+  else
+    k = 2;
+
+  yield();
+
+  int total = dense[k];
+  total += sparse[k];
+
+  return total & 0xff;
+
+}
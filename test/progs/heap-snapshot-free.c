@@ -0,0 +1,29 @@
+// Built with -llpe-heap-snapshot. Neither buffer may become a pre-initialised global: the first
+// is copied out part way through initialisation, and the second is freed through a call the
+// specialiser cannot resolve, which would be undefined behaviour if it were a global.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void (*volatile release)(void*) = free;
+
+int main(int argc, char** argv) {
+
+  int* copied = (int*)malloc(4 * sizeof(int));
+  int* freed = (int*)malloc(4 * sizeof(int));
+  int snapshot[2];
+
+  copied[0] = 10;
+  copied[1] = 20;
+  memcpy(snapshot, copied, (argc & 1) ? sizeof(snapshot) : sizeof(int));
+  copied[0] = 30;
+
+  freed[0] = 40;
+  freed[1] = 50;
+
+  printf("%d %d %d\n", snapshot[0], copied[0], freed[0] + freed[1]);
+  release(freed);
+  return 0;
+
+}
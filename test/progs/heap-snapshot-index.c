@@ -0,0 +1,24 @@
+// Built with -llpe-heap-snapshot. The buffer is read through an index that is only known at
+// runtime between its first and last constant stores, so that read sees its contents part way
+// through initialisation and the allocation must not be replaced by a pre-initialised global.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char** argv) {
+
+  int* buf = (int*)malloc(4 * sizeof(int));
+  int k = (argc - 1) & 1;
+
+  buf[0] = 10;
+  buf[1] = 20;
+
+  int before = buf[k];
+
+  buf[2] = 30;
+  buf[3] = 40;
+
+  printf("%d %d %d\n", before, buf[k + 2], buf[0] + buf[3]);
+  return 0;
+
+}
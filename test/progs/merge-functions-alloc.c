@@ -0,0 +1,35 @@
+// Like merge-functions, but each call to fill also allocates the buffer it fills and main uses
+// both buffers. The two residual copies of fill come out the same apart from which heap object
+// they allocate, so they must not be merged into one.
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+int* fill(int n, ...) {
+
+  va_list ap;
+  va_start(ap, n);
+
+  int* buf = (int*)malloc(n * sizeof(int));
+  for(int i = 0; i < n; ++i)
+    buf[i] = va_arg(ap, int);
+
+  va_end(ap);
+  return buf;
+
+}
+
+int main(int argc, char** argv) {
+
+  int* a = fill(2, argc, argc * 3);
+  int* b = fill(2, argc + 1, argc * 5);
+
+  a[0] += b[1];
+  printf("%d %d %d %d\n", a[0], a[1], b[0], b[1]);
+
+  free(a);
+  free(b);
+  return 0;
+
+}
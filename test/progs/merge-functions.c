@@ -0,0 +1,30 @@
+// Vararg functions are always committed out of line. Both calls to sum pass two values that are
+// only known at runtime, so their specialisations come out the same and should be merged into
+// one residual function after commit.
+
+#include <stdarg.h>
+#include <stdio.h>
+
+int sum(int n, ...) {
+
+  va_list ap;
+  va_start(ap, n);
+
+  int total = 0;
+  for(int i = 0; i < n; ++i)
+    total += va_arg(ap, int);
+
+  va_end(ap);
+  return total;
+
+}
+
+int main(int argc, char** argv) {
+
+  int a = sum(2, argc, argc * 3);
+  int b = sum(2, argc + 1, argc * 5);
+
+  printf("%d %d\n", a, b);
+  return 0;
+
+}
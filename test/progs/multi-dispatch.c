@@ -0,0 +1,21 @@
+// Specialised for two configurations at once (see multi-dispatch.configs). Run without
+// arguments, the dispatcher must pass over the argc == 2 variant and pick the argc == 1 one;
+// any other argc falls back to the unmodified main.
+
+#include <stdio.h>
+
+static int work(int n) {
+
+  int total = 0;
+  for(int i = 0; i < n * 10; ++i)
+    total += i * n;
+  return total;
+
+}
+
+int main(int argc, char** argv) {
+
+  printf("%d\n", work(argc));
+  return argc == 2 ? 3 : 0;
+
+}
@@ -0,0 +1,33 @@
+// Straight-line runs of constant stores into one object, long enough for commit to write each
+// as a single memcpy from a constant global (the table) or a memset (the zero fill).
+// store-run.expect checks that the optimised main contains both.
+
+#include <stdio.h>
+
+int main(int argc, char** argv) {
+
+  int table[20];
+  long zeroes[16];
+
+  table[0] = 3; table[1] = 1; table[2] = 4; table[3] = 1;
+  table[4] = 5; table[5] = 9; table[6] = 2; table[7] = 6;
+  table[8] = 5; table[9] = 3; table[10] = 5; table[11] = 8;
+  table[12] = 9; table[13] = 7; table[14] = 9; table[15] = 3;
+  table[16] = 2; table[17] = 3; table[18] = 8; table[19] = 4;
+
+  zeroes[0] = 0; zeroes[1] = 0; zeroes[2] = 0; zeroes[3] = 0;
+  zeroes[4] = 0; zeroes[5] = 0; zeroes[6] = 0; zeroes[7] = 0;
+  zeroes[8] = 0; zeroes[9] = 0; zeroes[10] = 0; zeroes[11] = 0;
+  zeroes[12] = 0; zeroes[13] = 0; zeroes[14] = 0; zeroes[15] = 0;
+
+  // Read at offsets only known at runtime, so the stores must all be committed.
+  long total = 0;
+  for(int i = 0; i < 20; i += argc)
+    total += table[i];
+  for(int i = 0; i < 16; i += argc)
+    total += zeroes[i];
+
+  printf("%ld\n", total);
+  return 0;
+
+}
@@ -0,0 +1,46 @@
+// Loops filling objects with constants, the last interleaving stores to two arrays. Each
+// peeled iteration commits into its own blocks and stores at most 8 bytes to each object, so
+// these stay individual stores (store-run.c covers the merged case); this checks that the
+// specialised program still computes the same total.
+
+#include <stdio.h>
+
+struct entry {
+  int key;
+  short weight;
+  short flags;
+};
+
+int main(int argc, char** argv) {
+
+  struct entry table[32];
+  int zeroes[64];
+  int squares[32];
+  long ones[32];
+
+  for(int i = 0; i < 32; ++i) {
+    table[i].key = i * 7;
+    table[i].weight = 100 - i;
+    table[i].flags = i & 3;
+  }
+
+  for(int i = 0; i < 64; ++i)
+    zeroes[i] = 0;
+
+  for(int i = 0; i < 32; ++i) {
+    squares[i] = i * i;
+    ones[i] = 1;
+  }
+
+  int total = 0;
+  for(int i = 0; i < 32; ++i)
+    total += table[i].key * table[i].weight + table[i].flags;
+  for(int i = 0; i < 64; i += argc)
+    total += zeroes[i];
+  for(int i = 0; i < 32; i += argc)
+    total += squares[i] + ones[i];
+
+  printf("%d\n", total);
+  return 0;
+
+}
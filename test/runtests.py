@@ -65,4 +65,11 @@ for prog in find_proc.stdout:
 	lines = filter(isinstline, lines)
 
 	print "Test", prog, "optimised down to", len(lines), "instructions"
-	
+
+	# Some tests list text their optimised main must contain, one item per line.
+	expectfile = os.path.join(workingdir, "%s.expect" % prog)
+	if os.path.exists(expectfile):
+		for expected in open(expectfile):
+			expected = expected.strip()
+			if expected != "" and not any(expected in x for x in lines):
+				print prog, "optimised main lacks", expected